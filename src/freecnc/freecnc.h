@@ -139,7 +139,7 @@ inline bool isRelativePath(const char *p) {
 }
 
 /// @TODO Stringify this funciton
-vector<char*> splitList(char* line, char delim);
+vector<char*> splitList(const char* line, char delim);
 
 /// @TODO Stringify this funciton
 char* stripNumbers(const char* src);
@@ -189,7 +189,7 @@ namespace BuildQueue
         left -= delta;
 
         if (0 != left) {
-            p::ppool->updateSidebar();
+            p::ppool->updateBuildProgress();
             return true;
         }
         const UnitOrStructureType* type = getCurrentType();
@@ -0,0 +1,294 @@
+#include <stdexcept>
+
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "../renderer/loadingscreen.h"
+#include "loadgraph.h"
+#include "map.h"
+
+using std::vector;
+
+LoadGraph::Probe* LoadGraph::probe = 0;
+
+LoadGraph::LoadGraph(const string& name, LoadingScreen* lscreen, unsigned int numthreads)
+    : name(name), lscreen(lscreen), totalweight(0), doneweight(0), inflight(0),
+      quit(false), failed(false)
+{
+    mutex = SDL_CreateMutex();
+    work = SDL_CreateSemaphore(0);
+    done = SDL_CreateSemaphore(0);
+    for (unsigned int i = 1; i < numthreads; ++i) {
+        SDL_Thread* thread = SDL_CreateThread(LoadGraph::runWorker, this);
+        if (thread == NULL) {
+            game.log << name << ": Unable to start worker thread: " << SDL_GetError() << endl;
+            break;
+        }
+        workers.push_back(thread);
+    }
+}
+
+LoadGraph::~LoadGraph()
+{
+    int stat;
+    SDL_mutexP(mutex);
+    quit = true;
+    SDL_mutexV(mutex);
+    for (vector<SDL_Thread*>::size_type i = 0; i < workers.size(); ++i) {
+        SDL_SemPost(work);
+    }
+    for (vector<SDL_Thread*>::iterator i = workers.begin(); i != workers.end(); ++i) {
+        SDL_WaitThread(*i, &stat);
+    }
+    for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i) {
+        delete *i;
+    }
+    SDL_DestroySemaphore(done);
+    SDL_DestroySemaphore(work);
+    SDL_DestroyMutex(mutex);
+}
+
+unsigned int LoadGraph::add(const string& name, const Step& step, unsigned int weight)
+{
+    Node* node = new Node;
+    node->name = name;
+    node->step = step;
+    node->parallel = false;
+    node->weight = weight;
+    node->waiting = 0;
+    node->ticks = 0;
+    node->onworker = false;
+    nodes.push_back(node);
+    totalweight += weight;
+    return nodes.size() - 1;
+}
+
+unsigned int LoadGraph::addParallel(const string& name, const Step& step, unsigned int weight)
+{
+    unsigned int num = add(name, step, weight);
+    nodes[num]->parallel = true;
+    return num;
+}
+
+void LoadGraph::depends(unsigned int step, unsigned int on)
+{
+    nodes[on]->dependents.push_back(step);
+    ++nodes[step]->waiting;
+}
+
+void LoadGraph::run()
+{
+    unsigned int start = SDL_GetTicks();
+
+    SDL_mutexP(mutex);
+    for (unsigned int i = 0; i < nodes.size(); ++i) {
+        if (nodes[i]->parallel && nodes[i]->waiting == 0) {
+            ready.push_back(i);
+            ++inflight;
+            SDL_SemPost(work);
+        }
+    }
+    SDL_mutexV(mutex);
+
+    for (unsigned int i = 0; i < nodes.size(); ++i) {
+        Node* node = nodes[i];
+        if (node->parallel) {
+            continue;
+        }
+        try {
+            // Help out with, or wait for, the parallel steps this one needs
+            while (true) {
+                SDL_mutexP(mutex);
+                bool blocked = node->waiting > 0;
+                bool stuck = blocked && inflight == 0;
+                bool stop = failed;
+                SDL_mutexV(mutex);
+                if (stop) {
+                    throw MapLoadingError(error);
+                }
+                if (stuck) {
+                    throw std::runtime_error(name + ": \"" + node->name
+                            + "\" depends on a step that runs after it");
+                }
+                if (!blocked) {
+                    break;
+                }
+                if (!help()) {
+                    SDL_SemWait(done);
+                }
+            }
+
+            if (lscreen != 0) {
+                lscreen->setCurrentTask(node->name);
+            }
+            unsigned int stepstart = SDL_GetTicks();
+            runStep(node, game.log);
+            node->ticks = SDL_GetTicks() - stepstart;
+        } catch (...) {
+            SDL_mutexP(mutex);
+            failed = true;
+            SDL_mutexV(mutex);
+            drain();
+            throw;
+        }
+        SDL_mutexP(mutex);
+        finish(i);
+        SDL_mutexV(mutex);
+    }
+
+    drain();
+    if (failed) {
+        throw MapLoadingError(error);
+    }
+    logTimings(SDL_GetTicks() - start);
+}
+
+int LoadGraph::runWorker(void* inst)
+{
+    LoadGraph* graph = (LoadGraph*)inst;
+    while (true) {
+        SDL_SemWait(graph->work);
+        SDL_mutexP(graph->mutex);
+        if (graph->quit) {
+            SDL_mutexV(graph->mutex);
+            break;
+        }
+        unsigned int step = graph->ready.front();
+        graph->ready.pop_front();
+        SDL_mutexV(graph->mutex);
+        graph->runParallel(step, true);
+    }
+    return 0;
+}
+
+/** Runs a queued parallel step on the calling thread
+ * @returns false if none were queued
+ */
+bool LoadGraph::help()
+{
+    if (SDL_SemTryWait(work) != 0) {
+        return false;
+    }
+    SDL_mutexP(mutex);
+    unsigned int step = ready.front();
+    ready.pop_front();
+    SDL_mutexV(mutex);
+    runParallel(step, false);
+    return true;
+}
+
+void LoadGraph::runParallel(unsigned int step, bool onworker)
+{
+    Node* node = nodes[step];
+
+    SDL_mutexP(mutex);
+    bool skip = failed;
+    SDL_mutexV(mutex);
+
+    string what;
+    if (!skip) {
+        if (!onworker && lscreen != 0) {
+            lscreen->setCurrentTask(node->name);
+        }
+        unsigned int start = SDL_GetTicks();
+        try {
+            runStep(node, node->log);
+        } catch (std::exception& e) {
+            what = node->name + ": " + e.what();
+            skip = true;
+        } catch (...) {
+            what = node->name + ": Unknown error";
+            skip = true;
+        }
+        node->ticks = SDL_GetTicks() - start;
+        node->onworker = onworker;
+    }
+
+    SDL_mutexP(mutex);
+    if (skip && !what.empty() && !failed) {
+        failed = true;
+        error = what;
+    }
+    --inflight;
+    finish(step);
+    SDL_mutexV(mutex);
+    SDL_SemPost(done);
+}
+
+void LoadGraph::runStep(Node* node, std::ostream& log)
+{
+    if (probe == 0) {
+        node->step(log);
+        return;
+    }
+    probe->begin(node->name);
+    try {
+        node->step(log);
+    } catch (...) {
+        probe->end(node->name, node->parallel);
+        throw;
+    }
+    probe->end(node->name, node->parallel);
+}
+
+void LoadGraph::finish(unsigned int step)
+{
+    Node* node = nodes[step];
+    doneweight += node->weight;
+    if (lscreen != 0 && totalweight > 0) {
+        lscreen->setProgress(static_cast<double>(doneweight) / totalweight);
+    }
+    for (vector<unsigned int>::iterator i = node->dependents.begin(); i != node->dependents.end(); ++i) {
+        Node* dependent = nodes[*i];
+        --dependent->waiting;
+        if (dependent->waiting == 0 && dependent->parallel && !failed) {
+            ready.push_back(*i);
+            ++inflight;
+            SDL_SemPost(work);
+        }
+    }
+}
+
+void LoadGraph::drain()
+{
+    while (true) {
+        SDL_mutexP(mutex);
+        unsigned int left = inflight;
+        SDL_mutexV(mutex);
+        if (left == 0) {
+            break;
+        }
+        if (!help()) {
+            SDL_SemWait(done);
+        }
+    }
+    // Nothing else is running now, so the buffered messages can go out
+    for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i) {
+        const string text = (*i)->log.str();
+        if (!text.empty()) {
+            game.log << text;
+            (*i)->log.str("");
+        }
+    }
+}
+
+void LoadGraph::logTimings(unsigned int total)
+{
+    unsigned int serial = 0, parallel = 0;
+    for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i) {
+        if ((*i)->parallel) {
+            parallel += (*i)->ticks;
+        } else {
+            serial += (*i)->ticks;
+        }
+    }
+    game.log << name << ": Finished in " << total << "ms using " << getNumThreads()
+             << " threads (" << serial << "ms of serial steps, " << parallel
+             << "ms of parallel steps)" << endl;
+    for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i) {
+        game.log << name << ":   " << (*i)->name << ": " << (*i)->ticks << "ms";
+        if ((*i)->onworker) {
+            game.log << " (worker)";
+        }
+        game.log << endl;
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef _GAME_LOADGRAPH_H
+#define _GAME_LOADGRAPH_H
+
+#include <deque>
+#include <sstream>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "SDL_thread.h"
+#include "../freecnc.h"
+
+class LoadingScreen;
+
+/** Runs the steps of a long load in the order their dependencies allow,
+ * reporting progress to a LoadingScreen and logging how long each took.
+ *
+ * Serial steps run on the calling thread in the order they were added, as
+ * most of loading shares the VFS, the image pool and the unit and structure
+ * pools, none of which are thread safe.  Parallel steps only work on data
+ * of their own and run on worker threads as soon as the steps they depend
+ * on have finished.  Whenever the calling thread is held up waiting for one
+ * it runs parallel steps itself, so a single thread still gets through the
+ * whole graph.
+ */
+class LoadGraph : private boost::noncopyable
+{
+public:
+    /// Parallel steps must not use game.log directly, they get a buffer
+    /// that is logged once they have finished.  Serial steps are given
+    /// game.log.
+    typedef boost::function<void (std::ostream&)> Step;
+
+    /// Told about each step as it runs, on the thread running it, so
+    /// benchmarks can measure more than the time it takes
+    class Probe
+    {
+    public:
+        virtual ~Probe() {}
+        virtual void begin(const string& step) = 0;
+        virtual void end(const string& step, bool parallel) = 0;
+    };
+
+    /// @param numthreads total number of threads running steps, including
+    /// the caller
+    LoadGraph(const string& name, LoadingScreen* lscreen, unsigned int numthreads);
+    ~LoadGraph();
+
+    /// Adds a step that runs on the calling thread after every serial step
+    /// added before it
+    /// @param weight how much of the progress bar the step is worth
+    /// @returns the step's number, for depends
+    unsigned int add(const string& name, const Step& step, unsigned int weight);
+
+    /// Adds a step that can run on any thread
+    unsigned int addParallel(const string& name, const Step& step, unsigned int weight);
+
+    /// Holds step back until the step numbered on has finished
+    void depends(unsigned int step, unsigned int on);
+
+    /// Runs every step.  If a step throws, the steps already running are
+    /// finished, no more are started and the exception is passed on; those
+    /// from parallel steps become a MapLoadingError.
+    void run();
+
+    unsigned int getNumThreads() const {return workers.size() + 1;}
+
+    /// Sets the probe told about the steps of every graph, or 0 for none
+    static void setProbe(Probe* newprobe) {probe = newprobe;}
+private:
+    struct Node {
+        string name;
+        Step step;
+        bool parallel;
+        unsigned int weight;
+        /// Steps that can't start until this one has finished
+        std::vector<unsigned int> dependents;
+        /// How many of the steps this one depends on haven't finished
+        unsigned int waiting;
+        unsigned int ticks;
+        bool onworker;
+        std::ostringstream log;
+    };
+
+    static int runWorker(void* inst);
+    bool help();
+    /// Runs a parallel step taken from ready
+    void runParallel(unsigned int step, bool onworker);
+    /// Marks a step as finished and queues the parallel steps it released.
+    /// Must hold mutex.
+    void finish(unsigned int step);
+    /// Runs or waits for parallel steps until none are queued or running
+    void drain();
+    void logTimings(unsigned int total);
+    /// Runs a step, telling the probe about it
+    static void runStep(Node* node, std::ostream& log);
+
+    static Probe* probe;
+
+    string name;
+    LoadingScreen* lscreen;
+    std::vector<Node*> nodes;
+    unsigned int totalweight, doneweight;
+
+    std::vector<SDL_Thread*> workers;
+    SDL_mutex* mutex;
+    /// Posted once for each step in ready, and once for each worker on quit
+    SDL_sem* work;
+    /// Posted whenever a parallel step finishes
+    SDL_sem* done;
+    /// Parallel steps whose dependencies have finished
+    std::deque<unsigned int> ready;
+    /// Parallel steps queued or running
+    unsigned int inflight;
+    bool quit;
+    bool failed;
+    string error;
+};
+
+#endif
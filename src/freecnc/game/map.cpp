@@ -1,13 +1,19 @@
 #include <cmath>
 #include <iostream>
 
+#include <boost/bind.hpp>
+
 #include "../renderer/renderer_public.h"
+#include "../sound/sound_public.h"
+#include "loadgraph.h"
 #include "map.h"
 #include "playerpool.h"
 #include "structure.h"
 #include "unit.h"
 #include "unitandstructurepool.h"
 
+using boost::bind;
+
 //-----------------------------------------------------------------------------
 // Functors
 //-----------------------------------------------------------------------------
@@ -20,14 +26,6 @@ struct TemplateCacheCleaner : public std::unary_function<TemplateCache::value_ty
     }
 };
 
-struct TemplateTileCacheCleaner : public std::unary_function<TemplateTileCache::value_type, void>
-{
-    void operator()(const TemplateTileCache::value_type& p)
-    {
-        delete p;
-    }
-};
-
 //-----------------------------------------------------------------------------
 // CnCMap Methods
 //-----------------------------------------------------------------------------
@@ -79,8 +77,10 @@ CnCMap::CnCMap()
         scrollbookmarks[i].xtile = 0;
         scrollbookmarks[i].ytile = 0;
     }
-    minimap = NULL;
-    oldmmap = NULL;
+    minimapbytes = 0;
+    tilebytes = 0;
+    tileframe = 0;
+    prefetchpos = 0xffffffff;
     loading = false;
     translate_64 = (game.config.gametype == GAME_TD);
 }
@@ -90,48 +90,111 @@ CnCMap::~CnCMap()
 {
     unsigned int i;
 
-    for( i = 0; i < tileimages.size(); i++ )
-        SDL_FreeSurface(tileimages[i]);
+    for( i = 0; i < maptiles.size(); i++ )
+        SDL_FreeSurface(maptiles[i].image);
 
     for( i = 0; i < pc::imagepool->size(); i++ )
         delete (*pc::imagepool)[i];
 
-    // Empty the cache of TemplateImage* & Tile
-    for_each(templateTileCache.begin(), templateTileCache.end(), TemplateTileCacheCleaner());
-
     // Empty the pool of TemplateImage*
     for_each(templateCache.begin(), templateCache.end(), TemplateCacheCleaner());
 
     delete p::uspool;
     delete p::ppool;
-    SDL_FreeSurface(minimap);
+    flushMiniMaps();
     for( i = 0; i < numShadowImg; i++ ) {
         SDL_FreeSurface(shadowimages[i]);
     }
     delete pc::imagepool;
 }
 
-/** @TODO Map loading goes here.
+/** Loads the map as a graph of steps.  The packed map data is decoded, and
+ * the tiles' colours worked out, on other threads while the rest is loaded,
+ * which has to stay in its original order as it fills the image pool.
  */
 void CnCMap::loadMap(const char* mapname, LoadingScreen* lscreen) {
     missionData.mapname = mapname;
-    string message = "Reading "; message += mapname;
-    message += ".INI";
     loading = true;
-    /* Load the ini part of the map */
-    lscreen->setCurrentTask(message);
-    loadIni();
 
-    /* Load the bin part of the map (the tiles) */
-    message = "Loading "; message += missionData.mapname;
-    message += ".BIN";
-    lscreen->setCurrentTask(message);
-    if (maptype == GAME_TD)
-        loadBin();
+    string name(mapname);
+    LoadGraph graph("Map loader", lscreen, max(game.config.load_threads, 1));
+
+    graph.add("Reading " + name + ".INI", bind(&CnCMap::loadIni, this), 10);
+
+    unsigned int unpacked = 0, overlaysunpacked = 0;
+    if (maptype == GAME_RA) {
+        unsigned int packs = graph.add("Reading the map data", bind(&CnCMap::readPacks, this), 1);
+        unpacked = graph.addParallel("Unpacking the map data", bind(&CnCMap::unMapPack, this, _1), 3);
+        graph.depends(unpacked, packs);
+        overlaysunpacked = graph.addParallel("Unpacking the overlays",
+                bind(&CnCMap::unOverlayPack, this, _1), 1);
+        graph.depends(overlaysunpacked, packs);
+    } else {
+        graph.add("Loading " + name + ".BIN", bind(&CnCMap::loadBin, this), 2);
+    }
+
+    graph.add("Loading the shadows", bind(&CnCMap::loadShadows, this), 3);
+
+    unsigned int templates = graph.add("Loading the templates", bind(&CnCMap::parseBin, this), 10);
+    if (maptype == GAME_RA) {
+        graph.depends(templates, unpacked);
+    }
+    const unsigned int parts = graph.getNumThreads();
+    for (unsigned int i = 0; i < parts; ++i) {
+        graph.depends(graph.addParallel("Averaging the tile colours",
+                bind(&CnCMap::averageTiles, this, i, parts, _1), 4 / parts + 1), templates);
+    }
+
+    graph.add("Loading the resources", bind(&CnCMap::load_resources, this), 3);
+    if (maptype == GAME_RA) {
+        graph.depends(graph.add("Placing the overlays", bind(&CnCMap::placeOverlayPack, this), 3),
+                overlaysunpacked);
+    } else {
+        graph.add("Placing the overlays", bind(&CnCMap::loadOverlay, this), 3);
+    }
+    graph.add("Loading the unit and structure types", bind(&CnCMap::loadTypes, this), 30);
+    graph.add("Placing the units and structures", bind(&CnCMap::advanced_sections, this), 10);
+
+    // The unit talkbacks and weapons loaded so far queued their sounds.
+    // They're opened in batches, each after the one before is decoded, so
+    // only a batch's worth of files is open at once.
+    graph.add("Finding the sounds", bind(&SoundEngine::FindPreloads, pc::sfxeng), 1);
+    const unsigned int batches = 4;
+    vector<unsigned int> decoded;
+    for (unsigned int batch = 0; batch < batches; ++batch) {
+        unsigned int opened = graph.add("Opening the sounds",
+                bind(&SoundEngine::OpenPreloads, pc::sfxeng, batch, batches), 1);
+        for (vector<unsigned int>::iterator it = decoded.begin(); it != decoded.end(); ++it) {
+            graph.depends(opened, *it);
+        }
+        decoded.clear();
+        for (unsigned int i = 0; i < parts; ++i) {
+            decoded.push_back(graph.addParallel("Decoding the sounds",
+                    bind(&SoundEngine::DecodePreloads, pc::sfxeng, batch, batches, i, parts, _1),
+                    1));
+            graph.depends(decoded.back(), opened);
+        }
+    }
+
+    graph.add("Loading the pips", bind(&CnCMap::load_pips_and_flash, this), 1);
+    graph.add("Finishing the map", bind(&CnCMap::placeTileTypes, this), 1);
+    unsigned int cached = graph.add("Caching the sounds",
+            bind(&SoundEngine::CachePreloads, pc::sfxeng), 1);
+    for (vector<unsigned int>::iterator it = decoded.begin(); it != decoded.end(); ++it) {
+        graph.depends(cached, *it);
+    }
+
+    graph.run();
 
     //   Path::setMapSize(width, height);
     p::ppool->setAlliances();
 
+    inifile.reset();
+    mappack.clear();
+    overlaypack.clear();
+    vector<unsigned char>().swap(overlaydata);
+    tilepixels.clear();
+
     loading = false;
     loaded = true;
 }
@@ -473,56 +536,35 @@ unsigned short CnCMap::getCost(unsigned short pos, Unit* excpUn) const
 }
 
 SDL_Surface* CnCMap::getMiniMap(unsigned char pixsize) {
-    static ImageProc ip;
     unsigned short tx,ty;
-    SDL_Rect pos = {0, 0, pixsize, pixsize};
-    SDL_Surface *cminitile;
+    SDL_Surface* minimap = NULL;
     if (pixsize == 0) {
         // Argh
         game.log << "CnCMap::getMiniMap: pixsize is zero, resetting to one" << endl;
         pixsize = 1;
     }
-    if(minimap != NULL) {
-        if (minimap->w == width*pixsize) {
-            return minimap;
-        } else {
-            // Each minimap surface is about 250k, so caching a lot of zooms
-            // would be somewhat expensive.  Could make how much memory to set aside
-            // for this customizable so people with half a gig of RAM can see some
-            // usage :-)
-            // For now, just keep the previous one.
-            SDL_FreeSurface(oldmmap);
-            oldmmap = minimap;
-            minimap = NULL;
+    for (MiniMapCache::iterator i = minimaps.begin(); i != minimaps.end(); ++i) {
+        if (i->first == pixsize) {
+            minimap = i->second;
+            // Move to the front so it is the last to be evicted
+            minimaps.splice(minimaps.begin(), minimaps, i);
+            break;
         }
     }
-    if (oldmmap != NULL && (oldmmap->w == pixsize*width)) {
-        minimap = oldmmap;
-        oldmmap = NULL;
-        return minimap;
-    }
-    minimap = SDL_CreateRGBSurface (SDL_SWSURFACE, width*pixsize,height*pixsize, 16,
-                                    0xff, 0xff, 0xff, 0);
-    SDL_Surface *maptileOne = getMapTile(0);
-    minimap->format->Rmask = maptileOne->format->Rmask;
-    minimap->format->Gmask = maptileOne->format->Gmask;
-    minimap->format->Bmask = maptileOne->format->Bmask;
-    minimap->format->Amask = maptileOne->format->Amask;
-    if( maptileOne->format->palette != NULL ) {
-        SDL_SetColors(minimap, maptileOne->format->palette->colors, 0,
-                      maptileOne->format->palette->ncolors);
-    }
-    int lineCounter = 0;
-    for(unsigned int i = 0;  i < (unsigned int) width*height; i++, pos.x += pixsize,
-            lineCounter++) {
-        if(lineCounter == width) {
-            pos.y += pixsize;
-            pos.x = 0;
-            lineCounter = 0;
+    if (minimap == NULL) {
+        minimap = buildMiniMap(pixsize);
+        minimaps.push_front(std::make_pair(pixsize, minimap));
+        minimapbytes += minimap->pitch * minimap->h;
+        // Each minimap surface is about 250k at the larger zooms, so only keep
+        // as many as the configured budget allows.  The one we're about to
+        // return is always kept.
+        const unsigned int budget = max(game.config.minimap_cache, 0) * 1024;
+        while (minimapbytes > budget && minimaps.size() > 1) {
+            SDL_Surface* old = minimaps.back().second;
+            minimapbytes -= old->pitch * old->h;
+            SDL_FreeSurface(old);
+            minimaps.pop_back();
         }
-        cminitile = ip.minimapScale(getMapTile(i), pixsize);
-        SDL_BlitSurface(cminitile, NULL, minimap, &pos);
-        SDL_FreeSurface(cminitile);
     }
     /* Now fill in clipping details for renderer and UI.
      * To make things easier, ensure that the geometry is divisable by the
@@ -545,6 +587,195 @@ SDL_Surface* CnCMap::getMiniMap(unsigned char pixsize) {
     return minimap;
 }
 
+/** Creates a minimap at the given zoom from the per-cell colours.  Each row of
+ * cells is resolved to colours once and then written out pixsize times.
+ */
+SDL_Surface* CnCMap::buildMiniMap(unsigned char pixsize)
+{
+    SDL_PixelFormat* fmt = getTileFormat();
+    SDL_Surface* minimap = SDL_CreateRGBSurface(SDL_SWSURFACE, width*pixsize,
+            height*pixsize, fmt->BitsPerPixel, fmt->Rmask, fmt->Gmask,
+            fmt->Bmask, fmt->Amask);
+    if (fmt->palette != NULL) {
+        SDL_SetColors(minimap, fmt->palette->colors, 0, fmt->palette->ncolors);
+    }
+
+    vector<unsigned int> row(width);
+    const unsigned char bpp = minimap->format->BytesPerPixel;
+    if (bpp == 3) {
+        // No fast path for packed 24bit surfaces
+        SDL_Rect dest = {0, 0, pixsize, pixsize};
+        for (unsigned int i = 0; i < (unsigned int)width*height; ++i) {
+            dest.x = static_cast<Sint16>((i % width) * pixsize);
+            dest.y = static_cast<Sint16>((i / width) * pixsize);
+            SDL_FillRect(minimap, &dest, getMiniMapColour(i));
+        }
+        return minimap;
+    }
+
+    SDL_LockSurface(minimap);
+    for (unsigned short cy = 0; cy < height; ++cy) {
+        for (unsigned short cx = 0; cx < width; ++cx) {
+            row[cx] = getMiniMapColour(cy*width + cx);
+        }
+        for (unsigned char py = 0; py < pixsize; ++py) {
+            Uint8* line = (Uint8*)minimap->pixels + (cy*pixsize + py)*minimap->pitch;
+            for (unsigned short cx = 0; cx < width; ++cx) {
+                for (unsigned char px = 0; px < pixsize; ++px, line += bpp) {
+                    switch (bpp) {
+                    case 1:
+                        *line = row[cx];
+                        break;
+                    case 2:
+                        *(Uint16*)line = row[cx];
+                        break;
+                    default:
+                        *(Uint32*)line = row[cx];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    SDL_UnlockSurface(minimap);
+    return minimap;
+}
+
+void CnCMap::updateMiniMapCell(unsigned int pos)
+{
+    if (minimaps.empty()) {
+        return;
+    }
+    const unsigned int colour = getMiniMapColour(pos);
+    for (MiniMapCache::iterator i = minimaps.begin(); i != minimaps.end(); ++i) {
+        const unsigned char pixsize = i->first;
+        SDL_Rect dest = {static_cast<Sint16>((pos % width) * pixsize),
+                static_cast<Sint16>((pos / width) * pixsize), pixsize, pixsize};
+        SDL_FillRect(i->second, &dest, colour);
+    }
+}
+
+void CnCMap::flushMiniMaps()
+{
+    for (MiniMapCache::iterator i = minimaps.begin(); i != minimaps.end(); ++i) {
+        SDL_FreeSurface(i->second);
+    }
+    minimaps.clear();
+    minimapbytes = 0;
+}
+
+/** Resources take priority over overlays, which take priority over the tile.
+ */
+unsigned int CnCMap::getMiniMapColour(unsigned int pos)
+{
+    if (resourcematrix[pos] != 0) {
+        return getImageColour(getResourceFrame(pos));
+    }
+    if (overlaymatrix[pos] & HAS_OVERLAY) {
+        return getImageColour(getOverlay(pos));
+    }
+    return getTileColour(tilematrix[pos]);
+}
+
+unsigned int CnCMap::getImageColour(unsigned int imgnum)
+{
+    std::map<unsigned int, unsigned int>::iterator i = imagecolours.find(imgnum);
+    if (i != imagecolours.end()) {
+        return i->second;
+    }
+    static ImageProc ip;
+    unsigned int colour = ip.averageColour(pc::imgcache->getImage(imgnum).image,
+            getTileFormat());
+    imagecolours[imgnum] = colour;
+    return colour;
+}
+
+void CnCMap::prefetchTiles(unsigned short w, unsigned short h, unsigned short margin)
+{
+    ++tileframe;
+    if (getScrollPos() == prefetchpos) {
+        return;
+    }
+    prefetchpos = getScrollPos();
+    const unsigned short x1 = scrollpos.curx > margin ? scrollpos.curx - margin : 0;
+    const unsigned short y1 = scrollpos.cury > margin ? scrollpos.cury - margin : 0;
+    const unsigned short x2 = min<unsigned int>(scrollpos.curx + w + margin, width);
+    const unsigned short y2 = min<unsigned int>(scrollpos.cury + h + margin, height);
+    for (unsigned short cy = y1; cy < y2; ++cy) {
+        for (unsigned short cx = x1; cx < x2; ++cx) {
+            readyTile(tilematrix[cy*width + cx]);
+        }
+    }
+}
+
+SDL_Surface* CnCMap::useTile(unsigned short id)
+{
+    readyTile(id);
+    maptiles[id].frame = tileframe;
+    return maptiles[id].image;
+}
+
+/** Surfaces are made from the template on demand.  Once they take up more
+ * than the configured budget the least recently used are freed, but never
+ * ones that have been drawn this frame, as the draw list still points at
+ * them.
+ */
+void CnCMap::readyTile(unsigned short id)
+{
+    MapTile& tile = maptiles[id];
+    if (tile.image != NULL) {
+        if (id != 0) {
+            tilelru.splice(tilelru.begin(), tilelru, tile.lru);
+        }
+        return;
+    }
+    tile.image = tile.theater->getImage(tile.tile);
+    if (id == 0 || tile.image == NULL) {
+        return;
+    }
+    tilelru.push_front(id);
+    tile.lru = tilelru.begin();
+    tilebytes += tile.image->pitch * tile.image->h;
+
+    const unsigned int budget = max(game.config.tile_cache, 0) * 1024;
+    while (tilebytes > budget && tilelru.size() > 1) {
+        MapTile& old = maptiles[tilelru.back()];
+        if (old.frame == tileframe) {
+            break;
+        }
+        tilebytes -= old.image->pitch * old.image->h;
+        SDL_FreeSurface(old.image);
+        old.image = NULL;
+        tilelru.pop_back();
+    }
+}
+
+SDL_PixelFormat* CnCMap::getTileFormat()
+{
+    readyTile(0);
+    if (maptiles[0].image != NULL) {
+        return maptiles[0].image->format;
+    }
+    // Tiles are made in the display format, so the screen's is the nearest
+    SDL_Surface* screen = SDL_GetVideoSurface();
+    if (screen == NULL) {
+        throw MapLoadingError("Map loader: Unable to make the first tile or find the screen format");
+    }
+    return screen->format;
+}
+
+unsigned int CnCMap::getTileColour(unsigned short id)
+{
+    if (tilecolours.empty()) {
+        SDL_PixelFormat* fmt = getTileFormat();
+        tilecolours.reserve(maptiles.size());
+        for (MapTiles::iterator i = maptiles.begin(); i != maptiles.end(); ++i) {
+            tilecolours.push_back(SDL_MapRGB(fmt, i->rgb >> 16, (i->rgb >> 8) & 0xff, i->rgb & 0xff));
+        }
+    }
+    return tilecolours[id];
+}
+
 void CnCMap::storeLocation(unsigned char loc)
 {
     if (loc >= NUMMARKS) {
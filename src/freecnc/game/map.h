@@ -1,9 +1,12 @@
 #ifndef _GAME_MAP_H
 #define _GAME_MAP_H
 
+#include <list>
+
 #include "../basictypes.h"
 #include "../lib/inifile.h"
 
+struct SDL_PixelFormat;
 struct SDL_Surface;
 
 class LoadingScreen;
@@ -91,13 +94,21 @@ struct MiniMapClipping {
     unsigned char tilew, tileh, pixsize;
 };
 
-struct TemplateTilePair {
+/// A distinct tile used by the map.  Its surface is only made while it is
+/// on or near the screen.
+struct MapTile {
     TemplateImage *theater; // Template for Theater
     unsigned char tile; //Tile number in this Theater
+    SDL_Surface *image; // NULL until it is needed
+    unsigned int rgb; // Average colour as 0xRRGGBB
+    unsigned int frame; // Last frame it was drawn in
+    std::list<unsigned short>::iterator lru; // Place in the recently used list
 };
 
 typedef std::map<std::string, TemplateImage*> TemplateCache;
-typedef std::vector<TemplateTilePair* > TemplateTileCache;
+typedef std::vector<MapTile> MapTiles;
+/// Index into the MapTiles of each template and tile that has been loaded
+typedef std::map<std::pair<TemplateImage*, unsigned char>, unsigned short> TileIds;
 
 struct MapLoadingError : std::runtime_error
 {
@@ -139,8 +150,11 @@ public:
 
     // C/S: These functions are client only
     SDL_Surface *getMapTile( unsigned int pos ) {
-        return tileimages[tilematrix[pos]];
+        return useTile(tilematrix[pos]);
     }
+    /// Starts a new frame, making the tiles within margin cells of the w by
+    /// h cells on screen if the map has scrolled
+    void prefetchTiles(unsigned short w, unsigned short h, unsigned short margin);
     SDL_Surface *getShadowTile(unsigned char shadownum) {
         if( shadownum >= numShadowImg ) {
             return NULL;
@@ -174,18 +188,13 @@ public:
         overlaymatrix[pos] &= ~(0xF0);
         return (overlaymatrix[pos] |= (value<<4));
     }
-    unsigned int setTiberium(unsigned int pos, unsigned char value) {
-        /// clear the existing tiberium bits first
-        overlaymatrix[pos] &= ~0xF;
-        return (overlaymatrix[pos] |= value);
-    }
     unsigned int getOverlay(unsigned int pos);
     unsigned int getTerrain(unsigned int pos, short* xoff, short* yoff);
     unsigned char getTerrainType(unsigned int pos) const {
         return terraintypes[pos];
     }
 
-    /// Reloads all the tiles SDL_Images
+    /// Drops all the tiles SDL_Images, to be made again when next drawn
     void reloadTiles();
 
     unsigned char accScroll(unsigned char direction);
@@ -209,7 +218,10 @@ public:
         return (unsigned short)scrollpos.curytileoffs;
     }
 
-     SDL_Surface* getMiniMap(unsigned char pixside);
+    SDL_Surface* getMiniMap(unsigned char pixside);
+    /// Redraws a single cell in every cached minimap.  Anything that changes
+    /// a cell's resource or overlay has to call this.
+    void updateMiniMapCell(unsigned int pos);
     void prepMiniClip(unsigned short sidew, unsigned short sideh) {
         miniclip.sidew = sidew;
         miniclip.sideh = sideh;
@@ -279,10 +291,20 @@ private:
     /// The map section of the ini
     void simpleSections();
 
-    /// The advanced section of the ini
+    /// Places the terrain, units and structures from the ini
     void advanced_sections();
 
-    /// Load the bin part of the map (TD)
+    /// Load the pips and the movement acknowledgement pulse
+    void load_pips_and_flash();
+
+    /// Load the shadow frames from SHADOW.SHP.  Not done on another thread,
+    /// as SDL_DisplayFormatAlpha is only safe on the main thread.
+    void loadShadows();
+
+    /// Load the unit and structure types the mission can build
+    void loadTypes();
+
+    /// Read the bin part of the map (TD)
     void loadBin();
 
     void load_terrain_detail(const char* prefix);
@@ -304,11 +326,20 @@ private:
     /// Load the overlay section of the map (TD)
     void loadOverlay();
 
+    /// Read the packed RA map and overlay data from the ini
+    void readPacks();
+
+    bool unPack(const string& pack, const char* name, unsigned char* dest,
+        unsigned int chunks, std::ostream& log);
+
     /// Extract RA map data
-    void unMapPack();
+    void unMapPack(std::ostream& log);
 
     /// Extract RA overlay data
-    void unOverlayPack();
+    void unOverlayPack(std::ostream& log);
+
+    /// Place the extracted RA overlays
+    void placeOverlayPack();
 
     /// load the palette
     /// The only thing map specific about this function is the theatre (whose
@@ -316,15 +347,45 @@ private:
     void loadPal(SDL_Color *palette);
 
     /// Parse the BIN part of the map (RA or TD)
-    void parseBin(TileList *bindata);
+    void parseBin();
+
+    void averageTiles(unsigned int part, unsigned int parts, std::ostream& log);
+
+    void placeTileTypes();
 
     /// Parse the overlay part of the map (RA or TD)
     void parseOverlay(const unsigned int& linenum, const std::string& name);
 
-    /// load a specified tile
-    SDL_Surface *loadTile(shared_ptr<INIFile> templini, unsigned int templ,
+    /// Builds a minimap surface in a single pass over the map
+    SDL_Surface* buildMiniMap(unsigned char pixsize);
+
+    /// Frees all cached minimap surfaces
+    void flushMiniMaps();
+
+    /// @returns the colour of a cell in the format of the tile images
+    unsigned int getMiniMapColour(unsigned int pos);
+
+    /// @returns the average colour of an image from the imagecache
+    unsigned int getImageColour(unsigned int imgnum);
+
+    /// load a specified tile, unless it is already loaded
+    /// @returns its index into maptiles
+    unsigned short loadTile(shared_ptr<INIFile> templini, unsigned int templ,
         unsigned int tile, unsigned int* tiletype);
 
+    /// @returns the surface of a tile for drawing this frame
+    SDL_Surface* useTile(unsigned short id);
+
+    /// Makes a tile's surface if it hasn't been, and marks it as recently used
+    void readyTile(unsigned short id);
+
+    /// @returns the format of the tile images, or the screen's if the first
+    /// tile can't be made
+    SDL_PixelFormat* getTileFormat();
+
+    /// @returns the average colour of a tile in the format of the tile images
+    unsigned int getTileColour(unsigned short id);
+
     /// width of map in tiles
     unsigned short width;
     /// height of map in tiles
@@ -350,8 +411,18 @@ private:
     // Client only
     TemplateCache templateCache; //Holds cache of TemplateImage*s
 
-    std::vector<SDL_Surface*> tileimages; //Holds the SDL_Surfaces of the TemplateImage
-    TemplateTileCache templateTileCache; //Stores the TemplateImage* and Tile# of each SDL_Surface in tileimages
+    MapTiles maptiles; //Each distinct tile, as numbered in the tilematrix
+    std::vector<unsigned int> tilecolours; //Average colour of each tile in the format of the tile images, mapped when first needed
+    TileIds tileids; //Which entry of maptiles each TemplateImage* and Tile# is
+    /// Tiles that have a surface, most recently used first.  The first tile
+    /// isn't in here, it is always kept as its format is used for the minimap.
+    std::list<unsigned short> tilelru;
+    /// Bytes used by the surfaces in tilelru
+    unsigned int tilebytes;
+    /// Counts frames, so tiles that are still to be drawn aren't freed
+    unsigned int tileframe;
+    /// Scroll position the tiles were last prefetched for
+    unsigned int prefetchpos;
 
     unsigned short numShadowImg;
     std::vector<SDL_Surface*> shadowimages;
@@ -376,7 +447,13 @@ private:
     unsigned char maptype;
 
     /// @TODO These need a better (client side only) home, (ui related)
-    SDL_Surface *minimap, *oldmmap;
+    /// Minimap surfaces for each zoom level, most recently used first
+    typedef std::list<std::pair<unsigned char, SDL_Surface*> > MiniMapCache;
+    MiniMapCache minimaps;
+    /// Bytes used by the surfaces in minimaps
+    unsigned int minimapbytes;
+    /// Average colours of overlay and resource images, keyed by image number
+    std::map<unsigned int, unsigned int> imagecolours;
     MiniMapClipping miniclip;
 
     /// @TODO These need a better (client side only) home (ui related)
@@ -400,6 +477,16 @@ private:
 
     // Only valid whilst the map is loading
     shared_ptr<INIFile> inifile;
+    /// The base64 text of the MapPack and OverlayPack (RA)
+    string mappack, overlaypack;
+    /// The template and tile of each cell
+    std::vector<TileList> bindata;
+    /// The overlay of each cell of the whole 128x128 map (RA)
+    std::vector<unsigned char> overlaydata;
+    /// The terrain type of each cell's tile
+    std::vector<unsigned char> tiletypes;
+    /// The pixels of each entry in maptiles, until its colour is worked out
+    std::vector<std::vector<unsigned char> > tilepixels;
 };
 
 #endif
@@ -60,13 +60,11 @@ void CnCMap::loadIni()
 
     terraintypes.resize(width*height, 0);
     resourcematrix.resize(width*height, 0);
+    overlaymatrix.resize(width*height, 0);
+}
 
-    advanced_sections();
-
-    if (maptype == GAME_RA) {
-        unMapPack();
-    }
-
+void CnCMap::load_pips_and_flash()
+{
     try {
         pips = new SHPImage("hpips.shp",mapscaleq);
     } catch(ImageNotFound&) {
@@ -93,8 +91,6 @@ void CnCMap::loadIni()
 
     flashnum = pc::imagepool->size()<<16;
     pc::imagepool->push_back(moveflash);
-
-    inifile.reset();
 }
 
 
@@ -173,6 +169,11 @@ void CnCMap::load_terrain_detail(const char* prefix)
 
 void CnCMap::load_resources()
 {
+    // No resources, craters or scorch marks for interior?
+    if (missionData.theater_prefix == "INT") {
+        return;
+    }
+
     string resource_name;
     if (maptype == GAME_TD) {
         resource_name = "TI1.";
@@ -191,7 +192,6 @@ void CnCMap::load_resources()
         throw MapLoadingError("Map loader: Could not load \"" + resource_name + "\"");
     }
 
-    // No craters or scorch marks for interior?
     load_terrain_detail("SC");
     load_terrain_detail("CR");
 }
@@ -434,36 +434,29 @@ void CnCMap::load_infantry_position(const INISectionItem& key)
             health, facing);
 }
 
-void CnCMap::advanced_sections()
+void CnCMap::loadShadows()
 {
     try {
         SHPImage image("SHADOW.SHP", mapscaleq);
         numShadowImg = image.getNumImg();
-        shadowimages.resize(numShadowImg);
-        for (int i = 0; i < 48; ++i) {
+        shadowimages.resize(numShadowImg, 0);
+        for (unsigned short i = 0; i < 48 && i < numShadowImg; ++i) {
             image.getImageAsAlpha(i, &shadowimages[i]);
         }
     } catch(ImageNotFound&) {
         game.log << "Unable to load \"shadow.shp\"" << endl;
         numShadowImg = 0;
     }
+}
 
-    // load the smudge marks and the tiberium/ore to the imagepool
-    if (missionData.theater_prefix != "INT") {
-        load_resources();
-    }
-
-    overlaymatrix.resize(width*height, 0);
-
-    if (maptype == GAME_RA) {
-        unOverlayPack();
-    } else {
-        loadOverlay();
-    }
-
+void CnCMap::loadTypes()
+{
     p::uspool->preloadUnitAndStructures(missionData.buildlevel);
     p::uspool->generateProductionGroups();
+}
 
+void CnCMap::advanced_sections()
+{
     static const char* sections[] = {"TERRAIN", "WAYPOINTS", "SMUDGE",
         "STRUCTURES", "UNITS", "INFANTRY"};
 
@@ -503,8 +496,8 @@ struct tiledata
 
 void CnCMap::loadBin()
 {
-    vector<TileList> mapdata(width * height);
-    vector<TileList>::iterator map_it = mapdata.begin();
+    bindata.resize(width * height);
+    vector<TileList>::iterator map_it = bindata.begin();
 
     shared_ptr<File> binfile = game.vfs.open(game.config.map + ".BIN");
     if (!binfile) {
@@ -529,69 +522,88 @@ void CnCMap::loadBin()
         // Go to next chunk of map data
         binfile->seek_cur(2*(64-width));
     }
-    parseBin(&mapdata[0]);
 }
 
-void CnCMap::unMapPack()
+void CnCMap::readPacks()
 {
-    int tmpval;
-    unsigned int curpos;
-    int xtile, ytile;
-    TileList *bindata;
-    unsigned int keynum;
     INIKey key;
-    unsigned char *mapdata1 = new unsigned char[49152]; // 48k
-    unsigned char *mapdata2 = new unsigned char[49152];
-
-    // read packed data into array
-    mapdata1[0] = 0;
     try {
-        for (keynum = 1;;++keynum) {
+        for (unsigned int keynum = 1;;++keynum) {
             key = inifile->readIndexedKeyValue("MAPPACK", keynum);
-            strcat(((char*)mapdata1), key->second.c_str());
+            mappack += key->second;
         }
     } catch(int) {}
+    try {
+        for (unsigned int keynum = 1;;++keynum) {
+            key = inifile->readIndexedKeyValue("OVERLAYPACK", keynum);
+            overlaypack += key->second;
+        }
+    } catch(int) {}
+}
 
-    Compression::dec_base64(mapdata1,mapdata2,strlen(((char*)mapdata1)));
-
-    /* decode the format80 coded data (6 chunks) */
-    curpos = 0;
-    for( tmpval = 0; tmpval < 6; tmpval++ ) {
-        //printf("first vals in data is %x %x %x %x\n", mapdata2[curpos],
-        //mapdata2[curpos+1], mapdata2[curpos+2], mapdata2[curpos+3]);
-        if( Compression::decode80((unsigned char *)mapdata2+4+curpos, mapdata1+8192*tmpval) != 8192 ) {
-            game.log << "A format80 chunk in the \"MapPack\" was of wrong size" << endl;
+/** Decodes a base64 block of format80 chunks of 8192 bytes
+ * @returns false if it isn't base64
+ */
+bool CnCMap::unPack(const string& pack, const char* name, unsigned char* dest,
+        unsigned int chunks, std::ostream& log)
+{
+    const unsigned int size = chunks * 8192;
+    vector<unsigned char> temp(size);
+    // Anything that would decode past the end can't be a whole chunk anyway
+    const size_t length = min<size_t>(pack.size(), size / 3 * 4);
+    if (Compression::dec_base64(reinterpret_cast<const unsigned char*>(pack.data()), &temp[0], length, log) < 0) {
+        log << "The \"" << name << "\" isn't valid base64" << endl;
+        return false;
+    }
+
+    unsigned int curpos = 0;
+    for (unsigned int tmpval = 0; tmpval < chunks; tmpval++) {
+        if (curpos > size - 4) {
+            log << "The \"" << name << "\" is missing format80 chunks" << endl;
+            break;
+        }
+        unsigned int chunklen = temp[curpos] + (temp[curpos+1]<<8) +
+                 (temp[curpos+2]<<16);
+        if (chunklen > size - 4 - curpos) {
+            log << "A format80 chunk in the \"" << name << "\" runs past the end" << endl;
+            break;
         }
-        curpos = curpos + 4 + mapdata2[curpos] + (mapdata2[curpos+1]<<8) +
-                 (mapdata2[curpos+2]<<16);
+        if (Compression::decode80(&temp[4+curpos], chunklen, dest+8192*tmpval, 8192) != 8192) {
+            log << "A format80 chunk in the \"" << name << "\" was of wrong size" << endl;
+        }
+        curpos = curpos + 4 + chunklen;
     }
-    delete[] mapdata2;
+    return true;
+}
+
+void CnCMap::unMapPack(std::ostream& log)
+{
+    vector<unsigned char> mapdata(49152); // 48k
+    unPack(mappack, "MapPack", &mapdata[0], 6, log);
 
     /* 128*128 16-bit template number followed by 128*128 8-bit tile numbers */
-    bindata = new TileList[width*height];
-    tmpval = y*128+x;
-    curpos = 0;
-    for( ytile = 0; ytile < height; ytile++ ) {
-        for( xtile = 0; xtile < width; xtile++ ) {
+    bindata.resize(width*height);
+    unsigned int tmpval = y*128+x;
+    unsigned int curpos = 0;
+    for (int ytile = 0; ytile < height; ytile++) {
+        for (int xtile = 0; xtile < width; xtile++) {
             /* Read template and tile */
-            bindata[curpos].templateNum = ((unsigned short *)mapdata1)[tmpval];
-            bindata[curpos].tileNum = mapdata1[tmpval+128*128*2];
+            bindata[curpos].templateNum = read_word(&mapdata[tmpval*2], FCNC_LIL_ENDIAN);
+            bindata[curpos].tileNum = mapdata[tmpval+128*128*2];
             curpos++;
             tmpval++;
-            /*  printf("tile %d, %d\n", bindata[curpos-1].templateNum,
-                 bindata[curpos-1].tileNum); */
         }
         /* Skip until the end of the line and the onwards to the
-         * beginning of usefull data on the next line 
+         * beginning of usefull data on the next line
          */
         tmpval += (128-width);
     }
-    delete[] mapdata1;
-    parseBin(bindata);
-    delete[] bindata;
 }
 
-void CnCMap::parseBin(TileList* bindata)
+/** Works out which tile image each cell uses and reads the pixels of each
+ * one, leaving them to averageTiles to work out their colours.
+ */
+void CnCMap::parseBin()
 {
     unsigned int index;
 
@@ -601,7 +613,6 @@ void CnCMap::parseBin(TileList* bindata)
     int xtile, ytile;
     shared_ptr<INIFile> templini;
 
-    SDL_Surface *tileimg;
     SDL_Color palette[256];
 
     std::map<unsigned int, struct tiledata> tilelist;
@@ -611,6 +622,7 @@ void CnCMap::parseBin(TileList* bindata)
     struct tiledata tiledata;
     unsigned int tiletype;
     tilematrix.resize(width*height);
+    tiletypes.resize(width*height, 0);
 
     loadPal(palette);
     SHPBase::setPalette(palette);
@@ -647,28 +659,23 @@ void CnCMap::parseBin(TileList* bindata)
                 tileidx = imgpos->second.image;
                 tiletype = imgpos->second.type;
             } else {
-                /* a new tile */
-                tileimg = loadTile(templini, templ, tile, &tiletype);
-
-                if (tileimg == NULL) {
-                    throw MapLoadingError("Map loader: Error loading tiles");
-                }
+                /* a new tile number, though it may be an image that's
+                 * already loaded */
+                tileidx = loadTile(templini, templ, tile, &tiletype);
 
-                tileidx = tileimages.size();
                 tiledata.image = tileidx;
                 tiledata.type = tiletype;
                 tilelist[templ<<8 | tile] = tiledata;
-                tileimages.push_back(tileimg);
             }
 
             // Set the tile in the tilematrix
             tilematrix[width*ytile+xtile] = tileidx;
-            if( terraintypes[width*ytile+xtile] == 0 )
-                terraintypes[width*ytile+xtile] = tiletype;
-
-
+            tiletypes[width*ytile+xtile] = tiletype;
         }
     }
+    vector<TileList>().swap(bindata);
+    game.log << "Map loader: " << width*height << " cells use " << maptiles.size()
+             << " tile images from " << templateCache.size() << " templates" << endl;
 }
 
 /////// Overlay loading routines
@@ -698,50 +705,30 @@ const char* RAOverlayNames[] = { "SBAG", "CYCL", "BRIK", "FENC", "WOOD",
     "GEM04", "V12", "V13", "V14", "V15", "V16", "V17", "V18", "FPLS",
     "WCRATE", "SCRATE", "FENC", "SBAG" };
 
-void CnCMap::unOverlayPack()
+void CnCMap::unOverlayPack(std::ostream& log)
+{
+    overlaydata.resize(16384); // 16k
+    unPack(overlaypack, "OverlayPack", &overlaydata[0], 2, log);
+}
+
+void CnCMap::placeOverlayPack()
 {
     unsigned int curpos, tilepos;
     unsigned char xtile, ytile;
-    unsigned int keynum;
-    INIKey key;
-    unsigned char mapdata[16384]; // 16k
-    unsigned char temp[16384];
-
-    // read packed data into array
-    mapdata[0] = 0;
-    try {
-        for (keynum = 1;;++keynum) {
-            key = inifile->readIndexedKeyValue("OVERLAYPACK", keynum);
-            strcat(((char*)mapdata), key->second.c_str());
-        }
-    } catch(int) {}
-
-    Compression::dec_base64(mapdata, temp, strlen(((char*)mapdata)));
-
-    /* decode the format80 coded data (2 chunks) */
-    curpos = 0;
-    for (int tmpval = 0; tmpval < 2; tmpval++) {
-        if (Compression::decode80((unsigned char *)temp+4+curpos, mapdata+8192*tmpval) != 8192) {
-            game.log << "A format80 chunk in the \"OverlayPack\" was of wrong size" << endl;
-        }
-        curpos = curpos + 4 + temp[curpos] + (temp[curpos+1]<<8) +
-            (temp[curpos+2]<<16);
-    }
 
     for (ytile = y; ytile <= y+height; ++ytile){
         for (xtile = x; xtile <= x+width; ++xtile){
             curpos = xtile+ytile*128;
             tilepos = xtile-x+(ytile-y)*width;
-            if (mapdata[curpos] == 0xff) // No overlay
+            if (overlaydata[curpos] == 0xff) // No overlay
                 continue;
-            if (mapdata[curpos] > 0x17) // Unknown overlay type
+            if (overlaydata[curpos] > 0x17) // Unknown overlay type
                 continue;
-            parseOverlay(tilepos, RAOverlayNames[mapdata[curpos]]);
+            parseOverlay(tilepos, RAOverlayNames[overlaydata[curpos]]);
         }
     }
 }
 
-
 void CnCMap::parseOverlay(const unsigned int& linenum, const string& name)
 {
     unsigned char type, frame;
@@ -808,6 +795,7 @@ void CnCMap::parseOverlay(const unsigned int& linenum, const string& name)
         else
             terraintypes[linenum] = t_other_nonpass;
     }
+    updateMiniMapCell(linenum);
 }
 
 /** Load a palette
@@ -839,19 +827,17 @@ void CnCMap::loadPal(SDL_Color *palette)
     }
 }
 
-/** load a tile from the mixfile.
- * @param the mixfiles.
+/** load a tile from the mixfile.  Each tile of a template is only read
+ * once, however many cells or template numbers use it.
  * @param the template inifile.
  * @param the template number.
  * @param the tilenumber.
- * @returns a SDL_Surface containing the tile.
+ * @returns the index into maptiles of the tile.
  */
-SDL_Surface *CnCMap::loadTile(shared_ptr<INIFile> templini, unsigned int templ, unsigned int tile, unsigned int* tiletype)
+unsigned short CnCMap::loadTile(shared_ptr<INIFile> templini, unsigned int templ, unsigned int tile, unsigned int* tiletype)
 {
     TemplateImage *theaterfile;
 
-    SDL_Surface *retimage;
-
     string tile_filename("TEM");
     string tile_number("tiletype");
 
@@ -864,15 +850,13 @@ SDL_Surface *CnCMap::loadTile(shared_ptr<INIFile> templini, unsigned int templ,
 
     *tiletype = templini->readInt(tile_filename.c_str(), tile_number.c_str(), 0);
 
-    // TODO: stringfy this after new INIFile
-    char* temp_name = templini->readString(tile_filename.c_str(), "NAME");
+    const char* temp_name = templini->readValue(tile_filename.c_str(), "NAME").c_str();
 
     if (temp_name == NULL) {
         game.log << "Map loader: Error in templates.ini: can't find \"" << tile_filename << "\""  << endl;
         tile_filename = "CLEAR1";
     } else {
         tile_filename = temp_name;
-        delete[] temp_name;
     }
 
     tile_filename += "." + missionData.theater_prefix;
@@ -901,40 +885,96 @@ SDL_Surface *CnCMap::loadTile(shared_ptr<INIFile> templini, unsigned int templ,
         theaterfile = ti->second;
     }
 
-    //Now return this SDL_Surface
-    retimage = theaterfile->getImage(tile);
-    if (retimage == NULL) {
+    // Already loaded through another template number or by a fallback
+    const TileIds::key_type key(theaterfile, static_cast<unsigned char>(tile));
+    TileIds::const_iterator id = tileids.find(key);
+    if (id != tileids.end()) {
+        return id->second;
+    }
+
+    vector<unsigned char> pixels;
+    if (!theaterfile->readImage(tile, pixels)) {
         game.log << "Illegal template " << templ << ", " << tile << " (\"" << tile_filename << "\")! using tile 0, 0 instead" << endl;
         assert(templ != 0 && tile != 0);
         return loadTile(templini, 0, 0, tiletype);
     }
+    if (maptiles.size() > 0xffff) {
+        throw MapLoadingError("Map loader: Too many different tiles");
+    }
 
-    // Save a cache of this TemplateImage & Tile, so we can reload the SDL_Surface later
-    TemplateTilePair* pair = new TemplateTilePair;
-    pair->theater = theaterfile;
-    pair->tile = tile;
+    unsigned short tileidx = static_cast<unsigned short>(maptiles.size());
+    tileids[key] = tileidx;
 
-    templateTileCache.push_back(pair);
+    // The surface is made from the TemplateImage & Tile when it is drawn
+    MapTile maptile;
+    maptile.theater = theaterfile;
+    maptile.tile = tile;
+    maptile.image = NULL;
+    maptile.rgb = 0;
+    maptile.frame = 0;
+    maptiles.push_back(maptile);
 
-    return retimage;
+    tilepixels.push_back(vector<unsigned char>());
+    tilepixels.back().swap(pixels);
+    return tileidx;
 }
 
-/** Reloads all the tile's SDL_Image
+/** Works out the average colour of part of the tiles read by loadTile, for
+ * the minimap.  Only touches its own share of maptiles, so the parts can be
+ * done at the same time.
+ * @param part which part to do, out of parts
  */
-void CnCMap::reloadTiles() {
-
-    SDL_Surface *image;
-
-    /* Free the old surfaces */
-    for(std::vector<SDL_Surface*>::size_type i = 0; i < tileimages.size(); i++ )
-        SDL_FreeSurface(tileimages[i]);
-
-    tileimages.clear();
+void CnCMap::averageTiles(unsigned int part, unsigned int parts, std::ostream&)
+{
+    const SDL_Color* palette = SHPBase::getPalette(0);
+    const unsigned int first = maptiles.size() * part / parts;
+    const unsigned int last = maptiles.size() * (part + 1) / parts;
+    for (unsigned int i = first; i < last; ++i) {
+        unsigned long r = 0, g = 0, b = 0, count = 0;
+        const vector<unsigned char>& pixels = tilepixels[i];
+        for (vector<unsigned char>::const_iterator p = pixels.begin(); p != pixels.end(); ++p) {
+            // Colour key
+            if (*p == 0) {
+                continue;
+            }
+            r += palette[*p].r;
+            g += palette[*p].g;
+            b += palette[*p].b;
+            ++count;
+        }
+        if (count > 0) {
+            maptiles[i].rgb = (r/count) << 16 | (g/count) << 8 | (b/count);
+        }
+        vector<unsigned char>().swap(tilepixels[i]);
+    }
+}
 
-    for (TemplateTileCache::iterator i = templateTileCache.begin(); i != templateTileCache.end(); ++i) {
-        TemplateTilePair* pair = *i;
-        image = pair->theater->getImage(pair->tile);
-        tileimages.push_back(image);
+/** The terrain and overlays have the final say over what type of terrain
+ * a cell is, so the tiles' types are only filled in once they are placed.
+ */
+void CnCMap::placeTileTypes()
+{
+    for (unsigned int i = 0; i < tiletypes.size(); ++i) {
+        if (terraintypes[i] == 0) {
+            terraintypes[i] = tiletypes[i];
+        }
     }
+    vector<unsigned char>().swap(tiletypes);
 }
 
+/** Frees all the tile's SDL_Image, they are made again as they are drawn
+ */
+void CnCMap::reloadTiles() {
+    for (MapTiles::iterator i = maptiles.begin(); i != maptiles.end(); ++i) {
+        SDL_FreeSurface(i->image);
+        i->image = NULL;
+    }
+    tilelru.clear();
+    tilebytes = 0;
+    prefetchpos = 0xffffffff;
+
+    /* The pixel format may have changed, so the minimaps have to be redrawn */
+    tilecolours.clear();
+    imagecolours.clear();
+    flushMiniMaps();
+}
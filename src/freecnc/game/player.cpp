@@ -102,6 +102,7 @@ Player::Player(const char *pname, shared_ptr<INIFile> mapini) {
     mapBuildable.resize(mapsize);
 
     allmap = buildall = buildany = infmoney = false;
+    visreset = true;
 }
 
 Player::~Player()
@@ -134,6 +135,8 @@ void Player::setVisBuild(SOB_update mode, bool val)
 {
     if (mode == SOB_SIGHT) {
         std::fill(mapVisible.begin(), mapVisible.end(), val);
+        vischanges.clear();
+        visreset = true;
     } else {
         std::fill(mapBuildable.begin(), mapBuildable.end(), val);
     }
@@ -167,12 +170,11 @@ void Player::setAlliances()
 {
     shared_ptr<INIFile> mapini = p::ppool->getMapINI();
     std::vector<char*> allies_n;
-    char *tmp;
+    const char *tmp;
 
-    tmp = mapini->readString(playername, "Allies");
+    tmp = mapini->readValue(playername, "Allies").c_str();
     if( tmp != NULL ) {
         allies_n = splitList(tmp,',');
-        delete[] tmp;
     }
 
     // always allied to self
@@ -345,6 +347,12 @@ void Player::builtStruct(Structure* str)
     powerGenerated += newpower.power;
     powerUsed += newpower.drain;
     structures_owned[st].push_back(str);
+    if (structcounts.size() <= st->getTypeNum()) {
+        structcounts.resize(st->getTypeNum() + 1, 0);
+    }
+    // Prerequisites only change when the first one of a type is built
+    bool techchanged = (++structcounts[st->getTypeNum()] == 1)
+        && p::uspool->updatePrereqs(this, st);
     if (st->primarySettable() && (0 != st->getPType())) {
         production_groups[st->getPType()].push_back(str);
         if ((production_groups[st->getPType()].size() == 1) ||
@@ -358,7 +366,12 @@ void Player::builtStruct(Structure* str)
         p::ppool->playerUndefeated(this);
     }
     if (playernum == p::ppool->getLPlayerNum()) {
-        p::ppool->updateSidebar();
+        if (techchanged) {
+            p::ppool->updateSidebar();
+        } else {
+            // A new factory can still change the status of what is listed
+            p::ppool->updateBuildProgress();
+        }
         if (radarstat == 0) {
             if ((strcasecmp(((StructureType*)str->getType())->getTName(),"eye") == 0) ||
                 (strcasecmp(((StructureType*)str->getType())->getTName(),"hq") == 0)  ||
@@ -396,6 +409,9 @@ void Player::lostStruct(Structure* str)
     std::list<Structure*>::iterator it = std::find(sto.begin(), sto.end(), str);
     assert(it != sto.end());
     sto.erase(it);
+    assert(structcounts[st->getTypeNum()] > 0);
+    bool techchanged = (--structcounts[st->getTypeNum()] == 0)
+        && p::uspool->updatePrereqs(this, st);
     if (st->primarySettable() && (st->getPType() != 0)) {
         std::list<Structure*>& prg = production_groups[st->getPType()];
         it = std::find(prg.begin(), prg.end(), str);
@@ -414,7 +430,11 @@ void Player::lostStruct(Structure* str)
         }
     }
     if (playernum == p::ppool->getLPlayerNum()) {
-        p::ppool->updateSidebar();
+        if (techchanged) {
+            p::ppool->updateSidebar();
+        } else {
+            p::ppool->updateBuildProgress();
+        }
         if (radarstat == 1) {
             if ((structures_owned[p::uspool->getStructureTypeByName("eye")].empty()) &&
                 (structures_owned[p::uspool->getStructureTypeByName("hq")].empty())  &&
@@ -570,6 +590,9 @@ void Player::addSoB(unsigned int pos, unsigned char width, unsigned char height,
     for( cpos = 0; cpos < xsize*ysize; cpos++ ) {
         sightMatrix[curpos] += (mode == SOB_SIGHT);
         buildMatrix[curpos] += (mode == SOB_BUILD);
+        if (mode == SOB_SIGHT && !visreset && !mapVisible[curpos]) {
+            vischanges.push_back(curpos);
+        }
         (*mapVoB)[curpos] = true;
         curpos++;
         if (cpos%xsize == xsize-1)
@@ -577,6 +600,15 @@ void Player::addSoB(unsigned int pos, unsigned char width, unsigned char height,
     }
 }
 
+bool Player::getVisChanges(std::vector<unsigned int>& cells)
+{
+    bool reset = visreset;
+    cells.insert(cells.end(), vischanges.begin(), vischanges.end());
+    vischanges.clear();
+    visreset = false;
+    return reset;
+}
+
 void Player::removeSoB(unsigned int pos, unsigned char width, unsigned char height, unsigned char sight, SOB_update mode)
 {
     unsigned int curpos, xsize, ysize, cpos;
@@ -22,6 +22,15 @@ namespace AI
 
 class Player;
 
+/// Which unit and structure types (by type number) a player has the
+/// prerequisites for.  Maintained by UnitAndStructurePool.
+struct PrereqState
+{
+    PrereqState() : generation(0) {}
+    std::vector<bool> units, structures;
+    unsigned int generation;
+};
+
 class Player
 {
 public:
@@ -86,6 +95,11 @@ public:
     unsigned short getStructureLosses() const {return structurelosses;}
 
     size_t ownsStructure(StructureType* stype) {return structures_owned[stype].size();}
+    /// @returns the number of structures owned with the given type number
+    unsigned short getStructureCount(unsigned short typenum) const {
+        return (typenum < structcounts.size()) ? structcounts[typenum] : 0;
+    }
+    PrereqState& getPrereqState() {return prereqstate;}
     Structure*& getPrimary(const UnitOrStructureType* uostype) {
         return primary_structure[uostype->getPType()];
     }
@@ -99,6 +113,9 @@ public:
     void setVisBuild(SOB_update mode, bool val);
     std::vector<bool>& getMapVis() {return mapVisible;}
     std::vector<bool>& getMapBuildable() {return mapBuildable;}
+    /// Appends the cells that have become visible since the last call
+    /// @returns true if the whole sight matrix was reset instead
+    bool getVisChanges(std::vector<unsigned int>& cells);
 
     /// Turns on a block of cells in either the sight or buildable matrix
     void addSoB(unsigned int pos, unsigned char width, unsigned char height, unsigned char sight, SOB_update mode);
@@ -138,6 +155,9 @@ private:
     std::vector<Unit*> unitpool;
     std::vector<Structure*> structurepool;
     std::map<StructureType*, std::list<Structure*> > structures_owned;
+    // Number of structures owned, indexed by structure type number
+    std::vector<unsigned short> structcounts;
+    PrereqState prereqstate;
     std::map<unsigned int, std::list<Structure*> > production_groups;
     std::map<unsigned int, Structure*> primary_structure;
 
@@ -150,6 +170,9 @@ private:
     std::vector<unsigned char> sightMatrix, buildMatrix;
 
     std::vector<bool> mapVisible, mapBuildable;
+    // Cells revealed since the last getVisChanges, for the minimap
+    std::vector<unsigned int> vischanges;
+    bool visreset;
     // cheat/debug flags: allmap (reveal all map), buildany (remove
     // proximity check), buildall (disable prerequisites) infmoney (doesn't
     // care if money goes negative).
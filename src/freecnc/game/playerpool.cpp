@@ -9,6 +9,7 @@ PlayerPool::PlayerPool(shared_ptr<INIFile> inifile, unsigned char gamemode)
     won = false;
     mapini = inifile;
     updatesidebar = false;
+    updateprogress = false;
     radarstatus = 0;
     this->gamemode = gamemode;
 }
@@ -199,6 +200,20 @@ void PlayerPool::updateSidebar()
     updatesidebar = true;
 }
 
+bool PlayerPool::pollBuildProgress()
+{
+    if (updateprogress) {
+        updateprogress = false;
+        return true;
+    }
+    return false;
+}
+
+void PlayerPool::updateBuildProgress()
+{
+    updateprogress = true;
+}
+
 unsigned char PlayerPool::statRadar()
 {
     unsigned char tmp = radarstatus;
@@ -67,6 +67,12 @@ public:
     /// Called by the local player when sidebar is to be updated
     void updateSidebar();
 
+    /// Called by input to see if build progress needs redrawing
+    bool pollBuildProgress();
+
+    /// Called by the local player when only build progress has changed
+    void updateBuildProgress();
+
     /// Called by input to see if radar status has changed.
     unsigned char statRadar();
 
@@ -80,7 +86,7 @@ private:
     std::vector<Player *> playerpool;
     std::vector<unsigned short> player_starts;
     unsigned char localPlayer, gamemode, radarstatus;
-    bool won, lost, updatesidebar;
+    bool won, lost, updatesidebar, updateprogress;
     shared_ptr<INIFile> mapini;
 };
 
@@ -16,15 +16,13 @@ StructureType::StructureType(const char* typeName, shared_ptr<INIFile> structini
     SHPImage *shpimage, *makeimage;
     unsigned int i;
     char shpname[13], imagename[8];
-    char* tmp;
+    const char* tmp;
     char blocktest[128];
     unsigned int size;
-    char* miscnames;
+    const char* miscnames;
 
     // Ensure that there is a section in the ini file
-    try {
-        structini->readKeyValue(typeName,0);
-    } catch (int) {
+    if (structini->getNumKeys(typeName) == 0) {
         shpnums = NULL;
         blocked = NULL;
         shptnum = NULL;
@@ -38,16 +36,14 @@ StructureType::StructureType(const char* typeName, shared_ptr<INIFile> structini
     strncpy(this->tname,typeName,8);
     name = structini->readString(tname,"name");
     //prereqs = structini->splitList(tname,"prerequisites",',');
-    tmp = structini->readString(tname, "prerequisites");
+    tmp = structini->readValue(tname, "prerequisites").c_str();
     if( tmp != NULL ) {
         prereqs = splitList(tmp, ',');
-        delete[] tmp;
     }
     //owners = structini->splitList(tname,"owners",',');
-    tmp = structini->readString(tname, "owners");
+    tmp = structini->readValue(tname, "owners").c_str();
     if(  tmp != NULL ) {
         owners = splitList(tmp, ',');
-        delete[] tmp;
     }
     if (owners.empty()) {
         game.log << "StructureType: " << tname << " has no owners" << endl;
@@ -98,13 +94,12 @@ StructureType::StructureType(const char* typeName, shared_ptr<INIFile> structini
 
     for( i = 0; i < numshps; i++ ) {
         sprintf(imagename, "image%d", i+1);
-        tmp = structini->readString(tname, imagename);
+        tmp = structini->readValue(tname, imagename).c_str();
         if( tmp == NULL ) {
             strncpy(shpname, tname, 13);
             strncat(shpname, ".SHP", 13);
         } else {
             strncpy(shpname, tmp, 13);
-            delete[] tmp;
         }
         try {
             shpimage = new SHPImage(shpname, mapscaleq);
@@ -159,19 +154,17 @@ StructureType::StructureType(const char* typeName, shared_ptr<INIFile> structini
             animinfo.makenum = 0;
         }
 
-        miscnames = structini->readString(tname, "primary_weapon");
+        miscnames = structini->readValue(tname, "primary_weapon").c_str();
         if( miscnames == NULL ) {
             primary_weapon = NULL;
         } else {
             primary_weapon = p::weappool->getWeapon(miscnames);
-            delete[] miscnames;
         }
-        miscnames = structini->readString(tname, "secondary_weapon");
+        miscnames = structini->readValue(tname, "secondary_weapon").c_str();
         if( miscnames == NULL ) {
             secondary_weapon = NULL;
         } else {
             secondary_weapon = p::weappool->getWeapon(miscnames);
-            delete[] miscnames;
         }
         turret = (structini->readInt(tname,"turret",0) != 0);
         if (turret) {
@@ -188,7 +181,7 @@ StructureType::StructureType(const char* typeName, shared_ptr<INIFile> structini
         game.log << "StructureType: \"" << tname << "\" has no cost, resetting to 1"  << endl;
         cost = 1;
     }
-    miscnames = structini->readString(tname,"armour","none");
+    miscnames = structini->readValue(tname,"armour").c_str();
     if (miscnames == NULL)
         armour = AC_none;
     else {
@@ -202,7 +195,6 @@ StructureType::StructureType(const char* typeName, shared_ptr<INIFile> structini
             armour = AC_heavy;
         else if (strncasecmp(miscnames,"concrete",8) == 0)
             armour = AC_concrete;
-        delete[] miscnames;
     }
 
     primarysettable = (structini->readInt(tname,"primary",0) != 0);
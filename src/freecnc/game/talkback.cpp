@@ -27,9 +27,7 @@ void Talkback::load(string talkback, shared_ptr<INIFile> tbini)
     unsigned int keynum;
     INIKey key;
 
-    try {
-        tbini->readKeyValue(talkback.c_str(), 0);
-    } catch(int) {
+    if (tbini->getNumKeys(talkback.c_str()) == 0) {
         game.log << "Could not find talkback \"" << talkback << "\", reverting to default" << endl;
         talkback = "Generic";
     }
@@ -59,7 +57,7 @@ void Talkback::load(string talkback, shared_ptr<INIFile> tbini)
                 if (tbt == TB_invalid) {
                     continue;
                 }
-                pc::sfxeng->LoadSound(key->second.c_str());
+                pc::sfxeng->PreloadSound(key->second.c_str());
                 talkstore[tbt].push_back(key->second);
             }
             delete[] first;
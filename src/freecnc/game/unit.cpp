@@ -33,9 +33,7 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
 
     deploytarget = NULL;
     // Ensure that there is a section in the ini file
-    try {
-        unitini->readKeyValue(typeName,0);
-    } catch (int) {
+    if (unitini->getNumKeys(typeName) == 0) {
         game.log << "UnitType: Unknown type: \"" << typeName << "\"" << endl;
         name = NULL;
         shpnums = NULL;
@@ -45,10 +43,9 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
     memset(this->tname,0x0,8);
     strncpy(this->tname,typeName,8);
     name = unitini->readString(tname,"name");
-    char* tmp = unitini->readString(tname,"prerequisites");
+    const char* tmp = unitini->readValue(tname,"prerequisites").c_str();
     if (0 != tmp) {
         prereqs = splitList(tmp,',');
-        delete[] tmp;
     }
 
     unittype = unitini->readInt(tname, "unittype",0);
@@ -81,10 +78,9 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
     buildlevel = unitini->readInt(tname,"buildlevel",99);
     techlevel = unitini->readInt(tname,"techlevel",99);
 
-    tmp = unitini->readString(tname, "owners");
+    tmp = unitini->readValue(tname, "owners").c_str();
     if( tmp != NULL ) {
         owners = splitList(tmp,',');
-        delete[] tmp;
     }
 
     if (unittype == 1)
@@ -108,16 +104,19 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
             movemod = (tmpspeed>4)?(tmpspeed-4):1;
         }
     }
-    char* talkmode = 0;
+    const char* talkmode = unitini->readValue(tname, "talkback").c_str();
     if (is_infantry) {
-        talkmode = unitini->readString(tname, "talkback","Generic");
+        if (talkmode == NULL) {
+            talkmode = "Generic";
+        }
         sight = unitini->readInt(tname, "sight", 3);
     } else {
-        talkmode = unitini->readString(tname, "talkback","Generic-Vehicle");
+        if (talkmode == NULL) {
+            talkmode = "Generic-Vehicle";
+        }
         sight = unitini->readInt(tname, "sight", 5);
     }
     talkback = p::uspool->getTalkback(talkmode);
-    delete[] talkmode;
     maxhealth = unitini->readInt(tname, "health", 50);
     cost = unitini->readInt(tname, "cost", 0);
     if (0 == cost) {
@@ -139,19 +138,17 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
         //size = shpimage->getWidth();
         offset = (shpimage->getWidth()-24)>>1;
     }
-    char* miscnames = unitini->readString(tname, "primary_weapon");
+    const char* miscnames = unitini->readValue(tname, "primary_weapon").c_str();
     if( miscnames == NULL ) {
         primary_weapon = NULL;
     } else {
         primary_weapon = p::weappool->getWeapon(miscnames);
-        delete[] miscnames;
     }
-    miscnames = unitini->readString(tname, "secondary_weapon");
+    miscnames = unitini->readValue(tname, "secondary_weapon").c_str();
     if( miscnames == NULL ) {
         secondary_weapon = NULL;
     } else {
         secondary_weapon = p::weappool->getWeapon(miscnames);
-        delete[] miscnames;
     }
     deploytarget = unitini->readString(tname, "deploysto");
     if (deploytarget != NULL) {
@@ -159,7 +156,7 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
         deploytype = p::uspool->getStructureTypeByName(deploytarget);
     }
     pipcolour = unitini->readInt(tname,"pipcolour",0);
-    miscnames = unitini->readString(tname,"armour");
+    miscnames = unitini->readValue(tname,"armour").c_str();
     if (miscnames == NULL)
         armour = AC_none;
     else {
@@ -173,8 +170,6 @@ UnitType::UnitType(const char *typeName, shared_ptr<INIFile> unitini)
             armour = AC_heavy;
         else if (strncasecmp(miscnames,"concrete",8) == 0)
             armour = AC_concrete;
-
-        delete[] miscnames;
     }
     valid = true;
 }
@@ -25,9 +25,10 @@ using p::ppool;
 /** Constructor, loads all the units from the inifile and create
  * those units/structures in the unit/structure pool
  */
-UnitAndStructurePool::UnitAndStructurePool() : deleted_unitorstruct(false), numdeletedunit(0), numdeletedstruct(0)
+UnitAndStructurePool::UnitAndStructurePool() : prereqgen(1), deleted_unitorstruct(false), numdeletedunit(0), numdeletedstruct(0)
 {
     unitandstructmat.resize(ccmap->getWidth() * ccmap->getHeight());
+    radardirty.resize(unitandstructmat.size());
 
     structini = GetConfig("structure.ini");
     unitini = GetConfig("unit.ini");
@@ -46,30 +47,16 @@ UnitAndStructurePool::~UnitAndStructurePool()
 {
     unsigned int i;
 
-    // this is for cleaning up the multimaps
-    typedef multimap<UnitType*, vector<StructureType*>* >::const_iterator Iu;
-    typedef multimap<StructureType*, vector<StructureType*>* >::const_iterator Is;
-    std::pair<Is,Is> structpair;
-    std::pair<Iu,Iu> unitpair;
-
     for( i = 0; i < unitpool.size(); i++ ) {
         delete unitpool[i];
     }
     for( i = 0; i < unittypepool.size(); i++ ) {
-        unitpair = unit_prereqs.equal_range(unittypepool[i]);
-        for (Iu l = unitpair.first; l != unitpair.second ; ++l) {
-            delete l->second;
-        }
         delete unittypepool[i];
     }
     for( i = 0; i < structurepool.size(); i++ ) {
         structurepool[i]->unrefer();
     }
     for( i = 0; i < structuretypepool.size(); i++ ) {
-        structpair = struct_prereqs.equal_range(structuretypepool[i]);
-        for (Is l = structpair.first; l != structpair.second ; ++l) {
-            delete l->second;
-        }
         delete structuretypepool[i];
     }
 
@@ -142,6 +129,24 @@ bool UnitAndStructurePool::getUnitOrStructureLimAt(unsigned int curpos, float* w
     return false;
 }
 
+void UnitAndStructurePool::getRadarChanges(std::vector<unsigned int>& cells)
+{
+    for (vector<unsigned int>::iterator i = radarchanges.begin(); i != radarchanges.end(); ++i) {
+        radardirty[*i] = false;
+    }
+    cells.insert(cells.end(), radarchanges.begin(), radarchanges.end());
+    radarchanges.clear();
+}
+
+/// Records that a cell's occupant has changed, each cell is only queued once
+void UnitAndStructurePool::markRadarCell(unsigned int pos)
+{
+    if (!radardirty[pos]) {
+        radardirty[pos] = true;
+        radarchanges.push_back(pos);
+    }
+}
+
 /// Gets a list of all flying stuff in the current tile
 unsigned char UnitAndStructurePool::getL2overlays(unsigned short pos, unsigned int **inumbers, char **xoffset, char **yoffset)
 {
@@ -231,6 +236,7 @@ bool UnitAndStructurePool::createStructure(StructureType* type, unsigned short c
             return false;
         }
         unitandstructmat[cellpos] = (US_LOWER_RIGHT|US_IS_WALL)|structnum;
+        markRadarCell(cellpos);
     } else {
         /// @TODO Rewrite this to use curpos in a more straightforward way.
         curpos = cellpos+ccmap->getWidth()*(type->getYsize());
@@ -265,6 +271,7 @@ bool UnitAndStructurePool::createStructure(StructureType* type, unsigned short c
             for (x = type->getXsize()-1; x>=0; --x) {
                 if (type->isBlocked(y*type->getXsize()+x)) {
                     unitandstructmat[curpos+x] = US_IS_STRUCTURE|structnum;
+                    markRadarCell(curpos+x);
                     if (!setlr) {
                         unitandstructmat[curpos+x] |= US_LOWER_RIGHT;
                         setlr = true;
@@ -351,6 +358,7 @@ bool UnitAndStructurePool::createUnit(UnitType* type, unsigned short cellpos,
     Unit* un = new Unit(type, cellpos, subpos, group, owner, health, facing);
     unitandstructmat[cellpos] = unitnum;
     unitandstructmat[cellpos] |= US_LOWER_RIGHT|US_IS_UNIT;
+    markRadarCell(cellpos);
     /* curpos = cellpos;
      for( y = 0; y < type->getSize(); y++ ){
       for(x = 0; x < type->getSize(); x++){
@@ -632,6 +640,7 @@ unsigned char UnitAndStructurePool::postMove(Unit *un, unsigned short newpos)
         // clear values from old position
         unitandstructmat[un->getPos()] &= ~(US_LOWER_RIGHT|US_IS_UNIT);
     }
+    markRadarCell(un->getPos());
     return subpos;
 }
 
@@ -680,6 +689,10 @@ unsigned char UnitAndStructurePool::unhideUnit(Unit* un, unsigned short newpos,
          then bitwise OR this value. */
         unitandstructmat[newpos] = US_LOWER_RIGHT|US_IS_UNIT|un->getNum();
     }
+    markRadarCell(newpos);
+    if (!unload) {
+        markRadarCell(un->getPos());
+    }
 
     return subpos;
 }
@@ -698,6 +711,7 @@ void UnitAndStructurePool::hideUnit(Unit* un)
     } else {
         unitandstructmat[un->getPos()] &= ~(US_IS_UNIT|US_LOWER_RIGHT);
     }
+    markRadarCell(un->getPos());
 }
 
 /** resets the US_MOVING_HERE flag of a cell when the unit stops
@@ -787,8 +801,11 @@ UnitType* UnitAndStructurePool::getUnitTypeByName(const char* unitname)
     } else {
         typenum = unittypepool.size();
         type = new UnitType(uname.c_str(), unitini);
+        type->setTypeNum(typenum);
         unittypepool.push_back(type);
         unitname2typenum[uname] = typenum;
+        unit_prereqs.push_back(Prereqs());
+        unit_sides.push_back(getOwnerSides(type));
     }
     if (type->isValid()) {
         return type;
@@ -816,8 +833,13 @@ StructureType *UnitAndStructurePool::getStructureTypeByName(const char* structna
     } else {
         typenum = structuretypepool.size();
         type = new StructureType(structname, structini, artini, theaterext);
+        type->setTypeNum(typenum);
         structuretypepool.push_back(type);
         structname2typenum[sname] = typenum;
+        struct_prereqs.push_back(Prereqs());
+        struct_dependents.resize(structuretypepool.size());
+        unit_dependents.resize(structuretypepool.size());
+        struct_sides.push_back(getOwnerSides(type));
     }
     if (type->isValid()) {
         return type;
@@ -859,6 +881,7 @@ void UnitAndStructurePool::removeUnit(Unit *un)
     } else {
         unitandstructmat[un->getPos()] &= ~(US_LOWER_RIGHT|US_IS_UNIT);
     }
+    markRadarCell(un->getPos());
     numdeletedunit++;
     deleted_unitorstruct = true;
     un->remove();
@@ -876,11 +899,13 @@ void UnitAndStructurePool::removeStructure(Structure *st)
     if (((StructureType*)st->getType())->isWall()) {
         updateWalls(st,false);
         unitandstructmat[curpos] &= ~(US_LOWER_RIGHT|US_IS_WALL);
+        markRadarCell(curpos);
     } else {
         for( y = 0; y<((StructureType *)st->getType())->getYsize(); y++ ) {
             for(x = 0; x<((StructureType *)st->getType())->getXsize(); x++) {
                 if( ((StructureType *)st->getType())->isBlocked(y*((StructureType *)st->getType())->getXsize()+x) ) {
                     unitandstructmat[curpos+x] &= ~(US_LOWER_RIGHT|US_IS_STRUCTURE);
+                    markRadarCell(curpos+x);
                 }
             }
             curpos += ccmap->getWidth();
@@ -992,46 +1017,59 @@ void UnitAndStructurePool::showMoves()
 
 void UnitAndStructurePool::addPrerequisites(UnitType* unittype)
 {
-    vector<StructureType*>* type_prereqs;
     if (unittype == NULL)
         return;
-    vector<char*> prereqs = unittype->getPrereqs();
-
-    if (prereqs.empty()) {
-        game.log << "UnitAndStructurePool::addPrerequisites: No prerequisites for unit \"" << unittype->getTName() << "\"" << endl;
-        return;
-    }
-    if (strcasecmp(prereqs[0],"none") == 0) {
-        return;
-    }
-    for (unsigned short x=0;x<prereqs.size();++x) {
-        type_prereqs = new vector<StructureType*>;
-        splitORPreReqs(prereqs[x],type_prereqs);
-        unit_prereqs.insert(make_pair(unittype,type_prereqs));
-    }
+    compilePrereqs(unittype, unit_prereqs, unit_dependents);
 }
 
 void UnitAndStructurePool::addPrerequisites(StructureType* structtype)
 {
-    vector<StructureType*>* type_prereqs;
     if (structtype == NULL)
         return;
-    vector<char*> prereqs = structtype->getPrereqs();
+    compilePrereqs(structtype, struct_prereqs, struct_dependents);
+}
+
+/** Turns the prerequisite names of a type into clauses of structure type
+ * numbers, and records the type as a dependent of every structure named.
+ */
+void UnitAndStructurePool::compilePrereqs(const UnitOrStructureType* type, vector<Prereqs>& typeprereqs,
+        vector<vector<unsigned short> >& dependents)
+{
+    vector<char*> prereqs = type->getPrereqs();
 
     if (prereqs.empty()) {
-        game.log << "UnitAndStructurePool::addPrerequisites: No prerequisites for structure \""
-                 << structtype->getTName() << "\"." "Use \"none\" if this intended." << endl;
+        game.log << "UnitAndStructurePool::addPrerequisites: No prerequisites for \""
+                 << type->getTName() << "\"." "Use \"none\" if this intended." << endl;
         return;
     }
     if (strcasecmp(prereqs[0],"none") == 0) {
         return;
     }
+    // Looking up the structures can load new types and grow typeprereqs, so
+    // only store the clauses at the end.
+    Prereqs clauses;
     for (unsigned short x=0;x<prereqs.size();++x) {
-        type_prereqs = new vector<StructureType*>;
-        splitORPreReqs(prereqs[x],type_prereqs);
-        struct_prereqs.insert(make_pair(structtype,type_prereqs));
+        vector<StructureType*> options;
+        splitORPreReqs(prereqs[x],&options);
+        // Invalid types are left out, so a clause naming only invalid types
+        // is empty and can never be met.
+        clauses.push_back(PrereqClause());
+        for (vector<StructureType*>::iterator st = options.begin(); st != options.end(); ++st) {
+            if (*st == NULL) {
+                continue;
+            }
+            unsigned short num = (*st)->getTypeNum();
+            clauses.back().push_back(num);
+            vector<unsigned short>& deps = dependents[num];
+            if (find(deps.begin(), deps.end(), type->getTypeNum()) == deps.end()) {
+                deps.push_back(type->getTypeNum());
+            }
+        }
     }
+    typeprereqs[type->getTypeNum()] = clauses;
+    ++prereqgen;
 }
+
 void UnitAndStructurePool::splitORPreReqs(const char* prereqs, vector<StructureType*>* type_prereqs)
 {
     char tmp[16];
@@ -1121,62 +1159,24 @@ void UnitAndStructurePool::generateProductionGroups() {
 vector<const char*> UnitAndStructurePool::getBuildableUnits(Player* pl)
 {
     vector<const char*> retval;
-    vector<StructureType*> prereqs;
-    typedef multimap<UnitType*, vector<StructureType*>* >::const_iterator I;
-    pair<I,I> b;
-    unsigned int x,y;
-    UnitType* utype;
-    bool ivalid, ovalid, buildall;
-    buildall = pl->canBuildAll();
-    for (x=0;x<unittypepool.size();++x) {
-        utype = unittypepool[x];
+    PrereqState& state = pl->getPrereqState();
+    if (state.generation != prereqgen || state.units.size() != unittypepool.size()
+            || state.structures.size() != structuretypepool.size()) {
+        resetPrereqs(pl);
+    }
+    bool buildall = pl->canBuildAll();
+    for (unsigned int x=0;x<unittypepool.size();++x) {
+        UnitType* utype = unittypepool[x];
         if (!utype->isValid())
             continue;
-        b = unit_prereqs.equal_range(utype);
-        ovalid = true;
         if (buildall) {
             if (strlen(utype->getTName()) < 5) {
                 retval.push_back(utype->getTName());
             }
             continue;
         }
-        if ( ( (utype->getBuildlevel() < 99) && (ccmap->getGameMode() != 0)) ||
-                (utype->getBuildlevel() <= ccmap->getMissionData().buildlevel) ) {
-            for (I i = b.first; i != b.second; ++i) {
-                // need all of these
-                prereqs = *(i->second);
-                ivalid = false;
-                for (y = 0;y < prereqs.size() ; ++y) {
-                    // need just one of these
-                    if (pl->ownsStructure(prereqs[y])) {
-                        ivalid = true;
-                        break;
-                    }
-                }
-                if (ovalid) {
-                    ovalid = ivalid;
-                }
-            }
-            if (ovalid) {
-                int localPlayerSide, curside;
-                char* tmpname;
-                localPlayerSide = ppool->getLPlayer()->getSide();
-                for (y=0;y<utype->getOwners().size();++y) {
-                    tmpname = utype->getOwners()[y];
-                    // note: should avoid hardcoded side names
-                    if (strcasecmp(tmpname,"gdi") == 0) {
-                        curside = PS_GOOD;
-                    } else if (strcasecmp(tmpname,"nod") == 0) {
-                        curside = PS_BAD;
-                    } else {
-                        curside = PS_NEUTRAL;
-                    }
-                    if (curside == (localPlayerSide&~PS_MULTI)) {
-                        retval.push_back(utype->getTName());
-                        break;
-                    }
-                }
-            }
+        if (state.units[x] && isListable(utype, unit_sides[x])) {
+            retval.push_back(utype->getTName());
         }
     }
     return retval;
@@ -1185,67 +1185,129 @@ vector<const char*> UnitAndStructurePool::getBuildableUnits(Player* pl)
 vector<const char*> UnitAndStructurePool::getBuildableStructures(Player* pl)
 {
     vector<const char*> retval;
-    vector<StructureType*> prereqs;
-    typedef multimap<StructureType*, vector<StructureType*>* >::const_iterator I;
-    pair<I,I> b;
-    unsigned int x,y;
-    bool ivalid, ovalid, buildall;
-    StructureType* stype;
-    buildall = pl->canBuildAll();
-    for (x=0;x<structuretypepool.size();++x) {
-        stype = structuretypepool[x];
+    PrereqState& state = pl->getPrereqState();
+    if (state.generation != prereqgen || state.units.size() != unittypepool.size()
+            || state.structures.size() != structuretypepool.size()) {
+        resetPrereqs(pl);
+    }
+    bool buildall = pl->canBuildAll();
+    for (unsigned int x=0;x<structuretypepool.size();++x) {
+        StructureType* stype = structuretypepool[x];
         if (!stype->isValid())
             continue;
-        b = struct_prereqs.equal_range(stype);
-        ovalid = true;
         if (buildall) {
             if (strlen(stype->getTName()) < 5) {
                 retval.push_back(stype->getTName());
             }
             continue;
         }
-        if ( ( (stype->getBuildlevel() < 99) && (ccmap->getGameMode() != 0)) ||
-                (stype->getBuildlevel() <= ccmap->getMissionData().buildlevel)) {
-            for (I i = b.first; i != b.second; ++i) {
-                // need all of these
-                prereqs = *(i->second);
-                ivalid = false;
-                for (y = 0;y < prereqs.size() ; ++y) {
-                    // need just one of these
-                    if (pl->ownsStructure(prereqs[y])) {
-                        ivalid = true;
-                        break;
-                    }
-                }
-                if (ovalid) {
-                    ovalid = ivalid;
-                }
-            }
-            if (ovalid) {
-                int localPlayerSide, curside;
-                char* tmpname;
-                localPlayerSide = (ppool->getLPlayer()->getSide())&~PS_MULTI;
-                for (y=0;y<stype->getOwners().size();++y) {
-                    tmpname = stype->getOwners()[y];
-                    // note: should avoid hardcoded side names
-                    if (strcasecmp(tmpname,"gdi") == 0) {
-                        curside = PS_GOOD;
-                    } else if (strcasecmp(tmpname,"nod") == 0) {
-                        curside = PS_BAD;
-                    } else {
-                        curside = PS_NEUTRAL;
-                    }
-                    if (curside == localPlayerSide) {
-                        retval.push_back(stype->getTName());
-                        break;
-                    }
-                }
-            }
+        if (state.structures[x] && isListable(stype, struct_sides[x])) {
+            retval.push_back(stype->getTName());
         }
     }
     return retval;
 }
 
+bool UnitAndStructurePool::updatePrereqs(Player* pl, StructureType* stype)
+{
+    PrereqState& state = pl->getPrereqState();
+    if (state.generation != prereqgen || state.units.size() != unittypepool.size()
+            || state.structures.size() != structuretypepool.size()) {
+        resetPrereqs(pl);
+        return true;
+    }
+    bool changed = false;
+    const vector<unsigned short>& units = unit_dependents[stype->getTypeNum()];
+    for (vector<unsigned short>::const_iterator i = units.begin(); i != units.end(); ++i) {
+        bool met = prereqsMet(pl, unit_prereqs[*i]);
+        if (met != state.units[*i]) {
+            state.units[*i] = met;
+            changed |= isListable(unittypepool[*i], unit_sides[*i]);
+        }
+    }
+    const vector<unsigned short>& structs = struct_dependents[stype->getTypeNum()];
+    for (vector<unsigned short>::const_iterator i = structs.begin(); i != structs.end(); ++i) {
+        bool met = prereqsMet(pl, struct_prereqs[*i]);
+        if (met != state.structures[*i]) {
+            state.structures[*i] = met;
+            changed |= isListable(structuretypepool[*i], struct_sides[*i]);
+        }
+    }
+    return changed;
+}
+
+/// Recalculates every entry of a player's PrereqState
+void UnitAndStructurePool::resetPrereqs(Player* pl)
+{
+    PrereqState& state = pl->getPrereqState();
+    state.units.resize(unittypepool.size());
+    state.structures.resize(structuretypepool.size());
+    for (unsigned int x = 0; x < unittypepool.size(); ++x) {
+        state.units[x] = prereqsMet(pl, unit_prereqs[x]);
+    }
+    for (unsigned int x = 0; x < structuretypepool.size(); ++x) {
+        state.structures[x] = prereqsMet(pl, struct_prereqs[x]);
+    }
+    state.generation = prereqgen;
+}
+
+bool UnitAndStructurePool::prereqsMet(const Player* pl, const Prereqs& clauses) const
+{
+    for (Prereqs::const_iterator i = clauses.begin(); i != clauses.end(); ++i) {
+        // need all of these
+        bool met = false;
+        for (PrereqClause::const_iterator j = i->begin(); j != i->end(); ++j) {
+            // need just one of these
+            if (pl->getStructureCount(*j) > 0) {
+                met = true;
+                break;
+            }
+        }
+        if (!met) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Checks the parts of buildability that do not depend on what the player
+ * owns: the mission's build level and which sides may build the type.
+ */
+bool UnitAndStructurePool::isListable(const UnitOrStructureType* type, unsigned char sides) const
+{
+    if (!type->isValid()) {
+        return false;
+    }
+    if (!( ( (type->getBuildlevel() < 99) && (ccmap->getGameMode() != 0)) ||
+            (type->getBuildlevel() <= ccmap->getMissionData().buildlevel) )) {
+        return false;
+    }
+    // Multiplayer sides build what their single player side would, which
+    // the unit and structure lists both did before they shared this check
+    unsigned char localPlayerSide = (ppool->getLPlayer()->getSide())&~PS_MULTI;
+    return localPlayerSide != 0 && (sides & localPlayerSide) == localPlayerSide;
+}
+
+unsigned char UnitAndStructurePool::getOwnerSides(const UnitOrStructureType* type) const
+{
+    if (!type->isValid()) {
+        return 0;
+    }
+    unsigned char sides = 0;
+    vector<char*> owners = type->getOwners();
+    for (unsigned int y=0;y<owners.size();++y) {
+        // note: should avoid hardcoded side names
+        if (strcasecmp(owners[y],"gdi") == 0) {
+            sides |= PS_GOOD;
+        } else if (strcasecmp(owners[y],"nod") == 0) {
+            sides |= PS_BAD;
+        } else {
+            sides |= PS_NEUTRAL;
+        }
+    }
+    return sides;
+}
+
 shared_ptr<Talkback> UnitAndStructurePool::getTalkback(const char* talkback)
 {
     map<string, shared_ptr<Talkback> >::iterator typeentry;
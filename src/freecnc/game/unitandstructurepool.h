@@ -105,6 +105,9 @@ public:
     }
     void showMoves();
 
+    /// Appends the cells whose occupant has changed since the last call
+    void getRadarChanges(std::vector<unsigned int>& cells);
+
     // techtree code
     void addPrerequisites(UnitType* unittype);
     void addPrerequisites(StructureType* structtype);
@@ -120,6 +123,11 @@ public:
     std::vector<const char*> getBuildableUnits(Player* pl);
     std::vector<const char*> getBuildableStructures(Player* pl);
 
+    /// Rechecks the types that list stype as a prerequisite, after pl built
+    /// its first or lost its last one.
+    /// @returns whether the buildable lists for pl have changed
+    bool updatePrereqs(Player* pl, StructureType* stype);
+
     // unit is removed from map (to be stored in transport)
     void hideUnit(Unit* un);
     unsigned char unhideUnit(Unit* un, unsigned short newpos, bool unload);
@@ -141,9 +149,29 @@ private:
     std::multimap<unsigned short, L2Overlay*> l2pool;
     std::map<unsigned short, unsigned short> numl2images;
 
-    std::multimap<StructureType*, std::vector<StructureType*>* > struct_prereqs;
-    std::multimap<UnitType*, std::vector<StructureType*>* > unit_prereqs;
+    // Prerequisites, indexed by type number.  Each clause lists structure
+    // type numbers of which at least one must be owned, and every clause
+    // must be met.
+    typedef std::vector<unsigned short> PrereqClause;
+    typedef std::vector<PrereqClause> Prereqs;
+    std::vector<Prereqs> struct_prereqs;
+    std::vector<Prereqs> unit_prereqs;
+    // Indexed by structure type number: the types listing it in a clause
+    std::vector<std::vector<unsigned short> > struct_dependents;
+    std::vector<std::vector<unsigned short> > unit_dependents;
+    // PS_* flags of the sides listed as owners, indexed by type number
+    std::vector<unsigned char> struct_sides;
+    std::vector<unsigned char> unit_sides;
+    // Bumped whenever prerequisites are added, so stale PrereqStates are
+    // recalculated from scratch
+    unsigned int prereqgen;
     void splitORPreReqs(const char* prereqs, std::vector<StructureType*>* type_prereqs);
+    void compilePrereqs(const UnitOrStructureType* type, std::vector<Prereqs>& typeprereqs,
+            std::vector<std::vector<unsigned short> >& dependents);
+    bool prereqsMet(const Player* pl, const Prereqs& clauses) const;
+    bool isListable(const UnitOrStructureType* type, unsigned char sides) const;
+    unsigned char getOwnerSides(const UnitOrStructureType* type) const;
+    void resetPrereqs(Player* pl);
 
     std::map<std::string, shared_ptr<Talkback> > talkbackpool;
 
@@ -156,6 +184,11 @@ private:
     unsigned short numdeletedunit;
     unsigned short numdeletedstruct;
     void updateWalls(Structure* st, bool add);
+
+    // Changed cells not yet collected by getRadarChanges
+    std::vector<unsigned int> radarchanges;
+    std::vector<bool> radardirty;
+    void markRadarCell(unsigned int pos);
 };
 
 #endif
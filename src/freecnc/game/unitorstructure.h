@@ -15,7 +15,7 @@ class Weapon;
 class UnitOrStructureType
 {
 public:
-    UnitOrStructureType() : ptype(0), valid(false) {}
+    UnitOrStructureType() : ptype(0), typenum(0), valid(false) {}
 
     virtual ~UnitOrStructureType() {};
 
@@ -91,11 +91,16 @@ public:
     unsigned char getPType() const {return ptype;}
     void setPType(unsigned char p) {ptype = p;}
 
+    /// @returns the index of this type in UnitAndStructurePool's type list
+    unsigned short getTypeNum() const {return typenum;}
+    void setTypeNum(unsigned short num) {typenum = num;}
+
     // Calling a virtual function is much faster than a dynamic_cast
     virtual bool isStructure() const = 0;
 
 protected:
     unsigned char ptype;
+    unsigned short typenum;
     bool valid;
 };
 
@@ -12,40 +12,37 @@
 
 Warhead::Warhead(const char *whname, shared_ptr<INIFile> weapini)
 {
-    char *tmpname;
     SHPImage* temp;
 
-    tmpname = weapini->readString(whname, "explosionimage");
+    const char* imagename = weapini->readValue(whname, "explosionimage").c_str();
     explosionimage = 0;
-    if( tmpname != NULL ) {
+    if( imagename != NULL ) {
         explosionimage = pc::imagepool->size()<<16;
         try {
-            temp = new SHPImage(tmpname, mapscaleq);
+            temp = new SHPImage(imagename, mapscaleq);
         } catch (ImageNotFound&) {
             throw 0;
         }
         pc::imagepool->push_back(temp);
-        delete[] tmpname;
     }
     explosionanimsteps = temp->getNumImg();
     explosionsound = weapini->readString(whname, "explosionsound");
     if (explosionsound != 0)
-        pc::sfxeng->LoadSound(explosionsound);
+        pc::sfxeng->PreloadSound(explosionsound);
     infantrydeath = 0;
     walls = (weapini->readInt(whname, "walls",0) != 0);
     trees = false;
     //blastradius = 0;
-    tmpname = weapini->readString(whname, "versus");
+    const char* versusvalues = weapini->readValue(whname, "versus").c_str();
     versus[0] = 100;
     versus[1] = 100;
     versus[2] = 100;
     versus[3] = 100;
     versus[4] = 100;
-    if (tmpname != NULL) {
-        sscanf(tmpname,"%u,%u,%u,%u,%u",&versus[0],&versus[1],
+    if (versusvalues != NULL) {
+        sscanf(versusvalues,"%u,%u,%u,%u,%u",&versus[0],&versus[1],
                &versus[2],&versus[3],&versus[4]);
     }
-    delete[] tmpname;
     //for (int i=0;i<5;++i)
     //    fprintf(stderr,"%s\t%i\t%i\n",whname,i,versus[i]);
 }
@@ -59,7 +56,7 @@ Warhead::~Warhead()
 
 Projectile::Projectile(const char *pname, shared_ptr<INIFile> weapini)
 {
-    char *iname = weapini->readString(pname, "image");
+    const char *iname = weapini->readValue(pname, "image").c_str();
     SHPImage* temp;
     imagenum = 0;
     rotates = false;
@@ -73,7 +70,6 @@ Projectile::Projectile(const char *pname, shared_ptr<INIFile> weapini)
         }
         //  printf("Projectile %s has %s which has %i\n",pname,iname,temp->getNumImg());
         pc::imagepool->push_back(temp);
-        delete[] iname;
 
         if (weapini->readInt(pname,"rotates",0) != 0) {
             rotationimgs = temp->getNumImg();
@@ -91,7 +87,7 @@ Projectile::~Projectile()
 
 Weapon::Weapon(const char* wname) : name(wname)
 {
-    char *pname, *whname, *faname, *faimage;
+    const char *pname, *whname, *faname, *faimage;
     map<string, Projectile*>::iterator projentry;
     map<string, Warhead*>::iterator wheadentry;
     shared_ptr<INIFile> weapini = p::weappool->getWeaponsINI();
@@ -102,7 +98,7 @@ Weapon::Weapon(const char* wname) : name(wname)
     
     std::transform(weapname.begin(), weapname.end(), weapname.begin(), toupper);
 
-    pname = weapini->readString(wname, "projectile");
+    pname = weapini->readValue(wname, "projectile").c_str();
     if( pname == NULL ) {
         game.log << "Unable to find projectile for weapon \"" << wname << "\" in inifile.."  << endl;
         throw 0;
@@ -117,16 +113,14 @@ Weapon::Weapon(const char* wname) : name(wname)
             projectile = new Projectile(pname, weapini);
         } catch(int) {
             game.log << "Unable to find projectile \"" << pname << "\" used for weapon \"" << wname << "\".  Units using this weapon will be unarmed\n" << endl;
-            delete[] pname;
             throw 0;
         }
         p::weappool->projectilepool[projname] = projectile;
     } else {
         projectile = projentry->second;
     }
-    delete[] pname;
 
-    whname = weapini->readString(wname, "warhead");
+    whname = weapini->readValue(wname, "warhead").c_str();
     if( whname == NULL ) {
         game.log << "Unable to find warhead for weapon \"" << wname << "\" in inifile.."  << endl;
         throw 0;
@@ -139,14 +133,12 @@ Weapon::Weapon(const char* wname) : name(wname)
             whead = new Warhead(whname, weapini);
         } catch (int) {
             game.log << "Unable to find warhead \"" << whname << "\" used for weapon \"" << wname << "\".  Units using this weapon will be unarmed\n" << endl;
-            delete[] whname;
             throw 0;
         }
         p::weappool->warheadpool[warheadname] = whead;
     } else {
         whead = wheadentry->second;
     }
-    delete[] whname;
 
     speed      = weapini->readInt(wname, "speed", 100);
     range      = weapini->readInt(wname, "range", 1);
@@ -159,26 +151,23 @@ Weapon::Weapon(const char* wname) : name(wname)
     // pc::imagepool->push_back(new SHPImage("minigun.shp", mapscaleq));
     firesound  = weapini->readString(wname, "firesound");
     if (firesound != 0)
-        pc::sfxeng->LoadSound(firesound);
+        pc::sfxeng->PreloadSound(firesound);
     fuel       = weapini->readInt(wname, "fuel", 0);
     seekfuel   = weapini->readInt(wname, "seekfuel", 0);
 
-    faname = weapini->readString(wname, "fireimage", "none");
-    if (strcasecmp(faname,"none") == 0) {
-        delete[] faname;
+    faname = weapini->readValue(wname, "fireimage").c_str();
+    if (faname == NULL || strcasecmp(faname,"none") == 0) {
         numfireimages = 0;
         numfiredirections = 1;
         fireimage = 0;
     } else {
         additional = (unsigned char)weapini->readInt(faname,"additional",0);
-        faimage = weapini->readString(faname, "image", "minigun.shp");
+        faimage = weapini->readValue(faname, "image").c_str();
         try {
-            fireanimtemp = new SHPImage(faimage, mapscaleq);
+            fireanimtemp = new SHPImage(faimage != NULL ? faimage : "minigun.shp", mapscaleq);
         } catch (ImageNotFound&) {
             throw 0;
         }
-        delete[] faimage;
-        faimage = NULL;
         numfireimages = fireanimtemp->getNumImg();
         numfiredirections = weapini->readInt(faname, "directions", 1);
         if (numfiredirections == 0) {
@@ -191,8 +180,8 @@ Weapon::Weapon(const char* wname) : name(wname)
             char* tmpname = new char[12];
             for (i=2;i<=additional;++i) {
                 sprintf(tmpname,"image%i",i);
-                faimage = weapini->readString(faname, tmpname, "");
-                if (strcasecmp(faimage,"") != 0) {
+                faimage = weapini->readValue(faname, tmpname).c_str();
+                if (faimage != NULL) {
                     try {
                         fireanimtemp = new SHPImage(faimage, mapscaleq);
                     } catch (ImageNotFound&) {
@@ -205,8 +194,6 @@ Weapon::Weapon(const char* wname) : name(wname)
                     fireimages[i] = 0;
                     game.log << "Weapon: " << tmpname << " was empty in [" << faname << "]" << endl;
                 }
-                delete[] faimage;
-                faimage = NULL;
             }
             delete[] tmpname;
         } else if (numfiredirections != 1) {
@@ -214,7 +201,6 @@ Weapon::Weapon(const char* wname) : name(wname)
                 fireimages[i] = fireimage+i*(numfireimages/numfiredirections);
             }
         }
-        delete[] faname;
     }
 }
 
@@ -7,6 +7,8 @@
 #include "SDL.h"
 
 #include "gameengine.h"
+#include "lib/inifile.h"
+#include "lib/rulesdb.h"
 #include "scripting/gameconfigscript.h"
 #include "renderer/renderer_public.h"
 #include "sound/sound_public.h"
@@ -69,10 +71,26 @@ void GameEngine::startup(int argc, char** argv)
     log.open((game.config.basedir + "/freecnc.log").c_str());
 
     try {
+        vfs.set_cache_dir(config.homedir + "/cache");
         {
             GameConfigScript gcs;
             gcs.parse(game.config.basedir + "/data/manifest.lua");
         }
+        const VFS::VFS::Stats& vfsstats = vfs.stats();
+        log << "GameEngine: Mix indexes: " << vfsstats.mixcached << " from the cache, "
+            << vfsstats.mixparsed << " parsed, the cache saved "
+            << vfsstats.mixsaved / 1000 << "ms" << endl;
+
+        // The rule files are only parsed when they have changed since the
+        // database was compiled
+        const string rulesdb = config.homedir + "/cache/rules-" + config.mod + ".db";
+        if (config.compile_rules) {
+            RulesDB::compile(rulesdb);
+            return;
+        }
+        if (!RulesDB::load(rulesdb) && RulesDB::compile(rulesdb)) {
+            RulesDB::load(rulesdb);
+        }
 
         log << "GameEngine: Bootstrapping engine..." << endl;
 
@@ -88,6 +106,24 @@ void GameEngine::startup(int argc, char** argv)
             SDL_ShowCursor(0);
         }
         
+        if (!config.benchmark_vqa.empty()) {
+            // No screen is set, so run() returns straight away
+            VQAMovie(config.benchmark_vqa).benchmark();
+            return;
+        }
+        if (!config.benchmark_shp.empty()) {
+            SHPImage::benchmark(config.benchmark_shp);
+            return;
+        }
+        if (!config.fuzz_shp.empty()) {
+            SHPImage::fuzz(config.fuzz_shp, 100);
+            return;
+        }
+        if (config.benchmark_ini) {
+            INIFile::benchmark();
+            return;
+        }
+
         // Init the rand functions
         srand(static_cast<unsigned int>(time(0)));
 
@@ -106,6 +142,11 @@ void GameEngine::startup(int argc, char** argv)
 void GameEngine::shutdown()
 {
     log << "GameEngine: Shutting down..." << endl;
+
+    const VFS::VFS::Stats& vfsstats = vfs.stats();
+    log << "GameEngine: VFS: " << vfsstats.lookups << " lookups, " << vfsstats.hits
+        << " found in the index, " << vfsstats.misses << " missing from the index, "
+        << vfsstats.negative << " known missing, " << vfsstats.scans << " scanned" << endl;
     
     // Legacy
     delete pc::gfxeng;
@@ -117,75 +158,101 @@ void GameEngine::shutdown()
     log.flush();   
 }
 
-void GameEngine::parse_options(int argc, char** argv)
+namespace
 {
-    po::options_description general("General options");
-    general.add_options()
-        ("help", "show this message")
-        ("version,v", "print version")
-        ("basedir", po::value<string>(&config.basedir)->default_value("."),
-            "use this location to find the data files");
-
-    po::options_description game("Game options");
-    game.add_options()
-        ("mod", po::value<string>(&config.mod)->default_value("td"),
-            "specify which game to load: td or ra")
-        ("map,m", po::value<string>(&config.map)->default_value("SCG01EA"),
-            "start on this mission")
-        ("fullscreen", po::bool_switch(&config.fullscreen)->default_value(false),
-            "start fullscreen")
-        ("width,w", po::value<int>(&config.width)->default_value(640),
-            "use this value for screen width")
-        ("height,h", po::value<int>(&config.height)->default_value(480),
-            "use this value for screen height")
-        ("bpp", po::value<int>(&config.bpp)->default_value(16),
-            "colour depth in bits per pixel");
-
-    po::options_description config_only("Config only options");
-    config_only.add_options()
-        ("play_intro", po::value<bool>(&config.play_intro)->default_value(true),
-            "enable/disable the intro")
-        ("scale_movies", po::value<bool>(&config.scale_movies)->default_value(true),
-            "enable/disable the scaler in video playback")
-        ("scaler_quality", po::value<int>(&config.scaler_quality),
-            "change which algorithm to use to scale the video")
-        ("scrollstep", po::value<int>(&config.scrollstep)->default_value(1),
-            "how many pixels to scroll in one step")
-        ("scrolltime", po::value<int>(&config.scrolltime)->default_value(5),
-            "how many ticks after releasing a scrollkey before slowing down")
-        ("maxscroll", po::value<int>(&config.maxscroll)->default_value(24),
-            "maximum speed for scrolling");
-
-    po::options_description debug("Debug options");
-    debug.add_options()
-        ("nosound", po::bool_switch(&config.nosound)->default_value(false),
-            "disable sound")
-        ("debug", po::bool_switch(&config.debug)->default_value(false),
-            "turn on various internal debugging features");
-
-    po::options_description cmdline_options, config_file_options;
+    /// The options of the game, bound to config.  Kept in one place so
+    /// defaultConfig gives exactly what parse_options does.
+    struct GameOptions
+    {
+        po::options_description general, game, config_only, debug;
+
+        explicit GameOptions(GameConfig& config) : general("General options"),
+            game("Game options"), config_only("Config only options"),
+            debug("Debug options")
+        {
+            general.add_options()
+                ("help", "show this message")
+                ("version,v", "print version")
+                ("basedir", po::value<string>(&config.basedir)->default_value("."),
+                    "use this location to find the data files")
+                ("homedir", po::value<string>(&config.homedir),
+                    "use this location for files the game writes, defaults to basedir")
+                ("compile_rules", po::bool_switch(&config.compile_rules)->default_value(false),
+                    "compile the rule files into the rules database in homedir and exit");
+
+            game.add_options()
+                ("mod", po::value<string>(&config.mod)->default_value("td"),
+                    "specify which game to load: td or ra")
+                ("map,m", po::value<string>(&config.map)->default_value("SCG01EA"),
+                    "start on this mission")
+                ("fullscreen", po::bool_switch(&config.fullscreen)->default_value(false),
+                    "start fullscreen")
+                ("width,w", po::value<int>(&config.width)->default_value(640),
+                    "use this value for screen width")
+                ("height,h", po::value<int>(&config.height)->default_value(480),
+                    "use this value for screen height")
+                ("bpp", po::value<int>(&config.bpp)->default_value(16),
+                    "colour depth in bits per pixel");
+
+            config_only.add_options()
+                ("play_intro", po::value<bool>(&config.play_intro)->default_value(true),
+                    "enable/disable the intro")
+                ("scale_movies", po::value<bool>(&config.scale_movies)->default_value(true),
+                    "enable/disable the scaler in video playback")
+                ("scaler_quality", po::value<int>(&config.scaler_quality),
+                    "change which algorithm to use to scale the video")
+                ("scrollstep", po::value<int>(&config.scrollstep)->default_value(1),
+                    "how many pixels to scroll in one step")
+                ("scrolltime", po::value<int>(&config.scrolltime)->default_value(5),
+                    "how many ticks after releasing a scrollkey before slowing down")
+                ("maxscroll", po::value<int>(&config.maxscroll)->default_value(24),
+                    "maximum speed for scrolling")
+                ("minimap_cache", po::value<int>(&config.minimap_cache)->default_value(1024),
+                    "kilobytes of memory to use for caching minimap zoom levels")
+                ("tile_cache", po::value<int>(&config.tile_cache)->default_value(4096),
+                    "kilobytes of memory to use for the map tiles around the screen")
+                ("sound_cache", po::value<int>(&config.sound_cache)->default_value(8192),
+                    "kilobytes of memory to use for decoded sounds")
+                ("render_threads", po::value<int>(&config.render_threads)->default_value(1),
+                    "number of threads used to draw the map")
+                ("load_threads", po::value<int>(&config.load_threads)->default_value(2),
+                    "number of threads used to load the map");
+
+            debug.add_options()
+                ("nosound", po::bool_switch(&config.nosound)->default_value(false),
+                    "disable sound")
+                ("debug", po::bool_switch(&config.debug)->default_value(false),
+                    "turn on various internal debugging features")
+                ("benchmark_vqa", po::value<string>(&config.benchmark_vqa),
+                    "decode a movie as fast as possible, log the frame rate and exit")
+                ("benchmark_shp", po::value<string>(&config.benchmark_shp),
+                    "decode every SHP frame in a mix file for a few seconds, log the throughput and exit")
+                ("benchmark_ini", po::bool_switch(&config.benchmark_ini)->default_value(false),
+                    "parse the rule files over and over, log the parse and lookup rates and exit")
+                ("fuzz_shp", po::value<string>(&config.fuzz_shp),
+                    "decode damaged copies of every SHP frame in a mix file, log any overruns and exit");
+        }
+    };
+}
 
-    cmdline_options.add(general).add(game).add(debug);
-    config_file_options.add(game).add(config_only).add(debug);
+void defaultConfig(GameConfig& config)
+{
+    GameOptions options(config);
+    po::options_description all;
+    all.add(options.general).add(options.game).add(options.config_only).add(options.debug);
 
     po::variables_map vm;
-    po::store(po::parse_command_line(argc, argv, cmdline_options), vm);
+    po::store(po::command_line_parser(vector<string>()).options(all).run(), vm);
     po::notify(vm);
+}
 
-    if (vm.count("help")) {
-        std::ostringstream s;
-        s << cmdline_options;
-        throw GameOptionsUsageMessage(s.str());
+void finishConfig(GameConfig& config)
+{
+    if (config.homedir.empty()) {
+        config.homedir = config.basedir;
     }
 
-    const string config_path(config.basedir + "/data/freecnc.cfg");
-    std::ifstream cfgfile(config_path.c_str());
-
-    po::store(po::parse_config_file(cfgfile, config_file_options), vm);
-    po::notify(vm);
-
-    // Temp
-    config.gametype = static_cast<GameType>(config.mod == "td" ? 1 : 2);
+    config.gametype = config.mod == "td" ? GAME_TD : GAME_RA;
 
     // Values that are now no longer configurable
 
@@ -205,3 +272,31 @@ void GameEngine::parse_options(int argc, char** argv)
 
     config.final_delay = 100;
 }
+
+void GameEngine::parse_options(int argc, char** argv)
+{
+    GameOptions options(config);
+    po::options_description cmdline_options, config_file_options;
+
+    cmdline_options.add(options.general).add(options.game).add(options.debug);
+    config_file_options.add(options.game).add(options.config_only).add(options.debug);
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, cmdline_options), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::ostringstream s;
+        s << cmdline_options;
+        throw GameOptionsUsageMessage(s.str());
+    }
+
+    // The config file lives in basedir, so it needs the command line first
+    const string config_path(config.basedir + "/data/freecnc.cfg");
+    std::ifstream cfgfile(config_path.c_str());
+
+    po::store(po::parse_config_file(cfgfile, config_file_options), vm);
+    po::notify(vm);
+
+    finishConfig(config);
+}
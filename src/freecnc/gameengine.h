@@ -21,6 +21,7 @@ enum GameType
 struct GameConfig
 {
     string basedir, homedir;
+    bool compile_rules;
 
     // Game options
     string mod;
@@ -34,6 +35,11 @@ struct GameConfig
     bool scale_movies;
     int scaler_quality;
     int scrollstep, scrolltime, maxscroll;
+    int minimap_cache;
+    int tile_cache;
+    int sound_cache;
+    int render_threads;
+    int load_threads;
     int final_delay;
     int buildable_radius;
     double buildable_ratio;
@@ -41,8 +47,18 @@ struct GameConfig
     // Debug flags
     bool nosound;
     bool debug;
+    string benchmark_vqa;
+    string benchmark_shp;
+    bool benchmark_ini;
+    string fuzz_shp;
 };
 
+/// Sets every option in config to the game's default
+void defaultConfig(GameConfig& config);
+/// Fills in the settings that follow from the options or are no longer
+/// configurable
+void finishConfig(GameConfig& config);
+
 class GameScreen 
 {
 public:
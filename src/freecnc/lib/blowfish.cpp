@@ -408,11 +408,67 @@ void Blowfish::encipher(const void* s, void* d, unsigned int size) const
     }
 }
 
+void Blowfish::ROUND4(unsigned int* a, const unsigned int* b, int n) const
+{
+    a[0] ^= bf_f(b[0]) ^ m_p[n];
+    a[1] ^= bf_f(b[1]) ^ m_p[n];
+    a[2] ^= bf_f(b[2]) ^ m_p[n];
+    a[3] ^= bf_f(b[3]) ^ m_p[n];
+}
+
+void Blowfish::decipher4(unsigned int* xl, unsigned int* xr) const
+{
+    unsigned int Xl[4] = {xl[0], xl[1], xl[2], xl[3]};
+    unsigned int Xr[4] = {xr[0], xr[1], xr[2], xr[3]};
+
+    Xl[0] ^= m_p[17];
+    Xl[1] ^= m_p[17];
+    Xl[2] ^= m_p[17];
+    Xl[3] ^= m_p[17];
+    ROUND4 (Xr, Xl, 16);
+    ROUND4 (Xl, Xr, 15);
+    ROUND4 (Xr, Xl, 14);
+    ROUND4 (Xl, Xr, 13);
+    ROUND4 (Xr, Xl, 12);
+    ROUND4 (Xl, Xr, 11);
+    ROUND4 (Xr, Xl, 10);
+    ROUND4 (Xl, Xr, 9);
+    ROUND4 (Xr, Xl, 8);
+    ROUND4 (Xl, Xr, 7);
+    ROUND4 (Xr, Xl, 6);
+    ROUND4 (Xl, Xr, 5);
+    ROUND4 (Xr, Xl, 4);
+    ROUND4 (Xl, Xr, 3);
+    ROUND4 (Xr, Xl, 2);
+    ROUND4 (Xl, Xr, 1);
+
+    for (int i = 0; i < 4; ++i) {
+        xl[i] = Xr[i] ^ m_p[0];
+        xr[i] = Xl[i];
+    }
+}
+
 void Blowfish::decipher(const void* s, void* d, int size) const
 {
     const unsigned int* r = reinterpret_cast<const unsigned int*>(s);
     unsigned int* w = reinterpret_cast<unsigned int*>(d);
     size >>= 3;
+    // Four blocks at a time: their rounds don't depend on each other, so
+    // the S-box lookups of one block overlap with those of the others
+    for (; size >= 4; size -= 4) {
+        unsigned int a[4], b[4];
+        for (int i = 0; i < 4; ++i) {
+            a[i] = reverse(r[2 * i]);
+            b[i] = reverse(r[2 * i + 1]);
+        }
+        decipher4(a, b);
+        for (int i = 0; i < 4; ++i) {
+            w[2 * i] = reverse(a[i]);
+            w[2 * i + 1] = reverse(b[i]);
+        }
+        r += 8;
+        w += 8;
+    }
     while (size--) {
         unsigned int a = reverse(*r++);
         unsigned int b = reverse(*r++);
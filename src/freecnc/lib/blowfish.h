@@ -18,6 +18,9 @@ private:
     unsigned int S(unsigned int x, int i) const;
     unsigned int bf_f(unsigned int x) const;
     void ROUND(unsigned int& a, unsigned int b, int n) const;
+    void ROUND4(unsigned int* a, const unsigned int* b, int n) const;
+    /// Deciphers four blocks with their rounds interleaved
+    void decipher4(unsigned int* xl, unsigned int* xr) const;
 
     t_bf_p m_p;
     t_bf_s m_s;
@@ -55,7 +55,7 @@ namespace ps {
 }
 
 // Server only
-std::vector<char*> splitList(char* line, char delim)
+std::vector<char*> splitList(const char* line, char delim)
 {
     std::vector<char*> retval;
     char* tmp;
@@ -13,11 +13,43 @@
 
 namespace Compression
 {
+    // Copies `count' bytes from earlier in the output. When the source
+    // overlaps the destination the copy repeats the bytes between them, so
+    // it goes a period at a time, or a byte at a time for short periods.
+    inline void copy_back(unsigned char* writep, const unsigned char* copyp, unsigned int count)
+    {
+        if (copyp >= writep) {
+            // Reads ahead of what has been written; odd, but stays in bounds
+            memmove(writep, copyp, count);
+            return;
+        }
+        unsigned int distance = static_cast<unsigned int>(writep - copyp);
+        if (distance >= count) {
+            memcpy(writep, copyp, count);
+        } else if (distance == 1) {
+            memset(writep, *copyp, count);
+        } else if (distance >= 8) {
+            while (count > distance) {
+                memcpy(writep, copyp, distance);
+                writep += distance;
+                copyp += distance;
+                count -= distance;
+            }
+            memcpy(writep, copyp, count);
+        } else {
+            while (count--)
+                *writep++ = *copyp++;
+        }
+    }
+
     // Decompresses format80
     // image_in: Buffer of compressed data
+    // insize: size of image_in
     // image_out: Buffer to hold output
-    // returns: size of uncompressed data
-    int decode80(const unsigned char image_in[], unsigned char image_out[])
+    // outsize: size of image_out
+    // returns: size of uncompressed data, or -1 if the data is truncated or
+    // would read or write outside the buffers
+    int decode80(const unsigned char* image_in, unsigned int insize, unsigned char* image_out, unsigned int outsize)
     {
         /*
         0 copy 0cccpppp p
@@ -27,25 +59,28 @@ namespace Compression
         4 copy 11111111 c c p p
         */
 
-        const unsigned char* copyp;
         const unsigned char* readp = image_in;
+        const unsigned char* readend = image_in + insize;
         unsigned char* writep = image_out;
+        unsigned char* writeend = image_out + outsize;
         unsigned int code;
         unsigned int count;
+        unsigned int pos;
 
-        #if FCNC_BYTEORDER == FCNC_BIG_ENDIAN
-        unsigned short bigend; /* temporary big endian var */
-        #endif
-
-        while (1) {
+        while (readp < readend) {
             code = *readp++;
             if (~code & 0x80) {
                 //bit 7 = 0
                 //command 0 (0cccpppp p): copy
+                if (readp >= readend)
+                    return -1;
                 count = (code >> 4) + 3;
-                copyp = writep - (((code & 0xf) << 8) + *readp++);
-                while (count--)
-                    *writep++ = *copyp++;
+                pos = ((code & 0xf) << 8) + *readp++;
+                if (pos > static_cast<unsigned int>(writep - image_out)
+                        || count > static_cast<unsigned int>(writeend - writep))
+                    return -1;
+                copy_back(writep, writep - pos, count);
+                writep += count;
             } else {
                 //bit 7 = 1
                 count = code & 0x3f;
@@ -53,75 +88,95 @@ namespace Compression
                     //bit 6 = 0
                     if (!count)
                         //end of image
-                        break;
+                        return static_cast<int>(writep - image_out);
                     //command 1 (10cccccc): copy
-                    while (count--)
-                        *writep++ = *readp++;
+                    if (count > static_cast<unsigned int>(readend - readp)
+                            || count > static_cast<unsigned int>(writeend - writep))
+                        return -1;
+                    memcpy(writep, readp, count);
+                    readp += count;
+                    writep += count;
                 } else {
                     //bit 6 = 1
                     if (count < 0x3e) {
                         //command 2 (11cccccc p p): copy
+                        if (readend - readp < 2)
+                            return -1;
                         count += 3;
-                        
-                        #if FCNC_BYTEORDER == FCNC_BIG_ENDIAN
-                        memcpy(&bigend, readp, 2);
-                        copyp = &image_out[SDL_Swap16(bigend)];
-                        #else
-                        copyp = &image_out[*(unsigned short*)readp];
-                        #endif
-
-                        readp += 2;
-                        while (count--)
-                            *writep++ = *copyp++;
+                        pos = read_word(readp, FCNC_LIL_ENDIAN);
                     } else if (count == 0x3e) {
                         //command 3 (11111110 c c v): fill
-                        #if FCNC_BYTEORDER == FCNC_BIG_ENDIAN
-                        memset(&count, 0, sizeof(unsigned int));
-                        memcpy(&count, readp, 2);
-                        count = SDL_Swap32(count);
-                        #else
-                        count = *(unsigned short*)readp;
-                        #endif
-
-                        readp += 2;
+                        if (readend - readp < 3)
+                            return -1;
+                        count = read_word(readp, FCNC_LIL_ENDIAN);
                         code = *readp++;
-                        while (count--)
-                            *writep++ = code;
+                        if (count > static_cast<unsigned int>(writeend - writep))
+                            return -1;
+                        memset(writep, code, count);
+                        writep += count;
+                        continue;
                     } else {
                         //command 4 (copy 11111111 c c p p): copy
-                        #if FCNC_BYTEORDER == FCNC_BIG_ENDIAN
-                        memset(&count, 0, sizeof(unsigned int));
-                        memcpy(&count, readp, 2);
-                        count = SDL_Swap32(count);
-                        #else
-                        count = *(unsigned short*)readp;
-                        #endif
-
-                        readp += 2;
-
-                        #if FCNC_BYTEORDER == FCNC_BIG_ENDIAN
-                        memcpy(&bigend, readp, 2);
-                        copyp = &image_out[SDL_Swap16(bigend)];
-                        #else
-                        copyp = &image_out[*(unsigned short*)readp];
-                        #endif
-
-                        readp += 2;
-                        while (count--)
-                            *writep++ = *copyp++;
+                        if (readend - readp < 4)
+                            return -1;
+                        count = read_word(readp, FCNC_LIL_ENDIAN);
+                        pos = read_word(readp, FCNC_LIL_ENDIAN);
                     }
+                    if (pos > outsize || count > outsize - pos
+                            || count > static_cast<unsigned int>(writeend - writep))
+                        return -1;
+                    copy_back(writep, image_out + pos, count);
+                    writep += count;
                 }
             }
         }
 
-        return (writep - image_out);
+        // Ran out of input before the end of image command
+        return -1;
+    }
+
+    // XORs `count' bytes of src into dst a word at a time
+    inline void xor_run(unsigned char* dst, const unsigned char* src, unsigned int count)
+    {
+        unsigned long word, srcword;
+        while (count >= sizeof(word)) {
+            memcpy(&word, dst, sizeof(word));
+            memcpy(&srcword, src, sizeof(srcword));
+            word ^= srcword;
+            memcpy(dst, &word, sizeof(word));
+            dst += sizeof(word);
+            src += sizeof(word);
+            count -= sizeof(word);
+        }
+        while (count--)
+            *dst++ ^= *src++;
+    }
+
+    // XORs `count' bytes of dst with `value' a word at a time
+    inline void xor_fill(unsigned char* dst, unsigned char value, unsigned int count)
+    {
+        // Every byte of the word set to value
+        const unsigned long pattern = value * (~0UL / 0xff);
+        unsigned long word;
+        while (count >= sizeof(word)) {
+            memcpy(&word, dst, sizeof(word));
+            word ^= pattern;
+            memcpy(dst, &word, sizeof(word));
+            dst += sizeof(word);
+            count -= sizeof(word);
+        }
+        while (count--)
+            *dst++ ^= value;
     }
 
     // Decompresses format40
     // image_in: Buffer of compressed data
-    // image_out: Buffer to hold output
-    // returns: size of uncompressed data
-    int decode40(const unsigned char image_in[], unsigned char image_out[])
+    // insize: size of image_in
+    // image_out: Buffer to hold output, which the data is XORed onto
+    // outsize: size of image_out
+    // returns: size of uncompressed data, or -1 if the data is truncated or
+    // would read or write outside the buffers
+    int decode40(const unsigned char* image_in, unsigned int insize, unsigned char* image_out, unsigned int outsize)
     {
         /*
         0 fill 00000000 c v
@@ -133,70 +188,78 @@ namespace Compression
         */
 
         const unsigned char* readp = image_in;
-        unsigned char* writep = image_out;
+        const unsigned char* readend = image_in + insize;
+        // Skips may run past the end without touching anything, so keep
+        // the write position as an offset
+        unsigned int writepos = 0;
         unsigned int code;
         unsigned int count;
 
-        while (1) {
+        while (readp < readend) {
             code = *readp++;
             if (~code & 0x80) {
                 //bit 7 = 0
                 if (!code) {
                     //command 0 (00000000 c v): fill
+                    if (readend - readp < 2)
+                        return -1;
                     count = *readp++;
                     code = *readp++;
-                    while (count--)
-                        *writep++ ^= code;
+                    if (writepos > outsize || count > outsize - writepos)
+                        return -1;
+                    xor_fill(image_out + writepos, code, count);
                 } else {
                     //command 1 (0ccccccc): copy
                     count = code;
-                    while (count--)
-                        *writep++ ^= *readp++;
+                    if (count > static_cast<unsigned int>(readend - readp)
+                            || writepos > outsize || count > outsize - writepos)
+                        return -1;
+                    xor_run(image_out + writepos, readp, count);
+                    readp += count;
                 }
-
+                writepos += count;
             } else {
                 //bit 7 = 1
                 if (!(count = code & 0x7f)) {
-                    #if FCNC_BYTEORDER == FCNC_BIG_ENDIAN
-                    memset(&count, 0, sizeof(unsigned int));
-                    memcpy(&count, readp, 2);
-                    count = SDL_Swap32(count);
-                    #else
-                    count = *(unsigned short*)readp;
-                    #endif
-
-                    readp += 2;
+                    if (readend - readp < 2)
+                        return -1;
+                    count = read_word(readp, FCNC_LIL_ENDIAN);
                     code = count >> 8;
                     if (~code & 0x80) {
                         //bit 7 = 0
                         //command 2 (10000000 c 0ccccccc): skip
                         if (!count)
                             // end of image
-                            break;
-                        writep += count;
+                            return static_cast<int>(writepos);
                     } else {
                         //bit 7 = 1
                         count &= 0x3fff;
+                        if (writepos > outsize || count > outsize - writepos)
+                            return -1;
                         if (~code & 0x40) {
                             //bit 6 = 0
                             //command 3 (10000000 c 10cccccc): copy
-                            while (count--)
-                                *writep++ ^= *readp++;
+                            if (count > static_cast<unsigned int>(readend - readp))
+                                return -1;
+                            xor_run(image_out + writepos, readp, count);
+                            readp += count;
                         } else {
                             //bit 6 = 1
                             //command 4 (10000000 c 11cccccc v): fill
+                            if (readp >= readend)
+                                return -1;
                             code = *readp++;
-                            while (count--)
-                                *writep++ ^= code;
+                            xor_fill(image_out + writepos, code, count);
                         }
                     }
-                } else {
-                    //command 5 (1ccccccc): skip
-                    writep += count;
                 }
+                // Anything else is command 5 (1ccccccc): skip
+                writepos += count;
             }
         }
-        return (writep - image_out);
+
+        // Ran out of input before the end of image command
+        return -1;
     }
 
     // Decompresses format20
@@ -227,24 +290,26 @@ namespace Compression
     // src: Base64 data stream
     // target: Buffer to hold output
     // length: size of the Base64 data stream
+    // log: where to report errors, as the map loader decodes off the main thread
     // returns: -1 if error
-    int dec_base64(const unsigned char* src, unsigned char* target, size_t length)
+    int dec_base64(const unsigned char* src, unsigned char* target, size_t length, std::ostream& log)
     {
         int i;
         unsigned char a, b, c, d;
-        static unsigned char dtable[256];
+        // Not static, the map loader decodes more than one pack at once
+        unsigned char dtable[256];
         int bits_to_skip = 0;
 
-        for( i = length-1; src[i] == '='; i-- ) {
+        for( i = length-1; i >= 0 && src[i] == '='; i-- ) {
             bits_to_skip += 2;
             length--;
         }
         if( bits_to_skip >= 6 ) {
-            game.log << "dec_base64: Expecting less than six bits to skip, got " << bits_to_skip << endl;
+            log << "dec_base64: Expecting less than six bits to skip, got " << bits_to_skip << endl;
             return -1;
         }
 
-        for(i= 0;i<255;i++) {
+        for(i= 0;i<256;i++) {
             dtable[i]= 0x80;
         }
         for(i= 'A';i<='Z';i++) {
@@ -268,7 +333,7 @@ namespace Compression
             d = dtable[src[3]];
             if( a == 0x80 || b == 0x80 ||
                     c == 0x80 || d == 0x80 ) {
-                game.log << "dec_base64: Read illegal character (0x80)" << endl;
+                log << "dec_base64: Read illegal character (0x80)" << endl;
                 return -1;
             }
             target[0] = a << 2 | b >> 4;
@@ -292,9 +357,9 @@ namespace Compression
                 target[0] = a << 2 | b >> 4;
                 target[1] = b << 4 | c >> 2;
             } else {
-                game.log << "Error in base64. number of bits to skip doesn't match length: "
-                         << "to skip " << bits_to_skip << " bit(s) but "
-                         << (unsigned int)length << " char(s) left\nData: " << src << endl;
+                log << "Error in base64. number of bits to skip doesn't match length: "
+                    << "to skip " << bits_to_skip << " bit(s) but "
+                    << (unsigned int)length << " char(s) left\nData: " << src << endl;
                 return -1;
             }
         }
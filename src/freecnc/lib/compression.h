@@ -1,14 +1,16 @@
 #ifndef _LIB_COMPRESSION_H
 #define _LIB_COMPRESSION_H
 
+#include <iosfwd>
+
 #include "../freecnc.h"
 
 namespace Compression
 {
-    int decode80(const unsigned char image_in[], unsigned char image_out[]);
-    int decode40(const unsigned char image_in[], unsigned char image_out[]);
+    int decode80(const unsigned char* image_in, unsigned int insize, unsigned char* image_out, unsigned int outsize);
+    int decode40(const unsigned char* image_in, unsigned int insize, unsigned char* image_out, unsigned int outsize);
     int decode20(const unsigned char* s, unsigned char* d, int cb_s);
-    int dec_base64(const unsigned char* src, unsigned char* target, size_t length);
+    int dec_base64(const unsigned char* src, unsigned char* target, size_t length, std::ostream& log);
 }
 
 #endif
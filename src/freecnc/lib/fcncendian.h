@@ -85,7 +85,7 @@ inline unsigned int big_endian(unsigned int dword)
 template<class Iterator>
 inline unsigned char read_byte(Iterator& it)
 {
-    unsigned char byte = *reinterpret_cast<unsigned char*>(&*it);
+    unsigned char byte = *reinterpret_cast<const unsigned char*>(&*it);
     ++it;
     return byte;
 }
@@ -96,7 +96,7 @@ inline unsigned char read_byte(Iterator& it)
 template<class Iterator>
 inline unsigned short read_word(Iterator& it, int byteorder=0)
 {
-    unsigned short word = *reinterpret_cast<unsigned short*>(&*it);
+    unsigned short word = *reinterpret_cast<const unsigned short*>(&*it);
     if (byteorder != 0) {
         word = byteorder == FCNC_LIL_ENDIAN ? little_endian(word) : big_endian(word);
     }
@@ -110,7 +110,7 @@ inline unsigned short read_word(Iterator& it, int byteorder=0)
 template<class Iterator>
 inline unsigned int read_dword(Iterator& it, int byteorder=0)
 {
-    unsigned int dword = *reinterpret_cast<unsigned int*>(&*it);
+    unsigned int dword = *reinterpret_cast<const unsigned int*>(&*it);
     if (byteorder != 0) {
         dword = byteorder == FCNC_LIL_ENDIAN ? little_endian(dword) : big_endian(dword);
     }
@@ -122,18 +122,18 @@ inline unsigned int read_dword(Iterator& it, int byteorder=0)
 
 // Reads a byte from `ptr' and returns it.
 // It is assumed `ptr' points to at least 1 byte of data.
-inline unsigned char read_byte(void* ptr)
+inline unsigned char read_byte(const void* ptr)
 {
-    unsigned char byte = *reinterpret_cast<unsigned char*>(ptr);
+    unsigned char byte = *reinterpret_cast<const unsigned char*>(ptr);
     return byte;
 }
 
 // Reads a word from `ptr', converting to system endianness from `byteorder'.
 // It is assumed `ptr' points to at least 2 bytes of data.
 // No swapping is performed on a system with the same endianness as `byteorder', or if byteorder is 0.
-inline unsigned short read_word(void* ptr, int byteorder=0)
+inline unsigned short read_word(const void* ptr, int byteorder=0)
 {
-    unsigned short word = *reinterpret_cast<unsigned short*>(ptr);
+    unsigned short word = *reinterpret_cast<const unsigned short*>(ptr);
     if (byteorder != 0) {
         word = byteorder == FCNC_LIL_ENDIAN ? little_endian(word) : big_endian(word);
     }
@@ -143,9 +143,9 @@ inline unsigned short read_word(void* ptr, int byteorder=0)
 // Reads a dword from `ptr', converting to system endianness from `byteorder'.
 // It is assumed `ptr' points to at least 4 bytes of data.
 // No swapping is performed on a system with the same endianness as `byteorder', or if byteorder is 0.
-inline unsigned int read_dword(void* ptr, int byteorder=0)
+inline unsigned int read_dword(const void* ptr, int byteorder=0)
 {
-    unsigned int dword = *reinterpret_cast<unsigned int*>(ptr);
+    unsigned int dword = *reinterpret_cast<const unsigned int*>(ptr);
     if (byteorder != 0) {
         dword = byteorder == FCNC_LIL_ENDIAN ? little_endian(dword) : big_endian(dword);
     }
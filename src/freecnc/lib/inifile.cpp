@@ -1,5 +1,4 @@
 #include <algorithm>
-#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cctype>
@@ -7,7 +6,8 @@
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/tokenizer.hpp>
+
+#include "SDL_timer.h"
 
 #include "../freecnc.h"
 #include "inifile.h"
@@ -15,30 +15,133 @@
 using std::runtime_error;
 using boost::lexical_cast;
 using boost::to_upper;
-using boost::trim;
 
 namespace
 {
-    typedef boost::tokenizer<boost::char_separator<char> > LineTokenizer;
-    boost::char_separator<char> keyvalue_sep("=");
-    boost::char_separator<char> section_sep("[]");
+    /// Case insensitive FNV-1a
+    unsigned int hash_name(const char* name)
+    {
+        unsigned int hash = 2166136261u;
+        for (; *name != 0; ++name) {
+            hash ^= static_cast<unsigned char>(toupper(static_cast<unsigned char>(*name)));
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    /// Compares a name from the file, which is already upper case, with one
+    /// that's been asked for, in the order map<string, ...> would use
+    int compare_name(const char* stored, const char* name)
+    {
+        for (;; ++stored, ++name) {
+            unsigned char a = static_cast<unsigned char>(*stored);
+            unsigned char b = static_cast<unsigned char>(toupper(static_cast<unsigned char>(*name)));
+            if (a != b) {
+                return a < b ? -1 : 1;
+            }
+            if (a == 0) {
+                return 0;
+            }
+        }
+    }
+
+    /// Orders sections or keys by name
+    struct NameLess
+    {
+        NameLess(const char* text) : text(text) {}
+        template<class T> bool operator()(const T& a, const T& b) const
+        {
+            return strcmp(text + a.name, text + b.name) < 0;
+        }
+        const char* text;
+    };
+
+    /// Splits [start, end) on sep1 and sep2, skipping empty tokens as
+    /// boost's char_separator does.  Fills in up to two tokens.
+    /// @returns the number of tokens
+    unsigned int split(char* start, char* end, char sep1, char sep2,
+            char* tokens[2], char* tokenends[2])
+    {
+        unsigned int count = 0;
+        char* p = start;
+        while (true) {
+            while (p < end && (*p == sep1 || *p == sep2)) {
+                ++p;
+            }
+            if (p == end) {
+                return count;
+            }
+            char* tokenstart = p;
+            while (p < end && *p != sep1 && *p != sep2) {
+                ++p;
+            }
+            if (count < 2) {
+                tokens[count] = tokenstart;
+                tokenends[count] = p;
+            }
+            ++count;
+        }
+    }
+
+    void trim(char*& start, char*& end)
+    {
+        while (start < end && isspace(static_cast<unsigned char>(*start))) {
+            ++start;
+        }
+        while (end > start && isspace(static_cast<unsigned char>(end[-1]))) {
+            --end;
+        }
+    }
+
+    void upper(char* start, char* end)
+    {
+        for (; start < end; ++start) {
+            *start = static_cast<char>(toupper(static_cast<unsigned char>(*start)));
+        }
+    }
 }
 
 INIFile::INIFile(shared_ptr<File> inifile)
 {
-    string cursection_name;
-    INISection cursection;
+    const char* data = reinterpret_cast<const char*>(inifile->read_all());
+    textbuf.assign(data, data + inifile->size());
+    textbuf.push_back('\0');
+    parse(inifile->name());
+    sort();
+}
 
+/** Splits the text into lines and picks out the names and values, which
+ * are upper cased (names only), trimmed and null terminated where they are.
+ * Sections and keys are recorded in the order they appear.
+ */
+void INIFile::parse(const string& filename)
+{
+    char* const begin = &textbuf[0];
+    char* const end = begin + textbuf.size() - 1;
+    char* tokens[2];
+    char* tokenends[2];
+    bool insection = false;
 
     int linenum = 0;
-    // parse the inifile and write data to inidata
-    for (string line; !inifile->eof(); line = inifile->readline()) {
-        string::const_iterator s(line.begin()), end(line.end());
-        while ((s != end) && ((*s) == ' ' || (*s) == '\t')) {
+    for (char* next = begin; next < end;) {
+        char* line = next;
+        char* lineend = static_cast<char*>(memchr(line, '\n', end - line));
+        if (lineend == 0) {
+            lineend = end;
+            next = end;
+        } else {
+            next = lineend + 1;
+        }
+        if (lineend > line && lineend[-1] == '\r') {
+            --lineend;
+        }
+
+        char* s = line;
+        while ((s != lineend) && ((*s) == ' ' || (*s) == '\t')) {
             ++s;
         }
 
-        if (s == end) {
+        if (s == lineend) {
             continue;
         }
 
@@ -48,90 +151,205 @@ INIFile::INIFile(shared_ptr<File> inifile)
 
         if (*s == '[') {
             // This isn't perfect, but it's better than what was before...
-            LineTokenizer section_name(line, section_sep);
-            if (std::distance(section_name.begin(), section_name.end()) == 1) {
-                if (cursection_name != "") {
-                    inidata[cursection_name] = cursection;
-                    cursection.clear();
+            if (split(line, lineend, '[', ']', tokens, tokenends) == 1) {
+                char* name = tokens[0];
+                char* nameend = tokenends[0];
+                trim(name, nameend);
+                upper(name, nameend);
+                *nameend = '\0';
+                insection = (name != nameend);
+                if (insection) {
+                    Section section = {static_cast<unsigned int>(name - begin), 0,
+                        static_cast<unsigned int>(keybuf.size()), 0};
+                    sectionbuf.push_back(section);
                 }
-                cursection_name = *section_name.begin();
-                to_upper(cursection_name);
-                trim(cursection_name);
             } else {
-                game.log << "INIFile: Malformed section in " << inifile->name()
-                         << " at line " << linenum << " (" << line << ")"
+                game.log << "INIFile: Malformed section in " << filename
+                         << " at line " << linenum << " (" << string(line, lineend) << ")"
                          << endl;
             }
-        } else if (cursection_name != "") {
-            LineTokenizer data(line, keyvalue_sep);
-
-            if (std::distance(data.begin(), data.end()) != 2) {
-                game.log << "INIFile: Missing key/value error in " << inifile->name()
-                         << " at line " << linenum << " (" << line << ")"
+        } else if (insection) {
+            if (split(line, lineend, '=', '=', tokens, tokenends) != 2) {
+                game.log << "INIFile: Missing key/value error in " << filename
+                         << " at line " << linenum << " (" << string(line, lineend) << ")"
                          << endl;
                 continue;
             }
-            LineTokenizer::iterator it(data.begin());
-
-            string key = *it++;
-            to_upper(key);
-            trim(key);
+            char* key = tokens[0];
+            char* keyend = tokenends[0];
+            trim(key, keyend);
 
-            string value = *it++;
+            char* value = tokens[1];
+            char* valueend = tokenends[1];
             // TODO: Trim comments
-            trim(value);
+            trim(value, valueend);
 
-            if ((key.length() == 0) || (value.length() == 0)) {
-                game.log << "INIFile: Empty key/value error in " << inifile->name()
-                         << " at line " << linenum << " (" << line << ")"
+            if ((key == keyend) || (value == valueend)) {
+                game.log << "INIFile: Empty key/value error in " << filename
+                         << " at line " << linenum << " (" << string(line, lineend) << ")"
                          << endl;
                 continue;
             }
-            cursection[key] = value;
+            upper(key, keyend);
+            *keyend = '\0';
+            *valueend = '\0';
+            Key newkey = {static_cast<unsigned int>(key - begin),
+                static_cast<unsigned int>(value - begin),
+                static_cast<unsigned int>(valueend - value)};
+            keybuf.push_back(newkey);
+            ++sectionbuf.back().numkeys;
         }
         ++linenum;
     }
-    if (cursection_name != "") {
-        inidata[cursection_name] = cursection;
+}
+
+/** Sorts the sections and each section's keys by name and builds the
+ * section hash table.  The sorts are stable so that of several sections or
+ * keys with the same name, the last one in the file is kept, as it was when
+ * they were read into maps.  Then points the tables at the buffers.
+ */
+void INIFile::sort()
+{
+    const char* names = &textbuf[0];
+    NameLess less(names);
+    std::stable_sort(sectionbuf.begin(), sectionbuf.end(), less);
+
+    vector<Section> uniquesections;
+    vector<Key> sortedkeys;
+    sortedkeys.reserve(keybuf.size());
+    for (unsigned int i = 0; i < sectionbuf.size(); ++i) {
+        Section section = sectionbuf[i];
+        if (i + 1 < sectionbuf.size() && strcmp(names + section.name, names + sectionbuf[i + 1].name) == 0) {
+            continue;
+        }
+        vector<Key>::iterator first = keybuf.begin() + section.firstkey;
+        vector<Key>::iterator last = first + section.numkeys;
+        std::stable_sort(first, last, less);
+
+        section.firstkey = sortedkeys.size();
+        for (vector<Key>::iterator it = first; it != last; ++it) {
+            if (it + 1 != last && strcmp(names + it->name, names + (it + 1)->name) == 0) {
+                continue;
+            }
+            sortedkeys.push_back(*it);
+        }
+        section.numkeys = sortedkeys.size() - section.firstkey;
+        section.hash = hash_name(names + section.name);
+        uniquesections.push_back(section);
+    }
+    sectionbuf.swap(uniquesections);
+    keybuf.swap(sortedkeys);
+
+    // At most half full
+    tablesize = 16;
+    while (tablesize < sectionbuf.size() * 2) {
+        tablesize <<= 1;
+    }
+    tablebuf.assign(tablesize, 0);
+    for (unsigned int i = 0; i < sectionbuf.size(); ++i) {
+        unsigned int slot = sectionbuf[i].hash & (tablesize - 1);
+        while (tablebuf[slot] != 0) {
+            slot = (slot + 1) & (tablesize - 1);
+        }
+        tablebuf[slot] = i + 1;
     }
+
+    text = &textbuf[0];
+    sections = sectionbuf.empty() ? 0 : &sectionbuf[0];
+    numsections = static_cast<unsigned int>(sectionbuf.size());
+    keys = keybuf.empty() ? 0 : &keybuf[0];
+    numkeys = static_cast<unsigned int>(keybuf.size());
+    sectiontable = &tablebuf[0];
 }
 
-// Deprecated
-INIKey INIFile::readKeyValue(const char* section, unsigned int keynum)
+const INIFile::Section* INIFile::findSection(const char* name) const
 {
-    map<string, INISection>::iterator sec;
-    INIKey key;
+    const unsigned int mask = tablesize - 1;
+    const unsigned int hash = hash_name(name);
+    for (unsigned int slot = hash & mask; sectiontable[slot] != 0; slot = (slot + 1) & mask) {
+        const Section& section = sections[sectiontable[slot] - 1];
+        if (section.hash == hash && compare_name(&text[section.name], name) == 0) {
+            return &section;
+        }
+    }
+    return 0;
+}
 
-    string s = section;
-    transform(s.begin(),s.end(), s.begin(), toupper);
+const INIFile::Key* INIFile::findKey(const Section& section, const char* name) const
+{
+    unsigned int first = section.firstkey;
+    unsigned int count = section.numkeys;
+    while (count > 0) {
+        unsigned int half = count / 2;
+        if (compare_name(&text[keys[first + half].name], name) < 0) {
+            first += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    if (first < section.firstkey + section.numkeys && compare_name(&text[keys[first].name], name) == 0) {
+        return &keys[first];
+    }
+    return 0;
+}
 
-    sec = inidata.find(s);
-    if (sec == inidata.end()) {
+INIString INIFile::readValue(const char* section, const char* key) const
+{
+    const Section* sec = findSection(section);
+    if (sec == 0) {
+        return INIString();
+    }
+    const Key* found = findKey(*sec, key);
+    if (found == 0) {
+        return INIString();
+    }
+    return INIString(&text[found->value], found->valuelen);
+}
+
+unsigned int INIFile::getNumKeys(const char* section) const
+{
+    const Section* sec = findSection(section);
+    return sec == 0 ? 0 : sec->numkeys;
+}
+
+// Deprecated
+INIKey INIFile::readKeyValue(const char* section, unsigned int keynum)
+{
+    INISection* sec = this->section(section);
+    if (sec == NULL) {
         throw 0;
     }
 
-    if (keynum >= sec->second.size()) {
+    if (keynum >= sec->size()) {
         throw 0;
     }
 
-    key = sec->second.begin();
+    INIKey key = sec->begin();
     for (unsigned int i = 0; i < keynum; ++i) {
         key++;
     }
-    if (key == sec->second.end())
-        throw 0;
-
     return key;
 }
 
 INISection* INIFile::section(string section)
 {
     to_upper(section);
-    map<string, INISection>::iterator sec = inidata.find(section);
-    if (sec == inidata.end()) {
+    map<string, INISection>::iterator sec = copies.find(section);
+    if (sec != copies.end()) {
+        return &sec->second;
+    }
+
+    const Section* found = findSection(section.c_str());
+    if (found == 0) {
         return NULL;
     }
-    return &sec->second;
+    INISection& copy = copies[section];
+    for (unsigned int i = found->firstkey; i < found->firstkey + found->numkeys; ++i) {
+        const Key& key = keys[i];
+        copy.insert(copy.end(), INISectionItem(&text[key.name], string(&text[key.value], key.valuelen)));
+    }
+    return &copy;
 }
 
 /** Use inside a loop to read all keys in a section when extraction in numeric
@@ -142,18 +360,12 @@ INISection* INIFile::section(string section)
  */
 INIKey INIFile::readIndexedKeyValue(const char* section, unsigned int index, const char* prefix)
 {
-    map<string, INISection>::iterator sec;
-    INIKey key;
-
-    string s = section;
-    transform(s.begin(),s.end(), s.begin(), toupper);
-
-    sec = inidata.find(s);
-    if (sec == inidata.end()) {
+    INISection* sec = this->section(section);
+    if (sec == NULL) {
         throw 0;
     }
 
-    if (index > sec->second.size()) {
+    if (index > sec->size()) {
         throw 0;
     }
 
@@ -161,8 +373,8 @@ INIKey INIFile::readIndexedKeyValue(const char* section, unsigned int index, con
     if (prefix)
         keyval = prefix;
     keyval += lexical_cast<string>(index);
-    key = sec->second.find(keyval);
-    if (key == sec->second.end()) {
+    INIKey key = sec->find(keyval);
+    if (key == sec->end()) {
         throw 0;
     }
     return key;
@@ -171,50 +383,27 @@ INIKey INIFile::readIndexedKeyValue(const char* section, unsigned int index, con
 
 string INIFile::readSection(unsigned int secnum)
 {
-    map<string, INISection>::iterator sec;
-    unsigned int i;
-
-    if (secnum >= inidata.size()) {
+    if (secnum >= numsections) {
         throw 0;
     }
-    sec = inidata.begin();
-    for (i = 0; i < secnum; i++) {
-        sec++;
-        if (sec == inidata.end()) {
-            throw 0;
-        }
-    }
-    return sec->first;
+    return &text[sections[secnum].name];
 }
 
 /** Function to extract a string from a ini file. The string
- * is malloced in this function so it should be freed.
+ * is allocated in this function so it should be delete[]d.
+ * readValue does the same without the copy.
  * @param the section in the file to extract string from.
  * @param the name of the string to extract.
  * @return the extracted string.
  */
 char* INIFile::readString(const char* section, const char* value)
 {
-    char* retval;
-    map<string, INISection>::iterator sec;
-    INIKey key;
-
-    string s = section;
-    to_upper(s);
-    string v = value;
-    to_upper(v);
-
-    sec = inidata.find(s);
-    if (sec == inidata.end()) {
-        return NULL;
-    }
-
-    key = sec->second.find(v);
-    if (key == sec->second.end()) {
+    INIString str = readValue(section, value);
+    if (!str.valid()) {
         return NULL;
     }
-    retval = new char[key->second.length()+1];
-    return strcpy(retval, key->second.c_str());
+    char* retval = new char[str.size() + 1];
+    return strcpy(retval, str.c_str());
 }
 
 /// wrapper around readString to return a provided default instead of NULL
@@ -225,43 +414,30 @@ char* INIFile::readString(const char* section, const char* value, const char* de
     tmp = readString(section,value);
     if (tmp == NULL) {
         /* a new string is allocated because this guarentees
-         * that the return value can be delete[]ed safely 
+         * that the return value can be delete[]ed safely
          */
         tmp = cppstrdup(deflt);
     }
     return tmp;
 }
 
-/** Function to extract a integer value from a ini file. The value
- * can be given in hex if it starts with 0x.
+/** Function to extract a integer value from a ini file.
  * @param the section in the file to extract values from.
  * @param the name of the value to extract.
  * @return the value.
  */
 int INIFile::readInt(const char* section, const char* value)
 {
-    int retval;
-    map<string, INISection>::iterator sec;
-    INIKey key;
-
-    string s = section;
-    transform (s.begin(),s.end(), s.begin(), toupper);
-    string v = value;
-    transform (v.begin(),v.end(), v.begin(), toupper);
-
-    sec = inidata.find(s);
-    if (sec == inidata.end()) {
-        return INIERROR;
-    }
-
-    key = sec->second.find(v);
-    if (key == sec->second.end()) {
+    INIString str = readValue(section, value);
+    if (!str.valid()) {
         return INIERROR;
     }
-    if (sscanf(key->second.c_str(), "%d", &retval) != 1) {
+    char* end;
+    long retval = strtol(str.c_str(), &end, 10);
+    if (end == str.c_str()) {
         return INIERROR;
     }
-    return retval;
+    return static_cast<int>(retval);
 }
 
 /// wrapper around readInt to return a provided default instead of INIERROR
@@ -275,3 +451,55 @@ int INIFile::readInt(const char* section, const char* value, unsigned int deflt)
     else
         return tmp;
 }
+
+void INIFile::benchmark()
+{
+    const char* names[] = {"unit.ini", "structure.ini", "art.ini", "weapons.ini",
+        "talkback.ini", "templates.ini", "sidebar.ini", "cursors.ini"};
+
+    for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        shared_ptr<File> inifile = game.vfs.open(names[i]);
+        if (!inifile) {
+            game.log << "INIFile: Unable to open " << names[i] << endl;
+            continue;
+        }
+
+        unsigned int parses = 0;
+        unsigned int start = SDL_GetTicks();
+        unsigned int elapsed;
+        do {
+            INIFile ini(inifile);
+            ++parses;
+            elapsed = SDL_GetTicks() - start;
+        } while (elapsed < 500);
+        unsigned long long bytes = static_cast<unsigned long long>(inifile->size()) * parses;
+
+        game.log << "INIFile: Parsed " << names[i] << " (" << inifile->size() << " bytes) "
+                 << parses << " times in " << elapsed << "ms: "
+                 << parses * 1000ULL / elapsed << " parses per second, "
+                 << bytes * 1000 / elapsed / 1024 << "KB per second" << endl;
+
+        // Every key looked up by name
+        INIFile ini(inifile);
+        const char* text = ini.text;
+        unsigned long long lookups = 0;
+        start = SDL_GetTicks();
+        do {
+            for (unsigned int s = 0; s < ini.numsections; ++s) {
+                const Section& section = ini.sections[s];
+                for (unsigned int k = section.firstkey; k < section.firstkey + section.numkeys; ++k) {
+                    if (ini.readValue(text + section.name, text + ini.keys[k].name).valid()) {
+                        ++lookups;
+                    }
+                }
+            }
+            elapsed = SDL_GetTicks() - start;
+        } while (elapsed < 500 && ini.numkeys != 0);
+
+        if (elapsed > 0) {
+            game.log << "INIFile: " << lookups * 1000 / elapsed << " lookups per second in "
+                     << names[i] << " (" << ini.numsections << " sections, "
+                     << ini.numkeys << " keys)" << endl;
+        }
+    }
+}
@@ -1,6 +1,8 @@
 #ifndef _LIB_INIFILE_H
 #define _LIB_INIFILE_H
 
+#include <cstring>
+#include <boost/noncopyable.hpp>
 #include "../basictypes.h"
 
 #define MAXLINELENGTH 1024
@@ -19,28 +21,114 @@ struct INIFileNotFound : std::runtime_error
 namespace VFS
 {
     class File;
+    class MappedFile;
 }
 
-class INIFile
+/// A name or value in an INIFile.  Points into the file's text, so it is
+/// only valid as long as the INIFile is, but it is null terminated.
+class INIString
+{
+public:
+    INIString() : data_(0), size_(0) {}
+    INIString(const char* data, unsigned int size) : data_(data), size_(size) {}
+
+    /// Whether the key was in the file at all
+    bool valid() const {return data_ != 0;}
+    bool empty() const {return size_ == 0;}
+    unsigned int size() const {return size_;}
+    /// 0 if the key wasn't in the file
+    const char* c_str() const {return data_;}
+    string str() const {return data_ ? string(data_, size_) : string();}
+
+    bool operator==(const char* s) const {return data_ != 0 && strcmp(data_, s) == 0;}
+    bool operator!=(const char* s) const {return !(*this == s);}
+private:
+    const char* data_;
+    unsigned int size_;
+};
+
+/** The whole file is kept as one block of text.  Section and key names are
+ * upper cased and every name and value is null terminated in place, so
+ * reading a value is a hash lookup that returns a pointer into the text.
+ * Not copyable, as the tables point into its own buffers or a RulesDB
+ * mapping.
+ */
+class INIFile : private boost::noncopyable
 {
 public:
     INIFile(shared_ptr<VFS::File> inifile);
 
-    /// @TODO Would be nice if there was a version that returned a non-copy.
+    /// Looks up a value without copying it.  Names are case insensitive.
+    /// @returns an INIString that isn't valid() if there's no such key
+    INIString readValue(const char* section, const char* key) const;
+
+    /// @returns the number of keys in the section, 0 if there's no such section
+    unsigned int getNumKeys(const char* section) const;
+
+    /// Copies of the value that the caller has to delete[]
     char* readString(const char* section, const char* value);
     char* readString(const char* section, const char* value, const char* deflt);
 
     int readInt(const char* section, const char* value, unsigned int deflt);
     int readInt(const char* section, const char* value);
 
+    // The functions below work on a copy of the section, made the first
+    // time it's needed.  They aren't safe to call from more than one thread.
+
     // Take copy to upper case
     INISection* section(string section);
 
     INIKey readKeyValue(const char* section, unsigned int keynum);
     INIKey readIndexedKeyValue(const char* section, unsigned int keynum, const char* prefix=0);
     string readSection(unsigned int secnum);
+
+    /// Parses the mod's rule files over and over for a few seconds each
+    /// and logs how long it takes
+    static void benchmark();
 private:
-    map<string, INISection> inidata;
+    friend class RulesDB;
+
+    /// For RulesDB, which points the tables into its mapping
+    INIFile() {}
+
+    struct Section {
+        unsigned int name;     // Offset into text
+        unsigned int hash;
+        unsigned int firstkey; // Index into keys
+        unsigned int numkeys;
+    };
+    struct Key {
+        unsigned int name;     // Offsets into text
+        unsigned int value;
+        unsigned int valuelen;
+    };
+
+    void parse(const string& filename);
+    void sort();
+    const Section* findSection(const char* name) const;
+    const Key* findKey(const Section& section, const char* name) const;
+
+    // The tables, in the buffers below when the file was parsed or in a
+    // compiled rules database
+    const char* text;
+    /// Sorted by name, as are each section's keys, so keys are found by
+    /// binary search
+    const Section* sections;
+    unsigned int numsections;
+    const Key* keys;
+    unsigned int numkeys;
+    /// Open addressed hash table of sections, holding index + 1
+    const unsigned int* sectiontable;
+    unsigned int tablesize;
+
+    vector<char> textbuf;
+    vector<Section> sectionbuf;
+    vector<Key> keybuf;
+    vector<unsigned int> tablebuf;
+    shared_ptr<VFS::MappedFile> mapping;
+
+    /// Copies of sections made for the old interface
+    map<string, INISection> copies;
 };
 
 #endif
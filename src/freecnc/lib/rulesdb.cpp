@@ -0,0 +1,249 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "../freecnc.h"
+#include "../vfs/mappedfile.h"
+#include "inifile.h"
+#include "rulesdb.h"
+
+using VFS::MappedFile;
+
+namespace
+{
+    const char* const rulefiles[] = {"unit.ini", "structure.ini", "weapons.ini",
+        "talkback.ini", "art.ini"};
+    const unsigned int numrulefiles = sizeof(rulefiles) / sizeof(rulefiles[0]);
+
+    // The database is a header and a record for each rule file, followed
+    // by the rule files' tables.  Everything is four byte aligned and in
+    // the byte order of the machine that compiled it.
+    struct DBHeader
+    {
+        char magic[4];
+        unsigned int version;
+        unsigned int byteorder;
+        unsigned int count;
+    };
+
+    struct DBFile
+    {
+        char name[16];
+        // Where the rule file came from, to tell when it has changed
+        unsigned int present;
+        unsigned int archive; // Hash of the archive's name
+        unsigned int size;
+        unsigned int mtime;
+        // Offsets from the start of the database
+        unsigned int text, textsize;
+        unsigned int sections, numsections;
+        unsigned int keys, numkeys;
+        unsigned int table, tablesize;
+    };
+
+    const char db_magic[4] = {'F', 'R', 'U', 'L'};
+    const unsigned int db_version = 1;
+    const unsigned int db_byteorder = 0x01020304;
+
+    // The rules are loaded before SDL is initialised, so SDL_GetTicks can't
+    // time them
+    unsigned int elapsed_msecs(clock_t start)
+    {
+        return static_cast<unsigned int>((clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+    }
+
+    // FNV-1a
+    unsigned int hash_archive(const string& archive)
+    {
+        unsigned int hash = 2166136261u;
+        for (string::const_iterator it = archive.begin(); it != archive.end(); ++it) {
+            hash = (hash ^ static_cast<unsigned char>(*it)) * 16777619u;
+        }
+        return hash;
+    }
+
+    void stamp(DBFile& record, shared_ptr<File> file)
+    {
+        record.present = file ? 1 : 0;
+        record.archive = file ? hash_archive(file->archive()) : 0;
+        record.size = file ? static_cast<unsigned int>(file->size()) : 0;
+        record.mtime = file ? file->mtime() : 0;
+    }
+
+    /// Appends count items to the database, padded to four bytes
+    /// @returns where they start
+    template<class T> unsigned int append(vector<char>& db, const T* items, unsigned int count)
+    {
+        const unsigned int offset = static_cast<unsigned int>(db.size());
+        const char* bytes = reinterpret_cast<const char*>(items);
+        db.insert(db.end(), bytes, bytes + count * sizeof(T));
+        db.resize((db.size() + 3) & ~3, 0);
+        return offset;
+    }
+
+    /// Whether count items of itemsize at offset are inside the database
+    bool fits(unsigned int offset, unsigned int count, unsigned int itemsize, unsigned int dbsize)
+    {
+        return offset % 4 == 0 && offset <= dbsize && count <= (dbsize - offset) / itemsize;
+    }
+}
+
+bool RulesDB::compile(const string& path)
+{
+    clock_t start = clock();
+
+    DBFile records[numrulefiles];
+    memset(records, 0, sizeof(records));
+    vector<char> db(sizeof(DBHeader) + sizeof(records));
+    for (unsigned int i = 0; i < numrulefiles; ++i) {
+        DBFile& record = records[i];
+        strncpy(record.name, rulefiles[i], sizeof(record.name) - 1);
+        shared_ptr<File> file = game.vfs.open(rulefiles[i]);
+        stamp(record, file);
+        if (!file) {
+            continue;
+        }
+        INIFile ini(file);
+        record.textsize = static_cast<unsigned int>(ini.textbuf.size());
+        record.text = append(db, ini.text, record.textsize);
+        record.numsections = ini.numsections;
+        record.sections = append(db, ini.sections, ini.numsections);
+        record.numkeys = ini.numkeys;
+        record.keys = append(db, ini.keys, ini.numkeys);
+        record.tablesize = ini.tablesize;
+        record.table = append(db, ini.sectiontable, ini.tablesize);
+    }
+
+    DBHeader header;
+    memcpy(header.magic, db_magic, sizeof(header.magic));
+    header.version = db_version;
+    header.byteorder = db_byteorder;
+    header.count = numrulefiles;
+    memcpy(&db[0], &header, sizeof(header));
+    memcpy(&db[sizeof(header)], records, sizeof(records));
+
+    // Written to the side and renamed so a half written database is never
+    // picked up
+    const string tempfile = path + ".tmp";
+    FILE* out = fopen(tempfile.c_str(), "wb");
+    if (!out) {
+        game.log << "RulesDB: Unable to write " << tempfile << endl;
+        return false;
+    }
+    bool ok = fwrite(&db[0], 1, db.size(), out) == db.size();
+    ok = fclose(out) == 0 && ok;
+    if (ok) {
+        std::remove(path.c_str());
+        ok = std::rename(tempfile.c_str(), path.c_str()) == 0;
+    }
+    if (!ok) {
+        std::remove(tempfile.c_str());
+        game.log << "RulesDB: Unable to write " << path << endl;
+        return false;
+    }
+    game.log << "RulesDB: Compiled " << numrulefiles << " rule files into " << path
+             << " (" << db.size() << " bytes) in " << elapsed_msecs(start) << "ms" << endl;
+    return true;
+}
+
+bool RulesDB::load(const string& path)
+{
+    clock_t start = clock();
+
+    shared_ptr<MappedFile> mapping = MappedFile::get(path);
+    if (!mapping || mapping->size() < static_cast<int>(sizeof(DBHeader) + numrulefiles * sizeof(DBFile))) {
+        return false;
+    }
+    const unsigned char* data = mapping->data();
+    const unsigned int dbsize = static_cast<unsigned int>(mapping->size());
+
+    DBHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, db_magic, sizeof(header.magic)) != 0
+            || header.version != db_version || header.byteorder != db_byteorder
+            || header.count != numrulefiles) {
+        game.log << "RulesDB: " << path << " is from another version" << endl;
+        return false;
+    }
+
+    vector<shared_ptr<INIFile> > inifiles(numrulefiles);
+    for (unsigned int i = 0; i < numrulefiles; ++i) {
+        DBFile record, current;
+        memcpy(&record, data + sizeof(DBHeader) + i * sizeof(DBFile), sizeof(record));
+        stamp(current, game.vfs.open(rulefiles[i]));
+        if (strncmp(record.name, rulefiles[i], sizeof(record.name)) != 0
+                || record.present != current.present || record.archive != current.archive
+                || record.size != current.size || record.mtime != current.mtime) {
+            game.log << "RulesDB: " << rulefiles[i] << " has changed since " << path
+                     << " was compiled" << endl;
+            return false;
+        }
+        if (!record.present) {
+            continue;
+        }
+
+        if (record.textsize == 0 || !fits(record.text, record.textsize, 1, dbsize)
+                || !fits(record.sections, record.numsections, sizeof(INIFile::Section), dbsize)
+                || !fits(record.keys, record.numkeys, sizeof(INIFile::Key), dbsize)
+                || !fits(record.table, record.tablesize, sizeof(unsigned int), dbsize)
+                || record.tablesize <= record.numsections
+                || (record.tablesize & (record.tablesize - 1)) != 0) {
+            game.log << "RulesDB: " << path << " is damaged" << endl;
+            return false;
+        }
+        shared_ptr<INIFile> ini(new INIFile());
+        ini->text = reinterpret_cast<const char*>(data + record.text);
+        ini->sections = reinterpret_cast<const INIFile::Section*>(data + record.sections);
+        ini->numsections = record.numsections;
+        ini->keys = reinterpret_cast<const INIFile::Key*>(data + record.keys);
+        ini->numkeys = record.numkeys;
+        ini->sectiontable = reinterpret_cast<const unsigned int*>(data + record.table);
+        ini->tablesize = record.tablesize;
+        ini->mapping = mapping;
+        if (!valid(*ini, record.textsize)) {
+            game.log << "RulesDB: " << path << " is damaged" << endl;
+            return false;
+        }
+        inifiles[i] = ini;
+    }
+
+    for (unsigned int i = 0; i < numrulefiles; ++i) {
+        if (inifiles[i]) {
+            p::settings[rulefiles[i]] = inifiles[i];
+        }
+    }
+    game.log << "RulesDB: Loaded " << numrulefiles << " rule files from " << path
+             << " in " << elapsed_msecs(start) << "ms" << endl;
+    return true;
+}
+
+bool RulesDB::valid(const INIFile& ini, unsigned int textsize)
+{
+    if (ini.text[textsize - 1] != '\0') {
+        return false;
+    }
+    for (unsigned int i = 0; i < ini.numsections; ++i) {
+        const INIFile::Section& section = ini.sections[i];
+        if (section.name >= textsize || section.firstkey > ini.numkeys
+                || section.numkeys > ini.numkeys - section.firstkey) {
+            return false;
+        }
+    }
+    for (unsigned int i = 0; i < ini.numkeys; ++i) {
+        const INIFile::Key& key = ini.keys[i];
+        if (key.name >= textsize || key.value >= textsize || key.valuelen >= textsize - key.value) {
+            return false;
+        }
+    }
+    // Needs an empty slot to end every search
+    unsigned int empty = 0;
+    for (unsigned int i = 0; i < ini.tablesize; ++i) {
+        if (ini.sectiontable[i] > ini.numsections) {
+            return false;
+        }
+        if (ini.sectiontable[i] == 0) {
+            ++empty;
+        }
+    }
+    return empty > 0;
+}
@@ -0,0 +1,34 @@
+#ifndef _LIB_RULESDB_H
+#define _LIB_RULESDB_H
+
+#include "../basictypes.h"
+
+class INIFile;
+
+/** The rule files behind the unit, structure and weapon types, compiled
+ * into one file holding the tables INIFile looks things up in.  Loading it
+ * is a single mapping, so the rule files are only parsed when the database
+ * is stale.
+ *
+ * Each rule file is stamped with the archive it was found in, its size and
+ * its modification time.  The database is stale as soon as what the VFS
+ * would open doesn't match.
+ */
+class RulesDB
+{
+public:
+    /// Parses the rule files and writes the database to path
+    /// @returns false if it couldn't be written
+    static bool compile(const string& path);
+
+    /// Maps the database at path and hands its rule files to GetConfig
+    /// @returns false if there is no usable database or it is stale, in
+    /// which case nothing is loaded
+    static bool load(const string& path);
+private:
+    /// Whether the tables of an INIFile read from a database only point
+    /// inside its text and at each other
+    static bool valid(const INIFile& ini, unsigned int textsize);
+};
+
+#endif
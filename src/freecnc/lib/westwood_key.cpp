@@ -1,12 +1,22 @@
 //
 // Based on code from XCC Mixer.
 //
+// The key is an RSA block: every (modulus bytes) chunk of the 80 byte
+// source is raised to the public exponent modulo the public key.  The
+// arithmetic is done on 32 bit limbs with 64 bit products, using Montgomery
+// multiplication so no division is needed.
+//
 #include <cstring>
+#include <boost/cstdint.hpp>
 #include "westwood_key.h"
 
-namespace 
+namespace
 {
+    typedef boost::uint32_t limb;
+    typedef boost::uint64_t dlimb;
+
     const char* pubkey_str = "AihRvNoIbTn85FZRYNZRcT+i6KpU+maCsEqr3Q5q+LDB5tH7Tz2qQ38V";
+    const unsigned int pubkey_exp = 0x10001;
 
     const char char2num[] = {
         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -27,411 +37,224 @@ namespace
         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
     };
 
-    typedef unsigned int bignum4[4];
-    typedef unsigned int bignum[64];
-    typedef unsigned int bignum130[130];
+    // Plenty for the 320 bit public key
+    const unsigned int max_limbs = 16;
+
+    // Little endian array of limbs
+    typedef limb bignum[max_limbs];
 
     struct pubkey_t {
-        bignum key1;
-        bignum key2;
-        unsigned int len;
+        bignum modulus;
+        unsigned int len;    // Limbs in use
+        unsigned int bitlen;
+        limb minv;           // -modulus^-1 mod 2^32
+        bignum r2;           // 2^(64*len) mod modulus
     } pubkey;
-    bignum glob1;
-    unsigned int glob1_bitlen, glob1_len_x2;
-    bignum130 glob2;
-    bignum4 glob1_hi, glob1_hi_inv;
-    unsigned int glob1_hi_bitlen;
-    unsigned int glob1_hi_inv_lo, glob1_hi_inv_hi;
 
-    void init_bignum(bignum n, unsigned int val, unsigned int len)
+    int cmp_bignum(const limb* n1, const limb* n2, unsigned int len)
     {
-        memset((void *)n, 0, len * 4);
-        n[0] = val;
-    }
-
-    void move_key_to_big(bignum n, char *key, unsigned int klen, unsigned int blen)
-    {
-        unsigned int sign;
-        int i;
-
-        if (key[0] & 0x80)
-            sign = 0xff;
-        else
-            sign = 0;
-
-        for (i = blen*4; (unsigned int)i > klen; i--)
-            ((char *)n)[i-1] = (char)sign;
-        for (; i > 0; i--)
-            ((char *)n)[i-1] = (char)key[klen-i];
-    }
-
-    void key_to_bignum(bignum n, char *key, unsigned int len)
-    {
-        unsigned int keylen;
-        int i;
-
-        if (key[0] != 2)
-            return;
-        key++;
-
-        if (key[0] & 0x80) {
-            keylen = 0;
-            for (i = 0; i < (key[0] & 0x7f); i++)
-                keylen = (keylen << 8) | key[i+1];
-            key += (key[0] & 0x7f) + 1;
-        } else {
-            keylen = key[0];
-            key++;
+        while (len-- > 0) {
+            if (n1[len] != n2[len]) {
+                return n1[len] < n2[len] ? -1 : 1;
+            }
         }
-        if (keylen <= len*4)
-            move_key_to_big(n, key, keylen, len);
+        return 0;
     }
 
-    unsigned int len_bignum(bignum n, unsigned int len)
+    // n -= m, returns the borrow
+    limb sub_bignum(limb* n, const limb* m, unsigned int len)
     {
-        int i;
-        i = len-1;
-        while ((i >= 0) && (n[i] == 0))
-            i--;
-        return i+1;
+        limb borrow = 0;
+        for (unsigned int i = 0; i < len; ++i) {
+            dlimb diff = (dlimb)n[i] - m[i] - borrow;
+            n[i] = (limb)diff;
+            borrow = (limb)(diff >> 32) & 1;
+        }
+        return borrow;
     }
 
-    unsigned int bitlen_bignum(bignum n, unsigned int len)
+    unsigned int bitlen_bignum(const limb* n, unsigned int len)
     {
-        unsigned int ddlen, bitlen, mask;
-        ddlen = len_bignum(n, len);
-        if (ddlen == 0)
+        while (len > 0 && n[len - 1] == 0) {
+            --len;
+        }
+        if (len == 0) {
             return 0;
-        bitlen = ddlen * 32;
-        mask = 0x80000000;
-        while ((mask & n[ddlen-1]) == 0) {
-            mask >>= 1;
-            bitlen--;
+        }
+        unsigned int bitlen = len * 32;
+        for (limb mask = 0x80000000; (n[len - 1] & mask) == 0; mask >>= 1) {
+            --bitlen;
         }
         return bitlen;
     }
 
-    void init_pubkey()
+    // Reads a big endian DER integer into n, returns false if it isn't one
+    // or doesn't fit
+    bool key_to_bignum(bignum n, const unsigned char* key)
     {
-        unsigned int i, i2, tmp;
-        char keytmp[256];
-
-        init_bignum(pubkey.key2, 0x10001, 64);
-
-        i = 0;
-        i2 = 0;
-        while (i < strlen(pubkey_str)) {
-            tmp = char2num[(unsigned char)pubkey_str[i++]];
-            tmp <<= 6;
-            tmp |= char2num[(unsigned char)pubkey_str[i++]];
-            tmp <<= 6;
-            tmp |= char2num[(unsigned char)pubkey_str[i++]];
-            tmp <<= 6;
-            tmp |= char2num[(unsigned char)pubkey_str[i++]];
-            keytmp[i2++] = (char)((tmp >> 16) & 0xff);
-            keytmp[i2++] = (char)((tmp >> 8) & 0xff);
-            keytmp[i2++] = (char)(tmp & 0xff);
+        if (key[0] != 2) {
+            return false;
         }
-        key_to_bignum(pubkey.key1, keytmp, 64);
-        pubkey.len = bitlen_bignum(pubkey.key1, 64) - 1;
-    }
+        ++key;
 
-    unsigned int len_predata()
-    {
-        unsigned int a = (pubkey.len - 1) / 8;
-        return (55 / a + 1) * (a + 1);
-    }
-
-    long int cmp_bignum(bignum n1, bignum n2, unsigned int len)
-    {
-        n1 += len-1;
-        n2 += len-1;
-        while (len > 0) {
-            if (*n1 < *n2)
-                return -1;
-            if (*n1 > *n2)
-                return 1;
-            n1--;
-            n2--;
-            len--;
+        unsigned int keylen;
+        if (key[0] & 0x80) {
+            keylen = 0;
+            for (int i = 0; i < (key[0] & 0x7f); ++i) {
+                keylen = (keylen << 8) | key[i + 1];
+            }
+            key += (key[0] & 0x7f) + 1;
+        } else {
+            keylen = key[0];
+            ++key;
         }
-        return 0;
-    }
-
-    void mov_bignum(bignum dest, bignum src, unsigned int len)
-    {
-        memmove(dest, src, len*4);
-    }
-
-    void shr_bignum(bignum n, unsigned int bits, long int len)
-    {
-        unsigned int i, i2;
-
-        i2 = bits / 32;
-        if (i2 > 0) {
-            for (i = 0; i < len - i2; i++)
-                n[i] = n[i + i2];
-            for (; i < (unsigned long int)len; i++)
-                n[i] = 0;
-            bits = bits % 32;
+        if (keylen > max_limbs * 4) {
+            return false;
         }
-        if (bits == 0)
-            return;
-        for (i = 0; i < (unsigned long int)len - 1; i++)
-            n[i] = (n[i] >> bits) | (n[i + 1] << (32 - bits));
-        n[i] = n[i] >> bits;
-    }
-
-    void shl_bignum(bignum n, unsigned int bits, unsigned int len)
-    {
-        unsigned int i, i2;
-
-        i2 = bits / 32;
-        if (i2 > 0) {
-            for (i = len - 1; i > i2; i--)
-                n[i] = n[i - i2];
-            for (; i > 0; i--)
-                n[i] = 0;
-            bits = bits % 32;
+        memset(n, 0, sizeof(bignum));
+        for (unsigned int i = 0; i < keylen; ++i) {
+            unsigned int pos = keylen - 1 - i;
+            n[pos / 4] |= (limb)key[i] << (8 * (pos % 4));
         }
-        if (bits == 0)
-            return;
-        for (i = len - 1; i > 0; i--)
-            n[i] = (n[i] << bits) | (n[i - 1] >> (32 -
-                                                  bits));
-        n[0] <<= bits;
+        return true;
     }
 
-    unsigned int sub_bignum(bignum dest, bignum src1, bignum src2, unsigned int carry, unsigned int len)
+    void init_pubkey()
     {
-        unsigned int i1, i2;
-
-        len += len;
-        while ((long)--len != -1) {
-            i1 = *(unsigned short *)src1;
-            i2 = *(unsigned short *)src2;
-            *(unsigned short *)dest = (unsigned short)(i1 - i2 - carry);
-            src1 = (unsigned int *)(((unsigned short *)src1) + 1);
-            src2 = (unsigned int *)(((unsigned short *)src2) + 1);
-            dest = (unsigned int *)(((unsigned short *)dest) + 1);
-            if ((i1 - i2 - carry) & 0x10000)
-                carry = 1;
-            else
-                carry = 0;
+        unsigned char keytmp[256];
+        unsigned int i2 = 0;
+        for (unsigned int i = 0; pubkey_str[i] != 0; i += 4) {
+            unsigned int tmp = char2num[(unsigned char)pubkey_str[i]];
+            tmp = (tmp << 6) | char2num[(unsigned char)pubkey_str[i + 1]];
+            tmp = (tmp << 6) | char2num[(unsigned char)pubkey_str[i + 2]];
+            tmp = (tmp << 6) | char2num[(unsigned char)pubkey_str[i + 3]];
+            keytmp[i2++] = (unsigned char)(tmp >> 16);
+            keytmp[i2++] = (unsigned char)(tmp >> 8);
+            keytmp[i2++] = (unsigned char)tmp;
         }
-        return carry;
-    }
-
-    void inv_bignum(bignum n1, bignum n2, unsigned int len)
-    {
-        bignum n_tmp;
-        unsigned int n2_bytelen, bit;
-        long int n2_bitlen;
-
-        init_bignum(n_tmp, 0, len);
-        init_bignum(n1, 0, len);
-        n2_bitlen = bitlen_bignum(n2, len);
-        bit = ((unsigned int)1) << (n2_bitlen % 32);
-        n1 += ((n2_bitlen + 32) / 32) - 1;
-        n2_bytelen = ((n2_bitlen - 1) / 32) * 4;
-        n_tmp[n2_bytelen / 4] |= ((unsigned int)1) << ((n2_bitlen - 1) & 0x1f);
-
-        while (n2_bitlen > 0) {
-            n2_bitlen--;
-            shl_bignum(n_tmp, 1, len);
-            if (cmp_bignum(n_tmp, n2, len) != -1) {
-                sub_bignum(n_tmp, n_tmp, n2, 0, len);
-                *n1 |= bit;
+        key_to_bignum(pubkey.modulus, keytmp);
+        pubkey.bitlen = bitlen_bignum(pubkey.modulus, max_limbs);
+        pubkey.len = (pubkey.bitlen + 31) / 32;
+
+        // Newton's iteration, each step doubles the number of correct bits
+        limb inv = 1;
+        for (int i = 0; i < 5; ++i) {
+            inv *= 2 - pubkey.modulus[0] * inv;
+        }
+        pubkey.minv = 0 - inv;
+
+        // R^2 mod modulus by doubling 1 until it has been shifted 2*32*len
+        // bits, only done once
+        const unsigned int len = pubkey.len;
+        memset(pubkey.r2, 0, sizeof(bignum));
+        pubkey.r2[0] = 1;
+        for (unsigned int i = 0; i < 64 * len; ++i) {
+            limb carry = 0;
+            for (unsigned int j = 0; j < len; ++j) {
+                limb next = pubkey.r2[j] >> 31;
+                pubkey.r2[j] = (pubkey.r2[j] << 1) | carry;
+                carry = next;
             }
-            bit >>= 1;
-            if (bit == 0) {
-                n1--;
-                bit = 0x80000000;
+            if (carry || cmp_bignum(pubkey.r2, pubkey.modulus, len) >= 0) {
+                sub_bignum(pubkey.r2, pubkey.modulus, len);
             }
         }
-        init_bignum(n_tmp, 0, len);
     }
 
-    void inc_bignum(bignum n, unsigned int len)
+    /// Bytes of key data fed to the decoder, a whole number of blocks
+    unsigned int block_size()
     {
-        while ((++*n == 0) && (--len > 0))
-            n++;
+        return (pubkey.bitlen - 2) / 8 + 1;
     }
 
-    void init_two_dw(bignum n, unsigned int len)
+    unsigned int len_predata()
     {
-        mov_bignum(glob1, n, len);
-        glob1_bitlen = bitlen_bignum(glob1, len);
-        glob1_len_x2 = (glob1_bitlen + 15) / 16;
-        mov_bignum(glob1_hi, glob1 + len_bignum(glob1, len) - 2, 2);
-        glob1_hi_bitlen = bitlen_bignum(glob1_hi, 2) - 32;
-        shr_bignum(glob1_hi, glob1_hi_bitlen, 2);
-        inv_bignum(glob1_hi_inv, glob1_hi, 2);
-        shr_bignum(glob1_hi_inv, 1, 2);
-        glob1_hi_bitlen = (glob1_hi_bitlen + 15) % 16 + 1;
-        inc_bignum(glob1_hi_inv, 2);
-        if (bitlen_bignum(glob1_hi_inv, 2) > 32) {
-            shr_bignum(glob1_hi_inv, 1, 2);
-            glob1_hi_bitlen--;
-        }
-        glob1_hi_inv_lo = *(unsigned short *)glob1_hi_inv;
-        glob1_hi_inv_hi = *(((unsigned short *)glob1_hi_inv) + 1);
+        const unsigned int a = block_size() - 1;
+        return (55 / a + 1) * (a + 1);
     }
 
-    void mul_bignum_word(bignum n1, bignum n2, unsigned int mul, unsigned int len)
+    // out = a * b / R mod modulus.  Requires a * b < modulus * R, which
+    // holds when either is below the modulus.  out may alias a or b.
+    void mont_mul(limb* out, const limb* a, const limb* b)
     {
-        unsigned int i, tmp;
-
-        tmp = 0;
-        for (i = 0; i < len; i++) {
-            tmp = mul * (*(unsigned short *)n2) + *(unsigned short *)n1 + tmp;
-            *(unsigned short *)n1 = (unsigned short)tmp;
-            n1 = (unsigned int *)(((unsigned short *)n1) + 1);
-            n2 = (unsigned int *)(((unsigned short *)n2) + 1);
-            tmp >>= 16;
+        const unsigned int len = pubkey.len;
+        const limb* m = pubkey.modulus;
+        limb t[max_limbs + 2];
+        memset(t, 0, sizeof(t));
+
+        for (unsigned int i = 0; i < len; ++i) {
+            dlimb carry = 0;
+            for (unsigned int j = 0; j < len; ++j) {
+                dlimb sum = (dlimb)a[j] * b[i] + t[j] + carry;
+                t[j] = (limb)sum;
+                carry = sum >> 32;
+            }
+            dlimb sum = (dlimb)t[len] + carry;
+            t[len] = (limb)sum;
+            t[len + 1] = (limb)(sum >> 32);
+
+            // Add the multiple of the modulus that clears the low limb,
+            // then drop it
+            const limb q = t[0] * pubkey.minv;
+            carry = ((dlimb)q * m[0] + t[0]) >> 32;
+            for (unsigned int j = 1; j < len; ++j) {
+                sum = (dlimb)q * m[j] + t[j] + carry;
+                t[j - 1] = (limb)sum;
+                carry = sum >> 32;
+            }
+            sum = (dlimb)t[len] + carry;
+            t[len - 1] = (limb)sum;
+            t[len] = t[len + 1] + (limb)(sum >> 32);
         }
-        *(unsigned short *)n1 += (unsigned short)tmp;
-    }
-
-    void mul_bignum(bignum dest, bignum src1, bignum src2, unsigned int len)
-    {
-        unsigned int i;
-
-        init_bignum(dest, 0, len*2);
-        for (i = 0; i < len*2; i++) {
-            mul_bignum_word(dest, src1, *(unsigned short *)src2, len*2);
-            src2 = (unsigned int *)(((unsigned short *)src2) + 1);
-            dest = (unsigned int *)(((unsigned short *)dest) + 1);
+        if (t[len] != 0 || cmp_bignum(t, m, len) >= 0) {
+            sub_bignum(t, m, len);
         }
+        memcpy(out, t, len * sizeof(limb));
     }
 
-    void not_bignum(bignum n, unsigned int len)
+    // out = base ^ pubkey_exp mod modulus
+    void calc_a_key(bignum out, const bignum base)
     {
-        unsigned int i;
-        for (i = 0; i < len; i++) {
-            *n = ~*n;
-            ++n;
-        }
-    }
+        const unsigned int len = pubkey.len;
+        bignum x, acc;
+        mont_mul(x, base, pubkey.r2);
+        memcpy(acc, x, len * sizeof(limb));
 
-    void neg_bignum(bignum n, unsigned int len)
-    {
-        not_bignum(n, len);
-        inc_bignum(n, len);
-    }
-
-    unsigned int get_mulword(bignum n)
-    {
-        unsigned int i;
-        unsigned short *wn;
-
-        wn = (unsigned short *)n;
-        i = (((((((((*(wn-1) ^ 0xffff) & 0xffff) * glob1_hi_inv_lo + 0x10000) >> 1)
-                 + (((*(wn-2) ^ 0xffff) * glob1_hi_inv_hi + glob1_hi_inv_hi) >> 1) + 1)
-                >> 16) + ((((*(wn-1) ^ 0xffff) & 0xffff) * glob1_hi_inv_hi) >> 1) +
-               (((*wn ^ 0xffff) * glob1_hi_inv_lo) >> 1) + 1) >> 14) + glob1_hi_inv_hi
-             * (*wn ^ 0xffff) * 2) >> glob1_hi_bitlen;
-        if (i > 0xffff)
-            i = 0xffff;
-        return i & 0xffff;
-    }
-
-    void dec_bignum(bignum n, unsigned int len)
-    {
-        while ((--*n == 0xffffffff) && (--len > 0))
-            n++;
-    }
-
-    void calc_a_bignum(bignum n1, bignum n2, bignum n3, unsigned int len)
-    {
-        unsigned int g2_len_x2, len_diff;
-        unsigned short *esi, *edi;
-        unsigned short tmp;
-
-        mul_bignum(glob2, n2, n3, len);
-        glob2[len*2] = 0;
-        g2_len_x2 = len_bignum(glob2, len*2+1)*2;
-        if (g2_len_x2 >= glob1_len_x2) {
-            inc_bignum(glob2, len*2+1);
-            neg_bignum(glob2, len*2+1);
-            len_diff = g2_len_x2 + 1 - glob1_len_x2;
-            esi = ((unsigned short *)glob2) + (1 + g2_len_x2 - glob1_len_x2);
-            edi = ((unsigned short *)glob2) + (g2_len_x2 + 1);
-            for (; len_diff != 0; len_diff--) {
-                edi--;
-                tmp = (unsigned short)get_mulword((unsigned int *)edi);
-                esi--;
-                if (tmp > 0) {
-                    mul_bignum_word((unsigned int *)esi, glob1, tmp, 2*len);
-                    if ((*edi & 0x8000) == 0) {
-                        if (sub_bignum((unsigned int *)esi, (unsigned int *)esi, glob1, 0, len))
-                            (*edi)--;
-                    }
-                }
-            }
-            neg_bignum(glob2, len);
-            dec_bignum(glob2, len);
+        unsigned int bit = 0x80000000;
+        while ((pubkey_exp & bit) == 0) {
+            bit >>= 1;
         }
-        mov_bignum(n1, glob2, len);
-    }
-
-    void clear_tmp_vars(unsigned int len)
-    {
-        init_bignum(glob1, 0, len);
-        init_bignum(glob2, 0, len);
-        init_bignum(glob1_hi_inv, 0, 4);
-        init_bignum(glob1_hi, 0, 4);
-        glob1_bitlen = 0;
-        glob1_hi_bitlen = 0;
-        glob1_len_x2 = 0;
-        glob1_hi_inv_lo = 0;
-        glob1_hi_inv_hi = 0;
-    }
-
-    void calc_a_key(bignum n1, bignum n2, bignum n3, bignum n4, unsigned int len)
-    {
-        bignum n_tmp;
-        unsigned int n3_len, n4_len, n3_bitlen, bit_mask;
-
-        init_bignum(n1, 1, len);
-        n4_len = len_bignum(n4, len);
-        init_two_dw(n4, n4_len);
-        n3_bitlen = bitlen_bignum(n3, n4_len);
-        n3_len = (n3_bitlen + 31) / 32;
-        bit_mask = (((unsigned int)1) << ((n3_bitlen - 1) % 32)) >> 1;
-        n3 += n3_len - 1;
-        n3_bitlen--;
-        mov_bignum(n1, n2, n4_len);
-        while ((long)--n3_bitlen != -1) {
-            if (bit_mask == 0) {
-                bit_mask = 0x80000000;
-                n3--;
+        for (bit >>= 1; bit != 0; bit >>= 1) {
+            mont_mul(acc, acc, acc);
+            if (pubkey_exp & bit) {
+                mont_mul(acc, acc, x);
             }
-            calc_a_bignum(n_tmp, n1, n1, n4_len);
-            if (*n3 & bit_mask)
-                calc_a_bignum(n1, n_tmp, n2, n4_len);
-            else
-                mov_bignum(n1, n_tmp, n4_len);
-            bit_mask >>= 1;
         }
-        init_bignum(n_tmp, 0, n4_len);
-        clear_tmp_vars(len);
+
+        bignum one;
+        memset(one, 0, sizeof(one));
+        one[0] = 1;
+        memset(out, 0, sizeof(bignum));
+        mont_mul(out, acc, one);
     }
 
     void process_predata(const unsigned char* pre, unsigned int pre_len, unsigned char *buf)
     {
         bignum n2, n3;
-        const unsigned int a = (pubkey.len - 1) / 8;
-        while (a + 1 <= pre_len) {
-            init_bignum(n2, 0, 64);
-            memmove(n2, pre, a + 1);
-            calc_a_key(n3, n2, pubkey.key2, pubkey.key1, 64);
-
-            memmove(buf, n3, a);
+        const unsigned int blocklen = block_size();
+        while (blocklen <= pre_len) {
+            memset(n2, 0, sizeof(n2));
+            for (unsigned int i = 0; i < blocklen; ++i) {
+                n2[i / 4] |= (limb)pre[i] << (8 * (i % 4));
+            }
+            calc_a_key(n3, n2);
+            for (unsigned int i = 0; i < blocklen - 1; ++i) {
+                buf[i] = (unsigned char)(n3[i / 4] >> (8 * (i % 4)));
+            }
 
-            pre_len -= a + 1;
-            pre += a + 1;
-            buf += a;
+            pre_len -= blocklen;
+            pre += blocklen;
+            buf += blocklen - 1;
         }
     }
 }
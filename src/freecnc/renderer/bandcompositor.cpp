@@ -0,0 +1,269 @@
+#include <cstring>
+
+#include "SDL.h"
+#include "SDL_thread.h"
+#include "bandcompositor.h"
+
+using std::vector;
+
+namespace
+{
+    typedef GraphicsEngine::DrawCommand DrawCommand;
+
+    /* Same clipping as SDL_UpperBlit, but against an arbitrary rectangle
+     * instead of the destination's clip_rect.  Keeping the arithmetic
+     * identical is what makes the banded output match the normal path. */
+    bool clipBlit(SDL_Surface* src, SDL_Rect& srcrect, SDL_Rect& dstrect, const SDL_Rect& clip)
+    {
+        int srcx = srcrect.x;
+        int w = srcrect.w;
+        if (srcx < 0) {
+            w += srcx;
+            dstrect.x -= srcx;
+            srcx = 0;
+        }
+        int maxw = src->w - srcx;
+        if (maxw < w) {
+            w = maxw;
+        }
+
+        int srcy = srcrect.y;
+        int h = srcrect.h;
+        if (srcy < 0) {
+            h += srcy;
+            dstrect.y -= srcy;
+            srcy = 0;
+        }
+        int maxh = src->h - srcy;
+        if (maxh < h) {
+            h = maxh;
+        }
+
+        int dx = clip.x - dstrect.x;
+        if (dx > 0) {
+            w -= dx;
+            dstrect.x += dx;
+            srcx += dx;
+        }
+        dx = dstrect.x + w - clip.x - clip.w;
+        if (dx > 0) {
+            w -= dx;
+        }
+
+        int dy = clip.y - dstrect.y;
+        if (dy > 0) {
+            h -= dy;
+            dstrect.y += dy;
+            srcy += dy;
+        }
+        dy = dstrect.y + h - clip.y - clip.h;
+        if (dy > 0) {
+            h -= dy;
+        }
+
+        if (w <= 0 || h <= 0) {
+            return false;
+        }
+        srcrect.x = srcx;
+        srcrect.y = srcy;
+        srcrect.w = dstrect.w = w;
+        srcrect.h = dstrect.h = h;
+        return true;
+    }
+
+    bool clipFill(SDL_Rect& rect, const SDL_Rect& clip)
+    {
+        int x1 = max<int>(rect.x, clip.x);
+        int y1 = max<int>(rect.y, clip.y);
+        int x2 = min<int>(rect.x + rect.w, clip.x + clip.w);
+        int y2 = min<int>(rect.y + rect.h, clip.y + clip.h);
+        if (x2 <= x1 || y2 <= y1) {
+            return false;
+        }
+        rect.x = x1;
+        rect.y = y1;
+        rect.w = x2 - x1;
+        rect.h = y2 - y1;
+        return true;
+    }
+
+    /* SDL_FillRect locks and unlocks the surface every call, which isn't
+     * safe from several threads at once, so the bands fill by hand.  The
+     * surface is already locked by composite. */
+    void fillRect(SDL_Surface* dest, const SDL_Rect& rect, Uint32 colour)
+    {
+        const int bpp = dest->format->BytesPerPixel;
+        Uint8* row = static_cast<Uint8*>(dest->pixels) + rect.y*dest->pitch + rect.x*bpp;
+        for (int y = 0; y < rect.h; ++y, row += dest->pitch) {
+            switch (bpp) {
+            case 1:
+                memset(row, colour, rect.w);
+                break;
+            case 2: {
+                Uint16* pixel = reinterpret_cast<Uint16*>(row);
+                for (int x = 0; x < rect.w; ++x) {
+                    pixel[x] = static_cast<Uint16>(colour);
+                }
+                break;
+            }
+            case 3:
+                for (Uint8* pixel = row; pixel < row + rect.w*3; pixel += 3) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+                    pixel[0] = static_cast<Uint8>(colour >> 16);
+                    pixel[1] = static_cast<Uint8>(colour >> 8);
+                    pixel[2] = static_cast<Uint8>(colour);
+#else
+                    pixel[0] = static_cast<Uint8>(colour);
+                    pixel[1] = static_cast<Uint8>(colour >> 8);
+                    pixel[2] = static_cast<Uint8>(colour >> 16);
+#endif
+                }
+                break;
+            default: {
+                Uint32* pixel = reinterpret_cast<Uint32*>(row);
+                for (int x = 0; x < rect.w; ++x) {
+                    pixel[x] = colour;
+                }
+                break;
+            }
+            }
+        }
+    }
+}
+
+/**
+ * @param numthreads total number of threads drawing, including the caller
+ */
+BandCompositor::BandCompositor(unsigned int numthreads) : quit(false), dest(0), cmds(0)
+{
+    done = SDL_CreateSemaphore(0);
+    for (unsigned int i = 1; i < numthreads; ++i) {
+        Worker* worker = new Worker;
+        worker->owner = this;
+        worker->start = SDL_CreateSemaphore(0);
+        worker->thread = SDL_CreateThread(BandCompositor::runWorker, worker);
+        if (worker->thread == NULL) {
+            game.log << "BandCompositor: Unable to start worker thread: " << SDL_GetError() << endl;
+            SDL_DestroySemaphore(worker->start);
+            delete worker;
+            break;
+        }
+        workers.push_back(worker);
+    }
+    game.log << "BandCompositor: Drawing the map with " << getNumThreads() << " threads" << endl;
+}
+
+BandCompositor::~BandCompositor()
+{
+    int stat;
+    quit = true;
+    for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i) {
+        SDL_SemPost((*i)->start);
+    }
+    for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i) {
+        SDL_WaitThread((*i)->thread, &stat);
+        SDL_DestroySemaphore((*i)->start);
+        delete *i;
+    }
+    SDL_DestroySemaphore(done);
+}
+
+/** Draws cmds onto dest.  The destination must not need locking.
+ */
+void BandCompositor::composite(SDL_Surface* dest, const SDL_Rect& area,
+        const vector<DrawCommand>& cmds)
+{
+    // Locked once here for the fills, the bands never lock it themselves
+    if (SDL_LockSurface(dest) != 0) {
+        return;
+    }
+    unsigned int numbands = min<unsigned int>(getNumThreads(), max<int>(area.h, 1));
+    if (numbands < 2) {
+        drawBand(dest, area, cmds);
+        SDL_UnlockSurface(dest);
+        return;
+    }
+
+    mapSurfaces(dest, cmds);
+
+    this->dest = dest;
+    this->cmds = &cmds;
+
+    unsigned short bandh = area.h / numbands;
+    SDL_Rect first = {area.x, area.y, area.w, bandh};
+    for (unsigned int i = 1; i < numbands; ++i) {
+        Worker* worker = workers[i-1];
+        worker->band.x = area.x;
+        worker->band.y = area.y + i*bandh;
+        worker->band.w = area.w;
+        // Last band picks up the remainder
+        worker->band.h = (i == numbands - 1) ? area.h - i*bandh : bandh;
+        SDL_SemPost(worker->start);
+    }
+
+    drawBand(dest, first, cmds);
+
+    for (unsigned int i = 1; i < numbands; ++i) {
+        SDL_SemWait(done);
+    }
+    this->dest = 0;
+    this->cmds = 0;
+    SDL_UnlockSurface(dest);
+}
+
+int BandCompositor::runWorker(void* inst)
+{
+    Worker* worker = (Worker*)inst;
+    BandCompositor* owner = worker->owner;
+    while (true) {
+        SDL_SemWait(worker->start);
+        if (owner->quit) {
+            break;
+        }
+        drawBand(owner->dest, worker->band, *owner->cmds);
+        SDL_SemPost(owner->done);
+    }
+    return 0;
+}
+
+void BandCompositor::drawBand(SDL_Surface* dest, const SDL_Rect& band,
+        const vector<DrawCommand>& cmds)
+{
+    for (vector<DrawCommand>::const_iterator i = cmds.begin(); i != cmds.end(); ++i) {
+        SDL_Rect dst = i->dst;
+        if (i->surface == NULL) {
+            if (clipFill(dst, band)) {
+                fillRect(dest, dst, i->colour);
+            }
+        } else {
+            SDL_Rect src = i->src;
+            if (clipBlit(i->surface, src, dst, band)) {
+                SDL_LowerBlit(i->surface, &src, dest, &dst);
+            }
+        }
+    }
+}
+
+/** SDL builds a surface's blit mapping lazily on the first blit to a new
+ * destination.  Doing that from several threads at once would race, so
+ * blit a single pixel of every source here first and put the pixel back.
+ */
+void BandCompositor::mapSurfaces(SDL_Surface* dest, const vector<DrawCommand>& cmds)
+{
+    const unsigned char bpp = dest->format->BytesPerPixel;
+    unsigned char saved[4];
+    memcpy(saved, dest->pixels, bpp);
+
+    SDL_Surface* last = NULL;
+    for (vector<DrawCommand>::const_iterator i = cmds.begin(); i != cmds.end(); ++i) {
+        if (i->surface == NULL || i->surface == last) {
+            continue;
+        }
+        last = i->surface;
+        SDL_Rect src = {0, 0, 1, 1};
+        SDL_Rect dst = {0, 0, 1, 1};
+        SDL_LowerBlit(i->surface, &src, dest, &dst);
+    }
+
+    memcpy(dest->pixels, saved, bpp);
+}
@@ -0,0 +1,50 @@
+#ifndef _RENDERER_BANDCOMPOSITOR_H
+#define _RENDERER_BANDCOMPOSITOR_H
+
+#include <boost/noncopyable.hpp>
+
+#include "SDL.h"
+#include "../freecnc.h"
+#include "graphicsengine.h"
+
+/** Draws a sorted draw list using several threads.
+ *
+ * The area is cut into horizontal bands and every thread draws the whole
+ * list clipped to its own band, so each pixel still sees the commands in
+ * the same order as the single threaded path.  The calling thread draws the
+ * first band itself.
+ */
+class BandCompositor : private boost::noncopyable
+{
+public:
+    explicit BandCompositor(unsigned int numthreads);
+    ~BandCompositor();
+
+    void composite(SDL_Surface* dest, const SDL_Rect& area,
+            const std::vector<GraphicsEngine::DrawCommand>& cmds);
+
+    unsigned int getNumThreads() const {return workers.size() + 1;}
+private:
+    struct Worker {
+        BandCompositor* owner;
+        SDL_Thread* thread;
+        SDL_sem* start;
+        SDL_Rect band;
+    };
+
+    static int runWorker(void* inst);
+    static void drawBand(SDL_Surface* dest, const SDL_Rect& band,
+            const std::vector<GraphicsEngine::DrawCommand>& cmds);
+    static void mapSurfaces(SDL_Surface* dest,
+            const std::vector<GraphicsEngine::DrawCommand>& cmds);
+
+    std::vector<Worker*> workers;
+    SDL_sem* done;
+    bool quit;
+
+    // Only valid during composite
+    SDL_Surface* dest;
+    const std::vector<GraphicsEngine::DrawCommand>* cmds;
+};
+
+#endif
@@ -61,7 +61,10 @@ void CPSImage::loadImage()
 //    unsigned int len = imgsize - offset;
 
     vector<unsigned char> image_data(header.imsize);
-    Compression::decode80(&cpsdata[offset], &image_data[0]);
+    if (Compression::decode80(&cpsdata[offset], cpsdata.size() - offset,
+                &image_data[0], image_data.size()) < 0) {
+        game.log << "CPSImage: Corrupt image data" << endl;
+    }
 
     SDL_Surface* imgtmp = SDL_CreateRGBSurfaceFrom(&image_data[0], 320, 200, 8,
         320, 0, 0, 0, 0);
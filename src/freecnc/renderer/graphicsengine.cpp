@@ -1,16 +1,27 @@
-#include <stdexcept>
+#include <algorithm>
 #include <cmath>
+#include <stdexcept>
 
 #include "../game/game_public.h"
 #include "../ui/ui_public.h"
+#include "bandcompositor.h"
 #include "graphicsengine.h"
 
 using pc::imgcache;
 
+namespace
+{
+    // Cells around the screen whose tiles are made before they scroll into view
+    const unsigned short tileprefetch = 4;
+}
+
 GraphicsEngine::GraphicsEngine()
 {
     width = game.config.width;
     height = game.config.height;
+    radarlayer = NULL;
+    radarzoom = 0;
+    compositor = NULL;
 
     string window_title("FreeCNC - " + game.config.map);
 
@@ -20,10 +31,9 @@ GraphicsEngine::GraphicsEngine()
     {
         SDL_Surface* icon = 0;
         shared_ptr<File> icon_file = game.vfs.open("base/icon.bmp");
-        if (icon_file) {
-            vector<unsigned char> buffer;
-            icon_file->read(buffer, icon_file->size());
-            icon = SDL_LoadBMP_RW(SDL_RWFromMem(&buffer[0], buffer.size()), 1);
+        if (icon_file && icon_file->size() > 0) {
+            const unsigned char* data = icon_file->read_all();
+            icon = SDL_LoadBMP_RW(SDL_RWFromConstMem(data, icon_file->size()), 1);
             if (icon != 0) {
                 SDL_WM_SetIcon(icon, NULL);
                 SDL_FreeSurface(icon);
@@ -52,6 +62,10 @@ GraphicsEngine::GraphicsEngine()
         throw VideoError();
     }
     logger->renderGameMsg(true);
+
+    if (game.config.render_threads > 1) {
+        compositor = new BandCompositor(game.config.render_threads);
+    }
 }
 
 
@@ -59,7 +73,9 @@ GraphicsEngine::GraphicsEngine()
 /** Destructor, free the memory used by the graphicsengine. */
 GraphicsEngine::~GraphicsEngine()
 {
+    delete compositor;
     delete imgcache;
+    SDL_FreeSurface(radarlayer);
     logger->renderGameMsg(false);
     delete pc::msg;
     pc::msg = NULL;
@@ -108,6 +124,64 @@ void GraphicsEngine::setupCurrentGame()
         // shpimage.cpp
         playercolours[i] = SHPBase::getColour(screen->format, i, 179);
     }
+    radarpalette.resize(playercolours.size() + 2);
+    radarpalette[0].r = radarpalette[0].g = radarpalette[0].b = 0;
+    radarpalette[1] = radarpalette[0];
+    for (unsigned char i = 0; i < playercolours.size() ; ++i) {
+        SDL_GetRGB(playercolours[i], screen->format, &radarpalette[i+2].r,
+                &radarpalette[i+2].g, &radarpalette[i+2].b);
+    }
+    // The map has changed, so the old layer is useless
+    SDL_FreeSurface(radarlayer);
+    radarlayer = NULL;
+}
+
+/** Redraws the whole minimap unit layer, only needed when the zoom changes or
+ * the local player's sight is reset.
+ */
+void GraphicsEngine::buildRadarLayer(unsigned char zoom, const std::vector<bool>& mapvis)
+{
+    SDL_FreeSurface(radarlayer);
+    radarlayer = SDL_CreateRGBSurface(SDL_SWSURFACE, p::ccmap->getWidth()*zoom,
+            p::ccmap->getHeight()*zoom, 8, 0, 0, 0, 0);
+    SDL_SetColors(radarlayer, &radarpalette[0], 0, radarpalette.size());
+    SDL_SetColorKey(radarlayer, SDL_SRCCOLORKEY, 0);
+    SDL_FillRect(radarlayer, NULL, 0);
+    radarzoom = zoom;
+    for (unsigned int pos = 0; pos < p::ccmap->getSize(); ++pos) {
+        drawRadarCell(pos, mapvis);
+    }
+}
+
+void GraphicsEngine::drawRadarCell(unsigned int pos, const std::vector<bool>& mapvis)
+{
+    SDL_Rect dest;
+    dest.x = (pos % p::ccmap->getWidth())*radarzoom;
+    dest.y = (pos / p::ccmap->getWidth())*radarzoom;
+    dest.w = radarzoom;
+    dest.h = radarzoom;
+    if (!mapvis[pos]) {
+        SDL_FillRect(radarlayer, &dest, 1);
+        return;
+    }
+    SDL_FillRect(radarlayer, &dest, 0);
+
+    float width, height;
+    unsigned char igroup, owner, pcol;
+    unsigned int cellpos;
+    bool blocked;
+    // Rather than make the graphics engine depend on the
+    // UnitOrStructureType, just pull what we need from the
+    // USPool.
+    if (p::uspool->getUnitOrStructureLimAt(pos, &width, &height, &cellpos,
+            &igroup, &owner, &pcol, &blocked)) {
+        /// @TODO drawing infanty groups as smaller pixels
+        if (blocked) {
+            dest.w = (unsigned short)ceil(width*radarzoom);
+            dest.h = (unsigned short)ceil(height*radarzoom);
+            SDL_FillRect(radarlayer, &dest, pcol + 2);
+        }
+    }
 }
 
 void GraphicsEngine::clipToMaparea(SDL_Rect *dest)
@@ -142,35 +216,17 @@ void GraphicsEngine::clipToMaparea(SDL_Rect *src, SDL_Rect *dest)
 void GraphicsEngine::renderScene()
 {
     //   int mx, my;
-    int i;
-    short xpos, ypos;
-
-    SDL_Surface *curimg, *bgimage;
-    SDL_Rect dest, src, udest, oldudest;
-
-    unsigned int tiberium, smudge, overlay, terrain;
-    unsigned char numshps;
-    unsigned int *unitorstructshps;
-    char *uxoffsets, *uyoffsets;
-    short txoff, tyoff;
-    double ratio;
-    Unit* tmp_un;
-
-    std::vector<unsigned short> l2overlays;
+    SDL_Surface *curimg;
+    SDL_Rect dest, src;
 
     Player* lplayer = p::ppool->getLPlayer();
     std::vector<bool>& mapvis = lplayer->getMapVis();
 
     static unsigned int whitepix = SDL_MapRGB(screen->format,0xff, 0xff, 0xff);
-    static unsigned int greenpix = SDL_MapRGB(screen->format,0, 0xff, 0);
-    static unsigned int yellowpix = SDL_MapRGB(screen->format,0xff, 0xff, 0);
-    static unsigned int redpix = SDL_MapRGB(screen->format,0xff, 0, 0);
     static unsigned int blackpix = SDL_MapRGB(screen->format,0, 0, 0);
 
-    unsigned short mapWidth, mapHeight, selection;
-    unsigned int curpos, curdpos;
+    unsigned short mapWidth, mapHeight;
 
-    char xmax, ymax;
     static SDL_Rect oldmouse = {0, 0, 0, 0};
     /* remove the old mousecursor */
     SDL_FillRect(screen, &oldmouse, blackpix);
@@ -189,12 +245,7 @@ void GraphicsEngine::renderScene()
     /*draw minimap*/
     if (Input::isMinimapEnabled()) {
         const unsigned char minizoom = *mz;
-        const unsigned int mapwidth = p::ccmap->getWidth();
-        const unsigned int mapheight = p::ccmap->getHeight();
         const MiniMapClipping& clip = p::ccmap->getMiniMapClipping();
-        unsigned char minx;
-        unsigned int cury;
-        bool blocked;
         // Need the exact dimensions in tiles
         // @TODO Positioning needs tweaking
         SDL_Surface *minimap = p::ccmap->getMiniMap(minizoom);
@@ -215,48 +266,127 @@ void GraphicsEngine::renderScene()
         if (src.y + src.h >= minimap->h) {
             src.y = minimap->h - src.h;
         }
+        SDL_Rect radardest = dest;
         SDL_BlitSurface(minimap, &src, screen, &dest);
-        // Draw black over not visible parts
-        curpos = p::ccmap->getScrollPos();
-        minx = min(curpos%mapwidth, mapwidth - clip.tilew);
-        cury = min(curpos/mapwidth, mapheight - clip.tileh);
-        curpos = minx+cury*mapwidth;
-        for (ypos = 0; ypos < clip.tileh ; ++ypos) {
-            for (xpos = 0 ; xpos < clip.tilew ; ++xpos) {
-                if (mapvis[curpos]) {
-                    float width, height;
-                    unsigned char igroup, owner, pcol;
-                    unsigned int cellpos;
-                    // Rather than make the graphics engine depend on the
-                    // UnitOrStructureType, just pull what we need from the
-                    // USPool.
-                    if (p::uspool->getUnitOrStructureLimAt(curpos, &width,
-                            &height, &cellpos, &igroup, &owner, &pcol, &blocked)) {
-                        /// @TODO drawing infanty groups as smaller pixels
-                        if (blocked) {
-                            dest.x = maparea.x+maparea.w+clip.x+xpos*minizoom;
-                            dest.y = maparea.y+clip.y+ypos*minizoom;
-                            dest.w = (unsigned short)ceil(width*minizoom);
-                            dest.h = (unsigned short)ceil(height*minizoom);
-                            SDL_FillRect(screen, &dest, playercolours[pcol]);
-                        }
-                    }
-                } else {
-                    // Draw a black square here
-                    dest.x = maparea.x+maparea.w+clip.x+xpos*minizoom;
-                    dest.y = maparea.y+clip.y+ypos*minizoom;
-                    dest.w = minizoom;
-                    dest.h = dest.w;
-                    SDL_FillRect(screen, &dest, blackpix);
-                }
-                ++curpos;
+
+        // Only redraw the cells that changed since the last frame, then put
+        // the units and the shroud on top of the terrain in one go.
+        bool rebuild = lplayer->getVisChanges(radarcells);
+        p::uspool->getRadarChanges(radarcells);
+        if (rebuild || radarlayer == NULL || radarzoom != minizoom) {
+            buildRadarLayer(minizoom, mapvis);
+        } else {
+            for (vector<unsigned int>::iterator i = radarcells.begin(); i != radarcells.end(); ++i) {
+                drawRadarCell(*i, mapvis);
             }
-            ++cury;
-            curpos = minx+cury*mapwidth;
         }
+        radarcells.clear();
+        SDL_BlitSurface(radarlayer, &src, screen, &radardest);
     }
     SDL_SetClipRect( screen, &maparea);
 
+    buildMapDrawList(mapWidth, mapHeight, mapvis);
+    flushDrawList();
+
+    /* draw the selectionbox */
+    if (Input::isDrawing()) {
+        dest.x = min(Input::getMarkRect().x, (short)Input::getMarkRect().w);
+        dest.y = min(Input::getMarkRect().y, (short)Input::getMarkRect().h);
+        dest.w = abs(Input::getMarkRect().x - Input::getMarkRect().w);
+        dest.h = 1;
+        SDL_FillRect(screen, &dest, whitepix);
+        dest.y += abs(Input::getMarkRect().y - Input::getMarkRect().h);
+        SDL_FillRect(screen, &dest, whitepix);
+        dest.y -= abs(Input::getMarkRect().y - Input::getMarkRect().h);
+        dest.h = abs(Input::getMarkRect().y - Input::getMarkRect().h);
+        dest.w = 1;
+        SDL_FillRect(screen, &dest, whitepix);
+        dest.x += abs(Input::getMarkRect().x - Input::getMarkRect().w);
+        SDL_FillRect(screen, &dest, whitepix);
+    }
+
+    dest.x = dest.y = 0;
+    dest.w = width;
+    dest.h = height;
+    SDL_SetClipRect( screen, &dest);
+
+    //   SDL_GetMouseState(&mx, &my);
+
+    //   dest.x = mx;
+    //   dest.y = my;
+    // Draw messages
+    curimg = pc::msg->getMessages();
+    if (curimg != NULL) {
+        dest.x = maparea.x;
+        dest.y = maparea.y;
+        dest.w = curimg->w;
+        dest.h = curimg->h;
+
+        SDL_BlitSurface(curimg, NULL, screen, &dest);
+    }
+
+    // Draw the mouse
+    dest.x = pc::cursor->getX();
+    dest.y = pc::cursor->getY();
+    if (dest.x < 0)
+        dest.x = 0;
+    if (dest.y < 0)
+        dest.y = 0;
+
+    curimg = pc::cursor->getCursor();
+    dest.w = curimg->w;
+    dest.h = curimg->h;
+
+    //oldmouse = dest;
+    SDL_BlitSurface(curimg, NULL, screen, &dest);
+
+    // just here to test drawLine
+    //drawLine(-160, -120, dest.x, dest.y, 5, blackpix);
+
+    SDL_Flip(screen);
+#ifdef _WIN32
+    SDL_FillRect(screen, &oldmouse, blackpix);
+#endif
+
+    oldmouse = dest;
+}
+
+
+
+/** Walks the visible part of the map and records everything that has to be
+ * drawn for it in the draw list, without touching the screen.
+ */
+void GraphicsEngine::buildMapDrawList(unsigned short mapWidth, unsigned short mapHeight,
+        std::vector<bool>& mapvis)
+{
+    int i;
+    short xpos, ypos;
+
+    SDL_Surface *bgimage;
+    SDL_Rect dest, src, udest, oldudest;
+
+    unsigned int tiberium, smudge, overlay, terrain;
+    unsigned char numshps;
+    unsigned int *unitorstructshps;
+    char *uxoffsets, *uyoffsets;
+    short txoff, tyoff;
+    double ratio;
+    Unit* tmp_un;
+
+    static unsigned int greenpix = SDL_MapRGB(screen->format,0, 0xff, 0);
+    static unsigned int yellowpix = SDL_MapRGB(screen->format,0xff, 0xff, 0);
+    static unsigned int redpix = SDL_MapRGB(screen->format,0xff, 0, 0);
+    static unsigned int blackpix = SDL_MapRGB(screen->format,0, 0, 0);
+
+    unsigned short selection;
+    unsigned int curpos, curdpos;
+
+    char xmax, ymax;
+
+    l2overlays.clear();
+
+    p::ccmap->prefetchTiles(mapWidth, mapHeight, tileprefetch);
+
     dest.y = maparea.y-p::ccmap->getYTileScroll();
 
     xmax = min(p::ccmap->getWidth()-(p::ccmap->getXScroll()+mapWidth), 4);
@@ -281,28 +411,26 @@ void GraphicsEngine::renderScene()
                 clipToMaparea(&src, &udest);
 
                 bgimage = p::ccmap->getMapTile(curpos);
-                if (bgimage != NULL) {
-                    SDL_BlitSurface(bgimage, &src, screen, &udest);
-                }
+                queueBlit(DL_TILE, bgimage, src, udest);
 
                 smudge = p::ccmap->getSmudge(curpos);
                 if (smudge != 0) {
                     ImageCacheEntry& images = imgcache->getImage(smudge);
-                    SDL_BlitSurface(images.image, &src, screen, &udest);
-                    SDL_BlitSurface(images.shadow, &src, screen, &udest);
+                    queueBlit(DL_SMUDGE, images.image, src, udest);
+                    queueBlit(DL_SMUDGE, images.shadow, src, udest);
                 }
 
                 tiberium = p::ccmap->getResourceFrame(curpos);
                 if (tiberium != 0) {
                     ImageCacheEntry& images = imgcache->getImage(tiberium);
-                    SDL_BlitSurface(images.image, &src, screen, &udest);
+                    queueBlit(DL_RESOURCE, images.image, src, udest);
                 }
 
                 overlay = p::ccmap->getOverlay(curpos);
                 if (overlay != 0) {
                     ImageCacheEntry& images = imgcache->getImage(overlay);
-                    SDL_BlitSurface(images.image, &src, screen, &udest);
-                    SDL_BlitSurface(images.shadow, &src, screen, &udest);
+                    queueBlit(DL_OVERLAY, images.image, src, udest);
+                    queueBlit(DL_OVERLAY, images.shadow, src, udest);
                 }
 
                 if (p::uspool->hasL2overlay(curpos)) {
@@ -325,8 +453,8 @@ void GraphicsEngine::renderScene()
                     udest.h = images.image->h;
                     clipToMaparea(&src, &udest);
 
-                    SDL_BlitSurface(images.image, &src, screen, &udest);
-                    SDL_BlitSurface(images.shadow, &src, screen, &udest);
+                    queueBlit(DL_OBJECT, images.image, src, udest);
+                    queueBlit(DL_OBJECT, images.shadow, src, udest);
                 }
 
                 numshps = p::uspool->getUnitOrStructureNum(curdpos, &unitorstructshps,
@@ -345,8 +473,8 @@ void GraphicsEngine::renderScene()
                         udest.y = dest.y+uyoffsets[i];
                         clipToMaparea(&src, &udest);
 
-                        SDL_BlitSurface(images.image, &src, screen, &udest);
-                        SDL_BlitSurface(images.shadow, &src, screen, &udest);
+                        queueBlit(DL_OBJECT, images.image, src, udest);
+                        queueBlit(DL_OBJECT, images.shadow, src, udest);
                     }
                     delete[] unitorstructshps;
                     delete[] uxoffsets;
@@ -366,12 +494,12 @@ void GraphicsEngine::renderScene()
                             clipToMaparea(&udest);
                             udest.w = 12;
                             udest.h = 5;
-                            SDL_FillRect(screen, &udest, blackpix);
+                            queueFill(DL_OBJECT, udest, blackpix);
                             udest.w = (unsigned short)(10.0 * ratio);
                             udest.h -= 2;
                             ++udest.x;
                             ++udest.y;
-                            SDL_FillRect(screen, &udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
+                            queueFill(DL_OBJECT, udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
                         }
                         if (selection &2) {
                             tmp_un  = (Unit*)p::uspool->getUnitOrStructureAt(curdpos,1);
@@ -381,12 +509,12 @@ void GraphicsEngine::renderScene()
                             clipToMaparea(&udest);
                             udest.w = 12;
                             udest.h = 5;
-                            SDL_FillRect(screen, &udest, blackpix);
+                            queueFill(DL_OBJECT, udest, blackpix);
                             udest.w = (unsigned short)(10.0 * ratio);
                             udest.h -= 2;
                             ++udest.x;
                             ++udest.y;
-                            SDL_FillRect(screen, &udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
+                            queueFill(DL_OBJECT, udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
                         }
                         if (selection &4) {
                             tmp_un = (Unit*)p::uspool->getUnitOrStructureAt(curdpos,2);
@@ -396,12 +524,12 @@ void GraphicsEngine::renderScene()
                             clipToMaparea(&udest);
                             udest.w = 12;
                             udest.h = 5;
-                            SDL_FillRect(screen, &udest, blackpix);
+                            queueFill(DL_OBJECT, udest, blackpix);
                             udest.w = (unsigned short)(10.0 * ratio);
                             udest.h -= 2;
                             ++udest.x;
                             ++udest.y;
-                            SDL_FillRect(screen, &udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
+                            queueFill(DL_OBJECT, udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
                         }
                         if (selection &8) {
                             tmp_un = (Unit*)p::uspool->getUnitOrStructureAt(curdpos,3);
@@ -411,12 +539,12 @@ void GraphicsEngine::renderScene()
                             clipToMaparea(&udest);
                             udest.w = 12;
                             udest.h = 5;
-                            SDL_FillRect(screen, &udest, blackpix);
+                            queueFill(DL_OBJECT, udest, blackpix);
                             udest.w = (unsigned short)(10.0 * ratio);
                             udest.h -= 2;
                             ++udest.x;
                             ++udest.y;
-                            SDL_FillRect(screen, &udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
+                            queueFill(DL_OBJECT, udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
                         }
                         if (selection &16) {
                             tmp_un = (Unit*)p::uspool->getUnitOrStructureAt(curdpos,4);
@@ -426,22 +554,22 @@ void GraphicsEngine::renderScene()
                             clipToMaparea(&udest);
                             udest.w = 12;
                             udest.h = 5;
-                            SDL_FillRect(screen, &udest, blackpix);
+                            queueFill(DL_OBJECT, udest, blackpix);
                             udest.w = (unsigned short)(10.0 * ratio);
                             udest.h -= 2;
                             ++udest.x;
                             ++udest.y;
-                            SDL_FillRect(screen, &udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
+                            queueFill(DL_OBJECT, udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
                         }
 
                     } else if (udest.w >= 2) {
                         ratio = p::uspool->getUnitOrStructureAt(curdpos,0)->getRatio();
-                        SDL_FillRect(screen, &udest, blackpix);
+                        queueFill(DL_OBJECT, udest, blackpix);
                         udest.h -= 2;
                         ++udest.x;
                         ++udest.y;
                         udest.w = (unsigned short)((double)(udest.w-2) * ratio);
-                        SDL_FillRect(screen, &udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
+                        queueFill(DL_OBJECT, udest, ((ratio<=0.5)?(ratio<=0.25?redpix:yellowpix):greenpix));
                     }
 
                 }
@@ -480,7 +608,11 @@ void GraphicsEngine::renderScene()
             udest.y = dest.y + uyoffsets[curdpos];
             udest.w = images.image->w;
             udest.h = images.image->h;
-            SDL_BlitSurface(images.image, NULL, screen, &udest);
+            src.x = 0;
+            src.y = 0;
+            src.w = udest.w;
+            src.h = udest.h;
+            queueBlit(DL_L2OVERLAY, images.image, src, udest);
         }
         delete[] unitorstructshps;
         delete[] uxoffsets;
@@ -526,28 +658,28 @@ void GraphicsEngine::renderScene()
                 //shadowoffs = 12*((curpos)%4); // Simplier, but maybe wrong?
                 if (i != 0) {
                     if (i&1) { // Top
-                        SDL_BlitSurface(p::ccmap->getShadowTile(3+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(3+shadowoffs), src, udest);
                     }
                     if (i&2) { // Right
-                        SDL_BlitSurface(p::ccmap->getShadowTile(5+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(5+shadowoffs), src, udest);
                     }
                     if (i&4) { // Bottom
-                        SDL_BlitSurface(p::ccmap->getShadowTile(0+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(0+shadowoffs), src, udest);
                     }
                     if (i&8) { // Left
-                        SDL_BlitSurface(p::ccmap->getShadowTile(1+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(1+shadowoffs), src, udest);
                     }
                     if ((i&3) == 3) { // Top Right
-                        SDL_BlitSurface(p::ccmap->getShadowTile(10+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(10+shadowoffs), src, udest);
                     }
                     if ((i&6) == 6) { // Bottom Right
-                        SDL_BlitSurface(p::ccmap->getShadowTile(11+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(11+shadowoffs), src, udest);
                     }
                     if ((i&12) == 12) { // Bottom Left
-                        SDL_BlitSurface(p::ccmap->getShadowTile(8+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(8+shadowoffs), src, udest);
                     }
                     if ((i&9) == 9) { // Top Left
-                        SDL_BlitSurface(p::ccmap->getShadowTile(9+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(9+shadowoffs), src, udest);
                     }
                 } else {
                     if (curpos >= p::ccmap->getWidth() && curpos%p::ccmap->getWidth() < (unsigned short)(p::ccmap->getWidth()-1) && !mapvis[curpos-p::ccmap->getWidth()+1]) {
@@ -565,16 +697,16 @@ void GraphicsEngine::renderScene()
 
                     switch(i) {
                     case 1: 
-                        SDL_BlitSurface(p::ccmap->getShadowTile(7+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(7+shadowoffs), src, udest);
                         break;
                     case 2: // Bottom Right
-                        SDL_BlitSurface(p::ccmap->getShadowTile(6+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(6+shadowoffs), src, udest);
                         break;
                     case 4:
-                        SDL_BlitSurface(p::ccmap->getShadowTile(2+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(2+shadowoffs), src, udest);
                         break;
                     case 8: // Top Left
-                        SDL_BlitSurface(p::ccmap->getShadowTile(4+shadowoffs), &src, screen, &udest);
+                        queueBlit(DL_SHROUD, p::ccmap->getShadowTile(4+shadowoffs), src, udest);
                         break;
                     default:
                         break;
@@ -582,7 +714,7 @@ void GraphicsEngine::renderScene()
                 }
             } else {
                 // draw a black square here
-                SDL_FillRect(screen, &udest, blackpix);
+                queueFill(DL_SHROUD, udest, blackpix);
             }
 
             dest.x += tilewidth;
@@ -591,72 +723,67 @@ void GraphicsEngine::renderScene()
         curpos += p::ccmap->getWidth()-mapWidth;
         dest.y += tilewidth;
     }
+}
 
-    /* draw the selectionbox */
-    if (Input::isDrawing()) {
-        dest.x = min(Input::getMarkRect().x, (short)Input::getMarkRect().w);
-        dest.y = min(Input::getMarkRect().y, (short)Input::getMarkRect().h);
-        dest.w = abs(Input::getMarkRect().x - Input::getMarkRect().w);
-        dest.h = 1;
-        SDL_FillRect(screen, &dest, whitepix);
-        dest.y += abs(Input::getMarkRect().y - Input::getMarkRect().h);
-        SDL_FillRect(screen, &dest, whitepix);
-        dest.y -= abs(Input::getMarkRect().y - Input::getMarkRect().h);
-        dest.h = abs(Input::getMarkRect().y - Input::getMarkRect().h);
-        dest.w = 1;
-        SDL_FillRect(screen, &dest, whitepix);
-        dest.x += abs(Input::getMarkRect().x - Input::getMarkRect().w);
-        SDL_FillRect(screen, &dest, whitepix);
+void GraphicsEngine::queueBlit(DrawLayer layer, SDL_Surface* surface, const SDL_Rect& src, const SDL_Rect& dst)
+{
+    if (surface == NULL) {
+        return;
     }
+    DrawCommand cmd = {surface, src, dst, 0, layer};
+    drawlist.push_back(cmd);
+}
 
-    dest.x = dest.y = 0;
-    dest.w = width;
-    dest.h = height;
-    SDL_SetClipRect( screen, &dest);
-
-    //   SDL_GetMouseState(&mx, &my);
+void GraphicsEngine::queueFill(DrawLayer layer, const SDL_Rect& dst, unsigned int colour)
+{
+    DrawCommand cmd = {NULL, dst, dst, colour, layer};
+    drawlist.push_back(cmd);
+}
 
-    //   dest.x = mx;
-    //   dest.y = my;
-    // Draw messages
-    curimg = pc::msg->getMessages();
-    if (curimg != NULL) {
-        dest.x = maparea.x;
-        dest.y = maparea.y;
-        dest.w = curimg->w;
-        dest.h = curimg->h;
+namespace
+{
+    /* Tiles never overlap, so they can be grouped by surface.  Everything
+     * else keeps the order it was queued in, as images and their shadows
+     * share a layer and a cell. */
+    struct DrawCommandOrder
+    {
+        bool operator()(const GraphicsEngine::DrawCommand& a, const GraphicsEngine::DrawCommand& b) const
+        {
+            if (a.layer != b.layer) {
+                return a.layer < b.layer;
+            }
+            if (a.layer == GraphicsEngine::DL_TILE) {
+                return a.surface < b.surface;
+            }
+            return false;
+        }
+    };
+}
 
-        SDL_BlitSurface(curimg, NULL, screen, &dest);
+/** Sorts the draw list into layers and blits it to the screen.  The list is
+ * split across threads when render_threads is set and the screen can be
+ * written without locking.
+ */
+void GraphicsEngine::flushDrawList()
+{
+    std::stable_sort(drawlist.begin(), drawlist.end(), DrawCommandOrder());
+    if (compositor != NULL && !SDL_MUSTLOCK(screen)) {
+        compositor->composite(screen, screen->clip_rect, drawlist);
+        drawlist.clear();
+        return;
     }
-
-    // Draw the mouse
-    dest.x = pc::cursor->getX();
-    dest.y = pc::cursor->getY();
-    if (dest.x < 0)
-        dest.x = 0;
-    if (dest.y < 0)
-        dest.y = 0;
-
-    curimg = pc::cursor->getCursor();
-    dest.w = curimg->w;
-    dest.h = curimg->h;
-
-    //oldmouse = dest;
-    SDL_BlitSurface(curimg, NULL, screen, &dest);
-
-    // just here to test drawLine
-    //drawLine(-160, -120, dest.x, dest.y, 5, blackpix);
-
-    SDL_Flip(screen);
-#ifdef _WIN32
-    SDL_FillRect(screen, &oldmouse, blackpix);
-#endif
-
-    oldmouse = dest;
+    for (vector<DrawCommand>::iterator i = drawlist.begin(); i != drawlist.end(); ++i) {
+        SDL_Rect dst = i->dst;
+        if (i->surface == NULL) {
+            SDL_FillRect(screen, &dst, i->colour);
+        } else {
+            SDL_Rect src = i->src;
+            SDL_BlitSurface(i->surface, &src, screen, &dst);
+        }
+    }
+    drawlist.clear();
 }
 
-
-
 /** Draw the sidebar and tabs. */
 void GraphicsEngine::drawSidebar()
 {
@@ -842,7 +969,7 @@ void GraphicsEngine::clearScreen()
 
 }
 
-void GraphicsEngine::renderLoading(const std::string& buff, SDL_Surface* logo)
+void GraphicsEngine::renderLoading(const std::string& buff, SDL_Surface* logo, double progress)
 {
     static unsigned int blackpix = SDL_MapRGB(screen->format, 0, 0, 0);
     SDL_Rect dest;
@@ -884,6 +1011,17 @@ void GraphicsEngine::renderLoading(const std::string& buff, SDL_Surface* logo)
     }
     pc::msg->clear();
 
+    if (progress >= 0.0) {
+        SDL_Rect bar;
+        bar.w = width / 3;
+        bar.h = 6;
+        bar.x = (width - bar.w) / 2;
+        bar.y = height / 2 + 60;
+        SDL_FillRect(screen, &bar, SDL_MapRGB(screen->format, 0x40, 0x40, 0x40));
+        bar.w = static_cast<Uint16>(bar.w * progress);
+        SDL_FillRect(screen, &bar, SDL_MapRGB(screen->format, 0xc0, 0xc0, 0xc0));
+    }
+
     SDL_Flip(screen);
 
 }
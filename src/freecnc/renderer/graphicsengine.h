@@ -4,6 +4,8 @@
 #include "SDL.h"
 #include "../freecnc.h"
 
+class BandCompositor;
+
 class GraphicsEngine
 {
 public:
@@ -30,12 +32,32 @@ public:
         messages->postMessage(msg);
     }*/
 
-    void renderLoading(const std::string& buff, SDL_Surface* logo);
+    /// @param progress how much of the progress bar to fill, or no bar if
+    /// negative
+    void renderLoading(const std::string& buff, SDL_Surface* logo, double progress = -1.0);
     class VideoError {};
+
+    /// Order in which the parts of the map are drawn
+    enum DrawLayer {DL_TILE, DL_SMUDGE, DL_RESOURCE, DL_OVERLAY, DL_OBJECT,
+        DL_L2OVERLAY, DL_SHROUD};
+    /// A single blit (or fill if surface is NULL) recorded for the map area
+    struct DrawCommand {
+        SDL_Surface* surface;
+        SDL_Rect src, dst;
+        unsigned int colour;
+        DrawLayer layer;
+    };
 private:
     void clipToMaparea(SDL_Rect *dest);
     void clipToMaparea(SDL_Rect *src, SDL_Rect *dest);
     void drawSidebar();
+    void buildMapDrawList(unsigned short mapWidth, unsigned short mapHeight,
+            std::vector<bool>& mapvis);
+    void queueBlit(DrawLayer layer, SDL_Surface* surface, const SDL_Rect& src, const SDL_Rect& dst);
+    void queueFill(DrawLayer layer, const SDL_Rect& dst, unsigned int colour);
+    void flushDrawList();
+    void buildRadarLayer(unsigned char zoom, const std::vector<bool>& mapvis);
+    void drawRadarCell(unsigned int pos, const std::vector<bool>& mapvis);
     void drawLine(short startx, short starty,
                   short stopx, short stopy, unsigned short width, unsigned int colour);
     SDL_Surface* screen;
@@ -52,6 +74,17 @@ private:
     unsigned char* mz;
     // Used to avoid SDL_MapRGB in the radar render step.
     std::vector<unsigned int> playercolours;
+    // Units and structures on the minimap, one palette index per pixel: 0 is
+    // transparent, 1 is unexplored and 2 onwards are the player colours.
+    SDL_Surface* radarlayer;
+    unsigned char radarzoom;
+    std::vector<SDL_Color> radarpalette;
+    std::vector<unsigned int> radarcells;
+    // Reused every frame so the draw list doesn't reallocate
+    std::vector<DrawCommand> drawlist;
+    std::vector<unsigned short> l2overlays;
+    // NULL when drawing on a single thread
+    BandCompositor* compositor;
 };
 
 #endif
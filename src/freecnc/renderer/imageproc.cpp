@@ -274,24 +274,53 @@ SDL_Surface* ImageProc::scale(SDL_Surface* input, char quality)
 }
 
 
-/** Scales down the map to a much smaller image which will be placed in the radar screen as the "minimap". Needs only to be called once per map load
- * @param the image to process
- */
-SDL_Surface* ImageProc::minimapScale(SDL_Surface *input, unsigned char pixsize)
+/// @returns the average colour of input as a pixel in format
+unsigned int ImageProc::averageColour(SDL_Surface *input, SDL_PixelFormat *format)
 {
-    SDL_Surface *output;
-    int bytesPerPixel = input->format->BytesPerPixel;
-    output = SDL_CreateRGBSurface (SDL_SWSURFACE, pixsize, pixsize, bytesPerPixel *8, 0xff, 0xff, 0xff, 0);
-    output->format->Rmask = input->format->Rmask;
-    output->format->Gmask = input->format->Gmask;
-    output->format->Bmask = input->format->Bmask;
-    output->format->Amask = input->format->Amask;
-    if( input->format->palette != NULL ) {
-        SDL_SetColors(output, input->format->palette->colors, 0, input->format->palette->ncolors);
+    unsigned long r = 0, g = 0, b = 0, count = 0;
+    unsigned char cr, cg, cb;
+    unsigned int pixel;
+    const int bytesPerPixel = input->format->BytesPerPixel;
+    const bool keyed = (input->flags & SDL_SRCCOLORKEY) != 0;
+
+    SDL_LockSurface(input);
+    for (int cy = 0; cy < input->h; cy++) {
+        unsigned char *srcp = (unsigned char*)input->pixels + cy*input->pitch;
+        for (int cx = 0; cx < input->w; cx++, srcp += bytesPerPixel) {
+            switch (bytesPerPixel) {
+            case 1:
+                pixel = *srcp;
+                break;
+            case 2:
+                pixel = *(unsigned short*)srcp;
+                break;
+            case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+                pixel = srcp[0] << 16 | srcp[1] << 8 | srcp[2];
+#else
+                pixel = srcp[0] | srcp[1] << 8 | srcp[2] << 16;
+#endif
+                break;
+            default:
+                pixel = *(unsigned int*)srcp;
+                break;
+            }
+            if (keyed && pixel == input->format->colorkey) {
+                continue;
+            }
+            SDL_GetRGB(pixel, input->format, &cr, &cg, &cb);
+            r += cr;
+            g += cg;
+            b += cb;
+            ++count;
+        }
     }
-    scaleNearest(input, output);
+    SDL_UnlockSurface(input);
 
-    return output;
+    if (count == 0) {
+        return SDL_MapRGB(format, 0, 0, 0);
+    }
+    return SDL_MapRGB(format, r/count, g/count, b/count);
 }
 
 void ImageProc::closeVideoScale()
@@ -3,6 +3,7 @@
 
 #include "../freecnc.h"
 
+struct SDL_PixelFormat;
 struct SDL_Surface;
 
 class ImageProc
@@ -14,9 +15,9 @@ public:
     // It really should take the dimentions you want for output
     SDL_Surface* scale(SDL_Surface* input, char quality);
 
-    //function the decrease the map to a size that it'll fit in the radar screen.
-    //NOTE: it's not to produce the radar image, only the minimap
-    SDL_Surface* minimapScale(SDL_Surface *input, unsigned char pixsize);
+    //average colour of the opaque pixels of input, mapped into format.
+    //Used to build the minimap, one colour per cell
+    unsigned int averageColour(SDL_Surface *input, SDL_PixelFormat *format);
 
     //Functions to scale the VQAs on-the-fly
     //quality setting is not supported.
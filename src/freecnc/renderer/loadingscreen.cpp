@@ -16,6 +16,7 @@ namespace {
 LoadingScreen::LoadingScreen()
 {
     done = false;
+    progress_ = -1.0;
     lsmutex = SDL_CreateMutex();
     oldwidth = pc::msg->getWidth();
     try {
@@ -59,10 +60,10 @@ int LoadingScreen::runRenderThread(void* inst)
 
         //render the frame here
         if (instance->logo == 0) {
-            pc::gfxeng->renderLoading(instance->task_, 0);
+            pc::gfxeng->renderLoading(instance->task_, 0, instance->progress_);
         } else {
             pc::gfxeng->renderLoading(instance->task_,
-                    instance->logo->getImage());
+                    instance->logo->getImage(), instance->progress_);
         }
         isDone = instance->done;
 
@@ -87,3 +88,14 @@ void LoadingScreen::setCurrentTask(const std::string& task)
     }
 }
 
+
+void LoadingScreen::setProgress(double fraction)
+{
+    while(SDL_mutexP(lsmutex)==-1) {
+        game.log << "Could not lock mutex" << endl;
+    }
+    progress_ = max(0.0, min(1.0, fraction));
+    while(SDL_mutexV(lsmutex)==-1) {
+        game.log << "Could not unlock mutex" << endl;
+    }
+}
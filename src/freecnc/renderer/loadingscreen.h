@@ -13,6 +13,8 @@ public:
     LoadingScreen();
     ~LoadingScreen();
     void setCurrentTask(const std::string& task);
+    /// Shows a progress bar filled to fraction, from 0 to 1
+    void setProgress(double fraction);
     const std::string& getCurrentTask() const {
         return task_;
     }
@@ -27,6 +29,7 @@ private:
     CPSImage* logo;
     bool done;
     std::string task_;
+    double progress_;
 };
 
 #endif /* LOADINGSCREEN_H */
@@ -1,9 +1,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
+#include <boost/filesystem/path.hpp>
 
 #include "../lib/compression.h"
 #include "../lib/inifile.h"
+#include "../vfs/mixarchive.h"
 #include "imageproc.h"
 #include "shpimage.h"
 #include "../lib/fcncendian.h"
@@ -11,6 +13,8 @@
 using std::string;
 using std::runtime_error;
 
+namespace fs = boost::filesystem;
+
 namespace
 {
     // Only code in this file needs to read three bytes, so don't bother with
@@ -19,7 +23,7 @@ namespace
     inline unsigned int read_three(Iterator& it, int byteorder=0)
     {
         // Like read_dword, except mask off top byte
-        unsigned int dword = *reinterpret_cast<unsigned int*>(&*it);
+        unsigned int dword = *reinterpret_cast<const unsigned int*>(&*it);
         dword &= 0x00FFFFFF;
         if (byteorder != 0) {
             dword = byteorder == FCNC_LIL_ENDIAN ? little_endian(dword) : big_endian(dword);
@@ -28,10 +32,10 @@ namespace
         return dword;
     }
 
-    inline unsigned int read_three(void* ptr, int byteorder=0)
+    inline unsigned int read_three(const void* ptr, int byteorder=0)
     {
         // Like read_dword, except mask off top byte
-        unsigned int dword = *reinterpret_cast<unsigned int*>(ptr);
+        unsigned int dword = *reinterpret_cast<const unsigned int*>(ptr);
         dword &= 0x00FFFFFF;
         if (byteorder != 0) {
             dword = byteorder == FCNC_LIL_ENDIAN ? little_endian(dword) : big_endian(dword);
@@ -211,14 +215,48 @@ SHPImage::SHPImage(const char *fname, char scaleq) : SHPBase(fname, scaleq)
     if (!imgfile) {
         throw ImageNotFound("SHPImage: File '" + string(fname) + "' not found");
     }
-    shpdata.resize(imgfile->size());
-    imgfile->read(shpdata, imgfile->size());
+    load(imgfile);
+}
+
+SHPImage::SHPImage(shared_ptr<File> file, char scaleq) : SHPBase(file->name(), scaleq)
+{
+    load(file);
+}
+
+/** Reads the whole file and checks that the frame table only points inside
+ * it, so frames can be decoded without checking again.  Mapped files are
+ * kept open so the data can stay in the archive's mapping, anything else is
+ * copied and closed.
+ */
+void SHPImage::load(shared_ptr<File> imgfile)
+{
+    shpdata = imgfile->map();
+    if (shpdata != 0) {
+        shpfile = imgfile;
+        shpsize = imgfile->size();
+    } else {
+        const unsigned char* span;
+        shpsize = imgfile->read_span(span, imgfile->size());
+        shpcopy.assign(span, span + shpsize);
+        shpdata = shpcopy.empty() ? 0 : &shpcopy[0];
+    }
+
+    if (shpsize < 14) {
+        throw ImageNotFound("SHPImage: '" + name + "' is too short to be a SHP file");
+    }
 
     // Header
     header.NumImages = read_word(&shpdata[0], FCNC_LIL_ENDIAN);
     header.Width = read_word(&shpdata[6], FCNC_LIL_ENDIAN);
 
     header.Height = read_word(&shpdata[8], FCNC_LIL_ENDIAN);
+
+    const unsigned int tablesize = 14 + 8 * (header.NumImages + 2);
+    if (header.NumImages == 0 || header.Width == 0 || header.Height == 0
+            || shpsize < tablesize) {
+        throw ImageNotFound("SHPImage: '" + name + "' has an invalid header");
+    }
+
     header.Offset.resize(header.NumImages + 2);
     header.Format.resize(header.NumImages + 2);
     header.RefOffs.resize(header.NumImages + 2);
@@ -236,6 +274,15 @@ SHPImage::SHPImage(const char *fname, char scaleq) : SHPBase(fname, scaleq)
         header.RefFormat[i] = read_byte(&shpdata[j]);
         j += 1;
     }
+
+    for (int i = 0; i < header.NumImages; i++) {
+        if (header.Offset[i] < tablesize || header.Offset[i] > header.Offset[i + 1]) {
+            throw ImageNotFound("SHPImage: '" + name + "' has an invalid frame table");
+        }
+    }
+    if (header.Offset[header.NumImages] > shpsize) {
+        throw ImageNotFound("SHPImage: '" + name + "' is truncated");
+    }
 }
 
 /** Extract a frame from a SHP into two SDL_Surface* (shadow is separate)
@@ -356,53 +403,213 @@ void SHPImage::getImageAsAlpha(unsigned short imgnum, SDL_Surface **img)
 /** Method to decompress a format xx compressed image.
  * @param imgdst The buffer in which to put the image (must contain XOR image).
  * @param imgnum The index of the frame to decompress.
+ * @returns false if the frame is damaged
  */
-void SHPImage::DecodeSprite(unsigned char *imgdst, unsigned short imgnum)
+bool SHPImage::DecodeSprite(unsigned char *imgdst, unsigned short imgnum)
 {
     if (imgnum >= header.NumImages) {
         game.log << "DecodeSprite (" << name << "): Invalid SHP imagenumber (" << imgnum
                  << " >= " << header.NumImages << endl;
         /// @TODO Throw something
-        return;
+        return false;
     }
 
-    unsigned int len;
-    unsigned char* imgsrc;
+    // load has checked that the frame lies inside shpdata
+    const unsigned char* imgsrc = shpdata + header.Offset[imgnum];
+    unsigned int len = header.Offset[imgnum + 1] - header.Offset[imgnum];
+    const unsigned int imgsize = header.Width * header.Height;
     switch (header.Format[imgnum]) {
-        case FORMAT_80:
-            len = header.Offset[imgnum + 1] - header.Offset[imgnum];
-            imgsrc = new unsigned char[len];
-            memcpy(imgsrc, &shpdata[0] + header.Offset[imgnum], len);
-            memset(imgdst, 0, sizeof(imgdst));
-            Compression::decode80(imgsrc, imgdst);
-            break;
+        case FORMAT_80: {
+            int size = Compression::decode80(imgsrc, len, imgdst, imgsize);
+            if (size < 0) {
+                game.log << "DecodeSprite (" << name << "): Frame " << imgnum
+                         << " is corrupt" << endl;
+                return false;
+            }
+            // Short frames leave the rest of the image blank
+            memset(imgdst + size, 0, imgsize - size);
+            return true;
+        }
         case FORMAT_40:{
             unsigned int i;
             for (i = 0; i < header.NumImages; i++ ) {
                 if (header.Offset[i] == header.RefOffs[imgnum])
                     break;
             }
-            DecodeSprite(imgdst, i);
-            len = header.Offset[imgnum + 1] - header.Offset[imgnum];
-            imgsrc = new unsigned char[len];
-            memcpy(imgsrc, &shpdata[header.Offset[imgnum]], len);
-            Compression::decode40(imgsrc, imgdst);
+            if (i == imgnum || !DecodeSprite(imgdst, i)) {
+                return false;
+            }
             break;
         }
         case FORMAT_20:
-            DecodeSprite(imgdst, imgnum - 1);
-            len = header.Offset[imgnum + 1] - header.Offset[imgnum];
-            imgsrc = new unsigned char[len];
-            memcpy(imgsrc, &shpdata[header.Offset[imgnum]], len);
-            Compression::decode40(imgsrc, imgdst);
+            if (!DecodeSprite(imgdst, imgnum - 1)) {
+                return false;
+            }
             break;
         default:
             game.log << "DecodeSprite: Possible memory corruption detected: "
                      << "unknown header format in " << name << " at frame "
                      << imgnum << "/" << header.NumImages << endl;
-            return;
+            return false;
+    }
+
+    // Format 40 and 20 frames are XORed onto the frame they refer to
+    if (Compression::decode40(imgsrc, len, imgdst, imgsize) < 0) {
+        game.log << "DecodeSprite (" << name << "): Frame " << imgnum
+                 << " is corrupt" << endl;
+        return false;
+    }
+    return true;
+}
+
+/** Opens every SHP file in a mix archive.  Mix files only keep hashes of
+ * the names, so anything that parses as a SHP is taken to be one.
+ */
+void SHPImage::loadArchive(const string& mixname, vector<shared_ptr<SHPImage> >& shps)
+{
+    shared_ptr<File> mixfile = game.vfs.open(mixname);
+    if (!mixfile) {
+        game.log << "SHPImage: Archive '" << mixname << "' not found" << endl;
+        return;
+    }
+    // The archive has to be a file on disk to be opened again on its own
+    VFS::MixArchive archive(fs::path(mixfile->archive()) / mixfile->name(), vector<string>());
+    vector<unsigned int> ids = archive.ids();
+    for (vector<unsigned int>::iterator it = ids.begin(); it != ids.end(); ++it) {
+        try {
+            shps.push_back(shared_ptr<SHPImage>(new SHPImage(archive.open(*it), -1)));
+        } catch (ImageNotFound&) {
+            // Not a SHP
+        }
+    }
+}
+
+void SHPImage::benchmark(const string& mixname)
+{
+    vector<shared_ptr<SHPImage> > shps;
+    loadArchive(mixname, shps);
+    if (shps.empty()) {
+        game.log << "SHPImage: No SHP files found in '" << mixname << "'" << endl;
+        return;
+    }
+
+    vector<unsigned char> imgdata;
+    unsigned int frames = 0, failed = 0, passes = 0;
+    unsigned long long bytes = 0;
+    unsigned int start = SDL_GetTicks();
+    unsigned int elapsed;
+    do {
+        for (vector<shared_ptr<SHPImage> >::iterator it = shps.begin(); it != shps.end(); ++it) {
+            SHPImage& shp = **it;
+            imgdata.resize(shp.header.Width * shp.header.Height);
+            for (unsigned short imgnum = 0; imgnum < shp.header.NumImages; ++imgnum) {
+                if (shp.DecodeSprite(&imgdata[0], imgnum)) {
+                    ++frames;
+                    bytes += imgdata.size();
+                } else {
+                    ++failed;
+                }
+            }
+        }
+        ++passes;
+        elapsed = SDL_GetTicks() - start;
+    } while (elapsed < 2000);
+
+    game.log << "SHPImage: Decoded " << frames << " frames from " << shps.size()
+             << " SHP files in " << mixname << " (" << passes << " passes) in "
+             << elapsed << "ms: " << frames * 1000ULL / elapsed << " frames per second, "
+             << bytes * 1000 / elapsed / 1024 << "KB per second, "
+             << failed << " failed" << endl;
+
+    // The format40 and format20 frames on their own, XORed straight onto
+    // whatever is in the buffer since the result doesn't matter here
+    unsigned int deltas = 0;
+    bytes = 0;
+    passes = 0;
+    start = SDL_GetTicks();
+    do {
+        for (vector<shared_ptr<SHPImage> >::iterator it = shps.begin(); it != shps.end(); ++it) {
+            SHPImage& shp = **it;
+            imgdata.resize(shp.header.Width * shp.header.Height);
+            for (unsigned short imgnum = 0; imgnum < shp.header.NumImages; ++imgnum) {
+                if (shp.header.Format[imgnum] == FORMAT_80) {
+                    continue;
+                }
+                unsigned int len = shp.header.Offset[imgnum + 1] - shp.header.Offset[imgnum];
+                if (Compression::decode40(shp.shpdata + shp.header.Offset[imgnum], len,
+                            &imgdata[0], imgdata.size()) >= 0) {
+                    ++deltas;
+                    bytes += imgdata.size();
+                }
+            }
+        }
+        ++passes;
+        elapsed = SDL_GetTicks() - start;
+    } while (deltas > 0 && elapsed < 2000);
+
+    if (deltas > 0) {
+        elapsed = max<unsigned int>(elapsed, 1);
+        game.log << "SHPImage: Applied " << deltas << " delta frames (" << passes
+                 << " passes) in " << elapsed << "ms: " << deltas * 1000ULL / elapsed
+                 << " frames per second, " << bytes * 1000 / elapsed / 1024
+                 << "KB per second" << endl;
     }
-    delete[] imgsrc;
+}
+
+void SHPImage::fuzz(const string& mixname, unsigned int rounds)
+{
+    vector<shared_ptr<SHPImage> > shps;
+    loadArchive(mixname, shps);
+
+    // Written after the end of every output buffer to catch overruns
+    const unsigned int guardsize = 64;
+    const unsigned char guard = 0xa5;
+
+    // Fixed seed so any failure can be reproduced
+    srand(1);
+    unsigned int tried = 0, rejected = 0, overruns = 0;
+    vector<unsigned char> src, out;
+    for (unsigned int round = 0; round < rounds; ++round) {
+        for (vector<shared_ptr<SHPImage> >::iterator it = shps.begin(); it != shps.end(); ++it) {
+            SHPImage& shp = **it;
+            const unsigned int imgsize = shp.header.Width * shp.header.Height;
+            for (unsigned short imgnum = 0; imgnum < shp.header.NumImages; ++imgnum) {
+                unsigned int len = shp.header.Offset[imgnum + 1] - shp.header.Offset[imgnum];
+                if (shp.header.Format[imgnum] != FORMAT_80 || len == 0) {
+                    continue;
+                }
+                const unsigned char* frame = shp.shpdata + shp.header.Offset[imgnum];
+                src.assign(frame, frame + len);
+
+                // Damage a few bytes, and sometimes cut the frame short
+                unsigned int damage = 1 + rand() % 4;
+                for (unsigned int i = 0; i < damage; ++i) {
+                    src[rand() % src.size()] = rand() & 0xff;
+                }
+                if (rand() % 4 == 0) {
+                    src.resize(1 + rand() % src.size());
+                }
+
+                out.assign(imgsize + guardsize, guard);
+                int size = Compression::decode80(&src[0], src.size(), &out[0], imgsize);
+                ++tried;
+                if (size < 0) {
+                    ++rejected;
+                }
+                bool overrun = size > static_cast<int>(imgsize);
+                for (unsigned int i = imgsize; i < out.size(); ++i) {
+                    overrun |= out[i] != guard;
+                }
+                if (overrun) {
+                    ++overruns;
+                    game.log << "SHPImage: Damaged frame " << imgnum << " of " << shp.name
+                             << " in round " << round << " overran its buffer" << endl;
+                }
+            }
+        }
+    }
+    game.log << "SHPImage: Decoded " << tried << " damaged frames from " << shps.size()
+             << " SHP files, " << rejected << " rejected, " << overruns << " overruns" << endl;
 }
 
 //-----------------------------------------------------------------------------
@@ -437,7 +644,12 @@ SDL_Surface *Dune2Image::getImage(unsigned short imgnum)
 
     if (~header.compression & 2) {
         vector<unsigned char> temp_buff(header.size_out);
-        int size = Compression::decode80(&shpdata[startpos], &temp_buff[0]);
+        int size = Compression::decode80(&shpdata[startpos], shpdata.size() - startpos,
+                &temp_buff[0], temp_buff.size());
+        if (size < 0) {
+            game.log << "Dune2Image (" << name << "): Frame " << imgnum << " is corrupt" << endl;
+            size = 0;
+        }
         Compression::decode20(&temp_buff[0], &data[0], size);
     } else {
         Compression::decode20(&shpdata[startpos], &data[0], header.size_out);
@@ -563,19 +775,32 @@ unsigned short TemplateImage::getNumTiles()
 
 SDL_Surface* TemplateImage::getImage(unsigned short imgnum)
 {
-    if (imgnum >= c_tiles)
+    vector<unsigned char> imgdata;
+    if (!readImage(imgnum, imgdata)) {
         return NULL;
+    }
+    return makeImage(imgdata);
+}
+
+bool TemplateImage::readImage(unsigned short imgnum, vector<unsigned char>& imgdata)
+{
+    if (imgnum >= c_tiles)
+        return false;
 
     if (image_index[imgnum] == 0xff)
-        return NULL;
+        return false;
 
     // Seek the start of the image
     datafile->seek_start(img_offset + width * height * image_index[imgnum]);
 
     // allocate space for the imagedata and load it
-    vector<unsigned char> imgdata(width * height);
+    imgdata.resize(width * height);
     datafile->read(imgdata, static_cast<int>(width * height));
+    return true;
+}
 
+SDL_Surface* TemplateImage::makeImage(vector<unsigned char>& imgdata)
+{
     // The image is made up from the data
     SDL_Surface* sdlimage = SDL_CreateRGBSurfaceFrom(&imgdata[0], width, height, 8, width, 0, 0, 0, 0);
 
@@ -5,6 +5,7 @@
 #include "../freecnc.h"
 
 class ImageProc;
+class File;
 
 struct SHPHeader {
     unsigned short  NumImages;
@@ -66,18 +67,39 @@ inline unsigned int SHPBase::getColour(SDL_PixelFormat* fmt, unsigned char palnu
 class SHPImage : SHPBase {
 public:
     SHPImage(const char *fname, char scaleq);
+    SHPImage(shared_ptr<File> file, char scaleq);
     void getImage(unsigned short imgnum, SDL_Surface **img, SDL_Surface **shadow, unsigned char palnum);
     void getImageAsAlpha(unsigned short imgnum, SDL_Surface **img);
     unsigned int getWidth() const { return header.Width; }
     unsigned int getHeight() const { return header.Height; }
     unsigned short getNumImg() const { return header.NumImages; }
 
+    /// Decodes every frame of every SHP in a mix archive over and over for
+    /// a few seconds and logs the throughput, then does the same for just
+    /// the delta frames
+    static void benchmark(const string& mixname);
+    /// Feeds damaged copies of the format80 frames of every SHP in a mix
+    /// archive to the decoder and logs any that got past its bounds checks
+    static void fuzz(const string& mixname, unsigned int rounds);
+
 private:
+    // Non-copyable, shpdata can point into shpcopy
+    SHPImage(const SHPImage&);
+    SHPImage& operator=(const SHPImage&);
+
     static SDL_Color shadowpal[2];
     static SDL_Color alphapal[6];
 
-    void DecodeSprite(unsigned char *imgdst, unsigned short imgnum);
-    vector<unsigned char> shpdata;
+    static void loadArchive(const string& mixname, vector<shared_ptr<SHPImage> >& shps);
+    void load(shared_ptr<File> imgfile);
+    bool DecodeSprite(unsigned char *imgdst, unsigned short imgnum);
+    // Kept only while shpdata points into its archive's mapping, so unmapped
+    // files don't hold a descriptor open for every cached SHP
+    shared_ptr<File> shpfile;
+    vector<unsigned char> shpcopy;
+    // The whole file, in shpfile's mapping or in shpcopy
+    const unsigned char* shpdata;
+    unsigned int shpsize;
     SHPHeader header;
 };
 
@@ -100,14 +122,18 @@ private:
 // TemplateImage
 //-----------------------------------------------------------------------------
 
-class File;
-
 class TemplateImage : SHPBase
 {
 public:
     TemplateImage(const char *fname, char scaleq, bool ratemp = false);
     unsigned short getNumTiles();
     SDL_Surface* getImage(unsigned short imgnum);
+    /// Reads the pixels of a tile
+    /// @returns false if the template doesn't have that tile
+    bool readImage(unsigned short imgnum, vector<unsigned char>& imgdata);
+    /// Makes the pixels from readImage into a surface.  This doesn't touch
+    /// the file, so tiles can be made on several threads at once.
+    SDL_Surface* makeImage(vector<unsigned char>& imgdata);
 private:
     bool ratemp;
     unsigned int c_tiles, width, height, img_offset;
@@ -14,7 +14,7 @@
 #include "../lib/fcncendian.h"
 
 using std::distance;
-using std::advance;
+using std::copy;
 
 namespace VQAPriv
 {
@@ -40,15 +40,107 @@ namespace VQAPriv
     const unsigned int vqa_vqfl_id = 0x4C465156;
     const unsigned int vqa_vqfr_id = 0x52465156;
 
-    unsigned int get_chunklen(shared_ptr<File>& file)
+    // XCC uses this size value for its buffers
+    const unsigned int lookup_size = 0x1fff << 4;
+
+    // FrameInfo::palette for frames with no palette before them
+    const unsigned int no_frame = 0xffffffff;
+
+    // How many decoded frames the decoder may get ahead of the display
+    const unsigned int ring_size = 8;
+
+    // Room for several seconds of decoded audio
+    const unsigned int sndbuf_size = 4 * SOUND_MAX_UNCOMPRESSED_SIZE;
+
+    /// Handles pending events
+    /// @returns whether escape was pressed
+    bool escape_pressed()
     {
-        vector<unsigned char> data(4);
-        file->read(data, 4);
-        return read_dword(&data[0], FCNC_BIG_ENDIAN);
+        SDL_Event event;
+        bool pressed = false;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_KEYDOWN && event.key.state == SDL_PRESSED
+                    && event.key.keysym.sym == SDLK_ESCAPE) {
+                pressed = true;
+            }
+        }
+        return pressed;
     }
 
-    // XCC uses this size value for its buffers
-    const unsigned int lookup_size = 0x1fff << 4;
+    /** Expands BW x BH blocks, writing every pixel XS times across and
+     * every row YS times down.  Keeping the geometry constant lets each
+     * block be a handful of fixed size copies.
+     */
+    template<unsigned int BW, unsigned int BH, unsigned int XS, unsigned int YS>
+    void expand_blocks(const unsigned char* vpt, unsigned int lowoffset,
+            const unsigned char* codebook, unsigned int cbsize, unsigned char modifier,
+            unsigned char* out, unsigned int pitch, unsigned int width, unsigned int height)
+    {
+        const unsigned int entry = BW * BH;
+        const unsigned char* hivals = vpt + lowoffset;
+        const unsigned int blocksx = width / BW;
+        const unsigned int blocksy = height / BH;
+        for (unsigned int by = 0; by < blocksy; ++by) {
+            unsigned char* blockrow = out + by * BH * YS * pitch;
+            for (unsigned int bx = 0; bx < blocksx; ++bx) {
+                unsigned char lo = *vpt++;
+                unsigned char hi = *hivals++;
+                unsigned char* dst = blockrow + bx * BW * XS;
+                unsigned int v = ((hi << 8) | lo) * entry;
+                // Out of range entries only come from broken files, fill
+                // those like solid blocks rather than read past the codebook
+                if (hi == modifier || v + entry > cbsize) {
+                    for (unsigned int row = 0; row < BH * YS; ++row) {
+                        memset(dst + row * pitch, lo, BW * XS);
+                    }
+                    continue;
+                }
+                const unsigned char* src = codebook + v;
+                for (unsigned int row = 0; row < BH; ++row, src += BW) {
+                    unsigned char* d = dst + row * YS * pitch;
+                    if (XS == 1) {
+                        memcpy(d, src, BW);
+                    } else {
+                        for (unsigned int x = 0; x < BW; ++x) {
+                            d[2*x] = d[2*x+1] = src[x];
+                        }
+                    }
+                    if (YS == 2) {
+                        memcpy(d + pitch, d, BW * XS);
+                    }
+                }
+            }
+        }
+    }
+
+    enum ExpandMode {EXPAND_NATIVE, EXPAND_DOUBLE, EXPAND_INTERLACE};
+
+    template<unsigned int BW, unsigned int BH>
+    ExpandFunc expander_for(ExpandMode mode)
+    {
+        switch (mode) {
+        case EXPAND_DOUBLE:
+            return expand_blocks<BW, BH, 2, 2>;
+        case EXPAND_INTERLACE:
+            // Only the even rows are written, the odd ones stay black
+            return expand_blocks<BW, BH, 2, 1>;
+        default:
+            return expand_blocks<BW, BH, 1, 1>;
+        }
+    }
+
+    /// @returns the expander for the block size, or 0 if it isn't supported
+    ExpandFunc get_expander(unsigned char blockw, unsigned char blockh, ExpandMode mode)
+    {
+        if (blockw == 4 && blockh == 2) {
+            return expander_for<4, 2>(mode);
+        } else if (blockw == 4 && blockh == 4) {
+            return expander_for<4, 4>(mode);
+        } else if (blockw == 2 && blockh == 2) {
+            return expander_for<2, 2>(mode);
+        }
+        return 0;
+    }
 }
 
 using namespace VQAPriv;
@@ -67,7 +159,7 @@ using namespace VQAPriv;
 /**
  * @param the name of the vqamovie.
  */
-VQAMovie::VQAMovie(const string& filename) : CBF_LookUp(lookup_size), CBP_LookUp(lookup_size), CBPOffset(0), CBPChunks(0)
+VQAMovie::VQAMovie(const string& filename) : CBF_LookUp(lookup_size), CBP_LookUp(lookup_size), CBPOffset(0), CBPChunks(0), stopdecoding(false)
 {
     if (filename.empty()) {
         throw VQAError("VQA: Empty filename");
@@ -77,6 +169,9 @@ VQAMovie::VQAMovie(const string& filename) : CBF_LookUp(lookup_size), CBP_LookUp
     if (!vqafile) {
         throw VQAError("VQA: Unable to open '" + filename + "'.VQA");
     }
+    mapped = vqafile->map();
+    filesize = vqafile->size();
+    filepos = 0;
 
     if (!DecodeFORMChunk()) {
         throw VQAError("VQA: (" + filename + ")Corrupt Header: Invalid FORM chunk");
@@ -90,6 +185,10 @@ VQAMovie::VQAMovie(const string& filename) : CBF_LookUp(lookup_size), CBP_LookUp
 
     VPT_Table.resize(lowoffset<<1);
 
+    BuildFrameIndex();
+    startframe = 0;
+    seekpalettevalid = false;
+
     scaleVideo = game.config.scale_movies;
     videoScaleQuality = game.config.scaler_quality;
 
@@ -97,20 +196,25 @@ VQAMovie::VQAMovie(const string& filename) : CBF_LookUp(lookup_size), CBP_LookUp
         throw VQAError("Could not build SDL_BuildAudioCVT filter");
     }
 
-    empty = SDL_CreateSemaphore(0);
-    full = SDL_CreateSemaphore(1);
+    ring.resize(ring_size);
+    expander = 0;
+    directscale = false;
+    outwidth = outheight = outpitch = 0;
+    freeslots = NULL;
+    readyslots = NULL;
+
     sndBufLock = SDL_CreateMutex();
 
-    sndbuf.resize(2 * SOUND_MAX_UNCOMPRESSED_SIZE);
-    sndbufMaxEnd = sndbuf.size();
-    sndbufStart  = 0;
-    sndbufEnd    = 0;
+    sndbuf.resize(sndbuf_size);
+    sndscratch.resize(SOUND_MAX_UNCOMPRESSED_SIZE);
+    sndbufStart = 0;
+    sndbufFill  = 0;
+    // VQA audio is always decoded to 16 bit samples
+    bytespersec = header.Freq * header.Channels * 2;
 }
 
 VQAMovie::~VQAMovie()
 {
-    SDL_DestroySemaphore(empty);
-    SDL_DestroySemaphore(full);
     SDL_DestroyMutex(sndBufLock);
 }
 
@@ -123,16 +227,30 @@ void VQAMovie::AudioHook(void* udata, unsigned char* stream, int len)
     // makes our audio bigger
     len = len / vqa->cvt.len_mult;
 
-    // While the buffer isn't filled, wait
     SDL_LockMutex(vqa->sndBufLock);
-    while ((vqa->sndbufEnd - vqa->sndbufStart) < static_cast<size_t>(len)) {
-        SDL_UnlockMutex(vqa->sndBufLock);
-        SDL_SemWait(vqa->empty);
-        SDL_LockMutex(vqa->sndBufLock);
+
+    // Copy our buffered data into the stream, wrapping around the end of
+    // the buffer
+    size_t avail = min(static_cast<size_t>(len), vqa->sndbufFill);
+    size_t first = min(avail, vqa->sndbuf.size() - vqa->sndbufStart);
+    memcpy(stream, &vqa->sndbuf[vqa->sndbufStart], first);
+    memcpy(stream + first, &vqa->sndbuf[0], avail - first);
+    vqa->sndbufStart = (vqa->sndbufStart + avail) % vqa->sndbuf.size();
+    vqa->sndbufFill -= avail;
+
+    if (avail < static_cast<size_t>(len)) {
+        // Never wait for the decoder here, play silence instead
+        memset(stream + avail, 0, len - avail);
+        if (!vqa->decodedone) {
+            ++vqa->underruns;
+        }
     }
 
-    // Copy our buffered data into the stream
-    memcpy(stream, &vqa->sndbuf[vqa->sndbufStart], len);
+    vqa->audioplayed += avail;
+    vqa->audiolast = avail;
+    vqa->audioticks = SDL_GetTicks();
+
+    SDL_UnlockMutex(vqa->sndBufLock);
 
     // Convert the audio to the format we like
     vqa->cvt.buf = stream;
@@ -140,143 +258,545 @@ void VQAMovie::AudioHook(void* udata, unsigned char* stream, int len)
 
     if (SDL_ConvertAudio(&vqa->cvt) < 0) {
         game.log << "Could not run conversion filter: " << SDL_GetError() << endl;
-        return;
     }
+}
 
-    // Move the start up
-    vqa->sndbufStart += len;
-
-    // If we are too near the end, move back some
-    if ((vqa->sndbufEnd + SOUND_MAX_UNCOMPRESSED_SIZE) >= vqa->sndbufMaxEnd) {
-
-        int len = (int)(vqa->sndbufEnd - vqa->sndbufStart);
-
-        // Move remaining data down
-        memmove(&vqa->sndbuf[0], &vqa->sndbuf[vqa->sndbufStart], len);
+/** Appends the decoded SND chunk in sndscratch to the audio buffer, waiting
+ * for AudioHook to make room if needed.
+ */
+void VQAMovie::QueueAudio(unsigned int len)
+{
+    if (!hassound || len == 0) {
+        return;
+    }
+    SDL_LockMutex(sndBufLock);
+    while (sndbuf.size() - sndbufFill < len) {
+        SDL_UnlockMutex(sndBufLock);
+        if (stopdecoding.load(boost::memory_order_acquire)) {
+            return;
+        }
+        SDL_Delay(5);
+        SDL_LockMutex(sndBufLock);
+    }
+    size_t end = (sndbufStart + sndbufFill) % sndbuf.size();
+    size_t first = min(static_cast<size_t>(len), sndbuf.size() - end);
+    memcpy(&sndbuf[end], &sndscratch[0], first);
+    memcpy(&sndbuf[0], &sndscratch[first], len - first);
+    sndbufFill += len;
+    SDL_UnlockMutex(sndBufLock);
+}
 
-        // Reset the start & ends
-        vqa->sndbufStart = 0;
-        vqa->sndbufEnd   = len;
+/** @returns how far into the movie playback is, in milliseconds.  This
+ * follows the audio when there is any, so the picture can't drift from it.
+ */
+unsigned int VQAMovie::GetClock()
+{
+    if (!hassound) {
+        return SDL_GetTicks() - starttick;
     }
+    SDL_LockMutex(sndBufLock);
+    unsigned int played = audioplayed;
+    unsigned int last = audiolast;
+    unsigned int since = SDL_GetTicks() - audioticks;
+    bool exhausted = decodedone && sndbufFill == 0;
+    SDL_UnlockMutex(sndBufLock);
+
+    // SDL was only just given the last block, so the clock is somewhere
+    // inside it.  Split the division to stay clear of overflow.
+    played -= last;
+    unsigned int ms = (played / bytespersec) * 1000 + (played % bytespersec) * 1000 / bytespersec;
+    unsigned int lastms = last * 1000 / bytespersec;
+    if (!exhausted) {
+        // Don't run ahead of audio that hasn't been played yet
+        since = min(since, lastms);
+    }
+    return ms + since;
+}
 
-    SDL_SemPost(vqa->full);
+/// Fills the frame ring until the movie ends or stopdecoding is set
+int VQAMovie::DecoderThread(void* inst)
+{
+    VQAMovie* vqa = (VQAMovie*)inst;
+
+    if (vqa->startframe == 0) {
+        try {
+            // The first SND chunk is played ahead of the first frame
+            vqa->QueueAudio(vqa->DecodeSNDChunk(&vqa->sndscratch[0]));
+        } catch (VQAError& e) {
+            game.log << e.what() << endl;
+        }
+    }
 
+    for (unsigned int framenum = vqa->startframe; framenum < vqa->header.NumFrames; ++framenum) {
+        SDL_SemWait(vqa->freeslots);
+        if (vqa->stopdecoding.load(boost::memory_order_acquire)) {
+            break;
+        }
+        Frame& frame = vqa->ring[framenum % vqa->ring.size()];
+        try {
+            vqa->QueueAudio(vqa->DecodeSNDChunk(&vqa->sndscratch[0]));
+            frame.valid = vqa->DecodeVQFRChunk(frame);
+        } catch (VQAError& e) {
+            game.log << e.what() << endl;
+            frame.valid = false;
+        }
+        SDL_SemPost(vqa->readyslots);
+        if (!frame.valid) {
+            game.log << "VQA: Decoding VQFR Chunk failed at frame " << framenum << endl;
+            break;
+        }
+    }
+    SDL_LockMutex(vqa->sndBufLock);
+    vqa->decodedone = true;
     SDL_UnlockMutex(vqa->sndBufLock);
+    return 0;
+}
+
+/** Picks the block expander and sizes the frame ring for the current
+ * screen.  Nearest and interlaced scaling to twice the movie width are done
+ * by the expander itself, which saves ImageProc a pass over every frame.
+ */
+void VQAMovie::SetupOutput()
+{
+    ExpandMode mode = EXPAND_NATIVE;
+    SDL_Surface* screen = SDL_GetVideoSurface();
+    if (scaleVideo && screen != NULL && screen->w == 2 * header.Width) {
+        if (videoScaleQuality == 0) {
+            mode = EXPAND_DOUBLE;
+        } else if (videoScaleQuality == -1) {
+            mode = EXPAND_INTERLACE;
+        }
+    }
+    directscale = (mode != EXPAND_NATIVE);
+    outwidth = header.Width * (directscale ? 2 : 1);
+    outheight = header.Height * (directscale ? 2 : 1);
+    outpitch = (mode == EXPAND_INTERLACE) ? outwidth * 2 : outwidth;
+    expander = get_expander(header.BlockW, header.BlockH, mode);
+    for (vector<Frame>::iterator it = ring.begin(); it != ring.end(); ++it) {
+        it->pixels.assign(outwidth * outheight, 0);
+    }
 }
 
-/// Play the vqamovie
-void VQAMovie::play()
+/** Play the vqamovie.
+ *
+ * Starting part way through only replays the codebook and palette chunks
+ * that the start frame needs, see BuildFrameIndex.
+ *
+ * A decoder thread keeps up to ring_size frames ready while this thread
+ * shows each one when the audio reaches it.  Frames that are already late
+ * when they arrive are skipped rather than holding everything up.
+ */
+void VQAMovie::play(unsigned int startframe)
 {
     if (vqafile == 0)
         return;
 
-    if (pc::sfxeng->NoSound()) {
-        return;
-    }
     SDL_Surface *frame, *cframe;
-    SDL_Rect dest;
-    SDL_Event esc_event;
     static ImageProc scaler;
 
-    dest.w = header.Width  << 1;
-    dest.h = header.Height << 1;
-    dest.x = (pc::gfxeng->getWidth() -  (header.Width  << 1)) >> 1;
-    dest.y = (pc::gfxeng->getHeight() - (header.Height << 1)) >> 1;
-
     pc::gfxeng->clearScreen();
 
-    // Seek to first frame/snd information of vqa
-    vqafile->seek_start(offsets[0]);
+    if (startframe >= header.NumFrames) {
+        return;
+    }
+    try {
+        SeekFrame(startframe);
+    } catch (VQAError& e) {
+        game.log << e.what() << endl;
+        return;
+    }
 
     sndindex = 0;
     sndsample = 0;
+    sndbufStart = 0;
+    sndbufFill = 0;
+    audioplayed = 0;
+    audiolast = 0;
+    audioticks = 0;
+    underruns = 0;
+    hassound = (header.Flags & 1) && !pc::sfxeng->NoSound();
+    stopdecoding.store(false, boost::memory_order_release);
+    decodedone = false;
+
+    SetupOutput();
+
+    freeslots = SDL_CreateSemaphore(ring.size());
+    readyslots = SDL_CreateSemaphore(0);
 
     // create the frame to store the image in. 
-    frame = SDL_CreateRGBSurface(SDL_SWSURFACE, header.Width, header.Height, 8, 0, 0, 0, 0);
+    frame = SDL_CreateRGBSurface(SDL_SWSURFACE, outwidth, outheight, 8, 0, 0, 0, 0);
+    if (seekpalettevalid) {
+        SDL_SetColors(frame, seekpalette, 0, header.Colors);
+    }
 
     // Initialise the scaler 
-    if (scaleVideo)
+    if (scaleVideo && !directscale)
         scaler.initVideoScale(frame, videoScaleQuality);
 
-    unsigned int jumplen;
-    unsigned int sndlen = DecodeSNDChunk(&sndbuf[sndbufEnd]);
-    sndbufEnd += sndlen;
+    SDL_Thread* decoder = SDL_CreateThread(DecoderThread, this);
+    if (decoder == NULL) {
+        game.log << "VQA: Unable to start decoder thread: " << SDL_GetError() << endl;
+    } else {
+        starttick = SDL_GetTicks();
 
-    // The jump len is how far ahead we are allowed to be
-    jumplen = sndlen;
+        // Start music (aka the sound)
+        if (hassound) {
+            pc::sfxeng->SetMusicHook(AudioHook, this);
+        }
 
-    // Start music (aka the sound)
-    pc::sfxeng->SetMusicHook(AudioHook, this);
-    for (unsigned int framenum = 0; framenum < header.NumFrames; ++framenum) {
-        SDL_LockMutex(sndBufLock);
+        const unsigned int framerate = max<unsigned int>(header.FrameRate, 1);
+        unsigned int shown = 0, dropped = 0;
+        bool quit = false;
+        for (unsigned int framenum = startframe; framenum < header.NumFrames; ++framenum) {
+            // Keep handling events while the decoder catches up
+            while (!quit && SDL_SemWaitTimeout(readyslots, 10) == SDL_MUTEX_TIMEDOUT) {
+                quit = escape_pressed();
+            }
+            if (quit) {
+                break;
+            }
+
+            Frame& cur = ring[framenum % ring.size()];
+            if (!cur.valid) {
+                break;
+            }
+            // Always take the palette, even from frames that get dropped
+            if (cur.newpalette) {
+                SDL_SetColors(frame, cur.palette, 0, header.Colors);
+            }
+
+            unsigned int due = (framenum - startframe) * 1000 / framerate;
+            if (GetClock() >= due + 1000 / framerate && framenum + 1 < header.NumFrames) {
+                // Already time for the next one
+                ++dropped;
+                SDL_SemPost(freeslots);
+                continue;
+            }
+
+            unsigned char* dst = static_cast<unsigned char*>(frame->pixels);
+            for (unsigned int y = 0; y < outheight; ++y) {
+                memcpy(dst + y * frame->pitch, &cur.pixels[y * outwidth], outwidth);
+            }
+            SDL_SemPost(freeslots);
 
-        // Decode SND Chunk first 
-        sndlen = DecodeSNDChunk(&sndbuf[sndbufEnd]);
-        sndbufEnd += sndlen;
+            unsigned int now = GetClock();
+            while (!quit && now < due) {
+                SDL_Delay(min(due - now, 10u));
+                quit = escape_pressed();
+                now = GetClock();
+            }
+            if (quit) {
+                break;
+            }
 
-        // Signal we have more audio data
-        SDL_SemPost(empty);
+            if (scaleVideo && !directscale) {
+                cframe = scaler.scaleVideo(frame);
+                pc::gfxeng->drawVQAFrame(cframe);
+            } else {
+                pc::gfxeng->drawVQAFrame(frame);
+            }
+            ++shown;
 
-        // Wait until the buffer has been emptied again
-        while ((sndbufEnd - sndbufStart) >= (size_t)(jumplen - (2 * sndlen))) {
-            SDL_UnlockMutex(sndBufLock);
-            SDL_SemWait(full);
-            SDL_LockMutex(sndBufLock);
+            if (escape_pressed()) {
+                break;
+            }
         }
 
-        SDL_UnlockMutex(sndBufLock);
+        stopdecoding.store(true, boost::memory_order_release);
+        SDL_SemPost(freeslots);
+        SDL_WaitThread(decoder, NULL);
+
+        if (hassound) {
+            pc::sfxeng->SetMusicHook(0, 0);
+        }
+
+        if (game.config.debug) {
+            game.log << "VQA: Showed " << shown << " of " << header.NumFrames - startframe << " frames, dropped "
+                     << dropped << ", " << underruns << " audio underruns" << endl;
+        }
+    }
+
+    SDL_DestroySemaphore(freeslots);
+    SDL_DestroySemaphore(readyslots);
+    freeslots = NULL;
+    readyslots = NULL;
+
+    SDL_FreeSurface(frame);
+    if (scaleVideo && !directscale) {
+        scaler.closeVideoScale();
+    }
+}
+
+void VQAMovie::benchmark()
+{
+    if (vqafile == 0 || header.NumFrames == 0)
+        return;
 
+    SeekFrame(0);
+    SetupOutput();
+
+    Frame& frame = ring[0];
+    unsigned int start = SDL_GetTicks();
+
+    DecodeSNDChunk(&sndscratch[0]);
+    unsigned int framenum;
+    for (framenum = 0; framenum < header.NumFrames; ++framenum) {
+        DecodeSNDChunk(&sndscratch[0]);
         if (!DecodeVQFRChunk(frame)) {
             game.log << "VQA: Decoding VQFR Chunk failed at frame " << framenum << endl;
             break;
         }
+    }
 
-        if (scaleVideo) {
-            cframe = scaler.scaleVideo(frame);
-            pc::gfxeng->drawVQAFrame(cframe);
-        } else {
-            pc::gfxeng->drawVQAFrame(frame);
+    unsigned int elapsed = max<unsigned int>(SDL_GetTicks() - start, 1);
+    game.log << "VQA: Decoded " << framenum << " frames in " << elapsed << "ms ("
+             << framenum * 1000 / elapsed << " frames per second)" << endl;
+}
+
+unsigned int VQAMovie::getKeyFrame(unsigned int framenum) const
+{
+    if (framenum >= frameindex.size()) {
+        return 0;
+    }
+    return frameindex[framenum].keyframe;
+}
+
+/** @returns len bytes from the current position.  Unless the file is
+ * mapped, the data is only valid until the next read.
+ */
+const unsigned char* VQAMovie::ReadBytes(unsigned int len)
+{
+    static const unsigned char nothing = 0;
+    if (len > filesize - filepos) {
+        throw VQAError("VQA: Chunk runs past the end of " + vqafile->name());
+    }
+    if (len == 0) {
+        return &nothing;
+    }
+    const unsigned char* data;
+    if (mapped != 0) {
+        data = mapped + filepos;
+    } else {
+        if (vqafile->read(chunkbuf, static_cast<int>(len)) != static_cast<int>(len)) {
+            throw VQAError("VQA: Short read from " + vqafile->name());
+        }
+        data = &chunkbuf[0];
+    }
+    filepos += len;
+    return data;
+}
+
+unsigned int VQAMovie::ReadChunkID()
+{
+    return read_dword(ReadBytes(4), FCNC_LIL_ENDIAN);
+}
+
+unsigned int VQAMovie::ReadChunkLen()
+{
+    return read_dword(ReadBytes(4), FCNC_BIG_ENDIAN);
+}
+
+void VQAMovie::SeekTo(unsigned int pos)
+{
+    if (pos > filesize) {
+        throw VQAError("VQA: Seek past the end of " + vqafile->name());
+    }
+    filepos = pos;
+    if (mapped == 0) {
+        vqafile->seek_start(pos);
+    }
+}
+
+/// Chunks start on even offsets
+void VQAMovie::AlignChunk()
+{
+    if (filepos & 1) {
+        SeekTo(filepos + 1);
+    }
+}
+
+/// Skips the chunks before the next VQFR chunk and reads its header
+bool VQAMovie::FindVQFRChunk()
+{
+    while (filepos + 8 <= filesize) {
+        AlignChunk();
+        unsigned int chunkid = ReadChunkID();
+        unsigned int chunklen = ReadChunkLen();
+        if (chunkid == vqa_vqfr_id) {
+            return true;
         }
+        SeekTo(filepos + chunklen);
+    }
+    return false;
+}
 
-        while (SDL_PollEvent(&esc_event)) {
-            if (esc_event.type == SDL_KEYDOWN) {
-                if (esc_event.key.state != SDL_PRESSED) {
+/** Works out what each frame needs from the frames before it.
+ *
+ * Frames only depend on earlier ones through the codebook and the palette.
+ * The codebook is replaced outright by a CBF chunk, or at the end of the
+ * frame that brings the CBP parts up to eight, so replaying the codebook
+ * chunks from the frame that started that is enough.  Only chunk headers are
+ * read here.
+ */
+void VQAMovie::BuildFrameIndex()
+{
+    frameindex.clear();
+    frameindex.reserve(header.NumFrames);
+    unsigned int fullstart = 0;  // Replaying from here rebuilds the codebook
+    unsigned int groupstart = 0; // Frame with the first of the pending CBP parts
+    unsigned int cbpchunks = 0;
+    unsigned int palette = no_frame;
+    try {
+        for (unsigned int framenum = 0; framenum < header.NumFrames; ++framenum) {
+            FrameInfo info;
+            info.keyframe = cbpchunks > 0 ? min(fullstart, groupstart) : fullstart;
+            info.palette = palette;
+
+            SeekTo(offsets[framenum]);
+            if (!FindVQFRChunk()) {
+                throw VQAError("VQA: No VQFR chunk for frame");
+            }
+            bool done = false, fullcodebook = false;
+            while (!done) {
+                AlignChunk();
+                unsigned int chunkid = ReadChunkID() & vqa_t_mask;
+                unsigned int chunklen = ReadChunkLen();
+                switch (chunkid) {
+                case vqa_cbf_id:
+                    fullstart = framenum;
+                    fullcodebook = true;
                     break;
-                }
-                if (esc_event.key.keysym.sym == SDLK_ESCAPE) {
-                    framenum = header.NumFrames; // Jump to end of video
+                case vqa_cbp_id:
+                    if (cbpchunks == 0) {
+                        groupstart = framenum;
+                    }
+                    ++cbpchunks;
+                    break;
+                case vqa_cpl_id:
+                    palette = framenum;
+                    break;
+                case vqa_vpt_id:
+                    done = true;
                     break;
                 }
+                SeekTo(filepos + chunklen);
+            }
+            // A CBF comes before the frame's VPT, so the frame needs nothing
+            // from before it but any CBP parts still pending
+            if (fullcodebook) {
+                info.keyframe = cbpchunks > 0 ? min(fullstart, groupstart) : fullstart;
+            }
+            if (cbpchunks & ~7) {
+                fullstart = groupstart;
+                cbpchunks = 0;
             }
+            frameindex.push_back(info);
         }
+    } catch (VQAError& e) {
+        // Still playable from the start, up to the damage
+        game.log << e.what() << ": only indexed " << frameindex.size() << " of "
+                 << header.NumFrames << " frames" << endl;
     }
+}
 
-    pc::sfxeng->SetMusicHook(0, 0);
+/** Gets the codebook and palette into the state framenum needs and moves to
+ * its chunks.
+ */
+void VQAMovie::SeekFrame(unsigned int framenum)
+{
+    if (framenum >= header.NumFrames || (framenum > 0 && framenum >= frameindex.size())) {
+        throw VQAError("VQA: Unable to seek to frame in " + vqafile->name());
+    }
+    CBPOffset = 0;
+    CBPChunks = 0;
+    sndindex = 0;
+    sndsample = 0;
+    seekpalettevalid = false;
+    if (framenum > 0) {
+        const FrameInfo& info = frameindex[framenum];
+        if (info.palette != no_frame && info.palette < info.keyframe) {
+            seekpalettevalid = ReplayFrame(info.palette, false);
+        }
+        for (unsigned int i = info.keyframe; i < framenum; ++i) {
+            if (ReplayFrame(i, true)) {
+                seekpalettevalid = true;
+            }
+        }
+    }
+    startframe = framenum;
+    SeekTo(offsets[framenum]);
+}
 
-    SDL_FreeSurface(frame);
-    if (scaleVideo) {
-        scaler.closeVideoScale();
+/** Applies a frame's palette, and optionally its codebook chunks, without
+ * expanding any blocks.
+ * @returns whether the frame had a palette, which is left in seekpalette
+ */
+bool VQAMovie::ReplayFrame(unsigned int framenum, bool codebook)
+{
+    SeekTo(offsets[framenum]);
+    if (!FindVQFRChunk()) {
+        throw VQAError("VQA: No VQFR chunk for frame in " + vqafile->name());
+    }
+    bool newpalette = false, compressed_cbp = false, done = false;
+    while (!done) {
+        AlignChunk();
+        unsigned int chunkid = ReadChunkID();
+        bool compressed = VQA_HI_BYTE(chunkid) == 'Z';
+        chunkid = chunkid & vqa_t_mask;
+        if (chunkid == vqa_cpl_id) {
+            DecodeCPLChunk(seekpalette);
+            newpalette = true;
+        } else if (codebook && chunkid == vqa_cbf_id) {
+            DecodeCBFChunk(compressed);
+        } else if (codebook && chunkid == vqa_cbp_id) {
+            compressed_cbp = compressed;
+            DecodeCBPChunk();
+        } else {
+            done = chunkid == vqa_vpt_id;
+            unsigned int chunklen = ReadChunkLen();
+            SeekTo(filepos + chunklen);
+        }
+    }
+    if (codebook) {
+        UpdateCodebook(compressed_cbp);
+    }
+    return newpalette;
+}
+
+/// Swaps in the new codebook once all of its CBP parts have arrived
+void VQAMovie::UpdateCodebook(bool compressed_cbp)
+{
+    if (CBPChunks & ~7) {
+        if (compressed_cbp) {
+            unsigned char CBPUNZ[lookup_size];
+            int size = Compression::decode80(&CBP_LookUp[0], CBPOffset, CBPUNZ, lookup_size);
+            if (size < 0) {
+                throw VQAError("VQA: Corrupt CBP chunks in " + vqafile->name());
+            }
+            memcpy(&CBF_LookUp[0], CBPUNZ, size);
+        } else {
+            memcpy(&CBF_LookUp[0], &CBP_LookUp[0], lookup_size);
+        }
+        CBPOffset = 0;
+        CBPChunks = 0;
     }
 }
 
 bool VQAMovie::DecodeFORMChunk()
 {
     // Four bytes for FORM and four bytes for the chunk length
-    int total_size = header_size + 8;
-    vector<unsigned char> data(total_size);
-    vqafile->read(data, total_size);
+    const unsigned char* it = ReadBytes(header_size + 8);
 
-    if (data[0] != 'F' || data[1] != 'O' || data[2] != 'R' || data[3] != 'M') {
+    if (it[0] != 'F' || it[1] != 'O' || it[2] != 'R' || it[3] != 'M') {
         game.log << "VQA: Malformed header in FORM chunk" << endl;
         return false;
     }
 
-    vector<unsigned char>::iterator it = data.begin();
     // skip FORM and chunklen
-    advance(it, 8);
+    it += 8;
 
     copy(it, it+8, header.Signature);
-    advance(it, 8);
+    it += 8;
     header.RStartPos = read_dword(it, FCNC_BIG_ENDIAN);
     header.Version   = read_word(it, FCNC_LIL_ENDIAN);
     header.Flags     = read_word(it, FCNC_LIL_ENDIAN);
@@ -307,6 +827,11 @@ bool VQAMovie::DecodeFORMChunk()
         game.log << "VQA: Unsupported version: Expected 2, got " << header.Version << endl;
         return false;
     }
+    if (get_expander(header.BlockW, header.BlockH, EXPAND_NATIVE) == 0) {
+        game.log << "VQA: Unsupported block size " << (int)header.BlockW << "x"
+                 << (int)header.BlockH << endl;
+        return false;
+    }
     // Set some constants based on the header
     lowoffset = (header.Width/header.BlockW)*(header.Height/header.BlockH);
     modifier = header.BlockH == 2 ? 0x0f : 0xff;
@@ -315,16 +840,14 @@ bool VQAMovie::DecodeFORMChunk()
 
 bool VQAMovie::DecodeFINFChunk()
 {
-    vector<unsigned char> data(4);
-
-    vqafile->read(data, 4);
+    const unsigned char* data = ReadBytes(4);
 
     if (data[0] != 'F' || data[1] != 'I' || data[2] != 'N' || data[3] != 'F') {
         game.log << "VQA: Malformed header in FINF chunk" << endl;
         return false;
     }
 
-    unsigned int chunklen = get_chunklen(vqafile);
+    unsigned int chunklen = ReadChunkLen();
 
     if (static_cast<unsigned int>(header.NumFrames << 2) != chunklen) {
         game.log << "VQA: Invalid chunk length (" << (header.NumFrames << 2) 
@@ -332,10 +855,7 @@ bool VQAMovie::DecodeFINFChunk()
         return false;
     }
 
-    data.resize(header.NumFrames * 4);
-    vqafile->read(data, header.NumFrames * 4);
-
-    vector<unsigned char>::iterator data_it = data.begin();
+    const unsigned char* data_it = ReadBytes(header.NumFrames * 4);
     vector<unsigned int>::iterator off_it = offsets.begin();
     for (unsigned int framenum = 0; framenum < header.NumFrames; ++framenum, ++off_it) {
         unsigned int value = read_dword(data_it, FCNC_LIL_ENDIAN);
@@ -357,16 +877,9 @@ unsigned int VQAMovie::DecodeSNDChunk(unsigned char *outbuf)
     }
 
     // seek to correct offset
-    if (vqafile->pos() & 1) {
-        vqafile->seek_cur(1);
-    }
+    AlignChunk();
 
-    unsigned int chunkid;
-    {
-        vector<unsigned char> data(4);
-        vqafile->read(data, 4);
-        chunkid = read_dword(&data[0], FCNC_LIL_ENDIAN);
-    }
+    unsigned int chunkid = ReadChunkID();
 
     if ((chunkid & vqa_t_mask) != vqa_snd_id) {
         game.log << "VQA: Decoding SND chunk - Expected 0x"
@@ -375,15 +888,13 @@ unsigned int VQAMovie::DecodeSNDChunk(unsigned char *outbuf)
         return 0; // Returning zero here, to set length of sound chunk to zero
     }
 
-    int chunklen = get_chunklen(vqafile);
-
-    SampleBuffer inbuf(chunklen);
+    unsigned int chunklen = ReadChunkLen();
 
-    vqafile->read(inbuf, chunklen);
+    const unsigned char* inbuf = ReadBytes(chunklen);
 
     switch (VQA_HI_BYTE(chunkid)) {
     case '0': // Raw uncompressed wave data 
-        memcpy(outbuf, &inbuf[0], chunklen);
+        memcpy(outbuf, inbuf, chunklen);
         break;
     case '1': // Westwoods own algorithm
         // TODO: Add support for this algorithm
@@ -392,7 +903,7 @@ unsigned int VQAMovie::DecodeSNDChunk(unsigned char *outbuf)
         chunklen = 0;
         break;
     case '2': // IMA ADPCM algorithm 
-        Sound::IMADecode(outbuf, inbuf.begin(), chunklen, sndsample, sndindex);
+        Sound::IMADecode(outbuf, inbuf, chunklen, sndsample, sndindex);
         chunklen <<= 2; // IMA ADPCM decompresses sound to a size 4 times larger than the compressed size 
         break;
     default:
@@ -405,23 +916,19 @@ unsigned int VQAMovie::DecodeSNDChunk(unsigned char *outbuf)
 }
 
 /** Decodes VQFR Chunk into one frame(?)
- * @param pointer to decoded frame
- * @param Current Frame to decode
+ * @param where to put the decoded pixels and any new palette
  */
-bool VQAMovie::DecodeVQFRChunk(SDL_Surface *frame)
+bool VQAMovie::DecodeVQFRChunk(Frame& frame)
 {
     bool compressed_cbp, compressed;
-    SDL_Color CPL[256];
 
-    if (vqafile->pos() & 1) {
-        vqafile->seek_cur(1);
-    }
+    frame.newpalette = false;
+
+    AlignChunk();
 
-    unsigned int chunkid;
-    vector<unsigned char> id_data(8);
-    vqafile->read(id_data, 8);
-    chunkid = read_dword(&id_data[0], FCNC_LIL_ENDIAN);
-    // ignore chunklen in last four bytes
+    unsigned int chunkid = ReadChunkID();
+    // ignore chunklen
+    ReadChunkLen();
 
     if (chunkid != vqa_vqfr_id) {
         game.log << "VQA: Decoding VQFR chunk - Expected 0x"
@@ -435,18 +942,15 @@ bool VQAMovie::DecodeVQFRChunk(SDL_Surface *frame)
     bool done = false;
     // Read chunks until we get to the VPT chunk
     while (!done) {
-        if (vqafile->pos() & 1) {
-            vqafile->seek_cur(1);
-        }
+        AlignChunk();
 
-        vqafile->read(id_data, 4);
-        chunkid = read_dword(&id_data[0], FCNC_LIL_ENDIAN);
+        chunkid = ReadChunkID();
         compressed = VQA_HI_BYTE(chunkid) == 'Z';
         chunkid = chunkid & vqa_t_mask;
         switch (chunkid) {
         case vqa_cpl_id:
-            DecodeCPLChunk(CPL);
-            SDL_SetColors(frame, CPL, 0, header.Colors);
+            DecodeCPLChunk(frame.palette);
+            frame.newpalette = true;
             break;
         case vqa_cbf_id:
             DecodeCBFChunk(compressed);
@@ -465,84 +969,58 @@ bool VQAMovie::DecodeVQFRChunk(SDL_Surface *frame)
         }
     }
 
-    // Optimise me harder
-    unsigned char* cpixel = static_cast<unsigned char*>(frame->pixels);
-    vector<unsigned char>::const_iterator fpixel = VPT_Table.begin();
-    for (unsigned short by = 0; by < header.Height; by += header.BlockH) {
-        for (unsigned short bx = 0; bx < header.Width; bx += header.BlockW) {
-            unsigned char LoVal = *fpixel;
-            unsigned char HiVal = *(fpixel + lowoffset);
+    expander(&VPT_Table[0], lowoffset, &CBF_LookUp[0], CBF_LookUp.size(), modifier,
+            &frame.pixels[0], outpitch, header.Width, header.Height);
 
-            if (HiVal == modifier) {
-                memset(cpixel, LoVal, header.BlockW);
-                memset(cpixel + header.Width, LoVal, header.BlockW);
-            } else {
-                unsigned int v1 = ((HiVal << 8) | LoVal) << 3;
-                memcpy(cpixel, &CBF_LookUp[v1], header.BlockW);
-                memcpy(cpixel + header.Width, &CBF_LookUp[v1+4], header.BlockW);
-            }
-            cpixel += header.BlockW;
-            ++fpixel;
-        }
-        cpixel += header.Width;
-    }
-
-    if (CBPChunks & ~7) {
-        if (compressed_cbp) {
-            unsigned char CBPUNZ[lookup_size];
-            Compression::decode80(&CBP_LookUp[0], CBPUNZ);
-            memcpy(&CBF_LookUp[0], CBPUNZ, lookup_size);
-        } else {
-            memcpy(&CBF_LookUp[0], &CBP_LookUp[0], lookup_size);
-        }
-        CBPOffset = 0;
-        CBPChunks = 0;
-    }
+    UpdateCodebook(compressed_cbp);
     return true;
 }
 
 inline void VQAMovie::DecodeCBPChunk()
 {
-    int chunklen = get_chunklen(vqafile);
+    unsigned int chunklen = ReadChunkLen();
 
-    vector<unsigned char> chunk(chunklen);
-    vqafile->read(chunk, chunklen);
-    copy(chunk.begin(), chunk.end(), CBP_LookUp.begin() + CBPOffset);
+    if (chunklen > CBP_LookUp.size() - CBPOffset) {
+        throw VQAError("VQA: CBP chunks overrun the codebook in " + vqafile->name());
+    }
+    memcpy(&CBP_LookUp[CBPOffset], ReadBytes(chunklen), chunklen);
     CBPOffset += chunklen;
     ++CBPChunks;
 }
 
 inline void VQAMovie::DecodeVPTChunk(bool compressed)
 {
-    int chunklen = get_chunklen(vqafile);
+    unsigned int chunklen = ReadChunkLen();
+    const unsigned char* data = ReadBytes(chunklen);
 
     if (compressed) {
-        vector<unsigned char> VPTZ(chunklen); // Compressed VPT_Table
-        vqafile->read(VPTZ, chunklen);
-        Compression::decode80(&VPTZ[0], &VPT_Table[0]);
+        if (Compression::decode80(data, chunklen, &VPT_Table[0], VPT_Table.size()) < 0) {
+            throw VQAError("VQA: Corrupt VPT chunk in " + vqafile->name());
+        }
     } else { // uncompressed VPT chunk. never found any.. but might be some
-        vqafile->read(VPT_Table, chunklen);
+        memcpy(&VPT_Table[0], data, min<size_t>(chunklen, VPT_Table.size()));
     }
 }
 
 inline void VQAMovie::DecodeCBFChunk(bool compressed)
 {
-    int chunklen = get_chunklen(vqafile);
+    unsigned int chunklen = ReadChunkLen();
+    const unsigned char* data = ReadBytes(chunklen);
 
-    vector<unsigned char> temp(chunklen);
-    vqafile->read(temp, chunklen);
     if (compressed) {
-        Compression::decode80(&temp[0], &CBF_LookUp[0]);
+        if (Compression::decode80(data, chunklen, &CBF_LookUp[0], CBF_LookUp.size()) < 0) {
+            throw VQAError("VQA: Corrupt CBF chunk in " + vqafile->name());
+        }
     } else {
-        copy(temp.begin(), temp.end(), CBF_LookUp.begin());
+        memcpy(&CBF_LookUp[0], data, min<size_t>(chunklen, CBF_LookUp.size()));
     }
 }
 
 inline void VQAMovie::DecodeCPLChunk(SDL_Color *palette)
 {
-    int chunklen = get_chunklen(vqafile);
+    unsigned int chunklen = ReadChunkLen();
 
-    int expected_size = header.Colors * 3;
+    unsigned int expected_size = header.Colors * 3;
 
     if (chunklen != expected_size) {
         game.log << "VQA: Malformed CPL header (got: " << chunklen
@@ -550,8 +1028,7 @@ inline void VQAMovie::DecodeCPLChunk(SDL_Color *palette)
         throw VQAError("asdf");
     }
 
-    vector<unsigned char> data(expected_size);
-    vqafile->read(data, expected_size);
+    const unsigned char* data = ReadBytes(expected_size);
     for (int i = 0; i < header.Colors; i++) {
         palette[i].r = data[3 * i]     << 2;
         palette[i].g = data[3 * i + 1] << 2;
@@ -561,10 +1038,10 @@ inline void VQAMovie::DecodeCPLChunk(SDL_Color *palette)
 
 inline void VQAMovie::DecodeUnknownChunk()
 {
-    int chunklen = get_chunklen(vqafile);
+    unsigned int chunklen = ReadChunkLen();
 
-    game.log << "VQA: Skipping unknown chunk at " << std::hex << vqafile->pos() << " for "
+    game.log << "VQA: Skipping unknown chunk at " << std::hex << filepos << " for "
              << std::dec << chunklen << " bytes." << endl;
 
-    vqafile->seek_cur(chunklen);
+    SeekTo(filepos + chunklen);
 }
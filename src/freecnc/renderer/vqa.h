@@ -1,6 +1,7 @@
 #ifndef _RENDERER_VQA_H
 #define _RENDERER_VQA_H
 
+#include <boost/atomic.hpp>
 #include <boost/noncopyable.hpp>
 #include "SDL.h"
 #include "../freecnc.h"
@@ -35,6 +36,11 @@ namespace VQAPriv
         unsigned char Bits;  // 8 or 16 bit sound
         unsigned char Unknown3[14];
     };
+
+    /// Expands the blocks of one frame from the VPT table and the codebook
+    typedef void (*ExpandFunc)(const unsigned char* vpt, unsigned int lowoffset,
+            const unsigned char* codebook, unsigned int cbsize, unsigned char modifier,
+            unsigned char* out, unsigned int pitch, unsigned int width, unsigned int height);
 }
 
 struct VQAError : public std::runtime_error
@@ -47,20 +53,60 @@ class VQAMovie : boost::noncopyable
 public:
     VQAMovie(const string& filename);
     ~VQAMovie();
-    void play();
+    /// Plays the movie from startframe to the end
+    void play(unsigned int startframe = 0);
+    /// Decodes every frame as fast as possible without showing anything
+    /// and logs the frame rate
+    void benchmark();
+
+    unsigned int getNumFrames() const {return header.NumFrames;}
+    /// @returns the first frame whose codebook has to be loaded to show
+    /// framenum, which is framenum itself if it carries a full codebook and
+    /// no CBP parts are pending from earlier frames
+    unsigned int getKeyFrame(unsigned int framenum) const;
 private:
     VQAMovie();
 
+    /// A decoded frame waiting to be shown
+    struct Frame {
+        vector<unsigned char> pixels;
+        SDL_Color palette[256];
+        bool newpalette;
+        bool valid;
+    };
+
+    /// What has to be replayed to show a frame without decoding the ones
+    /// before it
+    struct FrameInfo {
+        unsigned int keyframe; // First frame whose codebook chunks are needed
+        unsigned int palette;  // Last earlier frame with a palette, or no_frame
+    };
+
+    void SetupOutput();
+    const unsigned char* ReadBytes(unsigned int len);
+    unsigned int ReadChunkID();
+    unsigned int ReadChunkLen();
+    void SeekTo(unsigned int pos);
+    void AlignChunk();
+    bool FindVQFRChunk();
+    void BuildFrameIndex();
+    void SeekFrame(unsigned int framenum);
+    bool ReplayFrame(unsigned int framenum, bool codebook);
+    void UpdateCodebook(bool compressed_cbp);
+
     bool DecodeFORMChunk();
     bool DecodeFINFChunk();
     unsigned int DecodeSNDChunk(unsigned char* outbuf);
-    bool DecodeVQFRChunk(SDL_Surface* frame);
+    bool DecodeVQFRChunk(Frame& frame);
     inline void DecodeCBPChunk();
     inline void DecodeVPTChunk(bool compressed);
     inline void DecodeCBFChunk(bool compressed);
     inline void DecodeCPLChunk(SDL_Color* palette);
     inline void DecodeUnknownChunk();
 
+    static int DecoderThread(void* inst);
+    void QueueAudio(unsigned int len);
+    unsigned int GetClock();
     static void AudioHook(void* userdata, unsigned char* stream, int len);
 
     // VQA Video Related Variables 
@@ -72,8 +118,19 @@ private:
     shared_ptr<File> vqafile;
     VQAPriv::VQAHeader header;
 
+    // Chunks are used straight from the file's mapping when the archive
+    // supports it, otherwise they are read into chunkbuf
+    const unsigned char* mapped;
+    unsigned int filesize, filepos;
+    vector<unsigned char> chunkbuf;
+
     vector<unsigned char> VPT_Table;
     vector<unsigned int> offsets;
+    vector<FrameInfo> frameindex;
+    unsigned int startframe;
+    // Palette in effect at startframe, from an earlier frame
+    SDL_Color seekpalette[256];
+    bool seekpalettevalid;
     unsigned char modifier;
     unsigned int lowoffset;
 
@@ -83,16 +140,38 @@ private:
 
     int scaleVideo, videoScaleQuality;
 
-    // Buffer to hold ~15 audio frames 
-    SampleBuffer sndbuf; // The whole buffer
-    size_t sndbufMaxEnd; // The max end of the malloced size of the buffer
-    size_t sndbufStart; // The current start into the buffer
-    size_t sndbufEnd; // The current end in the buffer
-
-    // Semaphores to allow sync 
-    SDL_sem* empty;
-    SDL_sem* full;
-    SDL_mutex* sndBufLock;
+    // Frames are expanded straight to screen size when that is a plain
+    // doubling, otherwise at movie size and scaled by ImageProc
+    VQAPriv::ExpandFunc expander;
+    bool directscale;
+    unsigned int outwidth, outheight, outpitch;
+
+    // Decoded frames, filled by the decoder thread and emptied in order by
+    // play.  freeslots counts the entries the decoder may fill and
+    // readyslots the ones waiting to be shown.
+    vector<Frame> ring;
+    SDL_sem* freeslots;
+    SDL_sem* readyslots;
+    // Stored with release and loaded with acquire, like the music flags in
+    // SoundEngine
+    boost::atomic<bool> stopdecoding;
+
+    // Decoded audio waiting for AudioHook, used as a ring buffer.
+    // AudioHook never waits for the decoder: if it runs dry it plays
+    // silence and counts an underrun.
+    SampleBuffer sndbuf;
+    SampleBuffer sndscratch; // The SND chunk being decoded
+    size_t sndbufStart; // Where AudioHook reads from next
+    size_t sndbufFill; // Bytes waiting to be played
+    bool decodedone; // Set by the decoder thread once it has finished
+    SDL_mutex* sndBufLock; // Guards the above
+
+    // The audio clock: how much audio has been handed to SDL, and when
+    bool hassound;
+    unsigned int bytespersec;
+    unsigned int audioplayed, audiolast, audioticks;
+    unsigned int underruns;
+    unsigned int starttick;
 
     // Used to convert VQA audio to correct format 
     SDL_AudioCVT cvt;
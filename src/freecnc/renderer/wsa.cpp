@@ -38,11 +38,9 @@ WSA::WSA(const string& fname)
         throw WSAError("WSA: wsa.ini not found");
     }
 
-    // FIXME: readString is going away later on
-    char* tmp = wsa_ini->readString(fname.c_str(), "sound");
-    if (tmp != NULL) {
-        sndfile = tmp;
-        delete[] tmp;
+    INIString sound = wsa_ini->readValue(fname.c_str(), "sound");
+    if (sound.valid()) {
+        sndfile = sound.str();
     }
 
     vector<unsigned char>::iterator it(wsadata.begin());
@@ -88,8 +86,10 @@ SDL_Surface* WSA::decode_frame(unsigned short framenum)
     vector<unsigned char> image80(len_frame);
     memcpy(&image80[0], &wsadata[offsets[framenum]], len_frame);
 
-    Compression::decode80(&image80[0], &temp_buff[0]);
-    Compression::decode40(&temp_buff[0], &framedata[0]);
+    int size = Compression::decode80(&image80[0], len_frame, &temp_buff[0], temp_buff.size());
+    if (size < 0 || Compression::decode40(&temp_buff[0], size, &framedata[0], framedata.size()) < 0) {
+        game.log << "WSA: Frame " << framenum << " is corrupt" << endl;
+    }
 
     SDL_Surface* tempframe = SDL_CreateRGBSurfaceFrom(&framedata[0], width, height, 8, width, 0, 0, 0, 0);
     SDL_SetColors(tempframe, palette, 0, 256);
@@ -1,6 +1,7 @@
 #include <cassert>
 #include <algorithm>
 #include <functional>
+#include <sstream>
 
 #include "SDL_mixer.h"
 
@@ -27,14 +28,32 @@ namespace
     };
 
     SoundFile soundDecoder;
-    SoundFile musicDecoder;
+    // The music thread can't use game.log, so musicDecoder and DecodeMusic
+    // report here and flushMusicLog passes it on once the thread has stopped
+    std::ostringstream musicLog;
+    SoundFile musicDecoder(musicLog);
+
+    void flushMusicLog()
+    {
+        if (!musicLog.str().empty()) {
+            game.log << musicLog.str();
+            musicLog.str("");
+        }
+    }
+
+    // About a second and a half of decoded music
+    const unsigned int music_ring_size = SOUND_MAX_UNCOMPRESSED_SIZE * 4;
+    // Less room than this isn't worth waking up to decode into
+    const unsigned int music_decode_min = SOUND_MAX_CHUNK_SIZE;
 }
 
 //-----------------------------------------------------------------------------
 // Constructor / Destructor
 //-----------------------------------------------------------------------------
 
-SoundEngine::SoundEngine(bool disableSound) : nosound(disableSound), musicFinished(true), currentTrack(playlist.begin())
+SoundEngine::SoundEngine(bool disableSound) : soundBytes(0), nosound(disableSound), musicThread(0),
+    musicRing(music_ring_size), stopMusicThread(false), musicDecoded(true), musicFinished(true),
+    musicCallbacks(0), musicUnderruns(0), currentTrack(playlist.begin())
 {
     // There's some serious weirdness going on with the chunklen parameter:
     // 1024 causes deadlock for the briefing for SCG12EA on zx64's system
@@ -52,13 +71,20 @@ SoundEngine::SoundEngine(bool disableSound) : nosound(disableSound), musicFinish
 
 SoundEngine::~SoundEngine()
 {
-    if (nosound)
-        return;
+    if (!nosound) {
+        // Stop all playback
+        Mix_HaltChannel(-1);
+        StopMusic();
+    }
 
-    // Stop all playback
-    Mix_HaltChannel(-1);
-    Mix_HookMusic(NULL, NULL);
-    Mix_CloseAudio();
+    for_each(soundCache.begin(), soundCache.end(), SoundCacheCleaner());
+    for (vector<Preload>::iterator it = preloads.begin(); it != preloads.end(); ++it) {
+        delete it->buffer;
+    }
+
+    if (!nosound) {
+        Mix_CloseAudio();
+    }
 }
 
 //-----------------------------------------------------------------------------
@@ -92,6 +118,13 @@ int SoundEngine::PlayLoopedSound(const std::string& sound, unsigned int loops)
 
     int channel = Mix_PlayChannel(-1, snd->chunk, static_cast<int>(loops)-1);
     //Mix_Volume(channel, soundVolume);
+    if (channel >= 0) {
+        // Keeps the sound in the cache until the channel has finished
+        if (static_cast<unsigned int>(channel) >= channelSounds.size()) {
+            channelSounds.resize(channel + 1, 0);
+        }
+        channelSounds[channel] = snd;
+    }
     return channel;
 }
 
@@ -153,8 +186,20 @@ void SoundEngine::StopMusic()
     if (nosound)
         return;
 
+    // Once this returns MusicHook can't be running
     Mix_HookMusic(NULL, NULL);
+    if (musicThread != 0) {
+        stopMusicThread.store(true, boost::memory_order_release);
+        SDL_WaitThread(musicThread, NULL);
+        musicThread = 0;
+        if (game.config.debug) {
+            game.log << "Sound: Played " << musicCallbacks << " blocks of \"" << musicTrack
+                     << "\", " << musicUnderruns << " underruns" << endl;
+        }
+    }
+    musicFinished.store(true, boost::memory_order_release);
     musicDecoder.Close();
+    flushMusicLog();
 }
 
 void SoundEngine::PlayTrack(const std::string& sound)
@@ -169,10 +214,30 @@ void SoundEngine::PlayTrack(const std::string& sound)
         return;
     }
 
-    if (musicDecoder.Open(sound)) {
-        musicFinished = false;
-        Mix_HookMusic(MusicHook, reinterpret_cast<void*>(&musicFinished));
+    if (!musicDecoder.Open(sound)) {
+        flushMusicLog();
+        return;
     }
+    musicTrack = sound;
+    musicRing.reset();
+    musicCallbacks = 0;
+    musicUnderruns = 0;
+    stopMusicThread.store(false, boost::memory_order_release);
+    musicDecoded.store(false, boost::memory_order_release);
+    musicFinished.store(false, boost::memory_order_release);
+
+    // Fill the ring before the first callback so the start doesn't count
+    // as an underrun
+    if (DecodeMusic()) {
+        musicThread = SDL_CreateThread(MusicThread, this);
+        if (musicThread == 0) {
+            game.log << "Sound: Unable to start music decoder thread: " << SDL_GetError() << endl;
+            musicDecoder.Close();
+            flushMusicLog();
+            return;
+        }
+    }
+    Mix_HookMusic(MusicHook, this);
 }
 
 void SoundEngine::NextTrack()
@@ -199,24 +264,69 @@ void SoundEngine::PrevTrack()
 
 void SoundEngine::MusicHook(void* userdata, unsigned char* stream, int len)
 {
-    bool* musicFinished = reinterpret_cast<bool*>(userdata);
-    if (!*musicFinished) {
-        SampleBuffer buffer;
-        unsigned int ret = musicDecoder.Decode(buffer, len);
-        if (ret == SOUND_DECODE_COMPLETED) {
-            musicDecoder.Close();
-            *musicFinished = true;
-        } else if (ret == SOUND_DECODE_ERROR) {
-            game.log << "Sound: Error during music decoding, stopping playback of current track." << endl;
-            *musicFinished = true;
-            return;
+    SoundEngine* engine = reinterpret_cast<SoundEngine*>(userdata);
+    if (engine->musicFinished.load(boost::memory_order_acquire)) {
+        return;
+    }
+    // Checked before taking from the ring, so it can't miss audio the
+    // decoder pushed just before finishing
+    bool decoded = engine->musicDecoded.load(boost::memory_order_acquire);
+    size_t got = engine->musicRing.pop(stream, len);
+    ++engine->musicCallbacks;
+    if (got < static_cast<size_t>(len)) {
+        // Never wait for the decoder here, play silence instead
+        memset(stream + got, 0, len - got);
+        if (decoded) {
+            engine->musicFinished.store(true, boost::memory_order_release);
+        } else {
+            ++engine->musicUnderruns;
         }
-        memcpy(stream, &buffer[0], buffer.size());
     }
 }
 
+/** Decodes as much of the current track as there is room for in musicRing.
+ * Only called by the music thread once it is running.
+ * @returns false once the whole track is in musicRing, or decoding failed
+ */
+bool SoundEngine::DecodeMusic()
+{
+    SampleBuffer& buffer = musicScratch;
+    size_t room = musicRing.write_available();
+    if (room < music_decode_min) {
+        return true;
+    }
+    buffer.clear();
+    unsigned int ret = musicDecoder.Decode(buffer, static_cast<unsigned int>(room));
+    if (!buffer.empty()) {
+        musicRing.push(&buffer[0], buffer.size());
+    }
+    if (ret == SOUND_DECODE_STREAMING && buffer.empty() && room == music_ring_size) {
+        musicLog << "Sound: \"" << musicTrack << "\" has a sample too large to stream" << endl;
+        ret = SOUND_DECODE_ERROR;
+    }
+    if (ret == SOUND_DECODE_ERROR) {
+        musicLog << "Sound: Error during music decoding, stopping playback of current track." << endl;
+    }
+    if (ret != SOUND_DECODE_STREAMING) {
+        musicDecoded.store(true, boost::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+int SoundEngine::MusicThread(void* inst)
+{
+    SoundEngine* engine = reinterpret_cast<SoundEngine*>(inst);
+    while (!engine->stopMusicThread.load(boost::memory_order_acquire) && engine->DecodeMusic()) {
+        // The ring holds over a second, so there's no hurry to top it up
+        SDL_Delay(10);
+    }
+    return 0;
+}
+
 void SoundEngine::SetMusicHook(MixFunc mixfunc, void* arg)
 {
+    StopMusic();
     Mix_HookMusic(mixfunc, arg);
 }
 
@@ -236,14 +346,14 @@ SoundBuffer* SoundEngine::LoadSoundImpl(const std::string& sound)
     // Check if sound is already loaded and cached
     SoundCache::iterator cachedSound = soundCache.find(sound);
     if (cachedSound != soundCache.end()) {
-       buffer = cachedSound->second;
+        buffer = cachedSound->second;
+        soundLRU.splice(soundLRU.end(), soundLRU, buffer->lru);
     } else {
         // Load and cache sound
         if (soundDecoder.Open(sound)) {
             buffer = new SoundBuffer();       
-            if (soundDecoder.Decode(buffer->data) == SOUND_DECODE_COMPLETED) {
-                buffer->chunk = Mix_QuickLoad_RAW(&buffer->data[0], static_cast<unsigned int>(buffer->data.size()));
-                soundCache.insert(SoundCache::value_type(sound, buffer));
+            if (soundDecoder.Decode(buffer->data) == SOUND_DECODE_COMPLETED && !buffer->data.empty()) {
+                CacheSound(sound, buffer);
             } else {
                 delete buffer;
                 buffer = 0;
@@ -253,3 +363,161 @@ SoundBuffer* SoundEngine::LoadSoundImpl(const std::string& sound)
     }
     return buffer;
 }
+
+/// @returns the most the sound cache should hold, in bytes
+size_t SoundEngine::CacheBudget() const
+{
+    return static_cast<size_t>(max(game.config.sound_cache, 0)) * 1024;
+}
+
+/** Adds a decoded sound to the cache as the most recently played, then
+ * throws out the least recently played sounds until the cache is back
+ * under budget.  Sounds still playing are kept, as is the new one, so the
+ * cache can run over budget for a while.
+ */
+void SoundEngine::CacheSound(const std::string& sound, SoundBuffer* buffer)
+{
+    buffer->chunk = Mix_QuickLoad_RAW(&buffer->data[0], static_cast<unsigned int>(buffer->data.size()));
+    buffer->lru = soundLRU.insert(soundLRU.end(), sound);
+    soundCache.insert(SoundCache::value_type(sound, buffer));
+    soundBytes += buffer->data.size();
+
+    const size_t budget = CacheBudget();
+    std::list<string>::iterator it = soundLRU.begin();
+    while (soundBytes > budget && it != buffer->lru) {
+        SoundCache::iterator victim = soundCache.find(*it);
+        SoundBuffer* old = victim->second;
+        if (IsPlaying(old)) {
+            ++it;
+            continue;
+        }
+        soundBytes -= old->data.size();
+        FreeSound(old);
+        soundCache.erase(victim);
+        it = soundLRU.erase(it);
+    }
+}
+
+bool SoundEngine::IsPlaying(const SoundBuffer* buffer) const
+{
+    for (unsigned int i = 0; i < channelSounds.size(); ++i) {
+        if (channelSounds[i] == buffer && Mix_Playing(i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SoundEngine::FreeSound(SoundBuffer* buffer)
+{
+    std::replace(channelSounds.begin(), channelSounds.end(), buffer, static_cast<SoundBuffer*>(0));
+    Mix_FreeChunk(buffer->chunk);
+    delete buffer;
+}
+
+void SoundEngine::PreloadSound(const std::string& sound)
+{
+    if (nosound)
+        return;
+
+    preloadNames.push_back(sound);
+}
+
+void SoundEngine::FindPreloads()
+{
+    // Left over from a map that failed to load
+    for (vector<Preload>::iterator it = preloads.begin(); it != preloads.end(); ++it) {
+        delete it->buffer;
+    }
+    preloads.clear();
+
+    // Talkbacks share a lot of their sounds
+    std::sort(preloadNames.begin(), preloadNames.end());
+    preloadNames.erase(std::unique(preloadNames.begin(), preloadNames.end()), preloadNames.end());
+
+    for (vector<string>::const_iterator it = preloadNames.begin(); it != preloadNames.end(); ++it) {
+        if (soundCache.find(*it) != soundCache.end()) {
+            continue;
+        }
+        Preload preload;
+        preload.name = *it;
+        preload.buffer = 0;
+        preloads.push_back(preload);
+    }
+    preloadNames.clear();
+}
+
+/** Opens the files of one batch of the sounds found by FindPreloads.  The
+ * VFS isn't thread safe, so this has to be done on the main thread, and
+ * DecodePreloads closes each file once it has decoded it.
+ * @param batch which batch to open, out of batches
+ */
+void SoundEngine::OpenPreloads(unsigned int batch, unsigned int batches)
+{
+    const vector<Preload>::size_type first = preloads.size() * batch / batches;
+    const vector<Preload>::size_type last = preloads.size() * (batch + 1) / batches;
+    for (vector<Preload>::size_type i = first; i < last; ++i) {
+        preloads[i].file = game.vfs.open(preloads[i].name);
+        if (!preloads[i].file) {
+            game.log << "Sound: Could not open file \"" << preloads[i].name << "\"." << endl;
+        }
+    }
+}
+
+void SoundEngine::DecodePreloads(unsigned int batch, unsigned int batches,
+        unsigned int part, unsigned int parts, std::ostream& log)
+{
+    SoundFile decoder(log);
+    const vector<Preload>::size_type first = preloads.size() * batch / batches;
+    const vector<Preload>::size_type last = preloads.size() * (batch + 1) / batches;
+    for (vector<Preload>::size_type i = first + part; i < last; i += parts) {
+        Preload& preload = preloads[i];
+        if (!preload.file) {
+            continue;
+        }
+        if (decoder.Open(preload.name, preload.file)) {
+            SoundBuffer* buffer = new SoundBuffer();
+            if (decoder.Decode(buffer->data) == SOUND_DECODE_COMPLETED && !buffer->data.empty()) {
+                preload.buffer = buffer;
+            } else {
+                delete buffer;
+            }
+            decoder.Close();
+        }
+        preload.file.reset();
+    }
+}
+
+/** Caches the decoded sounds.  Once the cache is full the rest are thrown
+ * away rather than pushing out the sounds cached before them, which may
+ * well be ones played more often.
+ */
+void SoundEngine::CachePreloads()
+{
+    const size_t budget = CacheBudget();
+    unsigned int cached = 0, skipped = 0;
+    size_t bytes = 0;
+    for (vector<Preload>::iterator it = preloads.begin(); it != preloads.end(); ++it) {
+        if (it->buffer == 0) {
+            continue;
+        }
+        if (soundCache.find(it->name) != soundCache.end()) {
+            // Played while it was being decoded
+            delete it->buffer;
+        } else if (skipped > 0 || soundBytes + it->buffer->data.size() > budget) {
+            ++skipped;
+            delete it->buffer;
+        } else {
+            ++cached;
+            bytes += it->buffer->data.size();
+            CacheSound(it->name, it->buffer);
+        }
+        it->buffer = 0;
+    }
+    preloads.clear();
+    game.log << "Sound: Preloaded " << cached << " sounds (" << bytes / 1024 << "KB), "
+             << soundCache.size() << " sounds (" << soundBytes / 1024 << "KB) cached" << endl;
+    if (skipped > 0) {
+        game.log << "Sound: The cache is full, " << skipped << " sounds will load when first played" << endl;
+    }
+}
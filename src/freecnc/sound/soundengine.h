@@ -1,16 +1,23 @@
 #ifndef _SOUND_SOUNDENGINE_H
 #define _SOUND_SOUNDENGINE_H
 
+#include <list>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
 #include "../freecnc.h"
 #include "soundcommon.h"
 
 #include "SDL_mixer.h"
+#include "SDL_thread.h"
 
 namespace Sound
 {
     struct SoundBuffer {
         SampleBuffer data;
         Mix_Chunk* chunk;
+        /// Where the sound is in the least recently played list
+        std::list<string>::iterator lru;
     };
     typedef map<string, SoundBuffer*> SoundCache; // Make this use shared_ptr
 }
@@ -23,6 +30,19 @@ public:
 
     void LoadSound(const std::string& sound);
 
+    /// Queues a sound to be decoded by the preload steps of the next map
+    /// load, so it doesn't hitch the first time it plays
+    void PreloadSound(const std::string& sound);
+    /// Map loading steps for the queued sounds.  FindPreloads, OpenPreloads
+    /// and CachePreloads run on the main thread.  The sounds are opened and
+    /// decoded a batch at a time, so only one batch's files are open at
+    /// once; DecodePreloads can run on any thread after its batch is opened.
+    void FindPreloads();
+    void OpenPreloads(unsigned int batch, unsigned int batches);
+    void DecodePreloads(unsigned int batch, unsigned int batches,
+            unsigned int part, unsigned int parts, std::ostream& log);
+    void CachePreloads();
+
     // Game sounds
     void SetSoundVolume(unsigned int volume);
     void PlaySound(const std::string& sound);
@@ -43,6 +63,7 @@ public:
     static void MusicHook(void* userdata, unsigned char* stream, int len);
 
     typedef void (*MixFunc)(void*, unsigned char*, int);
+    /// Stops the music and plays from mixfunc instead
     void SetMusicHook(MixFunc mixfunc, void *arg);
 
     bool NoSound() const { return nosound; }
@@ -50,16 +71,51 @@ public:
 private:
     typedef std::vector<std::string> Playlist;
 
+    // Decoded sounds, limited to sound_cache kilobytes by throwing out the
+    // least recently played ones that aren't playing
     Sound::SoundCache soundCache;
+    std::list<string> soundLRU;
+    size_t soundBytes;
+    /// The sound last started on each channel
+    vector<Sound::SoundBuffer*> channelSounds;
+
+    struct Preload {
+        string name;
+        shared_ptr<File> file; // Only while its batch is being decoded
+        Sound::SoundBuffer* buffer;
+    };
+    vector<string> preloadNames;
+    vector<Preload> preloads;
 
     bool nosound;
-    bool musicFinished;
     unsigned int soundVolume;
 
+    // Music is decoded ahead by musicThread into musicRing, so MusicHook,
+    // which runs in the audio callback, only ever copies from it and never
+    // waits on the disk or the decoder
+    static int MusicThread(void* inst);
+    bool DecodeMusic();
+
+    SDL_Thread* musicThread;
+    boost::lockfree::spsc_queue<unsigned char> musicRing;
+    SampleBuffer musicScratch; // Kept so decoding doesn't allocate
+    // Stored with release and loaded with acquire, so whatever was written
+    // before a flag was set is seen by the thread that sees it set
+    boost::atomic<bool> stopMusicThread;
+    boost::atomic<bool> musicDecoded; // Everything left of the track is in musicRing
+    boost::atomic<bool> musicFinished;
+    string musicTrack;
+    // Only touched by MusicHook while the track plays
+    unsigned int musicCallbacks, musicUnderruns;
+
     Playlist playlist;
     Playlist::iterator currentTrack;
 
     Sound::SoundBuffer *LoadSoundImpl(const std::string &sound);
+    size_t CacheBudget() const;
+    void CacheSound(const std::string& sound, Sound::SoundBuffer* buffer);
+    bool IsPlaying(const Sound::SoundBuffer* buffer) const;
+    void FreeSound(Sound::SoundBuffer* buffer);
 };
 
 #endif
@@ -50,7 +50,7 @@ namespace Sound
         return Clip<OutputType, InputType>(value, std::numeric_limits<OutputType>::min(), std::numeric_limits<OutputType>::max());
     }
 
-    void IMADecode(unsigned char *output, SampleIterator input, unsigned short compressed_size, int& sample, int& index)
+    void IMADecode(unsigned char *output, const unsigned char* input, unsigned short compressed_size, int& sample, int& index)
     {
         if (compressed_size==0)
             return;
@@ -185,21 +185,19 @@ namespace
     SDL_AudioCVT monoconv;
     SDL_AudioCVT eightbitconv;
     bool initconv = false;
-
-    SampleBuffer chunk(SOUND_MAX_CHUNK_SIZE);
-    unsigned char tmpbuff[SOUND_MAX_UNCOMPRESSED_SIZE * 4];
 }
 
-SoundFile::SoundFile() : fileOpened(false)
+SoundFile::SoundFile(std::ostream& log) : log(log), fileOpened(false), chunk(SOUND_MAX_CHUNK_SIZE),
+    tmpbuff(SOUND_MAX_UNCOMPRESSED_SIZE * 4), conv(new SDL_AudioCVT)
 {
     if (!initconv) {
         if (SDL_BuildAudioCVT(&eightbitconv, AUDIO_U8, 1, 22050, SOUND_FORMAT, SOUND_CHANNELS, SOUND_FREQUENCY) < 0) {
-            game.log << "Could not build 8bit->16bit conversion filter" << endl;
+            log << "Could not build 8bit->16bit conversion filter" << endl;
             return;
         }
 
         if (SDL_BuildAudioCVT(&monoconv, AUDIO_S16SYS, 1, 22050, SOUND_FORMAT, SOUND_CHANNELS, SOUND_FREQUENCY) < 0) {
-            game.log << "Could not build mono->stereo conversion filter" << endl;
+            log << "Could not build mono->stereo conversion filter" << endl;
             return;
         }
         initconv = true;
@@ -213,17 +211,23 @@ SoundFile::~SoundFile()
 
 bool SoundFile::Open(const std::string& filename)
 {
-    Close();
-    
     // Open file
-    file = game.vfs.open(filename);
-    if (!file) {
-        game.log << "Sound: Could not open file \"" << filename << "\"." << endl;
+    shared_ptr<File> found = game.vfs.open(filename);
+    if (!found) {
+        Close();
+        log << "Sound: Could not open file \"" << filename << "\"." << endl;
         return false;
     }
-    
+    return Open(filename, found);
+}
+
+bool SoundFile::Open(const std::string& filename, shared_ptr<File> file)
+{
+    Close();
+    this->file = file;
+
     if (file->size() < 12) {
-        game.log << "Sound: Could not open file \"" << filename << "\": Invalid file size." << endl;
+        log << "Sound: Could not open file \"" << filename << "\": Invalid file size." << endl;
     }
 
     // Parse header
@@ -238,17 +242,18 @@ bool SoundFile::Open(const std::string& filename)
     type        = read_byte(it);
 
     // Check for known format
+    // Copied as Decode points the filter at its own buffer
     if (type == 1) {
-        conv = &eightbitconv;
+        *conv = eightbitconv;
     } else if (type == 99) {
-        conv = &monoconv;
+        *conv = monoconv;
     } else {
-        game.log << "Sound: Could not open file \"" << filename << "\": Corrupt header (Unknown type: " << type << ")." << endl;
+        log << "Sound: Could not open file \"" << filename << "\": Corrupt header (Unknown type: " << type << ")." << endl;
         return false;
     }
 
     if (frequency != 22050)
-        game.log << "Sound: \"" << filename << "\" needs converting from " << frequency << "Hz (should be 22050Hz)" << endl;
+        log << "Sound: \"" << filename << "\" needs converting from " << frequency << "Hz (should be 22050Hz)" << endl;
 
     imaSample = 0;
     imaIndex  = 0;
@@ -292,13 +297,13 @@ unsigned int SoundFile::Decode(SampleBuffer& buffer, unsigned int length)
         ID                  = read_dword(it, FCNC_LIL_ENDIAN);
 
         if (comp_sample_size > (SOUND_MAX_CHUNK_SIZE)) {
-            game.log << "Size data for current sample too large" << endl;
+            log << "Size data for current sample too large" << endl;
             return SOUND_DECODE_ERROR;
         }
 
         // abort if id was wrong */
         if (ID != 0xDEAF) {
-            game.log << "Sample had wrong ID: Got " << std::hex << ID << std::dec << " expected 0xDEAF." << endl;
+            log << "Sample had wrong ID: Got " << std::hex << ID << std::dec << " expected 0xDEAF." << endl;
             return SOUND_DECODE_ERROR;
         }
 
@@ -312,17 +317,17 @@ unsigned int SoundFile::Decode(SampleBuffer& buffer, unsigned int length)
         file->read(chunk, comp_sample_size);
         SampleIterator chit = chunk.begin();
         if (type == 1) {
-            Sound::WSADPCM_Decode(tmpbuff, chit, comp_sample_size, uncomp_sample_size);
+            Sound::WSADPCM_Decode(&tmpbuff[0], chit, comp_sample_size, uncomp_sample_size);
         } else {
-            Sound::IMADecode(tmpbuff, chit, comp_sample_size, imaSample, imaIndex);
+            Sound::IMADecode(&tmpbuff[0], &chunk[0], comp_sample_size, imaSample, imaIndex);
         }
-        conv->buf = tmpbuff;
+        conv->buf = &tmpbuff[0];
         conv->len = uncomp_sample_size;
-        if (SDL_ConvertAudio(conv) < 0) {
-            game.log << "Could not run conversion filter: " << SDL_GetError() << endl;
+        if (SDL_ConvertAudio(conv.get()) < 0) {
+            log << "Could not run conversion filter: " << SDL_GetError() << endl;
             return SOUND_DECODE_ERROR;
         }
-        memcpy(&buffer[written], tmpbuff, uncomp_sample_size*conv->len_mult);
+        memcpy(&buffer[written], &tmpbuff[0], uncomp_sample_size*conv->len_mult);
         //offset += 8 + comp_sample_size;
         written += uncomp_sample_size*conv->len_mult;
     }
@@ -14,17 +14,21 @@ enum {
 };
 
 namespace Sound {
-    void IMADecode(unsigned char *output, SampleIterator input, unsigned short compressed_size, int& sample, int& index);
+    void IMADecode(unsigned char *output, const unsigned char* input, unsigned short compressed_size, int& sample, int& index);
     void WSADPCM_Decode(unsigned char *output, SampleIterator input, unsigned short compressed_size, unsigned short uncompressed_size);
 }
 
 class SoundFile
 {
 public:
-    SoundFile();
+    /// @param log where to report problems, as a SoundFile used off the
+    /// main thread can't use game.log
+    SoundFile(std::ostream& log = game.log);
     ~SoundFile();
     
     bool Open(const string& filename);
+    /// Opens a file already found in the VFS
+    bool Open(const string& filename, shared_ptr<File> file);
     void Close();
    
     // Length is the max size in bytes of the uncompressed sample, returned
@@ -32,11 +36,18 @@ public:
     unsigned int Decode(SampleBuffer& buffer, unsigned int length = 0);
 
 private:
+    std::ostream& log;
+
     // File data
     std::string filename;
     shared_ptr<File> file;
     //unsigned int offset;
     bool fileOpened;
+
+    // Scratch space for one sample, per decoder so music can be decoded on
+    // its own thread while sounds are loaded
+    SampleBuffer chunk;
+    SampleBuffer tmpbuff;
     
     // Header information
     unsigned short frequency;
@@ -47,7 +58,7 @@ private:
     int imaSample;
     int imaIndex;
 
-    SDL_AudioCVT* conv;
+    scoped_ptr<SDL_AudioCVT> conv;
 };
 
 #endif
@@ -9,14 +9,21 @@ using std::runtime_error;
 namespace
 {
     SDL_Color font_colours[] = {{0x0, 0x0, 0x0, 0x0}, {0xff, 0xff, 0xff, 0xff}};
+    // Cached strings not drawn for this many ticks are freed
+    const unsigned int TEXT_MAX_AGE = 30000;
+    // Least recently drawn strings are freed above this many bytes per font
+    const unsigned int TEXT_MAX_BYTES = 256*1024;
+    // How often to look for strings that are too old
+    const unsigned int TEXT_EXPIRE_INTERVAL = 1000;
 }
 
-Font::Font(const string& fontname) : SHPBase(fontname), fontimg(0)  {
+Font::Font(const string& fontname) : SHPBase(fontname), fontimg(0), textbytes(0), lastexpire(0)  {
     this->fontname = fontname;
     reload();
 }
 
 Font::~Font() {
+    flushText();
     SDL_FreeSurface(fontimg);
 }
 
@@ -88,6 +95,7 @@ void Font::reload() {
         }
     }
 
+    flushText();
     SDL_FreeSurface(fontimg);
     fontimg = NULL;
 
@@ -117,16 +125,92 @@ unsigned int Font::calcTextWidth(const std::string& text) const {
 }
 
 void Font::drawText(const std::string& text, SDL_Surface *dest, unsigned int startx, unsigned int starty) const {
-    unsigned int i;
+    if (text.empty()) {
+        return;
+    }
+    unsigned int now = SDL_GetTicks();
+    if (now - lastexpire > TEXT_EXPIRE_INTERVAL) {
+        expireText(now);
+        lastexpire = now;
+    }
+
+    TextCache::iterator it = textcache.find(text);
+    if (it == textcache.end()) {
+        CachedText entry;
+        entry.image = renderText(text);
+        if (entry.image == NULL) {
+            return;
+        }
+        textbytes += entry.image->pitch * entry.image->h;
+        it = textcache.insert(TextCache::value_type(text, entry)).first;
+    }
+    it->second.lastused = now;
+
     SDL_Rect destr;
     destr.x = startx;
     destr.y = starty;
-    destr.h = chrdest[0].h;
+    SDL_BlitSurface(it->second.image, NULL, dest, &destr);
 
-    for (i = 0; text[i] != '\0'; i++) {
+    // Done after the blit, as the string just drawn may be evicted too
+    if (textbytes > TEXT_MAX_BYTES) {
+        expireText(now);
+    }
+}
+
+/** Draws a string onto a new surface in the same format as the glyphs. */
+SDL_Surface* Font::renderText(const std::string& text) const {
+    SDL_PixelFormat* fmt = fontimg->format;
+    SDL_Surface* image = SDL_CreateRGBSurface(SDL_SWSURFACE, calcTextWidth(text), getHeight(),
+            fmt->BitsPerPixel, fmt->Rmask, fmt->Gmask, fmt->Bmask, fmt->Amask);
+    if (image == NULL) {
+        return NULL;
+    }
+    SDL_FillRect(image, NULL, fmt->colorkey);
+
+    SDL_Rect destr;
+    destr.x = 0;
+    destr.y = 0;
+    destr.h = chrdest[0].h;
+    for (unsigned int i = 0; text[i] != '\0'; i++) {
         SDL_Rect* src_rect = const_cast<SDL_Rect*>(&chrdest[text[i]]);
         destr.w = src_rect->w;
-        SDL_BlitSurface(fontimg, src_rect, dest, &destr);
+        SDL_BlitSurface(fontimg, src_rect, image, &destr);
         destr.x += destr.w+1;
     }
+    SDL_SetColorKey(image, SDL_SRCCOLORKEY|SDL_RLEACCEL, fmt->colorkey);
+    return image;
+}
+
+/** Frees cached strings that haven't been drawn recently, then the least
+ * recently drawn ones until the cache is back under its size limit.
+ */
+void Font::expireText(unsigned int now) const {
+    for (TextCache::iterator i = textcache.begin(); i != textcache.end();) {
+        if (now - i->second.lastused > TEXT_MAX_AGE) {
+            textbytes -= i->second.image->pitch * i->second.image->h;
+            SDL_FreeSurface(i->second.image);
+            textcache.erase(i++);
+        } else {
+            ++i;
+        }
+    }
+    while (textbytes > TEXT_MAX_BYTES && textcache.size() > 1) {
+        TextCache::iterator oldest = textcache.begin();
+        for (TextCache::iterator i = textcache.begin(); i != textcache.end(); ++i) {
+            if (i->second.lastused < oldest->second.lastused) {
+                oldest = i;
+            }
+        }
+        textbytes -= oldest->second.image->pitch * oldest->second.image->h;
+        SDL_FreeSurface(oldest->second.image);
+        textcache.erase(oldest);
+    }
+}
+
+void Font::flushText() const {
+    for (TextCache::iterator i = textcache.begin(); i != textcache.end(); ++i) {
+        SDL_FreeSurface(i->second.image);
+    }
+    textcache.clear();
+    textbytes = 0;
 }
@@ -15,9 +15,25 @@ public:
     void drawText(const string& text, SDL_Surface* dest, unsigned int startx, unsigned int starty) const;
     void reload();
 private:
+    struct CachedText {
+        SDL_Surface* image;
+        unsigned int lastused;
+    };
+    typedef map<string, CachedText> TextCache;
+
+    SDL_Surface* renderText(const string& text) const;
+    void expireText(unsigned int now) const;
+    void flushText() const;
+
     SDL_Surface* fontimg;
     vector<SDL_Rect> chrdest;
     string fontname;
+    // Strings that have already been drawn once, so they can be redrawn with
+    // a single blit.  The font is always drawn in the same colour so the
+    // string alone is enough of a key.
+    mutable TextCache textcache;
+    mutable unsigned int textbytes;
+    mutable unsigned int lastexpire;
 };
 
 #endif
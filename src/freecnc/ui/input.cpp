@@ -348,8 +348,12 @@ void Input::handle()
         selected.checkSelection();
     }
 
+    // A full update also redraws progress, so always clear both flags
+    bool progress = p::ppool->pollBuildProgress();
     if (p::ppool->pollSidebar()) {
         pc::sidebar->update_sidebar();
+    } else if (progress) {
+        pc::sidebar->update_progress();
     }
     radarstat = p::ppool->statRadar();
     switch (radarstat) {
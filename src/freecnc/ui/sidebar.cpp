@@ -285,9 +285,7 @@ SDL_Surface *Sidebar::get_sidebar_image(SDL_Rect location)
         SDL_BlitSurface(radar, NULL, sbar, &radarlocation);
     }
 
-    for (int x = buttons.size() - 1 ; x >= 0; --x) {
-        draw_button(x);
-    }
+    redraw_buttons(0, true);
 
     invalidated = false;
 
@@ -298,6 +296,8 @@ void Sidebar::add_button(unsigned short x, unsigned short y, const char* fname,
 {
     shared_ptr<SidebarButton> t(new SidebarButton(x, y, fname, f, theatre, pal, sidebar_type));
     buttons.push_back(t);
+    ButtonState state = {0, BQ_INVALID, 0, 0};
+    drawnstate.push_back(state);
     vischanged = true;
 }
 
@@ -366,42 +366,71 @@ unsigned char Sidebar::get_button(unsigned short x,unsigned short y)
     return 255;
 }
 
-void Sidebar::draw_button(unsigned char index)
+/** Draws every button from first onwards, skipping the ones whose image and
+ * build status are the same as when they were last drawn unless force is set.
+ */
+void Sidebar::redraw_buttons(unsigned char first, bool force)
+{
+    for (int x = buttons.size() - 1; x >= first; --x) {
+        draw_button(x, force);
+    }
+}
+
+void Sidebar::draw_button(unsigned char index, bool force)
 {
     if (sbar == 0) {
         /// @TODO Ensure we don't actually get called when this is the case
         return;
     }
     SDL_Rect dest = buttons[index]->getRect();
-    SDL_FillRect(sbar, &dest, 0x0);
     unsigned char func = buttons[index]->getFunction();
 
-    // Blit the button's image onto the sidebar surface
-    SDL_Surface *temp = buttons[index]->getSurface();
-    SDL_BlitSurface(temp, NULL, sbar, &dest);
-
-    vischanged = true;
+    ButtonState state = {buttons[index]->getGeneration(), BQ_EMPTY, 0, 100};
+    bool hastype = false;
     // Skip scroll buttons
-    if (index < 4) {
-        return;
+    if (index >= 4) {
+        // Calculate which icon was clicked on
+        unsigned char offset = index - 4 + // First four buttons are scroll buttons
+                       ((func&sbo_unit)
+                        ? unitoff  // Unit buttons are created first
+                        : (structoff-buildbut) // See comment around line 265
+                       );
+        vector<char*>& icons = ((func&sbo_unit)
+                ?(uniticons)
+                :(structicons));
+
+        if (offset < icons.size()) {
+            // Extract type name from icon name, e.g. NUKE from NUKEICON.SHP
+            unsigned int length = strlen(icons[offset])-8; if (length>13) length = 13;
+            string name(icons[offset], length);
+
+            UnitOrStructureType* type;
+            if (func&sbo_unit) {
+                type = p::uspool->getUnitTypeByName(name.c_str());
+            } else {
+                type = (UnitOrStructureType*)p::uspool->getStructureTypeByName(name.c_str());
+            }
+            if (0 == type) {
+                throw runtime_error("Asking for \""+name+"\" resulted in a null pointer");
+            }
+            state.status = player->getStatus(type, &state.quantity, &state.progress);
+            hastype = true;
+        }
     }
-    // Calculate which icon was clicked on
-    unsigned char offset = index - 4 + // First four buttons are scroll buttons
-                   ((func&sbo_unit)
-                    ? unitoff  // Unit buttons are created first
-                    : (structoff-buildbut) // See comment around line 265
-                   );
-    vector<char*>& icons = ((func&sbo_unit)
-            ?(uniticons)
-            :(structicons));
-
-    if (offset >= icons.size()) {
+
+    if (!force && state == drawnstate[index]) {
         return;
     }
+    drawnstate[index] = state;
+
+    SDL_FillRect(sbar, &dest, 0x0);
 
-    // Extract type name from icon name, e.g. NUKE from NUKEICON.SHP
-    unsigned int length = strlen(icons[offset])-8; if (length>13) length = 13;
-    string name(icons[offset], length);
+    // Blit the button's image onto the sidebar surface
+    SDL_BlitSurface(buttons[index]->getSurface(), NULL, sbar, &dest);
+
+    if (!hastype) {
+        return;
+    }
 
     static const char* stat_mesg[] = {
         "???",  // BQ_INVALID
@@ -421,19 +450,9 @@ void Sidebar::draw_button(unsigned char index)
         }
         posinit = true;
     }
-    ConStatus status;
-    unsigned char quantity, progress, imgnum;
+    ConStatus status = state.status;
+    unsigned char quantity = state.quantity, progress = state.progress, imgnum;
 
-    UnitOrStructureType* type;
-    if (func&sbo_unit) {
-        type = p::uspool->getUnitTypeByName(name.c_str());
-    } else {
-        type = (UnitOrStructureType*)p::uspool->getStructureTypeByName(name.c_str());
-    }
-    if (0 == type) {
-        throw runtime_error("Asking for \""+name+"\" resulted in a null pointer");
-    }
-    status = player->getStatus(type, &quantity, &progress);
     if (BQ_INVALID == status) {
         get_font()->drawText(stat_mesg[status], sbar, dest.x + stat_pos[status].x, dest.y + stat_pos[status].y);
         // Grey out invalid items for prettyness
@@ -578,6 +597,11 @@ void Sidebar::update_sidebar() {
     update_icons();
 }
 
+/** Redraws the build buttons whose progress or status has changed. */
+void Sidebar::update_progress() {
+    redraw_buttons(4, false);
+}
+
 /** Rebuild the list of icons that are available.
  *
  * @bug Newer items should be appended, although with some grouping (i.e. keep
@@ -627,12 +651,15 @@ void Sidebar::update_available_lists() {
             structicons.push_back(nametemp);
         }
     }
+    bool wasvisible = visible;
     visible = (visible || uniticons.size() > prev_units_avail ||
             structicons.size() > prev_structs_avail);
     if (uniticons.empty() && structicons.empty()) {
         visible = false;
     }
-    vischanged = true;
+    if (visible != wasvisible) {
+        vischanged = true;
+    }
 }
 
 /** Sets the images of the visible icons, having scrolled.
@@ -656,9 +683,7 @@ void Sidebar::update_icons() {
         }
     }
 
-    for (char x = buttons.size()-1;x>=0;--x) {
-        draw_button(x);
-    }
+    redraw_buttons(0, false);
 }
 
 void Sidebar::down_button(unsigned char index)
@@ -708,7 +733,7 @@ void Sidebar::scroll_sidebar(bool scrollup)
 
 Sidebar::SidebarButton::SidebarButton(short x, short y, const char* picname,
         unsigned char f, const char* theatre, unsigned char pal, const Sidebar::SidebarType& st)
- : pic(0), function(f), palnum(pal), theatre(theatre), using_fallback(false), sidebar_type(st)
+ : pic(0), generation(0), function(f), palnum(pal), theatre(theatre), using_fallback(false), sidebar_type(st)
 {
     picloc.x = x;
     picloc.y = y;
@@ -745,6 +770,7 @@ void Sidebar::SidebarButton::change_image(const char* fname, unsigned char numbe
 {
     bool use_palette = true;
 
+    ++generation;
     if (using_fallback) {
         SDL_FreeSurface(pic);
         using_fallback = false;
@@ -797,6 +823,7 @@ void Sidebar::SidebarButton::change_image(const char* fname, unsigned char numbe
 
 void Sidebar::SidebarButton::reload_image()
 {
+    ++generation;
     //If we are using fallback we must redraw
     if (using_fallback) {
         SDL_FreeSurface(pic);
@@ -36,6 +36,7 @@ public:
     void reset_button();
     void scroll_sidebar(bool scrollup);
     void update_sidebar();
+    void update_progress();
 
     void start_radar_anim(unsigned char mode, bool* minienable);
 
@@ -82,6 +83,11 @@ private:
         SDL_Surface* getSurface() const {
             return pic;
         }
+        /// Changes whenever the image does, as a new surface can be
+        /// allocated where the old one was
+        unsigned int getGeneration() const {
+            return generation;
+        }
         SDL_Rect getRect() const {
             return picloc;
         }
@@ -94,6 +100,7 @@ private:
     private:
         unsigned int picnum;
         SDL_Surface *pic;
+        unsigned int generation;
         unsigned char function, palnum;
         const char* theatre;
 
@@ -111,7 +118,8 @@ private:
     void update_available_lists();
     void down_button(unsigned char index);
     void add_button(unsigned short x, unsigned short y, const char* fname, unsigned char f, unsigned char pal);
-    void draw_button(unsigned char index);
+    void draw_button(unsigned char index, bool force);
+    void redraw_buttons(unsigned char first, bool force);
     void draw_clock(unsigned char index, unsigned char imgnum);
 
     void load_images();
@@ -144,6 +152,19 @@ private:
     unsigned char buildbut;
     std::vector<shared_ptr<SidebarButton> > buttons;
 
+    // What each button showed when it was last drawn onto sbar, so buttons
+    // that haven't changed are not drawn again.
+    struct ButtonState {
+        unsigned int generation;
+        ConStatus status;
+        unsigned char quantity, progress;
+        bool operator==(const ButtonState& other) const {
+            return generation == other.generation && status == other.status
+                && quantity == other.quantity && progress == other.progress;
+        }
+    };
+    std::vector<ButtonState> drawnstate;
+
     std::vector<char*> uniticons;
     std::vector<char*> structicons;
 
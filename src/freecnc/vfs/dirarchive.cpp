@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <sstream>
@@ -5,7 +6,10 @@
 #include <boost/filesystem/operations.hpp>
 
 #include "dirarchive.h"
+#include "mappedfile.h"
 
+using std::max;
+using std::min;
 using std::ostringstream;
 using std::runtime_error;
 using std::string;
@@ -31,15 +35,22 @@ namespace VFS
         int do_read(vector<unsigned char>& buf, int count);
         void do_seek(int pos, int orig);
         int do_write(const vector<unsigned char>& buf);
+        const unsigned char* do_map();
+        unsigned int do_mtime() const;
         
     private:
         void update_state();
+        // Closed once a read-only file is mapped, everything is then read
+        // from the mapping
         FILE* handle;
+        string path;
+        shared_ptr<MappedFile> mapping;
     };
 
     //-------------------------------------------------------------------------
     
     DirFile::DirFile(const string& path, const string& archive, const string& name, bool writable)
+        : path(path)
     {
         // Info
         archive_ = archive;
@@ -80,11 +91,22 @@ namespace VFS
     
     void DirFile::do_flush()
     {
-        fflush(handle);
+        if (handle) {
+            fflush(handle);
+        }
     }
     
     int DirFile::do_read(vector<unsigned char>& buf, int count)
     {
+        if (!handle) {
+            count = max(0, min(count, size_ - pos_));
+            const unsigned char* start = mapping->data() + pos_;
+            buf.assign(start, start + count);
+            pos_ += count;
+            eof_ = pos_ >= size_;
+            return count;
+        }
+
         buf.resize(count);
         int bytesread = static_cast<int>(fread(&buf[0], sizeof(char), buf.size(), handle));
         buf.resize(bytesread);
@@ -101,6 +123,15 @@ namespace VFS
             case  1: origin = SEEK_END; break;
             default: return;
         }
+        if (!handle) {
+            switch (origin) {
+                case SEEK_CUR: offset += pos_; break;
+                case SEEK_END: offset += size_; break;
+            }
+            pos_ = max(0, min(offset, size_));
+            eof_ = pos_ >= size_;
+            return;
+        }
         fseek(handle, offset, origin);
         update_state();
     }
@@ -112,6 +143,36 @@ namespace VFS
         return byteswritten;
     }    
 
+    const unsigned char* DirFile::do_map()
+    {
+        if (!handle) {
+            return mapping->data();
+        }
+        if (!mapping) {
+            mapping = MappedFile::get(path);
+        }
+        // The file may have been written since it was mapped
+        if (!mapping || mapping->size() < size_) {
+            return 0;
+        }
+        // Files kept around mapped, like cached SHPs, shouldn't each hold a
+        // descriptor as well
+        if (!writable_) {
+            fclose(handle);
+            handle = 0;
+        }
+        return mapping->data();
+    }
+
+    unsigned int DirFile::do_mtime() const
+    {
+        try {
+            return static_cast<unsigned int>(fs::last_write_time(path));
+        } catch (fs::filesystem_error&) {
+            return 0;
+        }
+    }
+
     //-------------------------------------------------------------------------
     // DirArchive
     //-------------------------------------------------------------------------
@@ -135,4 +196,16 @@ namespace VFS
 
         return shared_ptr<File>(new DirFile(filepath.c_str(), path(), filename, writable));
     }
+
+    vector<string> DirArchive::names() const
+    {
+        vector<string> result;
+        fs::directory_iterator end;
+        for (fs::directory_iterator it(dir); it != end; ++it) {
+            if (!fs::is_directory(it->path())) {
+                result.push_back(fs::path(it->path().filename()).string());
+            }
+        }
+        return result;
+    }
 }
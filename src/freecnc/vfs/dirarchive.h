@@ -2,6 +2,7 @@
 #define _VFS_DIRARCHIVE_H
 
 #include <string>
+#include <vector>
 #include <boost/filesystem/path.hpp>
 #include <boost/smart_ptr.hpp>
 
@@ -18,6 +19,9 @@ namespace VFS
         std::string path();
         boost::shared_ptr<File> open(const std::string& filename, bool writable);
 
+        // Names of the files directly in the directory, not in subdirectories.
+        std::vector<std::string> names() const;
+
     private:
         boost::filesystem::path dir;
     };
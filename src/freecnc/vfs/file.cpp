@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 
@@ -7,6 +8,8 @@
 using std::distance;
 using std::find;
 using std::logic_error;
+using std::max;
+using std::min;
 using std::string;
 using std::vector;
 
@@ -16,6 +19,7 @@ namespace VFS
     {
         if (writable_) { throw logic_error("File not readable"); }
 
+        unread();
         return do_read(buf, count);
     }
 
@@ -23,6 +27,7 @@ namespace VFS
     {
         if (writable_) { throw logic_error("File not readable"); }
 
+        unread();
         vector<unsigned char> buf;
         do_read(buf, count);
         return string(buf.begin(), buf.end());
@@ -32,6 +37,7 @@ namespace VFS
     {
         if (writable_) { throw logic_error("File not readable"); }
         
+        unread();
         vector<unsigned char> buffer;
         vector<unsigned char>::iterator it;
         while (!eof_) {
@@ -55,14 +61,105 @@ namespace VFS
     
     string File::readline()
     {
-        vector<unsigned char> buf;
-        if (read(buf, '\n') > 0) {
-            vector<unsigned char>::iterator end = buf.end();
-            return string(buf.begin(), *buf.rbegin() == '\r' ? --end : end);
+        const char* line;
+        int len;
+        if (readline(line, len)) {
+            return string(line, len);
         } else {
             return "";
         }
     }
+
+    bool File::readline(const char*& line, int& len)
+    {
+        if (writable_) { throw logic_error("File not readable"); }
+
+        const unsigned char* mapped = do_map();
+        if (mapped != 0) {
+            unread();
+            if (pos_ >= size_) {
+                return false;
+            }
+            const unsigned char* start = mapped + pos_;
+            const unsigned char* nl = static_cast<const unsigned char*>(memchr(start, '\n', size_ - pos_));
+            len = static_cast<int>(nl ? nl - start : size_ - pos_);
+            line = reinterpret_cast<const char*>(start);
+            do_seek(nl ? len + 1 : len, 0);
+        } else {
+            // Fetch blocks until there's a whole line buffered
+            const int blocksize = 4096;
+            unsigned int scanned = bufpos_;
+            unsigned char* nl = 0;
+            while (true) {
+                if (scanned < linebuf_.size()) {
+                    nl = static_cast<unsigned char*>(memchr(&linebuf_[scanned], '\n', linebuf_.size() - scanned));
+                }
+                if (nl || eof_) {
+                    break;
+                }
+                linebuf_.erase(linebuf_.begin(), linebuf_.begin() + bufpos_);
+                bufpos_ = 0;
+                scanned = static_cast<unsigned int>(linebuf_.size());
+                if (do_read(spanbuf_, blocksize) == 0) {
+                    break;
+                }
+                linebuf_.insert(linebuf_.end(), spanbuf_.begin(), spanbuf_.end());
+            }
+            if (buffered() == 0) {
+                return false;
+            }
+            const unsigned char* start = &linebuf_[bufpos_];
+            len = nl ? static_cast<int>(nl - start) : buffered();
+            line = reinterpret_cast<const char*>(start);
+            bufpos_ += nl ? len + 1 : len;
+        }
+        if (len > 0 && line[len - 1] == '\r') {
+            --len;
+        }
+        return true;
+    }
+
+    const unsigned char* File::read_all()
+    {
+        seek_start();
+        const unsigned char* data;
+        read_span(data, size_);
+        return data;
+    }
+
+    void File::unread()
+    {
+        int count = buffered();
+        linebuf_.clear();
+        bufpos_ = 0;
+        if (count > 0) {
+            do_seek(-count, 0);
+        }
+    }
+
+    int File::read_span(const unsigned char*& data, int count)
+    {
+        if (writable_) { throw logic_error("File not readable"); }
+
+        unread();
+        const unsigned char* mapped = do_map();
+        if (mapped != 0) {
+            count = max(0, min(count, size_ - pos_));
+            data = mapped + pos_;
+            do_seek(count, 0);
+            return count;
+        }
+        do_read(spanbuf_, count);
+        data = spanbuf_.empty() ? 0 : &spanbuf_[0];
+        return static_cast<int>(spanbuf_.size());
+    }
+
+    const unsigned char* File::map()
+    {
+        if (writable_) { throw logic_error("File not readable"); }
+
+        return do_map();
+    }
    
     //-------------------------------------------------------------------------
  
@@ -31,6 +31,31 @@ namespace VFS
         
         // Reads a line from the file and returns it. The linebreak is discarded.
         std::string readline();
+
+        // Points `line' at the next line and sets `len' to its length without
+        // the linebreak. Mapped files are not copied; anything else is read
+        // a block at a time into a buffer owned by the File. The line stays
+        // valid until the next read or seek.
+        // Returns false at EOF.
+        bool readline(const char*& line, int& len);
+
+        // Returns the whole file as one block of size() bytes, leaving the
+        // position at the end. This is the mapping when there is one,
+        // otherwise the file is read into a buffer owned by the File, which
+        // stays valid until the next read.
+        const unsigned char* read_all();
+
+        // Points `data' at the next `count' bytes or until EOF and moves
+        // past them. Mapped files are not copied; anything else is read into
+        // a buffer owned by the File, which the next call reuses.
+        // Returns bytes available at `data'.
+        int read_span(const unsigned char*& data, int count);
+
+        // Returns the whole file as read-only memory without copying it, or 0
+        // if the archive can't map it. The memory stays valid as long as the
+        // File does, and Files in the same archive share the mapping. A
+        // mapped File holds no descriptor of its own.
+        const unsigned char* map();
         
         //---------------------------------------------------------------------
 
@@ -52,13 +77,13 @@ namespace VFS
         //---------------------------------------------------------------------
         
         // Seeks from the current position in the file.
-        void seek_cur(int offset) { do_seek(offset, 0); }
+        void seek_cur(int offset) { unread(); do_seek(offset, 0); }
         
         // Seeks from the end of the file.
-        void seek_end(int offset = 0) { do_seek(offset, 1); }
+        void seek_end(int offset = 0) { unread(); do_seek(offset, 1); }
         
         // Seeks form the beginning of the file.
-        void seek_start(int offset = 0) { do_seek(offset, -1); }
+        void seek_start(int offset = 0) { unread(); do_seek(offset, -1); }
        
         //---------------------------------------------------------------------
         
@@ -69,18 +94,24 @@ namespace VFS
         std::string name() const { return name_; }
 
         // Whether the stream is at the end-of-file.
-        bool eof() const { return eof_; }
+        bool eof() const { return buffered() == 0 && (eof_ || (!writable_ && pos_ >= size_)); }
         
         // Current position in the file.
-        int pos() const { return pos_; }
+        int pos() const { return pos_ - buffered(); }
         
         // Size of the file in bytes.
         int size() const { return size_; }
+
+        // Last modification time of the file, or of the mix archive it is
+        // in. Returns 0 if it can't be found.
+        unsigned int mtime() const { return do_mtime(); }
         
         // Whether the file is readable or writable.
         bool writable() const { return writable_; }
         
     protected:
+        File() : bufpos_(0) {}
+
         std::string archive_;
         std::string name_;
 
@@ -88,11 +119,25 @@ namespace VFS
         int pos_;
         int size_;
         bool writable_;
+        std::vector<unsigned char> spanbuf_;
+
+        // Read ahead by readline, with the first bufpos_ bytes used up. The
+        // archive's position is past all of it, so pos_ is ahead of pos().
+        std::vector<unsigned char> linebuf_;
+        unsigned int bufpos_;
 
         virtual void do_flush() = 0;
         virtual int do_read(std::vector<unsigned char>& buf, int count) = 0;
         virtual void do_seek(int pos, int orig) = 0; // orig = -1 - start, 0 - cur, 1 - end
         virtual int do_write(const std::vector<unsigned char>& buf) = 0;
+        virtual const unsigned char* do_map() { return 0; }
+        virtual unsigned int do_mtime() const { return 0; }
+
+    private:
+        int buffered() const { return static_cast<int>(linebuf_.size() - bufpos_); }
+        // Gives back what readline read ahead, before anything else moves
+        // the position
+        void unread();
     }; 
 }
 
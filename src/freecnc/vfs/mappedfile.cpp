@@ -0,0 +1,124 @@
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mappedfile.h"
+
+using std::map;
+using std::ostringstream;
+using std::runtime_error;
+using std::string;
+using boost::shared_ptr;
+using boost::weak_ptr;
+
+namespace
+{
+    typedef map<string, weak_ptr<VFS::MappedFile> > MappingMap;
+
+    // Mappings currently in use, by path
+    MappingMap mappings;
+}
+
+namespace VFS
+{
+    shared_ptr<MappedFile> MappedFile::get(const string& path)
+    {
+        MappingMap::iterator it = mappings.find(path);
+        if (it != mappings.end()) {
+            shared_ptr<MappedFile> existing = it->second.lock();
+            if (existing) {
+                return existing;
+            }
+        }
+
+        shared_ptr<MappedFile> mapped;
+        try {
+            mapped.reset(new MappedFile(path));
+        } catch (runtime_error&) {
+            return shared_ptr<MappedFile>();
+        }
+        mappings[path] = mapped;
+        return mapped;
+    }
+
+#ifdef _WIN32
+
+    MappedFile::MappedFile(const string& path) : data_(0), size_(0), file(0), mapping(0)
+    {
+        HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE) {
+            throw runtime_error("MappedFile: '" + path + "': CreateFile failed");
+        }
+        file = handle;
+        size_ = static_cast<int>(GetFileSize(handle, NULL));
+        if (size_ <= 0) {
+            CloseHandle(handle);
+            throw runtime_error("MappedFile: '" + path + "': Empty file");
+        }
+        mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            CloseHandle(handle);
+            throw runtime_error("MappedFile: '" + path + "': CreateFileMapping failed");
+        }
+        data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data_ == NULL) {
+            CloseHandle(mapping);
+            CloseHandle(handle);
+            throw runtime_error("MappedFile: '" + path + "': MapViewOfFile failed");
+        }
+    }
+
+    MappedFile::~MappedFile()
+    {
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping);
+        CloseHandle(file);
+    }
+
+#else
+
+    MappedFile::MappedFile(const string& path) : data_(0), size_(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            ostringstream temp;
+            temp << "MappedFile: '" << path << "': open failed: " << errno << ": " << strerror(errno);
+            throw runtime_error(temp.str());
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1 || info.st_size <= 0) {
+            close(fd);
+            throw runtime_error("MappedFile: '" + path + "': Unable to get size");
+        }
+        size_ = static_cast<int>(info.st_size);
+        void* addr = mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping keeps its own reference to the file
+        close(fd);
+        if (addr == MAP_FAILED) {
+            ostringstream temp;
+            temp << "MappedFile: '" << path << "': mmap failed: " << errno << ": " << strerror(errno);
+            throw runtime_error(temp.str());
+        }
+        data_ = static_cast<const unsigned char*>(addr);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        munmap(const_cast<unsigned char*>(data_), size_);
+    }
+
+#endif
+}
@@ -0,0 +1,40 @@
+#ifndef _VFS_MAPPEDFILE_H
+#define _VFS_MAPPEDFILE_H
+
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr.hpp>
+
+namespace VFS
+{
+    // A read-only memory mapping of a whole file on disk.
+    class MappedFile : private boost::noncopyable
+    {
+    public:
+        ~MappedFile();
+
+        // Returns the mapping of `path', creating it if nobody holds one yet,
+        // so every File in an archive shares a single mapping.
+        // Returns 0 if the file can't be mapped.
+        // Not thread safe: call from one thread at a time.
+        static boost::shared_ptr<MappedFile> get(const std::string& path);
+
+        // Start of the file's contents.
+        const unsigned char* data() const { return data_; }
+
+        // Size of the file in bytes.
+        int size() const { return size_; }
+
+    private:
+        explicit MappedFile(const std::string& path);
+
+        const unsigned char* data_;
+        int size_;
+#ifdef _WIN32
+        void* file;
+        void* mapping;
+#endif
+    };
+}
+
+#endif
@@ -3,6 +3,9 @@
 #include <cerrno>
 #include <cstdio>
 #include <cctype>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
 #include <sstream>
 #include <stdexcept>
 #include <vector>
@@ -10,8 +13,10 @@
 
 #include "../lib/blowfish.h"
 #include "../lib/westwood_key.h"
+#include "mappedfile.h"
 #include "mixarchive.h"
 
+using std::max;
 using std::min;
 using std::ostringstream;
 using std::out_of_range;
@@ -51,6 +56,42 @@ namespace
     const unsigned int RA_MIX_CHECKSUM  = 0x00010000;
     const unsigned int RA_MIX_ENCRYPTED = 0x00020000;
 
+    // Start of an index cache file. It is followed by the key, padded to a
+    // multiple of four bytes, and then the sorted index entries.
+    struct CacheHeader
+    {
+        char magic[4];
+        unsigned int version;
+        unsigned int archivesize;
+        unsigned int mtime;
+        unsigned int parsetime; // Microseconds parsing the archive took
+        unsigned int keylen;
+        unsigned int count;
+    };
+
+    const char cache_magic[4] = {'F', 'M', 'I', 'X'};
+    const unsigned int cache_version = 1;
+
+    // FNV-1a, to make a file name for each cache key
+    unsigned int hash_key(const string& key)
+    {
+        unsigned int hash = 2166136261u;
+        for (string::const_iterator it = key.begin(); it != key.end(); ++it) {
+            hash = (hash ^ static_cast<unsigned char>(*it)) * 16777619u;
+        }
+        return hash;
+    }
+
+    unsigned int elapsed_usecs(clock_t start)
+    {
+        return static_cast<unsigned int>((clock() - start) * 1000000.0 / CLOCKS_PER_SEC);
+    }
+
+    bool entry_before(const VFS::MixArchive::Entry& entry, unsigned int id)
+    {
+        return entry.id < id;
+    }
+
     MixArchiveType archive_type(unsigned int first_four_bytes)
     {
         return first_four_bytes == 0 || first_four_bytes == RA_MIX_CHECKSUM || first_four_bytes == RA_MIX_ENCRYPTED || first_four_bytes == (RA_MIX_ENCRYPTED | RA_MIX_CHECKSUM) ? RA_MIXFILE : TD_MIXFILE;
@@ -63,10 +104,12 @@ namespace VFS
     // MixFile
     //-------------------------------------------------------------------------
 
+    // A file inside a mix archive. When the archive is mapped it is just a
+    // window on the mapping and holds no file handle of its own.
     class MixFile : public File
     {
     public:
-        MixFile(const string& archive, const string& name, int lower_boundary, int size);
+        MixFile(const string& archive, const string& name, int lower_boundary, int size, shared_ptr<MappedFile> mapping);
         ~MixFile();
         
     protected:
@@ -74,14 +117,18 @@ namespace VFS
         int do_read(vector<unsigned char>& buf, int count);
         void do_seek(int pos, int orig);
         int do_write(const vector<unsigned char>& buf) { return 0; }
+        const unsigned char* do_map();
+        unsigned int do_mtime() const;
         
     private:
         void update_state();
         FILE* handle;
         int lower_boundary;
+        shared_ptr<MappedFile> mapping;
     };
     
-    MixFile::MixFile(const string& archive, const string& name, int lower_boundary, int size)
+    MixFile::MixFile(const string& archive, const string& name, int lower_boundary, int size, shared_ptr<MappedFile> mapping)
+        : handle(0), mapping(mapping)
     {
         // Info
         archive_ = archive;
@@ -93,6 +140,11 @@ namespace VFS
         writable_ = false;
 
         this->lower_boundary = lower_boundary;
+
+        if (mapping) {
+            eof_ = size_ == 0;
+            return;
+        }
        
         // Open file
         handle = fopen(archive_.c_str(), "rb");
@@ -113,6 +165,10 @@ namespace VFS
     
     void MixFile::update_state()
     {
+        if (mapping) {
+            eof_ = pos_ >= size_;
+            return;
+        }
         int tell = ftell(handle);
         eof_ = tell >= lower_boundary + size_ || feof(handle) != 0;
         pos_ = tell - lower_boundary;
@@ -123,10 +179,19 @@ namespace VFS
     int MixFile::do_read(vector<unsigned char>& buf, int count)
     {
         if (eof_) {
+            buf.clear();
             return 0;
         }
 
         count = min(count, size_ - pos_);
+        if (mapping) {
+            const unsigned char* start = mapping->data() + lower_boundary + pos_;
+            buf.assign(start, start + count);
+            pos_ += count;
+            update_state();
+            return count;
+        }
+
         buf.resize(count);
         int bytesread = static_cast<int>(fread(&buf[0], sizeof(char), buf.size(), handle));
         buf.resize(bytesread);
@@ -150,17 +215,75 @@ namespace VFS
             throw out_of_range(temp.str());
         }
 
-        fseek(handle, offset, SEEK_SET);
+        if (mapping) {
+            pos_ = offset - lower_boundary;
+        } else {
+            fseek(handle, offset, SEEK_SET);
+        }
         update_state();
     }
 
+    const unsigned char* MixFile::do_map()
+    {
+        // Without the archive's mapping there's nothing to share
+        return mapping ? mapping->data() + lower_boundary : 0;
+    }
+
+    unsigned int MixFile::do_mtime() const
+    {
+        try {
+            return static_cast<unsigned int>(fs::last_write_time(archive_));
+        } catch (fs::filesystem_error&) {
+            return 0;
+        }
+    }
+
     //-------------------------------------------------------------------------
     // MixArchive
     //-------------------------------------------------------------------------
   
-    MixArchive::MixArchive(const fs::path& mixfile, const vector<string>& subarchives)
-        : mixfile(mixfile)
+    MixArchive::MixArchive(const fs::path& mixfile, const vector<string>& subarchives, const fs::path& cachedir)
+        : mixfile(mixfile), table(0), tablesize(0), cached_(false), parsetime(0), loadtime(0)
     {
+        // Every file opened in the archive shares this, so opening them
+        // costs neither a file handle nor a copy. Without it each file
+        // falls back to its own handle.
+        mapping = MappedFile::get(path());
+
+        unsigned int archivesize = 0, mtime = 0;
+        if (!cachedir.empty()) {
+            try {
+                archivesize = static_cast<unsigned int>(fs::file_size(mixfile));
+                mtime = static_cast<unsigned int>(fs::last_write_time(mixfile));
+            } catch (fs::filesystem_error&) {
+                // parse will say what's wrong with it
+            }
+        }
+        if (archivesize == 0) {
+            parse(subarchives);
+            return;
+        }
+
+        // The cache is only good for the same archive with the same
+        // subarchives loaded
+        string key = path();
+        for (vector<string>::const_iterator it = subarchives.begin(); it != subarchives.end(); ++it) {
+            key += '\n' + *it;
+        }
+        ostringstream name;
+        name << "mix-" << std::hex << std::setw(8) << std::setfill('0') << hash_key(key) << ".idx";
+        const string cachefile = (cachedir / name.str()).string();
+
+        if (!load_cache(cachefile, key, archivesize, mtime)) {
+            parse(subarchives);
+            save_cache(cachefile, key, archivesize, mtime);
+        }
+    }
+
+    void MixArchive::parse(const vector<string>& subarchives)
+    {
+        clock_t start = clock();
+
         FILE* mix = fopen(path().c_str(), "rb");
         if (!mix) {
             ostringstream temp;
@@ -192,6 +315,18 @@ namespace VFS
             throw;
         }
         fclose(mix);
+
+        // The map is already sorted by id
+        entrybuf.reserve(index.size());
+        for (Index::const_iterator it = index.begin(); it != index.end(); ++it) {
+            Entry entry = {it->first, it->second.first, it->second.second};
+            entrybuf.push_back(entry);
+        }
+        Index().swap(index);
+        table = entrybuf.empty() ? 0 : &entrybuf[0];
+        tablesize = static_cast<unsigned int>(entrybuf.size());
+
+        parsetime = elapsed_usecs(start);
     }
 
     MixArchive::~MixArchive()
@@ -216,10 +351,6 @@ namespace VFS
         if (archive_type(type_header) == TD_MIXFILE) {
             parse_td_header(mix, base_offset);
         } else {
-            // This is the sort of assumption that westwood key makes :-(
-            if (sizeof(void*) != 4) {
-                throw runtime_error("Red Alert mixfiles not currently supported on this architecture :-(");
-            }
             parse_ra_header(mix, base_offset);
         }  
     }
@@ -311,6 +442,86 @@ namespace VFS
         }
     }
 
+    //-------------------------------------------------------------------------
+
+    bool MixArchive::load_cache(const string& cachefile, const string& key, unsigned int archivesize, unsigned int mtime)
+    {
+        clock_t start = clock();
+
+        if (!fs::exists(cachefile)) {
+            return false;
+        }
+        shared_ptr<MappedFile> cache = MappedFile::get(cachefile);
+        if (!cache || cache->size() < static_cast<int>(sizeof(CacheHeader))) {
+            return false;
+        }
+
+        CacheHeader header;
+        memcpy(&header, cache->data(), sizeof(header));
+        const unsigned int keysize = (header.keylen + 3) & ~3;
+        const unsigned int tablestart = sizeof(CacheHeader) + keysize;
+        if (memcmp(header.magic, cache_magic, sizeof(header.magic)) != 0
+                || header.version != cache_version
+                || header.archivesize != archivesize || header.mtime != mtime
+                || header.keylen != key.size()
+                || header.count > static_cast<unsigned int>(cache->size()) / sizeof(Entry)
+                || static_cast<unsigned int>(cache->size()) != tablestart + header.count * sizeof(Entry)
+                || key.compare(0, string::npos, reinterpret_cast<const char*>(cache->data()) + sizeof(CacheHeader), header.keylen) != 0) {
+            return false;
+        }
+
+        // Written by save_cache, so already sorted and aligned.  open_entry
+        // only clamps the size, so an offset outside the archive would be
+        // read from outside its mapping.
+        const Entry* entries = reinterpret_cast<const Entry*>(cache->data() + tablestart);
+        for (unsigned int i = 0; i < header.count; ++i) {
+            if (entries[i].offset < 0 || static_cast<unsigned int>(entries[i].offset) > archivesize) {
+                return false;
+            }
+        }
+        cachemapping = cache;
+        table = header.count == 0 ? 0 : entries;
+        tablesize = header.count;
+        cached_ = true;
+        parsetime = header.parsetime;
+        loadtime = elapsed_usecs(start);
+        return true;
+    }
+
+    void MixArchive::save_cache(const string& cachefile, const string& key, unsigned int archivesize, unsigned int mtime)
+    {
+        CacheHeader header;
+        memcpy(header.magic, cache_magic, sizeof(header.magic));
+        header.version = cache_version;
+        header.archivesize = archivesize;
+        header.mtime = mtime;
+        header.parsetime = parsetime;
+        header.keylen = static_cast<unsigned int>(key.size());
+        header.count = tablesize;
+        const char padding[4] = {0, 0, 0, 0};
+        const unsigned int padsize = ((header.keylen + 3) & ~3) - header.keylen;
+
+        // Written to the side and renamed so a half written cache is never
+        // picked up
+        const string tempfile = cachefile + ".tmp";
+        FILE* out = fopen(tempfile.c_str(), "wb");
+        if (!out) {
+            return;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+                && fwrite(key.data(), 1, key.size(), out) == key.size()
+                && fwrite(padding, 1, padsize, out) == padsize
+                && (tablesize == 0 || fwrite(table, sizeof(Entry), tablesize, out) == tablesize);
+        ok = fclose(out) == 0 && ok;
+        if (ok) {
+            std::remove(cachefile.c_str());
+            ok = std::rename(tempfile.c_str(), cachefile.c_str()) == 0;
+        }
+        if (!ok) {
+            std::remove(tempfile.c_str());
+        }
+    }
+
     //-------------------------------------------------------------------------
         
     shared_ptr<File> MixArchive::open(const std::string& filename, bool writable)
@@ -325,15 +536,57 @@ namespace VFS
         }
 
         // Lookup file
-        unsigned int id = calc_id(filename);
-        Index::iterator it = index.find(id);
-        if (it != index.end()) {
-            return shared_ptr<File>(new MixFile(path(), filename, it->second.first, it->second.second));
+        const Entry* entry = find(calc_id(filename));
+        if (entry) {
+            return open_entry(filename, *entry);
         }
 
         return shared_ptr<File>();
     }
 
+    vector<unsigned int> MixArchive::ids() const
+    {
+        vector<unsigned int> result;
+        result.reserve(tablesize);
+        for (unsigned int i = 0; i < tablesize; ++i) {
+            result.push_back(table[i].id);
+        }
+        return result;
+    }
+
+    shared_ptr<File> MixArchive::open(unsigned int id)
+    {
+        const Entry* entry = find(id);
+        if (!entry) {
+            return shared_ptr<File>();
+        }
+        ostringstream name;
+        name << std::hex << std::uppercase << id;
+        return open_entry(name.str(), *entry);
+    }
+
+    shared_ptr<File> MixArchive::open_entry(const string& name, const Entry& entry)
+    {
+        int size = entry.size;
+        if (mapping) {
+            // Don't let a bad index entry point past the end of the mapping
+            size = max(0, min(size, mapping->size() - entry.offset));
+        }
+        return shared_ptr<File>(new MixFile(path(), name, entry.offset, size, mapping));
+    }
+
+    const MixArchive::Entry* MixArchive::find(unsigned int id) const
+    {
+        const Entry* end = table + tablesize;
+        const Entry* it = std::lower_bound(table, end, id, entry_before);
+        return it != end && it->id == id ? it : 0;
+    }
+
+    unsigned int MixArchive::id(const string& filename)
+    {
+        return calc_id(filename);
+    }
+
     string MixArchive::path()
     {
         return mixfile.c_str();
@@ -12,25 +12,81 @@
 
 namespace VFS
 {    
+    class MappedFile;
+
     class MixArchive : public Archive
     {
         typedef std::pair<int, int> IndexValue;
         typedef std::map<unsigned int, IndexValue> Index;
     public:
-        MixArchive(const boost::filesystem::path& mixfile, const std::vector<std::string>& subarchives);
+        // Where a file is in the archive. Laid out as it is in the index
+        // cache.
+        struct Entry
+        {
+            unsigned int id;
+            int offset;
+            int size;
+        };
+
+        // Loads the index from a cache in `cachedir' if the archive hasn't
+        // changed since it was written, otherwise parses the archive and
+        // writes the cache. No caching is done if `cachedir' is empty.
+        MixArchive(const boost::filesystem::path& mixfile, const std::vector<std::string>& subarchives,
+                const boost::filesystem::path& cachedir = boost::filesystem::path());
         ~MixArchive();
         
         std::string path();
         boost::shared_ptr<File> open(const std::string& filename, bool writable);
 
+        // Ids of every file in the archive. Mix files only store a hash of
+        // each filename, so this is the only way to list their contents.
+        std::vector<unsigned int> ids() const;
+
+        // Opens the file with the given id for reading, naming it after the
+        // id in hex. Returns 0 if there is no such file.
+        boost::shared_ptr<File> open(unsigned int id);
+
+        // Every file in the archive, sorted by id.
+        const Entry* entries() const { return table; }
+        unsigned int num_entries() const { return tablesize; }
+
+        // Opens a file found in entries() without looking it up again.
+        boost::shared_ptr<File> open_entry(const std::string& name, const Entry& entry);
+
+        // The id mix files store for `filename', which can be at most 12
+        // characters long.
+        static unsigned int id(const std::string& filename);
+
+        // Whether the index came from the cache.
+        bool cached() const { return cached_; }
+
+        // Microseconds of processor time it took to parse the index, and if
+        // it came from the cache, to load it from there instead.
+        unsigned int parse_time() const { return parsetime; }
+        unsigned int load_time() const { return loadtime; }
+
     private:
         boost::filesystem::path mixfile;
-        Index index;
+        Index index; // Only used while parsing
+
+        // The index, either in the cache's mapping or in entrybuf
+        const Entry* table;
+        unsigned int tablesize;
+        std::vector<Entry> entrybuf;
+        boost::shared_ptr<MappedFile> cachemapping;
+        bool cached_;
+        unsigned int parsetime, loadtime;
+
+        boost::shared_ptr<MappedFile> mapping;
         
+        const Entry* find(unsigned int id) const;
+        void parse(const std::vector<std::string>& subarchives);
         void parse_header(FILE* mix, int base_offset);
         void parse_td_header(FILE* mix, int base_offset);
         void parse_ra_header(FILE* mix, int base_offset);
         void build_index(const std::vector<unsigned char>& index_buf, int base_offset);
+        bool load_cache(const std::string& cachefile, const std::string& key, unsigned int archivesize, unsigned int mtime);
+        void save_cache(const std::string& cachefile, const std::string& key, unsigned int archivesize, unsigned int mtime);
     };
 }
 
@@ -1,3 +1,4 @@
+#include <climits>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/convenience.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -10,12 +11,22 @@ using std::string;
 using std::vector;
 using boost::shared_ptr;
 using boost::to_upper;
+using boost::to_upper_copy;
 
 namespace fs = boost::filesystem;
 
+namespace
+{
+    // Whether the name is of a file directly inside an archive
+    bool indexable(const string& filename)
+    {
+        return filename.find_first_of("/\\") == string::npos;
+    }
+}
+
 namespace VFS
 {
-    VFS::VFS()
+    VFS::VFS() : stats_(Stats())
     {
     }
 
@@ -30,10 +41,14 @@ namespace VFS
         }
 
         if (fs::is_directory(pth)) {
-            archives.push_back(shared_ptr<DirArchive>(new DirArchive(pth)));
+            shared_ptr<DirArchive> dir(new DirArchive(pth));
+            archives.push_back(dir);
+            index(*dir, static_cast<unsigned int>(archives.size() - 1));
             return true;
         } else if (fs::is_regular(pth)) {
-            archives.push_back(shared_ptr<MixArchive>(new MixArchive(pth, vector<string>())));
+            shared_ptr<MixArchive> mix(new MixArchive(pth, vector<string>(), cachedir));
+            archives.push_back(mix);
+            index(*mix, static_cast<unsigned int>(archives.size() - 1));
             return true;
         }
         
@@ -43,6 +58,22 @@ namespace VFS
     void VFS::remove_all()
     {
         ArchiveVector().swap(archives);
+        names.clear();
+        ids.clear();
+        missing.clear();
+    }
+
+    void VFS::set_cache_dir(const fs::path& dir)
+    {
+        cachedir = fs::path();
+        try {
+            if (!fs::exists(dir)) {
+                fs::create_directories(dir);
+            }
+            cachedir = dir;
+        } catch (fs::filesystem_error&) {
+            // Go without
+        }
     }
 
     shared_ptr<File> VFS::open(const string& filename)
@@ -57,12 +88,116 @@ namespace VFS
 
     shared_ptr<File> VFS::open(const string& filename, bool writable)
     {
-        for (ArchiveVector::iterator it = archives.begin(); it != archives.end(); ++it) {
-            shared_ptr<File> file = (*it)->open(filename, writable);
+        if (writable || !indexable(filename)) {
+            return scan(filename, writable);
+        }
+        ++stats_.lookups;
+
+        const Location* mixloc = 0;
+        if (filename.size() <= 12) {
+            boost::unordered_map<unsigned int, Location>::const_iterator it = ids.find(MixArchive::id(filename));
+            if (it != ids.end()) {
+                mixloc = &it->second;
+            }
+        }
+
+        // Directories earlier in the search order than the mix archive come
+        // first.  The name only matched ignoring case, so they can still
+        // turn out not to have it.
+        const unsigned int mixarchive = mixloc ? mixloc->archive : UINT_MAX;
+        boost::unordered_map<string, Locations>::const_iterator it = names.find(to_upper_copy(filename));
+        if (it != names.end()) {
+            for (Locations::const_iterator loc = it->second.begin(); loc != it->second.end() && loc->archive < mixarchive; ++loc) {
+                shared_ptr<File> file = archives[loc->archive]->open(filename, false);
+                if (file) {
+                    ++stats_.hits;
+                    return file;
+                }
+            }
+        }
+
+        if (mixloc) {
+            ++stats_.hits;
+            MixArchive& mix = static_cast<MixArchive&>(*archives[mixloc->archive]);
+            MixArchive::Entry entry = {MixArchive::id(filename), mixloc->offset, mixloc->size};
+            return mix.open_entry(filename, entry);
+        }
+
+        ++stats_.misses;
+        return shared_ptr<File>();
+    }
+
+    shared_ptr<File> VFS::scan(const string& filename, bool writable)
+    {
+        if (!writable) {
+            ++stats_.lookups;
+            if (missing.find(filename) != missing.end()) {
+                ++stats_.negative;
+                return shared_ptr<File>();
+            }
+            ++stats_.scans;
+        }
+
+        for (ArchiveVector::size_type i = 0; i < archives.size(); ++i) {
+            shared_ptr<File> file = archives[i]->open(filename, writable);
             if (file) {
+                // Writing may have created the file
+                if (writable) {
+                    missing.erase(filename);
+                    if (indexable(filename)) {
+                        index_name(filename, static_cast<unsigned int>(i));
+                    }
+                }
                 return file;
             }
         }
+
+        if (!writable) {
+            missing.insert(filename);
+        }
         return shared_ptr<File>();
     }
+
+    void VFS::index(const DirArchive& dir, unsigned int archive)
+    {
+        // Anything remembered as missing may be in the new archive
+        missing.clear();
+
+        vector<string> files = dir.names();
+        for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+            index_name(*it, archive);
+        }
+    }
+
+    void VFS::index(const MixArchive& mix, unsigned int archive)
+    {
+        missing.clear();
+
+        if (mix.cached()) {
+            ++stats_.mixcached;
+            stats_.mixsaved += mix.parse_time() - std::min(mix.parse_time(), mix.load_time());
+        } else {
+            ++stats_.mixparsed;
+        }
+
+        const MixArchive::Entry* entries = mix.entries();
+        for (unsigned int i = 0; i < mix.num_entries(); ++i) {
+            Location loc = {archive, entries[i].offset, entries[i].size};
+            // Doesn't replace an id from an earlier archive
+            ids.insert(std::make_pair(entries[i].id, loc));
+        }
+    }
+
+    void VFS::index_name(const string& filename, unsigned int archive)
+    {
+        Locations& locs = names[to_upper_copy(filename)];
+        Locations::iterator it = locs.begin();
+        while (it != locs.end() && it->archive < archive) {
+            ++it;
+        }
+        if (it == locs.end() || it->archive != archive) {
+            Location loc = {archive, -1, 0};
+            locs.insert(it, loc);
+        }
+    }
 }
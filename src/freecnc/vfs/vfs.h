@@ -10,17 +10,35 @@
 #include <boost/filesystem/path.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/smart_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 #include "file.h"
 
 namespace VFS
 {
     class Archive;
+    class DirArchive;
+    class MixArchive;
 
     class VFS : private boost::noncopyable
     {
         typedef std::vector<boost::shared_ptr<Archive> > ArchiveVector;
     public:
+        // How open has been finding files, and how the mix archives' own
+        // indexes were loaded.
+        struct Stats
+        {
+            unsigned int lookups;   // Files opened for reading
+            unsigned int hits;      // Found through the index
+            unsigned int misses;    // Known to be missing from the index
+            unsigned int negative;  // Known to be missing from an earlier scan
+            unsigned int scans;     // Names the index doesn't cover, so every archive was asked
+            unsigned int mixcached; // Mix indexes loaded from the cache
+            unsigned int mixparsed; // Mix indexes parsed from the archive
+            unsigned int mixsaved;  // Microseconds the cache saved over parsing
+        };
+
         VFS();
         ~VFS();
 
@@ -32,19 +50,50 @@ namespace VFS
         // Removes all directories.
         void remove_all();
 
+        // Keeps the parsed indexes of mix archives added from now on in
+        // `dir', which is created if needed, so they load faster next time.
+        void set_cache_dir(const boost::filesystem::path& dir);
+
         // Opens a file for reading.
         boost::shared_ptr<File> open(const std::string& filename);
 
         // Opens a file for writing.
         boost::shared_ptr<File> open_write(const std::string& filename);
 
+        const Stats& stats() const { return stats_; }
+
     private:
+        // Where a file is: which archive, and for mix archives which entry.
+        // Directories have an offset of -1 since the file is opened by name.
+        struct Location
+        {
+            unsigned int archive;
+            int offset;
+            int size;
+        };
+        typedef std::vector<Location> Locations;
+
         boost::shared_ptr<File> open(const std::string& filename, bool writable);
+        boost::shared_ptr<File> scan(const std::string& filename, bool writable);
+        void index(const DirArchive& dir, unsigned int archive);
+        void index(const MixArchive& mix, unsigned int archive);
+        void index_name(const std::string& filename, unsigned int archive);
 
         // Contains the list of archives; The first archive of each group is the
         // directory that was added, and the remaining members are archives located
         // in that directory.
         ArchiveVector archives;
+        boost::filesystem::path cachedir;
+
+        // Every file in every archive: by upper case name for directories,
+        // in the order they are searched, and by id for mix archives, where
+        // only the first archive with the id matters.  Names with a path in
+        // them aren't indexed and are looked up in each archive in turn,
+        // remembering the ones that aren't anywhere.
+        boost::unordered_map<std::string, Locations> names;
+        boost::unordered_map<unsigned int, Location> ids;
+        boost::unordered_set<std::string> missing;
+        Stats stats_;
     };
 }
 
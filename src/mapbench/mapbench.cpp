@@ -0,0 +1,440 @@
+//
+// Loads maps without a screen or sound and reports what each step of the
+// map loader costs, one JSON object per line
+//
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <exception>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "SDL.h"
+#include "SDL_thread.h"
+
+#include "../freecnc/freecnc.h"
+#include "../freecnc/game/actioneventqueue.h"
+#include "../freecnc/game/loadgraph.h"
+#include "../freecnc/game/map.h"
+#include "../freecnc/lib/rulesdb.h"
+#include "../freecnc/renderer/imagecache.h"
+#include "../freecnc/scripting/gameconfigscript.h"
+
+namespace po = boost::program_options;
+
+using std::cerr;
+using std::cout;
+using std::ostream;
+using std::ostringstream;
+using std::runtime_error;
+using boost::to_lower_copy;
+
+GameEngine game;
+Logger* logger;
+
+// Every C++ allocation goes through these so the probe can count them.
+// Allocations made by C libraries (SDL, the mixer) are not counted.
+namespace
+{
+    volatile unsigned long numallocs = 0;
+    volatile unsigned long allocbytes = 0;
+}
+
+#if __cplusplus >= 201103L
+#define MAPBENCH_THROWS_BAD_ALLOC
+#else
+#define MAPBENCH_THROWS_BAD_ALLOC throw(std::bad_alloc)
+#endif
+
+void* operator new(std::size_t size) MAPBENCH_THROWS_BAD_ALLOC
+{
+    __sync_fetch_and_add(&numallocs, 1ul);
+    __sync_fetch_and_add(&allocbytes, static_cast<unsigned long>(size));
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == 0) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size) MAPBENCH_THROWS_BAD_ALLOC
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) throw()
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) throw()
+{
+    std::free(ptr);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* ptr, std::size_t) throw()
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) throw()
+{
+    std::free(ptr);
+}
+#endif
+
+namespace
+{
+    struct UsageMessage : public runtime_error
+    {
+        UsageMessage(const string& msg) : runtime_error(msg) {}
+    };
+
+    struct Sample
+    {
+        long long usecs;
+        unsigned long allocs, bytes;
+        long peakrss;
+
+        static Sample now()
+        {
+            Sample sample;
+            timeval tv;
+            gettimeofday(&tv, 0);
+            sample.usecs = static_cast<long long>(tv.tv_sec) * 1000000 + tv.tv_usec;
+            sample.allocs = numallocs;
+            sample.bytes = allocbytes;
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            // Kilobytes on Linux and the BSDs, bytes on Mac OS X
+            sample.peakrss = usage.ru_maxrss;
+            return sample;
+        }
+    };
+
+    struct Stage
+    {
+        string name;
+        bool parallel;
+        /// How many steps had this name, e.g. the parts of a split step
+        unsigned int count;
+        long long usecs;
+        unsigned long allocs, bytes;
+        /// Highest the peak reached by the end of the stage, and how much
+        /// the stage raised it
+        long peakrss, rssgrowth;
+    };
+
+    void write_string(ostream& out, const string& text)
+    {
+        out << '"';
+        for (string::const_iterator it = text.begin(); it != text.end(); ++it) {
+            if (*it == '"' || *it == '\\') {
+                out << '\\' << *it;
+            } else if (static_cast<unsigned char>(*it) < 0x20) {
+                char escaped[8];
+                sprintf(escaped, "\\u%04x", static_cast<unsigned char>(*it));
+                out << escaped;
+            } else {
+                out << *it;
+            }
+        }
+        out << '"';
+    }
+}
+
+/** Adds up what the steps of the map loader cost, by step name.
+ *
+ * The allocation counts are global, so they are only exact for a step when
+ * nothing runs alongside it, that is with a single loader thread.
+ */
+class StageProbe : public LoadGraph::Probe
+{
+public:
+    StageProbe() : mutex(SDL_CreateMutex()) {}
+    ~StageProbe() {SDL_DestroyMutex(mutex);}
+
+    void begin(const string& step)
+    {
+        Sample sample = Sample::now();
+        SDL_mutexP(mutex);
+        running.push_back(Running(SDL_ThreadID(), step, sample));
+        SDL_mutexV(mutex);
+    }
+
+    void end(const string& step, bool parallel)
+    {
+        Sample sample = Sample::now();
+        SDL_mutexP(mutex);
+        Uint32 thread = SDL_ThreadID();
+        for (vector<Running>::iterator it = running.begin(); it != running.end(); ++it) {
+            if (it->thread == thread && it->step == step) {
+                Stage& stage = find(step, parallel);
+                ++stage.count;
+                stage.usecs += sample.usecs - it->start.usecs;
+                stage.allocs += sample.allocs - it->start.allocs;
+                stage.bytes += sample.bytes - it->start.bytes;
+                stage.peakrss = max(stage.peakrss, sample.peakrss);
+                stage.rssgrowth += sample.peakrss - it->start.peakrss;
+                running.erase(it);
+                break;
+            }
+        }
+        SDL_mutexV(mutex);
+    }
+
+    /// @returns the stages seen since the last call, in the order they
+    /// first finished
+    vector<Stage> take()
+    {
+        vector<Stage> ret;
+        SDL_mutexP(mutex);
+        ret.swap(stages);
+        SDL_mutexV(mutex);
+        return ret;
+    }
+private:
+    struct Running
+    {
+        Running(Uint32 thread, const string& step, const Sample& start)
+            : thread(thread), step(step), start(start) {}
+        Uint32 thread;
+        string step;
+        Sample start;
+    };
+
+    Stage& find(const string& step, bool parallel)
+    {
+        for (vector<Stage>::iterator it = stages.begin(); it != stages.end(); ++it) {
+            if (it->name == step) {
+                return *it;
+            }
+        }
+        Stage stage;
+        stage.name = step;
+        stage.parallel = parallel;
+        stage.count = 0;
+        stage.usecs = 0;
+        stage.allocs = stage.bytes = 0;
+        stage.peakrss = stage.rssgrowth = 0;
+        stages.push_back(stage);
+        return stages.back();
+    }
+
+    SDL_mutex* mutex;
+    vector<Running> running;
+    vector<Stage> stages;
+};
+
+class MapBench
+{
+public:
+    MapBench() : repeat(1), out(&cout), failures(0) {}
+    void parse(int argc, char** argv);
+    void boot();
+    /// @returns how many loads failed
+    unsigned int run();
+private:
+    void loadMap(const string& map, unsigned int run);
+    void writeStage(const string& map, unsigned int run, const string& theater,
+            const Stage& stage);
+
+    vector<string> maps;
+    unsigned int repeat;
+    string output;
+    std::ofstream outfile;
+    ostream* out;
+    StageProbe probe;
+    unsigned int failures;
+};
+
+void MapBench::parse(int argc, char** argv)
+{
+    GameConfig& config = game.config;
+    // Everything the options below don't cover is as the game has it
+    defaultConfig(config);
+
+    po::options_description general("General options");
+    general.add_options()
+        ("help", "show this message")
+        ("basedir", po::value<string>(&config.basedir)->default_value("."),
+            "use this location to find the data files")
+        ("homedir", po::value<string>(&config.homedir),
+            "use this location for the caches and the log, defaults to basedir")
+        ("mod", po::value<string>(&config.mod)->default_value("td"),
+            "specify which game to load: td or ra")
+        ("threads", po::value<int>(&config.load_threads)->default_value(1),
+            "number of threads used to load each map; the allocation counts of "
+            "each step are only exact with one")
+        ("repeat", po::value<unsigned int>(&repeat)->default_value(1),
+            "load each map this many times; only the first load finds the "
+            "shared images, templates and sounds uncached")
+        ("output,o", po::value<string>(&output),
+            "write the results here instead of to standard output");
+
+    po::options_description implicit("Implicit options");
+    implicit.add_options()
+        ("maps", po::value<vector<string> >(&maps));
+
+    po::positional_options_description pd;
+    pd.add("maps", -1);
+
+    po::options_description cmdline_options;
+    cmdline_options.add(general).add(implicit);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+        options(cmdline_options).positional(pd).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || maps.empty()) {
+        ostringstream s;
+        s << "Usage: " << argv[0] << " [options] MAP...\n" << general;
+        throw UsageMessage(s.str());
+    }
+
+    finishConfig(config);
+    // Loading a map plays nothing, so the sound engine stays off as before
+    config.nosound = true;
+
+    if (!output.empty()) {
+        outfile.open(output.c_str());
+        if (!outfile) {
+            throw runtime_error("Unable to write " + output);
+        }
+        out = &outfile;
+    }
+}
+
+void MapBench::boot()
+{
+    // The engines still want a screen and an audio device, so give them
+    // ones that go nowhere unless told otherwise
+    setenv("SDL_VIDEODRIVER", "dummy", 0);
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+
+    game.log.open((game.config.homedir + "/mapbench.log").c_str());
+
+    game.vfs.set_cache_dir(game.config.homedir + "/cache");
+    {
+        GameConfigScript gcs;
+        gcs.parse(game.config.basedir + "/data/manifest.lua");
+    }
+    const string rulesdb = game.config.homedir + "/cache/rules-" + game.config.mod + ".db";
+    if (!RulesDB::load(rulesdb) && RulesDB::compile(rulesdb)) {
+        RulesDB::load(rulesdb);
+    }
+
+    logger = new Logger();
+    game.reconfigure();
+}
+
+unsigned int MapBench::run()
+{
+    LoadGraph::setProbe(&probe);
+    for (vector<string>::const_iterator it = maps.begin(); it != maps.end(); ++it) {
+        for (unsigned int i = 1; i <= repeat; ++i) {
+            loadMap(*it, i);
+        }
+    }
+    LoadGraph::setProbe(0);
+    return failures;
+}
+
+void MapBench::loadMap(const string& map, unsigned int run)
+{
+    Stage total;
+    total.name = "total";
+    total.parallel = false;
+    total.count = 1;
+
+    string error, theater;
+    Sample start = Sample::now();
+    try {
+        p::aequeue = new ActionEventQueue();
+        p::ccmap = new CnCMap();
+        p::ccmap->loadMap(map.c_str(), 0);
+        if (p::ccmap->getMissionData().theater != 0) {
+            theater = p::ccmap->getMissionData().theater;
+        }
+    } catch (std::exception& e) {
+        error = e.what();
+    }
+    Sample finish = Sample::now();
+
+    total.usecs = finish.usecs - start.usecs;
+    total.allocs = finish.allocs - start.allocs;
+    total.bytes = finish.bytes - start.bytes;
+    total.peakrss = finish.peakrss;
+    total.rssgrowth = finish.peakrss - start.peakrss;
+
+    vector<Stage> stages = probe.take();
+    for (vector<Stage>::const_iterator it = stages.begin(); it != stages.end(); ++it) {
+        writeStage(map, run, theater, *it);
+    }
+    if (error.empty()) {
+        writeStage(map, run, theater, total);
+    } else {
+        *out << "{\"map\":";
+        write_string(*out, map);
+        *out << ",\"run\":" << run << ",\"error\":";
+        write_string(*out, error);
+        *out << "}\n";
+        ++failures;
+    }
+    out->flush();
+
+    delete p::ccmap;
+    p::ccmap = 0;
+    delete p::aequeue;
+    p::aequeue = 0;
+    pc::imgcache->flush();
+    // So every run parses the map again, the rule files stay loaded as they
+    // do between missions
+    p::settings.erase(to_lower_copy(map) + ".ini");
+}
+
+void MapBench::writeStage(const string& map, unsigned int run, const string& theater,
+        const Stage& stage)
+{
+    *out << "{\"map\":";
+    write_string(*out, map);
+    *out << ",\"run\":" << run << ",\"theater\":";
+    write_string(*out, theater);
+    *out << ",\"threads\":" << max(game.config.load_threads, 1) << ",\"stage\":";
+    write_string(*out, stage.name);
+    *out << ",\"parallel\":" << (stage.parallel ? "true" : "false")
+         << ",\"count\":" << stage.count
+         << ",\"wall_us\":" << stage.usecs
+         << ",\"allocs\":" << stage.allocs
+         << ",\"alloc_bytes\":" << stage.bytes
+         << ",\"peak_rss_kb\":" << stage.peakrss
+         << ",\"rss_growth_kb\":" << stage.rssgrowth << "}\n";
+}
+
+int main(int argc, char** argv)
+{
+    MapBench bench;
+    try {
+        bench.parse(argc, argv);
+        bench.boot();
+        return bench.run() == 0 ? 0 : 1;
+    } catch (UsageMessage& e) {
+        cout << e.what() << "\n";
+        return 1;
+    } catch (std::exception& e) {
+        cerr << "Fatal error: " << e.what() << "\n";
+        return 1;
+    }
+}